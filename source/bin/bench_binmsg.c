@@ -0,0 +1,197 @@
+/*
+** bench_binmsg.c -- The microbenchmark of the text and the binary formats
+**      of the PurCMC messages.
+**
+** Copyright (C) 2022 FMSoft (http://www.fmsoft.cn)
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+#undef NDEBUG
+
+#include <config.h>
+
+#include "purcmc/binmsg.h"
+
+#include <purc/purc.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#define BENCH_ROUNDS    20000
+#define SZ_MAX_PACKET   (1 << 20)
+
+typedef struct Buffer {
+    char   *data;
+    size_t  len;
+} Buffer;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static ssize_t write_to_buffer(void *ctxt, const void *buf, size_t count)
+{
+    Buffer *buffer = ctxt;
+
+    if (buffer->len + count > SZ_MAX_PACKET)
+        return -1;
+
+    memcpy(buffer->data + buffer->len, buf, count);
+    buffer->len += count;
+    return count;
+}
+
+static void serialize(const pcrdr_msg *msg, bool binary, Buffer *buffer)
+{
+    int ret;
+
+    buffer->len = 0;
+    if (binary)
+        ret = purcmc_binmsg_serialize(msg, write_to_buffer, buffer);
+    else
+        ret = pcrdr_serialize_message(msg, write_to_buffer, buffer);
+    assert(ret == 0);
+}
+
+static pcrdr_msg *parse(Buffer *buffer, bool binary, char *scratch)
+{
+    pcrdr_msg *msg;
+    int ret;
+
+    if (binary) {
+        ret = purcmc_binmsg_parse(buffer->data, buffer->len, &msg);
+    }
+    else {
+        /* pcrdr_parse_packet() changes the packet in place */
+        memcpy(scratch, buffer->data, buffer->len);
+        ret = pcrdr_parse_packet(scratch, buffer->len, &msg);
+    }
+    assert(ret == 0);
+    return msg;
+}
+
+/* The packet of the message parsed back must be the same as the original */
+static void check_round_trip(const pcrdr_msg *msg, bool binary)
+{
+    Buffer first = { malloc(SZ_MAX_PACKET), 0 };
+    Buffer second = { malloc(SZ_MAX_PACKET), 0 };
+    char *scratch = malloc(SZ_MAX_PACKET);
+    pcrdr_msg *parsed;
+
+    assert(first.data && second.data && scratch);
+
+    serialize(msg, binary, &first);
+    parsed = parse(&first, binary, scratch);
+    serialize(parsed, binary, &second);
+    assert(first.len == second.len);
+    assert(memcmp(first.data, second.data, first.len) == 0);
+
+    pcrdr_release_message(parsed);
+    free(first.data);
+    free(second.data);
+    free(scratch);
+}
+
+static void bench_format(const char *name, const pcrdr_msg *msg,
+        bool binary)
+{
+    Buffer buffer = { malloc(SZ_MAX_PACKET), 0 };
+    char *scratch = malloc(SZ_MAX_PACKET);
+    double start, t_serialize, t_parse;
+
+    assert(buffer.data && scratch);
+
+    start = now();
+    for (int i = 0; i < BENCH_ROUNDS; i++)
+        serialize(msg, binary, &buffer);
+    t_serialize = now() - start;
+
+    start = now();
+    for (int i = 0; i < BENCH_ROUNDS; i++)
+        pcrdr_release_message(parse(&buffer, binary, scratch));
+    t_parse = now() - start;
+
+    printf("%-8s %-6s %8zu bytes: serialize %8.2f us, parse %8.2f us\n",
+            name, binary ? "binary" : "text", buffer.len,
+            t_serialize * 1e6 / BENCH_ROUNDS, t_parse * 1e6 / BENCH_ROUNDS);
+
+    free(buffer.data);
+    free(scratch);
+}
+
+/* Make a JSON text of an array of `n` records like the data of an event */
+static char *make_json(int n)
+{
+    size_t sz = n * 160 + 16, len = 0;
+    char *json = malloc(sz);
+
+    assert(json);
+    len += snprintf(json + len, sz - len, "[");
+    for (int i = 0; i < n; i++) {
+        len += snprintf(json + len, sz - len,
+                "%s{\"id\":%d,\"name\":\"item-%d\",\"checked\":%s,"
+                "\"ratio\":%.3f,\"tags\":[\"foo\",\"bar\",\"qux\"],"
+                "\"rect\":{\"x\":%d,\"y\":%d,\"w\":320,\"h\":240}}",
+                i ? "," : "", i, i, (i & 1) ? "true" : "false",
+                i / 7.0, i * 3, i * 5);
+        assert(len < sz);
+    }
+    len += snprintf(json + len, sz - len, "]");
+    return json;
+}
+
+int main(void)
+{
+    static const int sizes[] = { 0, 1, 16, 256 };
+    int ret;
+
+    ret = purc_init_ex(PURC_MODULE_EJSON, "cn.fmsoft.hvml.xguipro",
+            "bench_binmsg", NULL);
+    assert(ret == PURC_ERROR_OK);
+
+    for (size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+        char name[32];
+        char *json = make_json(sizes[i]);
+        pcrdr_msg *msg;
+
+        msg = pcrdr_make_event_message(PCRDR_MSG_TARGET_DOM, 0x5a5a5a5a,
+                "change", "edpt://localhost/cn.fmsoft.hvml.test/main",
+                PCRDR_MSG_ELEMENT_TYPE_HANDLE, "0x7f0012345678", NULL,
+                sizes[i] ? PCRDR_MSG_DATA_TYPE_JSON : PCRDR_MSG_DATA_TYPE_VOID,
+                sizes[i] ? json : NULL, sizes[i] ? strlen(json) : 0);
+        assert(msg);
+
+        check_round_trip(msg, true);
+
+        snprintf(name, sizeof(name), "%d rec", sizes[i]);
+        bench_format(name, msg, false);
+        bench_format(name, msg, true);
+        printf("\n");
+
+        pcrdr_release_message(msg);
+        free(json);
+    }
+
+    purc_cleanup();
+    return 0;
+}
@@ -0,0 +1,169 @@
+/*
+** bench_operations.c -- The microbenchmark of the lookup of operations.
+**
+** Copyright (C) 2022 FMSoft (http://www.fmsoft.cn)
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#undef NDEBUG
+
+#include <config.h>
+
+#include "purcmc/operations.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define BENCH_ROUNDS    2000000
+
+/* The names sorted for the binary search used by the dispatcher before */
+static const char *sorted_names[] = {
+    PCRDR_OPERATION_ADDPAGEGROUPS,
+    PCRDR_OPERATION_APPEND,
+    PCRDR_OPERATION_CALLMETHOD,
+    PCRDR_OPERATION_CLEAR,
+    PCRDR_OPERATION_CREATEPLAINWINDOW,
+    PCRDR_OPERATION_CREATEWIDGET,
+    PCRDR_OPERATION_CREATEWORKSPACE,
+    PCRDR_OPERATION_DESTROYPLAINWINDOW,
+    PCRDR_OPERATION_DESTROYWIDGET,
+    PCRDR_OPERATION_DESTROYWORKSPACE,
+    PCRDR_OPERATION_DISPLACE,
+    PCRDR_OPERATION_ENDSESSION,
+    PCRDR_OPERATION_ERASE,
+    PCRDR_OPERATION_GETPROPERTY,
+    PCRDR_OPERATION_INSERTAFTER,
+    PCRDR_OPERATION_INSERTBEFORE,
+    PCRDR_OPERATION_LOAD,
+    PCRDR_OPERATION_PREPEND,
+    PCRDR_OPERATION_REMOVEPAGEGROUP,
+    PCRDR_OPERATION_SETPAGEGROUPS,
+    PCRDR_OPERATION_SETPROPERTY,
+    PCRDR_OPERATION_STARTSESSION,
+    PCRDR_OPERATION_UPDATE,
+    PCRDR_OPERATION_UPDATEPLAINWINDOW,
+    PCRDR_OPERATION_UPDATEWIDGET,
+    PCRDR_OPERATION_UPDATEWORKSPACE,
+    PCRDR_OPERATION_WRITEBEGIN,
+    PCRDR_OPERATION_WRITEEND,
+    PCRDR_OPERATION_WRITEMORE,
+};
+
+#define NR_NAMES    ((int)(sizeof(sorted_names)/sizeof(sorted_names[0])))
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int binary_search(const char *operation)
+{
+    ssize_t low = 0, high = NR_NAMES - 1, mid;
+
+    while (low <= high) {
+        int cmp;
+
+        mid = (low + high) / 2;
+        cmp = strcasecmp(operation, sorted_names[mid]);
+        if (cmp == 0)
+            return mid;
+        else if (cmp < 0)
+            high = mid - 1;
+        else
+            low = mid + 1;
+    }
+
+    return -1;
+}
+
+static int perfect_hash(const char *operation)
+{
+    return purcmc_operation_id(operation);
+}
+
+/* Look up the names in a shuffled order */
+static void bench_lookup(const char *name, int (*lookup)(const char *),
+        const char **names, int nr_names)
+{
+    volatile int sink = 0;
+    double start, elapsed;
+
+    start = now();
+    for (int i = 0; i < BENCH_ROUNDS; i++)
+        sink += lookup(names[i % nr_names]);
+    elapsed = now() - start;
+
+    printf("%-14s %8.2f ns/lookup\n", name, elapsed * 1e9 / BENCH_ROUNDS);
+    (void)sink;
+}
+
+int main(void)
+{
+    static const char *others[] = {
+        "loads", "Load ", "apPend", "createworkspace", "noop", "x",
+    };
+    const char *names[NR_NAMES + sizeof(others)/sizeof(others[0])];
+    int nr_names = 0;
+
+    /* check every name and its case variants against the binary search */
+    for (int i = 0; i < NR_NAMES; i++) {
+        char upper[64];
+        size_t len = strlen(sorted_names[i]);
+        int id = purcmc_operation_id(sorted_names[i]);
+
+        assert(len < sizeof(upper));
+        for (size_t j = 0; j <= len; j++)
+            upper[j] = (sorted_names[i][j] >= 'a' &&
+                    sorted_names[i][j] <= 'z') ?
+                sorted_names[i][j] - 'a' + 'A' : sorted_names[i][j];
+
+        assert(id >= 0);
+        assert(strcmp(purcmc_operation_name(id), sorted_names[i]) == 0);
+        assert(purcmc_operation_id(upper) == id);
+        assert(binary_search(upper) == i);
+    }
+    for (size_t i = 0; i < sizeof(others)/sizeof(others[0]); i++) {
+        assert((purcmc_operation_id(others[i]) < 0) ==
+                (binary_search(others[i]) < 0));
+    }
+    assert(purcmc_operation_id("") < 0);
+    printf("All %d operations passed the check\n\n", NR_NAMES);
+
+    srand(2022);
+    for (int i = 0; i < NR_NAMES; i++)
+        names[nr_names++] = sorted_names[i];
+    for (size_t i = 0; i < sizeof(others)/sizeof(others[0]); i++)
+        names[nr_names++] = others[i];
+    for (int i = nr_names - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        const char *tmp = names[i];
+        names[i] = names[j];
+        names[j] = tmp;
+    }
+
+    bench_lookup("binary search", binary_search, names, nr_names);
+    bench_lookup("perfect hash", perfect_hash, names, nr_names);
+    return 0;
+}
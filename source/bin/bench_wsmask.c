@@ -0,0 +1,120 @@
+/*
+** bench_wsmask.c -- The microbenchmark of the WebSocket unmasking kernels.
+**
+** Copyright (C) 2022 FMSoft (http://www.fmsoft.cn)
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+#undef NDEBUG
+
+#include <config.h>
+
+#include "purcmc/wsmask.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#define MAX_CHECK_LEN   300
+#define BENCH_TOTAL     (1UL << 30)
+
+static const unsigned char mask[4] = { 0x3c, 0xa5, 0x0f, 0x81 };
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Check the kernel against the scalar one for all phases, alignments,
+   and lengths of the tails. */
+static void check_kernel(const WSUnmaskKernel *ref,
+        const WSUnmaskKernel *kernel)
+{
+    char src[MAX_CHECK_LEN + 16];
+    char expected[MAX_CHECK_LEN + 16];
+    char got[MAX_CHECK_LEN + 16];
+
+    for (size_t i = 0; i < sizeof(src); i++)
+        src[i] = (char)(i * 131 + 7);
+
+    for (size_t phase = 0; phase < 4; phase++) {
+        for (size_t align = 0; align < 16; align++) {
+            for (size_t len = 0; len <= MAX_CHECK_LEN; len++) {
+                memcpy(expected, src, sizeof(src));
+                memcpy(got, src, sizeof(src));
+                ref->unmask(expected + align, len, mask, phase);
+                kernel->unmask(got + align, len, mask, phase);
+                assert(memcmp(expected, got, sizeof(got)) == 0);
+            }
+        }
+    }
+}
+
+static void bench_kernel(const WSUnmaskKernel *kernel, char *buf,
+        size_t len)
+{
+    size_t rounds = BENCH_TOTAL / len;
+    double start, elapsed;
+
+    if (rounds == 0)
+        rounds = 1;
+
+    /* warm up the cache and the page table */
+    kernel->unmask(buf, len, mask, 0);
+
+    start = now();
+    for (size_t i = 0; i < rounds; i++)
+        kernel->unmask(buf, len, mask, i & 3);
+    elapsed = now() - start;
+
+    printf("%-8s %10zu bytes: %8.2f GB/s\n", kernel->name, len,
+            (double)len * rounds / elapsed / 1e9);
+}
+
+int main(void)
+{
+    static const size_t sizes[] = { 64, 1024, 16384, 1 << 20, 16 << 20 };
+    const WSUnmaskKernel *kernels;
+    int nr_kernels;
+    char *buf;
+
+    ws_unmask_init();
+    kernels = ws_unmask_kernels(&nr_kernels);
+
+    for (int i = 1; i < nr_kernels; i++)
+        check_kernel(&kernels[0], &kernels[i]);
+    printf("All %d kernels passed the check; selected: %s\n\n",
+            nr_kernels, ws_unmask_kernel()->name);
+
+    buf = malloc(sizes[sizeof(sizes)/sizeof(sizes[0]) - 1]);
+    assert(buf);
+    memset(buf, 0x5a, sizes[sizeof(sizes)/sizeof(sizes[0]) - 1]);
+
+    for (size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+        for (int j = 0; j < nr_kernels; j++)
+            bench_kernel(&kernels[j], buf, sizes[i]);
+        printf("\n");
+    }
+
+    free(buf);
+    return 0;
+}
+
@@ -48,6 +48,9 @@ struct purcmc_workspace {
 struct purcmc_session {
     purcmc_server *srv;
 
+    /* the endpoint owning the session; it might be removed earlier */
+    purcmc_endpoint_ref endpoint;
+
     WebKitSettings *webkit_settings;
     WebKitWebContext *web_context;
 
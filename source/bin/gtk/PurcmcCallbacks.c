@@ -91,16 +91,7 @@ static purcmc_workspace *create_or_get_workspace(purcmc_endpoint* endpoint)
  */
 purcmc_endpoint* purcmc_get_endpoint_by_session(purcmc_session *sess)
 {
-    char host[PURC_LEN_HOST_NAME + 1];
-    char app[PURC_LEN_APP_NAME + 1];
-    char runner[PURC_LEN_RUNNER_NAME + 1];
-
-    purc_hvml_uri_split(sess->uri_prefix, host, app, runner, NULL, NULL);
-
-    char endpoint_name[PURC_LEN_ENDPOINT_NAME + 1];
-    purc_assemble_endpoint_name(host, app, runner, endpoint_name);
-
-    return purcmc_endpoint_from_name(sess->srv, endpoint_name);
+    return purcmc_endpoint_from_ref(sess->srv, &sess->endpoint);
 }
 
 bool gtk_pend_response(purcmc_session* sess, const char *operation,
@@ -307,6 +298,7 @@ purcmc_session *gtk_create_session(purcmc_server *srv, purcmc_endpoint *endpt)
     }
 
     sess->srv = srv;
+    purcmc_endpoint_get_ref(endpt, &sess->endpoint);
     WebKitSettings *webkit_settings = purcmc_rdrsrv_get_user_data(srv);
     WebKitWebsiteDataManager *manager;
     manager = g_object_get_data(G_OBJECT(webkit_settings),
@@ -37,7 +37,9 @@
 #include "purcmc/purcmc.h"
 
 #include <errno.h>
+#include <glib-unix.h>
 #include <gtk/gtk.h>
+#include <signal.h>
 #include <string.h>
 #include <webkit2/webkit2.h>
 
@@ -46,6 +48,8 @@
 
 static purcmc_server_config pcmc_srvcfg;
 static purcmc_server *pcmc_srv;
+/* the original command line to exec the new instance for a hot upgrade */
+static char **savedArgv;
 
 static const gchar **uriArguments = NULL;
 static const gchar **ignoreHosts = NULL;
@@ -145,6 +149,14 @@ static const GOptionEntry commandLineOptions[] =
 #endif
     { "pcmc-maxfrmsize", 0, 0, G_OPTION_ARG_INT, &pcmc_srvcfg.max_frm_size, "The maximum size of a socket frame", "BYTES" },
     { "pcmc-backlog", 0, 0, G_OPTION_ARG_INT, &pcmc_srvcfg.backlog, "The maximum length to which the queue of pending connections.", "NUMBER" },
+    { "pcmc-max-clients", 0, 0, G_OPTION_ARG_INT, &pcmc_srvcfg.max_clients, "The maximal number of the clients of each transport", "NUMBER" },
+    { "pcmc-sched-msgs", 0, 0, G_OPTION_ARG_INT, &pcmc_srvcfg.sched_msgs, "The maximal number of the messages handled for an endpoint per turn", "NUMBER" },
+    { "pcmc-sched-bytes", 0, 0, G_OPTION_ARG_INT, &pcmc_srvcfg.sched_bytes, "The maximal number of the bytes handled for an endpoint per turn", "BYTES" },
+    { "pcmc-threaded", 0, 0, G_OPTION_ARG_NONE, &pcmc_srvcfg.threaded, "Handle the sockets in a dedicated I/O thread", NULL },
+#if HAVE(ZLIB)
+    { "pcmc-nodeflate", 0, 0, G_OPTION_ARG_NONE, &pcmc_srvcfg.nodeflate, "Without support for the permessage-deflate extension of WebSocket", NULL },
+    { "pcmc-deflate-threshold", 0, 0, G_OPTION_ARG_INT, &pcmc_srvcfg.deflate_threshold, "The minimum size of a WebSocket message to compress", "BYTES" },
+#endif
 
     { "autoplay-policy", 0, 0, G_OPTION_ARG_CALLBACK, parseAutoplayPolicy, "Autoplay policy. Valid options are: allow, allow-without-sound, and deny", NULL },
     { "bg-color", 0, 0, G_OPTION_ARG_CALLBACK, parseBackgroundColor, "Background color", NULL },
@@ -687,6 +699,53 @@ static void setDefaultWebsitePolicies(WebKitSettings *webkitSettings)
     g_object_ref(policies);
 }
 
+static gboolean pcmc_source_prepare(GSource *source, gint *timeout)
+{
+    (void)source;
+    *timeout = -1;
+    /* the deferred packets are ready to handle without any new event */
+    return purcmc_rdrsrv_has_deferred(pcmc_srv);
+}
+
+static gboolean pcmc_source_dispatch(GSource *source,
+        GSourceFunc callback, gpointer user_data)
+{
+    (void)source;
+    return callback(user_data);
+}
+
+static GSourceFuncs pcmc_source_funcs = {
+    .prepare = pcmc_source_prepare,
+    .dispatch = pcmc_source_dispatch,
+};
+
+static gint64 handOffTime;
+
+static gboolean drainEndpoints(GApplication *application)
+{
+    /* quit when the endpoints left are gone, or waited them too long */
+    if (purcmc_rdrsrv_nr_socket_endpoints(pcmc_srv) == 0 ||
+            g_get_monotonic_time() - handOffTime >=
+            PURCMC_HANDOFF_DRAIN_TIMEOUT * G_USEC_PER_SEC) {
+        g_application_quit(application);
+        return G_SOURCE_REMOVE;
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean handOffServer(GApplication *application)
+{
+    /* the new instance accepts the clients from now on */
+    if (purcmc_rdrsrv_hand_off(pcmc_srv, savedArgv) == 0) {
+        handOffTime = g_get_monotonic_time();
+        g_timeout_add_seconds(PURCMC_CHECK_ENDPOINTS_INTERVAL,
+                G_SOURCE_FUNC(drainEndpoints), application);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
 static void startup(GApplication *application, WebKitSettings *webkitSettings)
 {
     const char *actionAccels[] = {
@@ -764,16 +823,31 @@ static void startup(GApplication *application, WebKitSettings *webkitSettings)
     GMainContext *context = g_main_context_default();
 
     GSource *source;
-    source = g_timeout_source_new(10);
+    int fd = purcmc_rdrsrv_get_fd(pcmc_srv);
+    if (fd >= 0) {
+        /* wake up only when the server has events to dispatch */
+        source = g_source_new(&pcmc_source_funcs, sizeof(GSource));
+        g_source_add_unix_fd(source, fd, G_IO_IN);
+    }
+    else {
+        source = g_timeout_source_new(10);
+    }
     g_source_set_callback(source,
             G_SOURCE_FUNC(purcmc_rdrsrv_check), pcmc_srv, NULL);
     g_source_attach(source, context);
     g_source_unref(source);
+
+    g_timeout_add_seconds(PURCMC_CHECK_ENDPOINTS_INTERVAL,
+            G_SOURCE_FUNC(purcmc_rdrsrv_check_endpoints), pcmc_srv);
+
+    /* SIGUSR2 asks for a hot upgrade */
+    g_unix_signal_add(SIGUSR2, G_SOURCE_FUNC(handOffServer), application);
 }
 
 static void shutdown(GApplication *application, WebKitSettings *webkitSettings)
 {
-    g_source_remove_by_user_data(pcmc_srv);
+    while (g_source_remove_by_user_data(pcmc_srv))
+        ;
     purcmc_rdrsrv_deinit(pcmc_srv);
 
     WebKitWebsiteDataManager *manager;
@@ -923,6 +997,8 @@ int main(int argc, char *argv[])
     g_setenv("WEBKIT_INJECTED_BUNDLE_PATH", WEBKIT_INJECTED_BUNDLE_PATH, FALSE);
 #endif
 
+    savedArgv = g_strdupv(argv);
+
 #if GTK_CHECK_VERSION(3, 98, 0)
     gtk_init();
 #else
@@ -974,6 +1050,7 @@ int main(int argc, char *argv[])
     g_signal_connect(application, "activate", G_CALLBACK(activate), webkitSettings);
     g_application_run(G_APPLICATION(application), 0, NULL);
     g_object_unref(application);
+    g_strfreev(savedArgv);
 
     return exitAfterLoad && webProcessCrashed ? 1 : 0;
 }
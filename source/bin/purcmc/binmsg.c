@@ -0,0 +1,640 @@
+/*
+** binmsg.c -- the binary encoding of the messages of PurCMC protocol.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <config.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <purc/purc-variant.h>
+
+#include "binmsg.h"
+
+/* the number of the items of a message */
+#define NR_MSG_ITEMS        15
+
+/* the MessagePack format bytes used */
+enum {
+    MP_NIL          = 0xc0,
+    MP_FALSE        = 0xc2,
+    MP_TRUE         = 0xc3,
+    MP_BIN8         = 0xc4,
+    MP_BIN16        = 0xc5,
+    MP_BIN32        = 0xc6,
+    MP_FLOAT32      = 0xca,
+    MP_FLOAT64      = 0xcb,
+    MP_UINT8        = 0xcc,
+    MP_UINT16       = 0xcd,
+    MP_UINT32       = 0xce,
+    MP_UINT64       = 0xcf,
+    MP_INT8         = 0xd0,
+    MP_INT16        = 0xd1,
+    MP_INT32        = 0xd2,
+    MP_INT64        = 0xd3,
+    MP_STR8         = 0xd9,
+    MP_STR16        = 0xda,
+    MP_STR32        = 0xdb,
+    MP_ARRAY16      = 0xdc,
+    MP_ARRAY32      = 0xdd,
+    MP_MAP16        = 0xde,
+    MP_MAP32        = 0xdf,
+};
+
+/* the size of the buffer to gather the small items before writing */
+#define SZ_WRITER_BUFF      4096
+
+typedef struct Writer {
+    purcmc_binmsg_write_fn  fn;
+    void                   *ctxt;
+    size_t                  len;
+    bool                    failed;
+    unsigned char           buff[SZ_WRITER_BUFF];
+} Writer;
+
+static void flush(Writer *w)
+{
+    if (w->len > 0 && !w->failed) {
+        if (w->fn(w->ctxt, w->buff, w->len) < 0)
+            w->failed = true;
+    }
+    w->len = 0;
+}
+
+static void put_bytes(Writer *w, const void *data, size_t len)
+{
+    if (w->len + len > SZ_WRITER_BUFF) {
+        flush(w);
+        if (len > SZ_WRITER_BUFF) {
+            if (!w->failed && w->fn(w->ctxt, data, len) < 0)
+                w->failed = true;
+            return;
+        }
+    }
+
+    memcpy(w->buff + w->len, data, len);
+    w->len += len;
+}
+
+/* Write the format byte followed by `nr` bytes of `v` in big endian */
+static void put_be(Writer *w, unsigned char fmt, uint64_t v, int nr)
+{
+    unsigned char bytes[9];
+
+    bytes[0] = fmt;
+    for (int i = nr; i > 0; i--) {
+        bytes[i] = (unsigned char)v;
+        v >>= 8;
+    }
+    put_bytes(w, bytes, nr + 1);
+}
+
+static inline void put_byte(Writer *w, unsigned char c)
+{
+    put_bytes(w, &c, 1);
+}
+
+static void put_uint(Writer *w, uint64_t v)
+{
+    if (v < 0x80)
+        put_byte(w, (unsigned char)v);
+    else if (v <= UINT8_MAX)
+        put_be(w, MP_UINT8, v, 1);
+    else if (v <= UINT16_MAX)
+        put_be(w, MP_UINT16, v, 2);
+    else if (v <= UINT32_MAX)
+        put_be(w, MP_UINT32, v, 4);
+    else
+        put_be(w, MP_UINT64, v, 8);
+}
+
+static void put_int(Writer *w, int64_t v)
+{
+    if (v >= 0)
+        put_uint(w, (uint64_t)v);
+    else if (v >= -32)
+        put_byte(w, (unsigned char)(int8_t)v);
+    else if (v >= INT8_MIN)
+        put_be(w, MP_INT8, (uint64_t)v, 1);
+    else if (v >= INT16_MIN)
+        put_be(w, MP_INT16, (uint64_t)v, 2);
+    else if (v >= INT32_MIN)
+        put_be(w, MP_INT32, (uint64_t)v, 4);
+    else
+        put_be(w, MP_INT64, (uint64_t)v, 8);
+}
+
+static void put_double(Writer *w, double d)
+{
+    uint64_t v;
+
+    memcpy(&v, &d, sizeof(v));
+    put_be(w, MP_FLOAT64, v, 8);
+}
+
+/* Write the header of a string, a binary, an array, or a map */
+static void put_header(Writer *w, unsigned char fix, unsigned fix_max,
+        unsigned char fmt8, size_t n)
+{
+    if (n <= fix_max)
+        put_byte(w, fix | (unsigned char)n);
+    else if (fmt8 && n <= UINT8_MAX)
+        put_be(w, fmt8, n, 1);
+    else if (n <= UINT16_MAX)
+        put_be(w, fmt8 ? fmt8 + 1 : fix == 0x90 ? MP_ARRAY16 : MP_MAP16, n, 2);
+    else
+        put_be(w, fmt8 ? fmt8 + 2 : fix == 0x90 ? MP_ARRAY32 : MP_MAP32, n, 4);
+}
+
+static void put_str(Writer *w, const char *str, size_t len)
+{
+    put_header(w, 0xa0, 31, MP_STR8, len);
+    put_bytes(w, str, len);
+}
+
+static void put_bin(Writer *w, const void *bytes, size_t len)
+{
+    /* there is no fixbin format */
+    put_header(w, 0, 0, MP_BIN8, len);
+    put_bytes(w, bytes, len);
+}
+
+static inline void put_array_header(Writer *w, size_t n)
+{
+    put_header(w, 0x90, 15, 0, n);
+}
+
+static inline void put_map_header(Writer *w, size_t n)
+{
+    put_header(w, 0x80, 15, 0, n);
+}
+
+static void put_variant(Writer *w, purc_variant_t v, int depth)
+{
+    const char *str;
+    size_t len;
+
+    if (v == PURC_VARIANT_INVALID) {
+        put_byte(w, MP_NIL);
+        return;
+    }
+
+    if (depth > PURCMC_BINMSG_MAX_DEPTH) {
+        w->failed = true;
+        return;
+    }
+
+    switch (purc_variant_get_type(v)) {
+    case PURC_VARIANT_TYPE_BOOLEAN:
+        put_byte(w, purc_variant_is_true(v) ? MP_TRUE : MP_FALSE);
+        break;
+
+    case PURC_VARIANT_TYPE_NUMBER:
+    case PURC_VARIANT_TYPE_LONGDOUBLE: {
+        double d = 0;
+        purc_variant_cast_to_number(v, &d, false);
+        put_double(w, d);
+        break;
+    }
+
+    case PURC_VARIANT_TYPE_LONGINT: {
+        int64_t i64 = 0;
+        purc_variant_cast_to_longint(v, &i64, false);
+        put_int(w, i64);
+        break;
+    }
+
+    case PURC_VARIANT_TYPE_ULONGINT: {
+        uint64_t u64 = 0;
+        purc_variant_cast_to_ulongint(v, &u64, false);
+        put_uint(w, u64);
+        break;
+    }
+
+    case PURC_VARIANT_TYPE_STRING:
+    case PURC_VARIANT_TYPE_ATOMSTRING:
+    case PURC_VARIANT_TYPE_EXCEPTION:
+        str = purc_variant_get_string_const_ex(v, &len);
+        if (str)
+            put_str(w, str, len);
+        else
+            put_byte(w, MP_NIL);
+        break;
+
+    case PURC_VARIANT_TYPE_BSEQUENCE: {
+        const unsigned char *bytes = purc_variant_get_bytes_const(v, &len);
+        put_bin(w, bytes, bytes ? len : 0);
+        break;
+    }
+
+    case PURC_VARIANT_TYPE_OBJECT: {
+        purc_variant_t k, val;
+
+        len = 0;
+        purc_variant_object_size(v, &len);
+        put_map_header(w, len);
+        foreach_key_value_in_variant_object(v, k, val)
+            put_variant(w, k, depth + 1);
+            put_variant(w, val, depth + 1);
+        end_foreach;
+        break;
+    }
+
+    case PURC_VARIANT_TYPE_ARRAY:
+        len = 0;
+        purc_variant_array_size(v, &len);
+        put_array_header(w, len);
+        for (size_t i = 0; i < len; i++)
+            put_variant(w, purc_variant_array_get(v, i), depth + 1);
+        break;
+
+    /* a set is sent as an array */
+    case PURC_VARIANT_TYPE_SET:
+        len = 0;
+        purc_variant_set_size(v, &len);
+        put_array_header(w, len);
+        for (size_t i = 0; i < len; i++)
+            put_variant(w, purc_variant_set_get_by_index(v, i), depth + 1);
+        break;
+
+    /* null, undefined, and the values can not be serialized */
+    default:
+        put_byte(w, MP_NIL);
+        break;
+    }
+}
+
+int purcmc_binmsg_serialize(const pcrdr_msg *msg,
+        purcmc_binmsg_write_fn fn, void *ctxt)
+{
+    Writer w;
+
+    w.fn = fn;
+    w.ctxt = ctxt;
+    w.len = 0;
+    w.failed = false;
+
+    put_array_header(&w, NR_MSG_ITEMS);
+    put_uint(&w, PURCMC_BINMSG_VERSION);
+    put_uint(&w, msg->type);
+    put_uint(&w, msg->target);
+    put_uint(&w, msg->targetValue);
+    put_variant(&w, msg->operation, 0);
+    put_uint(&w, msg->elementType);
+    put_variant(&w, msg->elementValue, 0);
+    put_variant(&w, msg->property, 0);
+    put_variant(&w, msg->eventName, 0);
+    put_variant(&w, msg->requestId, 0);
+    put_variant(&w, msg->sourceURI, 0);
+    put_uint(&w, msg->retCode);
+    put_uint(&w, msg->resultValue);
+    put_uint(&w, msg->dataType);
+    put_variant(&w, (msg->dataType == PCRDR_MSG_DATA_TYPE_VOID) ?
+            PURC_VARIANT_INVALID : msg->data, 0);
+    flush(&w);
+
+    return w.failed ? -1 : 0;
+}
+
+typedef struct Reader {
+    const unsigned char    *p;
+    const unsigned char    *end;
+    bool                    failed;
+} Reader;
+
+static const unsigned char *take(Reader *r, size_t n)
+{
+    const unsigned char *p = r->p;
+
+    if (r->failed || (size_t)(r->end - r->p) < n) {
+        r->failed = true;
+        return NULL;
+    }
+
+    r->p += n;
+    return p;
+}
+
+static uint64_t get_be(Reader *r, int nr)
+{
+    const unsigned char *p = take(r, nr);
+    uint64_t v = 0;
+
+    if (p) {
+        for (int i = 0; i < nr; i++)
+            v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static inline int peek(Reader *r)
+{
+    if (r->failed || r->p >= r->end) {
+        r->failed = true;
+        return -1;
+    }
+    return *r->p;
+}
+
+static uint64_t get_uint(Reader *r)
+{
+    int c = peek(r);
+
+    if (c < 0)
+        return 0;
+
+    r->p++;
+    if (c < 0x80)
+        return c;
+
+    switch (c) {
+    case MP_UINT8:
+        return get_be(r, 1);
+    case MP_UINT16:
+        return get_be(r, 2);
+    case MP_UINT32:
+        return get_be(r, 4);
+    case MP_UINT64:
+        return get_be(r, 8);
+    }
+
+    r->failed = true;
+    return 0;
+}
+
+/* Get the length of a string, a binary, an array, or a map */
+static size_t get_length(Reader *r, int c)
+{
+    size_t n;
+
+    switch (c) {
+    case MP_STR8:
+    case MP_BIN8:
+        return get_be(r, 1);
+    case MP_STR16:
+    case MP_BIN16:
+    case MP_ARRAY16:
+    case MP_MAP16:
+        return get_be(r, 2);
+    case MP_STR32:
+    case MP_BIN32:
+    case MP_ARRAY32:
+    case MP_MAP32:
+        n = get_be(r, 4);
+        /* an item takes one byte at least */
+        if (n > (size_t)(r->end - r->p))
+            r->failed = true;
+        return n;
+    }
+
+    /* the fix formats */
+    return (c >= 0xa0 && c <= 0xbf) ? (c & 0x1f) : (c & 0x0f);
+}
+
+static purc_variant_t get_variant(Reader *r, int depth);
+
+static purc_variant_t get_array(Reader *r, size_t n, int depth)
+{
+    purc_variant_t arr;
+
+    arr = purc_variant_make_array(0, PURC_VARIANT_INVALID);
+    if (arr == PURC_VARIANT_INVALID) {
+        r->failed = true;
+        return PURC_VARIANT_INVALID;
+    }
+
+    for (size_t i = 0; i < n && !r->failed; i++) {
+        purc_variant_t v = get_variant(r, depth + 1);
+
+        if (v == PURC_VARIANT_INVALID || !purc_variant_array_append(arr, v))
+            r->failed = true;
+        if (v)
+            purc_variant_unref(v);
+    }
+
+    if (r->failed) {
+        purc_variant_unref(arr);
+        return PURC_VARIANT_INVALID;
+    }
+
+    return arr;
+}
+
+static purc_variant_t get_map(Reader *r, size_t n, int depth)
+{
+    purc_variant_t obj;
+
+    obj = purc_variant_make_object(0, PURC_VARIANT_INVALID,
+            PURC_VARIANT_INVALID);
+    if (obj == PURC_VARIANT_INVALID) {
+        r->failed = true;
+        return PURC_VARIANT_INVALID;
+    }
+
+    for (size_t i = 0; i < n && !r->failed; i++) {
+        purc_variant_t k, v = PURC_VARIANT_INVALID;
+        int c = peek(r);
+
+        /* the keys must be strings */
+        if (!((c >= 0xa0 && c <= 0xbf) ||
+                    c == MP_STR8 || c == MP_STR16 || c == MP_STR32)) {
+            r->failed = true;
+            break;
+        }
+
+        k = get_variant(r, depth + 1);
+        if (k)
+            v = get_variant(r, depth + 1);
+        if (v == PURC_VARIANT_INVALID || !purc_variant_object_set(obj, k, v))
+            r->failed = true;
+        if (k)
+            purc_variant_unref(k);
+        if (v)
+            purc_variant_unref(v);
+    }
+
+    if (r->failed) {
+        purc_variant_unref(obj);
+        return PURC_VARIANT_INVALID;
+    }
+
+    return obj;
+}
+
+static purc_variant_t get_variant(Reader *r, int depth)
+{
+    const unsigned char *p;
+    purc_variant_t v = PURC_VARIANT_INVALID;
+    int c;
+    size_t n;
+
+    if (depth > PURCMC_BINMSG_MAX_DEPTH || (c = peek(r)) < 0) {
+        r->failed = true;
+        return PURC_VARIANT_INVALID;
+    }
+
+    if (c < 0x80 || (c >= MP_UINT8 && c <= MP_UINT64))
+        return purc_variant_make_ulongint(get_uint(r));
+
+    r->p++;
+    if (c >= 0xe0)
+        return purc_variant_make_longint((int8_t)c);
+
+    switch (c) {
+    case MP_NIL:
+        return purc_variant_make_null();
+
+    case MP_FALSE:
+    case MP_TRUE:
+        return purc_variant_make_boolean(c == MP_TRUE);
+
+    case MP_FLOAT32: {
+        uint32_t u32 = (uint32_t)get_be(r, 4);
+        float f;
+        memcpy(&f, &u32, sizeof(f));
+        v = purc_variant_make_number(f);
+        break;
+    }
+
+    case MP_FLOAT64: {
+        uint64_t u64 = get_be(r, 8);
+        double d;
+        memcpy(&d, &u64, sizeof(d));
+        v = purc_variant_make_number(d);
+        break;
+    }
+
+    case MP_INT8:
+        v = purc_variant_make_longint((int8_t)get_be(r, 1));
+        break;
+    case MP_INT16:
+        v = purc_variant_make_longint((int16_t)get_be(r, 2));
+        break;
+    case MP_INT32:
+        v = purc_variant_make_longint((int32_t)get_be(r, 4));
+        break;
+    case MP_INT64:
+        v = purc_variant_make_longint((int64_t)get_be(r, 8));
+        break;
+
+    case MP_STR8:
+    case MP_STR16:
+    case MP_STR32:
+    case 0xa0 ... 0xbf:
+        n = get_length(r, c);
+        if ((p = take(r, n)))
+            v = purc_variant_make_string_ex((const char *)p, n, true);
+        break;
+
+    case MP_BIN8:
+    case MP_BIN16:
+    case MP_BIN32:
+        n = get_length(r, c);
+        if ((p = take(r, n)))
+            v = purc_variant_make_byte_sequence(p, n);
+        break;
+
+    case 0x90 ... 0x9f:
+    case MP_ARRAY16:
+    case MP_ARRAY32:
+        n = get_length(r, c);
+        if (!r->failed)
+            v = get_array(r, n, depth);
+        break;
+
+    case 0x80 ... 0x8f:
+    case MP_MAP16:
+    case MP_MAP32:
+        n = get_length(r, c);
+        if (!r->failed)
+            v = get_map(r, n, depth);
+        break;
+
+    default:
+        break;
+    }
+
+    if (v == PURC_VARIANT_INVALID)
+        r->failed = true;
+    return v;
+}
+
+/* Get a variant of the header; nil means the variant is absent */
+static purc_variant_t get_field(Reader *r)
+{
+    if (peek(r) == MP_NIL) {
+        r->p++;
+        return PURC_VARIANT_INVALID;
+    }
+
+    return get_variant(r, 0);
+}
+
+int purcmc_binmsg_parse(const char *packet, size_t sz_packet,
+        pcrdr_msg **msg_out)
+{
+    Reader r;
+    pcrdr_msg *msg;
+
+    r.p = (const unsigned char *)packet;
+    r.end = r.p + sz_packet;
+    r.failed = false;
+
+    /* a fixarray of all items */
+    if (peek(&r) != (0x90 | NR_MSG_ITEMS))
+        return PCRDR_ERROR_PROTOCOL;
+    r.p++;
+    if (get_uint(&r) != PURCMC_BINMSG_VERSION || r.failed)
+        return PCRDR_ERROR_PROTOCOL;
+
+    msg = pcrdr_make_void_message();
+    if (msg == NULL)
+        return PCRDR_ERROR_NOMEM;
+
+    msg->type = get_uint(&r);
+    msg->target = get_uint(&r);
+    msg->targetValue = get_uint(&r);
+    msg->operation = get_field(&r);
+    msg->elementType = get_uint(&r);
+    msg->elementValue = get_field(&r);
+    msg->property = get_field(&r);
+    msg->eventName = get_field(&r);
+    msg->requestId = get_field(&r);
+    msg->sourceURI = get_field(&r);
+    msg->retCode = get_uint(&r);
+    msg->resultValue = get_uint(&r);
+    msg->dataType = get_uint(&r);
+    if (msg->dataType == PCRDR_MSG_DATA_TYPE_JSON)
+        msg->data = get_variant(&r, 0);
+    else
+        msg->data = get_field(&r);
+
+    if (r.failed || r.p != r.end ||
+            msg->type > PCRDR_MSG_TYPE_LAST ||
+            msg->target > PCRDR_MSG_TARGET_LAST ||
+            msg->elementType > PCRDR_MSG_ELEMENT_TYPE_LAST ||
+            msg->dataType > PCRDR_MSG_DATA_TYPE_LAST) {
+        pcrdr_release_message(msg);
+        return PCRDR_ERROR_PROTOCOL;
+    }
+
+    *msg_out = msg;
+    return 0;
+}
@@ -0,0 +1,79 @@
+/*
+** binmsg.h -- the binary encoding of the messages of PurCMC protocol.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef XGUIPRO_PURCMC_BINMSG_H
+#define XGUIPRO_PURCMC_BINMSG_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <purc/purc-pcrdr.h>
+
+/*
+ * The name of the binary format advertised in the features of the server.
+ *
+ * A message in the binary format is a MessagePack array of the following
+ * items, and it is sent in a binary packet (US_OPCODE_BIN or
+ * WS_OPCODE_BIN):
+ *
+ *  0. the version of the format (1);
+ *  1. type, 2. target, 3. targetValue, 4. operation,
+ *  5. elementType, 6. elementValue, 7. property, 8. eventName,
+ *  9. requestId, 10. sourceURI, 11. retCode, 12. resultValue,
+ *  13. dataType, 14. data.
+ *
+ * The enumerations and the integers are unsigned integers; a variant
+ * absent is nil. The operation of a request can be given by its
+ * identifier (PCRDR_K_OPERATION_*) instead of its name. The data of JSON type is encoded as a MessagePack value
+ * directly, so it needs no JSON parsing; the data of other types are
+ * strings.
+ *
+ * The text format is the default one. The server sends the messages in
+ * the binary format to an endpoint once the endpoint sent a message in
+ * the binary format, e.g., the request to start the session.
+ */
+#define PURCMC_BINMSG_FORMAT        "msgpack-1"
+#define PURCMC_BINMSG_VERSION       1
+
+/* the max nesting level of the containers in the data */
+#define PURCMC_BINMSG_MAX_DEPTH     64
+
+typedef ssize_t (*purcmc_binmsg_write_fn)(void *ctxt,
+        const void *buf, size_t count);
+
+/*
+ * Serialize the message in the binary format by calling `fn`.
+ *
+ * Returns 0 on success, or -1 if failed to write.
+ */
+int purcmc_binmsg_serialize(const pcrdr_msg *msg,
+        purcmc_binmsg_write_fn fn, void *ctxt);
+
+/*
+ * Parse a message in the binary format.
+ *
+ * Returns 0 on success and the message is stored in `msg`; it should be
+ * released by calling pcrdr_release_message(). Returns an error code of
+ * PurC on failure.
+ */
+int purcmc_binmsg_parse(const char *packet, size_t sz_packet,
+        pcrdr_msg **msg);
+
+#endif /* !XGUIPRO_PURCMC_BINMSG_H */
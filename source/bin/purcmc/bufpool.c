@@ -0,0 +1,108 @@
+/*
+** bufpool.c -- the pool of the reusable buffers for incoming packets.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bufpool.h"
+
+/* Return the index of the class for the size, or -1 if it is too large */
+static inline int size_to_class(size_t size)
+{
+    int order = BUF_POOL_MIN_ORDER;
+
+    if (size > ((size_t)1 << BUF_POOL_MAX_ORDER))
+        return -1;
+
+    if (size > ((size_t)1 << BUF_POOL_MIN_ORDER)) {
+        order = sizeof(unsigned long) * 8 -
+            __builtin_clzl((unsigned long)(size - 1));
+    }
+
+    return order - BUF_POOL_MIN_ORDER;
+}
+
+static inline size_t class_size(int cls)
+{
+    return (size_t)1 << (cls + BUF_POOL_MIN_ORDER);
+}
+
+void buf_pool_init(BufPool *pool, size_t max_cached)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->max_cached = max_cached;
+}
+
+void buf_pool_destroy(BufPool *pool)
+{
+    for (int cls = 0; cls < BUF_POOL_NR_CLASSES; cls++) {
+        void *buf = pool->free_lists[cls];
+
+        while (buf) {
+            void *next = *(void **)buf;
+            free(buf);
+            buf = next;
+        }
+
+        pool->free_lists[cls] = NULL;
+        pool->nr_free[cls] = 0;
+    }
+
+    pool->sz_cached = 0;
+}
+
+void *buf_pool_get(BufPool *pool, size_t size)
+{
+    int cls = size_to_class(size);
+    void *buf;
+
+    pool->nr_gets++;
+    if (cls < 0)
+        return malloc(size);
+
+    buf = pool->free_lists[cls];
+    if (buf) {
+        pool->free_lists[cls] = *(void **)buf;
+        pool->nr_free[cls]--;
+        pool->sz_cached -= class_size(cls);
+        pool->nr_hits++;
+        return buf;
+    }
+
+    return malloc(class_size(cls));
+}
+
+void buf_pool_put(BufPool *pool, void *buf, size_t size)
+{
+    int cls = size_to_class(size);
+
+    if (cls < 0 || pool->nr_free[cls] >= BUF_POOL_MAX_FREE ||
+            pool->sz_cached + class_size(cls) > pool->max_cached) {
+        free(buf);
+        return;
+    }
+
+    *(void **)buf = pool->free_lists[cls];
+    pool->free_lists[cls] = buf;
+    pool->nr_free[cls]++;
+    pool->sz_cached += class_size(cls);
+}
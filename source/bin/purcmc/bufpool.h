@@ -0,0 +1,76 @@
+/*
+** bufpool.h -- the pool of the reusable buffers for incoming packets.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef XGUIPRO_PURCMC_BUFPOOL_H
+#define XGUIPRO_PURCMC_BUFPOOL_H
+
+#include <stddef.h>
+
+/* the orders of the sizes of the smallest and the largest classes */
+#define BUF_POOL_MIN_ORDER      8       /* 256B */
+#define BUF_POOL_MAX_ORDER      20      /* 1MiB */
+#define BUF_POOL_NR_CLASSES     (BUF_POOL_MAX_ORDER - BUF_POOL_MIN_ORDER + 1)
+
+/* the max number of the free buffers kept for each class */
+#define BUF_POOL_MAX_FREE       16
+
+/* the default max size of all free buffers kept in a pool (4MiB) */
+#define BUF_POOL_DEF_MAX_CACHED (4 << 20)
+
+/*
+ * A pool of buffers in power-of-two size classes.
+ *
+ * A free buffer is linked to the free list of its class by its first
+ * bytes. The buffers larger than the largest class are allocated and
+ * freed directly. The pool is not thread-safe; it belongs to the thread
+ * handling the reads of the clients.
+ */
+typedef struct BufPool_ {
+    void               *free_lists[BUF_POOL_NR_CLASSES];
+    unsigned            nr_free[BUF_POOL_NR_CLASSES];
+
+    /* the total size of the free buffers and the limit */
+    size_t              sz_cached;
+    size_t              max_cached;
+
+    /* statistics */
+    unsigned long       nr_gets;
+    unsigned long       nr_hits;
+} BufPool;
+
+void buf_pool_init(BufPool *pool, size_t max_cached);
+
+/* Free all buffers kept in the pool */
+void buf_pool_destroy(BufPool *pool);
+
+/*
+ * Borrow a buffer which can hold at least `size` bytes.
+ *
+ * Returns NULL if failed to allocate memory.
+ */
+void *buf_pool_get(BufPool *pool, size_t size);
+
+/*
+ * Return a buffer to the pool; `size` must be the size passed to
+ * buf_pool_get() when the buffer was borrowed.
+ */
+void buf_pool_put(BufPool *pool, void *buf, size_t size);
+
+#endif /* !XGUIPRO_PURCMC_BUFPOOL_H */
@@ -0,0 +1,220 @@
+/*
+** builtin.c -- the connections of the builtin endpoints.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#include <config.h>
+
+#if HAVE(SYS_EVENTFD_H)
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <purc/purc.h>
+
+#include "builtin.h"
+
+BuiltinConn *builtin_conn_new(int wake_fd)
+{
+    BuiltinConn *conn = calloc(1, sizeof(BuiltinConn));
+
+    if (conn == NULL)
+        return NULL;
+
+    if (io_queue_init(&conn->to_server)) {
+        free(conn);
+        return NULL;
+    }
+
+    if (io_queue_init(&conn->to_client)) {
+        io_queue_destroy(&conn->to_server);
+        free(conn);
+        return NULL;
+    }
+
+    pthread_mutex_init(&conn->lock, NULL);
+    conn->wake_fd = wake_fd;
+    conn->refc = 2;
+    list_head_init(&conn->link);
+    return conn;
+}
+
+// Release the messages left in the queue; they are not allocated by malloc().
+static void drain_queue(IOQueue *queue)
+{
+    IOMessage msg;
+
+    while (io_queue_pop(queue, &msg)) {
+        if (msg.type == BIM_MESSAGE)
+            pcrdr_release_message((pcrdr_msg *)msg.data);
+    }
+
+    io_queue_destroy(queue);
+}
+
+static void release_conn(BuiltinConn *conn)
+{
+    if (__atomic_sub_fetch(&conn->refc, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    drain_queue(&conn->to_server);
+    drain_queue(&conn->to_client);
+    pthread_mutex_destroy(&conn->lock);
+    free(conn);
+}
+
+static int push_message(IOQueue *queue, int type, pcrdr_msg *data)
+{
+    IOMessage *msg = calloc(1, sizeof(IOMessage));
+
+    if (msg == NULL)
+        return -1;
+
+    msg->type = type;
+    msg->data = (char *)data;
+    io_queue_push(queue, msg);
+    return 0;
+}
+
+static void wake_server(BuiltinConn *conn)
+{
+    uint64_t one = 1;
+
+    if (write(conn->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        purc_log_error("Failed to write to eventfd: %s\n", strerror(errno));
+    }
+}
+
+int builtin_conn_post(BuiltinConn *conn, const pcrdr_msg *msg)
+{
+    pcrdr_msg *clone = pcrdr_clone_message(msg);
+
+    if (clone == NULL)
+        return -1;
+
+    if (push_message(&conn->to_client, BIM_MESSAGE, clone)) {
+        pcrdr_release_message(clone);
+        return -1;
+    }
+
+    io_queue_notify(&conn->to_client);
+    return 0;
+}
+
+bool builtin_conn_fetch(BuiltinConn *conn, pcrdr_msg **msg)
+{
+    IOMessage iomsg;
+
+    if (conn->unfetched) {
+        *msg = conn->unfetched;
+        conn->unfetched = NULL;
+        return true;
+    }
+
+    if (!io_queue_pop(&conn->to_server, &iomsg))
+        return false;
+
+    *msg = (iomsg.type == BIM_MESSAGE) ? (pcrdr_msg *)iomsg.data : NULL;
+    return true;
+}
+
+void builtin_conn_unfetch(BuiltinConn *conn, pcrdr_msg *msg)
+{
+    conn->unfetched = msg;
+}
+
+void builtin_conn_detach(BuiltinConn *conn)
+{
+    list_del_init(&conn->link);
+    conn->endpoint = NULL;
+    if (conn->unfetched) {
+        pcrdr_release_message(conn->unfetched);
+        conn->unfetched = NULL;
+    }
+
+    /* wait for the interpreter writing `wake_fd` */
+    pthread_mutex_lock(&conn->lock);
+    __atomic_store_n(&conn->closed, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&conn->lock);
+
+    if (push_message(&conn->to_client, BIM_CLOSE, NULL) == 0)
+        io_queue_notify(&conn->to_client);
+    release_conn(conn);
+}
+
+int purcmc_builtin_conn_get_fd(purcmc_builtin_conn *conn)
+{
+    return conn->to_client.efd;
+}
+
+int purcmc_builtin_conn_send(purcmc_builtin_conn *conn, pcrdr_msg *msg)
+{
+    int ret = PCRDR_SC_OK;
+
+    /* `wake_fd` may be closed by the server once `closed` is set */
+    pthread_mutex_lock(&conn->lock);
+    if (conn->closed)
+        ret = PCRDR_SC_NOT_READY;
+    else if (push_message(&conn->to_server, BIM_MESSAGE, msg))
+        ret = PCRDR_SC_INSUFFICIENT_STORAGE;
+    else
+        wake_server(conn);
+    pthread_mutex_unlock(&conn->lock);
+
+    if (ret != PCRDR_SC_OK)
+        pcrdr_release_message(msg);
+    return ret;
+}
+
+pcrdr_msg *purcmc_builtin_conn_recv(purcmc_builtin_conn *conn)
+{
+    IOMessage msg;
+
+    /* clear the eventfd before checking the queue again */
+    if (!io_queue_pop(&conn->to_client, &msg)) {
+        io_queue_clear(&conn->to_client);
+        if (!io_queue_pop(&conn->to_client, &msg))
+            return NULL;
+    }
+
+    /* BIM_CLOSE is the last one; `closed` was set before it */
+    if (msg.type != BIM_MESSAGE)
+        return NULL;
+    return (pcrdr_msg *)msg.data;
+}
+
+bool purcmc_builtin_conn_is_closed(purcmc_builtin_conn *conn)
+{
+    return __atomic_load_n(&conn->closed, __ATOMIC_ACQUIRE);
+}
+
+void purcmc_builtin_conn_close(purcmc_builtin_conn *conn)
+{
+    /* the server will remove the endpoint after handled the messages sent */
+    pthread_mutex_lock(&conn->lock);
+    if (!conn->closed && push_message(&conn->to_server, BIM_CLOSE, NULL) == 0)
+        wake_server(conn);
+    pthread_mutex_unlock(&conn->lock);
+    release_conn(conn);
+}
+
+#endif /* HAVE(SYS_EVENTFD_H) */
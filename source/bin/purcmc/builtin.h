@@ -0,0 +1,99 @@
+/*
+** builtin.h -- the connections of the builtin endpoints.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#ifndef XGUIPRO_PURCMC_BUILTIN_H
+#define XGUIPRO_PURCMC_BUILTIN_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <purc/purc-pcrdr.h>
+
+#include "utils/list.h"
+#include "purcmc.h"
+#include "ioqueue.h"
+
+/* types of the messages passed via the queues of a builtin connection */
+enum {
+    BIM_MESSAGE = 0,    // a message in `data`; taken over by the consumer.
+    BIM_CLOSE,          // the producer closed the connection.
+};
+
+/*
+ * The connection between the server and an interpreter in this process.
+ * Each queue has a single producer and a single consumer; the connection
+ * is freed after released by both sides.
+ */
+struct purcmc_builtin_conn {
+    /* the messages from the interpreter; its eventfd is not used since
+       the server is woken up by `wake_fd` */
+    IOQueue             to_server;
+    /* the messages from the server; the interpreter waits for its eventfd */
+    IOQueue             to_client;
+
+    /* the eventfd to wake up the server */
+    int                 wake_fd;
+    /* the references held by the server and the interpreter */
+    int                 refc;
+    /* set when the server closed the connection; the interpreter holds
+       `lock` to check it and write `wake_fd`, so the server can close
+       the eventfd once every connection was closed */
+    bool                closed;
+    pthread_mutex_t     lock;
+
+    /* the following fields are only touched by the server */
+    purcmc_endpoint    *endpoint;
+    /* the message put back by the server; fetched again first */
+    pcrdr_msg          *unfetched;
+    /* the node in the list of the builtin connections of the server */
+    struct list_head    link;
+};
+
+typedef struct purcmc_builtin_conn BuiltinConn;
+
+/* Called by the server; returns NULL on failure */
+BuiltinConn *builtin_conn_new(int wake_fd);
+
+/*
+ * Called by the server to pass a clone of the message to the interpreter;
+ * the message is copied by pcrdr_clone_message() on every call.
+ */
+int builtin_conn_post(BuiltinConn *conn, const pcrdr_msg *msg);
+
+/*
+ * Called by the server to fetch the next message from the interpreter;
+ * `*msg` is set to NULL if the interpreter closed the connection.
+ *
+ * Returns false if there is no message.
+ */
+bool builtin_conn_fetch(BuiltinConn *conn, pcrdr_msg **msg);
+
+/* Called by the server to put back the message just fetched */
+void builtin_conn_unfetch(BuiltinConn *conn, pcrdr_msg *msg);
+
+/*
+ * Called by the server to close the connection and drop its reference;
+ * the interpreter never writes `wake_fd` after this returns.
+ */
+void builtin_conn_detach(BuiltinConn *conn);
+
+#endif /* !XGUIPRO_PURCMC_BUILTIN_H */
+
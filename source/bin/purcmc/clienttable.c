@@ -0,0 +1,81 @@
+/*
+** clienttable.c -- the table of the watched sockets indexed by fd.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "clienttable.h"
+
+void client_table_init(ClientTable *table, size_t sz_slot)
+{
+    table->sz_slot = sz_slot;
+    table->nr_chunks = 0;
+    table->chunks = NULL;
+}
+
+void client_table_destroy(ClientTable *table)
+{
+    for (unsigned i = 0; i < table->nr_chunks; i++)
+        free(table->chunks[i]);
+
+    free(table->chunks);
+    table->chunks = NULL;
+    table->nr_chunks = 0;
+}
+
+void *client_table_slot_slow(ClientTable *table, int fd, bool create)
+{
+    unsigned chunk;
+
+    if (fd < 0 || !create)
+        return NULL;
+
+    chunk = (unsigned)fd >> CLIENT_TABLE_CHUNK_BITS;
+    if (chunk >= table->nr_chunks) {
+        unsigned n = table->nr_chunks ? table->nr_chunks : 4;
+        char **chunks;
+
+        while (n <= chunk)
+            n *= 2;
+
+        chunks = realloc(table->chunks, sizeof(char *) * n);
+        if (chunks == NULL)
+            return NULL;
+
+        memset(chunks + table->nr_chunks, 0,
+                sizeof(char *) * (n - table->nr_chunks));
+        table->chunks = chunks;
+        table->nr_chunks = n;
+    }
+
+    if (table->chunks[chunk] == NULL) {
+        table->chunks[chunk] = calloc(CLIENT_TABLE_CHUNK_SLOTS,
+                table->sz_slot);
+        if (table->chunks[chunk] == NULL)
+            return NULL;
+    }
+
+    return table->chunks[chunk] +
+        table->sz_slot * ((unsigned)fd & CLIENT_TABLE_CHUNK_MASK);
+}
@@ -0,0 +1,82 @@
+/*
+** clienttable.h -- the table of the watched sockets indexed by fd.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+
+
+#ifndef XGUIPRO_PURCMC_CLIENTTABLE_H
+#define XGUIPRO_PURCMC_CLIENTTABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+/* a chunk has 1 << CLIENT_TABLE_CHUNK_BITS slots */
+#define CLIENT_TABLE_CHUNK_BITS     8
+#define CLIENT_TABLE_CHUNK_SLOTS    (1 << CLIENT_TABLE_CHUNK_BITS)
+#define CLIENT_TABLE_CHUNK_MASK     (CLIENT_TABLE_CHUNK_SLOTS - 1)
+
+/*
+ * A table of fixed-size slots indexed by file descriptors. The slots are
+ * allocated in zeroed chunks on demand and never move, so a pointer to a
+ * slot is valid until the table is destroyed. Only the array of the
+ * chunk pointers grows, and looking up a slot is O(1).
+ */
+typedef struct ClientTable_ {
+    size_t              sz_slot;
+    unsigned            nr_chunks;
+    char              **chunks;
+} ClientTable;
+
+void client_table_init(ClientTable *table, size_t sz_slot);
+void client_table_destroy(ClientTable *table);
+
+/* Allocate the chunk of the fd if `create`; NULL if absent or out of memory */
+void *client_table_slot_slow(ClientTable *table, int fd, bool create);
+
+/*
+ * Return the slot of the fd. If the chunk of the fd is absent, it is
+ * allocated when `create` is true; otherwise NULL is returned.
+ */
+static inline void *client_table_slot(ClientTable *table, int fd, bool create)
+{
+    unsigned chunk = (unsigned)fd >> CLIENT_TABLE_CHUNK_BITS;
+
+    if (fd >= 0 && chunk < table->nr_chunks && table->chunks[chunk])
+        return table->chunks[chunk] +
+            table->sz_slot * ((unsigned)fd & CLIENT_TABLE_CHUNK_MASK);
+
+    return client_table_slot_slow(table, fd, create);
+}
+
+/*
+ * Allocate the client of the fd in its slot, cleared; NULL if out of
+ * memory. The slot is taken again by the next client of the same fd, so
+ * a client is released by closing its fd, and nothing is freed.
+ */
+static inline void *client_table_alloc(ClientTable *table, int fd)
+{
+    void *slot = client_table_slot(table, fd, true);
+
+    if (slot)
+        memset(slot, 0, table->sz_slot);
+    return slot;
+}
+
+#endif /* !XGUIPRO_PURCMC_CLIENTTABLE_H */
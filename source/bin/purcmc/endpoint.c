@@ -25,6 +25,7 @@
 #include <assert.h>
 
 #include "endpoint.h"
+#include "operations.h"
 #include "unixsocket.h"
 #include "websocket.h"
 
@@ -46,32 +47,44 @@ const char *purcmc_endpoint_runner_name(purcmc_endpoint *endpoint)
 purcmc_endpoint *purcmc_endpoint_from_name(purcmc_server *srv,
         const char *endpoint_name)
 {
-    void *data;
-    data = kvlist_get(&srv->endpoint_list, endpoint_name);
-    if (data == NULL)
+    /* a name never interned can not be of an endpoint */
+    purc_atom_t atom = ep_name_try(endpoint_name);
+    return ep_table_get(&srv->endpoint_table, atom);
+}
+
+void purcmc_endpoint_get_ref(purcmc_endpoint *endpoint,
+        purcmc_endpoint_ref *ref)
+{
+    ref->name = endpoint->name_atom;
+    ref->generation = endpoint->generation;
+    ref->endpoint = endpoint;
+}
+
+purcmc_endpoint *purcmc_endpoint_from_ref(purcmc_server *srv,
+        const purcmc_endpoint_ref *ref)
+{
+    purcmc_endpoint *endpoint = ep_table_get(&srv->endpoint_table, ref->name);
+
+    /* the name may be taken by a new endpoint at the same address */
+    if (endpoint == NULL || endpoint != ref->endpoint ||
+            endpoint->generation != ref->generation)
         return NULL;
 
-    return *(purcmc_endpoint **)data;
+    return endpoint;
 }
 
 static int do_send_message(purcmc_server *srv,
         purcmc_endpoint *endpoint, const pcrdr_msg *msg)
 {
-    int retv = PCRDR_SC_OK;
-    size_t n;
-    char buff[PCRDR_DEF_PACKET_BUFF_SIZE];
+    int retv;
 
     if (endpoint->status == ES_CLOSING)
         return PCRDR_SC_NOT_READY;
 
-    n = pcrdr_serialize_message_to_buffer(msg, buff, sizeof(buff));
-    if (n > sizeof(buff)) {
-        purc_log_error("The size of buffer for the message is too small.\n");
-        retv = PCRDR_SC_INTERNAL_SERVER_ERROR;
-    }
-    else if (send_packet_to_endpoint(srv, endpoint, buff, n)) {
+    /* large messages are streamed to the client in fragments */
+    retv = send_message_to_endpoint(srv, endpoint, msg);
+    if (retv == PCRDR_SC_IOERR) {
         endpoint->status = ES_CLOSING;
-        retv = PCRDR_SC_IOERR;
     }
 
     return retv;
@@ -116,6 +129,9 @@ int purcmc_endpoint_post_event(purcmc_server *srv,
 
         retv = do_send_message(srv, endpoint, msg);
 
+        /* the packets reacting to the input should not wait for others */
+        sched_mark_interactive(&srv->sched, &endpoint->sched);
+
         if (msg->eventName)
             purc_variant_unref(msg->eventName);
         if (msg->sourceURI)
@@ -144,7 +160,9 @@ purcmc_endpoint* new_endpoint(purcmc_server* srv, int type, void* client)
     clock_gettime (CLOCK_MONOTONIC, &ts);
     endpoint->t_created = ts.tv_sec;
     endpoint->t_living = ts.tv_sec;
-    endpoint->avl.key = NULL;
+    timer_node_init(&endpoint->timer);
+    list_head_init(&endpoint->dangling);
+    sched_entity_init(&endpoint->sched);
 
     switch (type) {
         case ET_UNIX_SOCKET:
@@ -156,11 +174,16 @@ purcmc_endpoint* new_endpoint(purcmc_server* srv, int type, void* client)
             endpoint->host_name = NULL;
             endpoint->app_name = NULL;
             endpoint->runner_name = NULL;
-            if (!store_dangling_endpoint (srv, endpoint)) {
-                purc_log_error ("Failed to store dangling endpoint\n");
-                free (endpoint);
-                return NULL;
-            }
+            store_dangling_endpoint (srv, endpoint);
+            break;
+
+        case ET_BUILTIN:
+            endpoint->type = type;
+            endpoint->status = ES_AUTHING;
+            endpoint->conn = client;
+
+            /* an interpreter in this process is never timed out */
+            list_add_tail (&endpoint->dangling, &srv->dangling_endpoints);
             break;
 
         default:
@@ -177,6 +200,9 @@ purcmc_endpoint* new_endpoint(purcmc_server* srv, int type, void* client)
         WSClient* wsc = (WSClient*)client;
         wsc->entity = &endpoint->entity;
     }
+    else if (type == ET_BUILTIN) {
+        endpoint->conn->endpoint = endpoint;
+    }
 
     return endpoint;
 }
@@ -190,11 +216,16 @@ int del_endpoint(purcmc_server* srv, purcmc_endpoint* endpoint, int cause)
         endpoint->session = NULL;
     }
 
-    if (assemble_endpoint_name(endpoint, endpoint_name) > 0) {
-        if (endpoint->avl.key)
-            avl_delete (&srv->living_avl, &endpoint->avl);
+    timer_wheel_del(&endpoint->timer);
+    sched_entity_cleanup(&srv->sched, &endpoint->sched);
+#if HAVE(BUILTIN_ENDPOINT)
+    if (endpoint->conn) {
+        builtin_conn_detach(endpoint->conn);
+        endpoint->conn = NULL;
     }
-    else {
+#endif
+
+    if (assemble_endpoint_name(endpoint, endpoint_name) <= 0) {
         strcpy (endpoint_name, "@endpoint/not/authenticated");
     }
 
@@ -207,53 +238,50 @@ int del_endpoint(purcmc_server* srv, purcmc_endpoint* endpoint, int cause)
     return 0;
 }
 
-bool store_dangling_endpoint(purcmc_server* srv, purcmc_endpoint* endpoint)
+void store_dangling_endpoint(purcmc_server* srv, purcmc_endpoint* endpoint)
 {
-    if (srv->dangling_endpoints == NULL)
-        srv->dangling_endpoints = gslist_create(endpoint);
-    else
-        srv->dangling_endpoints =
-            gslist_insert_append(srv->dangling_endpoints, endpoint);
-
-    if (srv->dangling_endpoints)
-        return true;
+    list_add_tail(&endpoint->dangling, &srv->dangling_endpoints);
 
-    return false;
+    /* the client must authenticate itself in time */
+    timer_wheel_add(&srv->timers, &endpoint->timer,
+            endpoint->t_created + PCRDR_MAX_NO_RESPONDING_TIME + 1);
 }
 
 bool remove_dangling_endpoint(purcmc_server* srv, purcmc_endpoint* endpoint)
 {
-    gs_list* node = srv->dangling_endpoints;
-
-    while (node) {
-        if (node->data == endpoint) {
-            gslist_remove_node(&srv->dangling_endpoints, node);
-            return true;
-        }
-
-        node = node->next;
-    }
+    (void)srv;
+    if (list_empty(&endpoint->dangling))
+        return false;
 
-    return false;
+    list_del_init(&endpoint->dangling);
+    timer_wheel_del(&endpoint->timer);
+    return true;
 }
 
 bool make_endpoint_ready(purcmc_server* srv,
         const char* endpoint_name, purcmc_endpoint* endpoint)
 {
     if (remove_dangling_endpoint(srv, endpoint)) {
-        if (!kvlist_set(&srv->endpoint_list, endpoint_name, &endpoint)) {
-            purc_log_error ("Failed to store the endpoint: %s\n", endpoint_name);
+        purc_atom_t atom = ep_name_intern(endpoint_name);
+
+        /* the atom is owned by the endpoint having the name already */
+        if (ep_table_get(&srv->endpoint_table, atom)) {
+            purc_log_error ("Duplicated endpoint: %s\n", endpoint_name);
             return false;
         }
 
-        endpoint->t_living = purc_get_monotoic_time();
-        endpoint->avl.key = endpoint;
-        if (avl_insert(&srv->living_avl, &endpoint->avl)) {
-            purc_log_error("Failed to insert to the living AVL tree: %s\n",
-                    endpoint_name);
-            assert(0);
+        if (!ep_table_add(&srv->endpoint_table, atom, endpoint)) {
+            purc_log_error ("Failed to store the endpoint: %s\n", endpoint_name);
+            ep_name_release(atom);
             return false;
         }
+        endpoint->name_atom = atom;
+        endpoint->generation = ++srv->endpoint_gen;
+
+        endpoint->t_living = purc_get_monotoic_time();
+        if (endpoint->type != ET_BUILTIN)
+            timer_wheel_add(&srv->timers, &endpoint->timer,
+                    endpoint->t_living + PCRDR_MAX_PING_TIME + 1);
         srv->nr_endpoints++;
     }
     else {
@@ -267,85 +295,66 @@ bool make_endpoint_ready(purcmc_server* srv,
 
 static void cleanup_endpoint_client(purcmc_server *srv, purcmc_endpoint* endpoint)
 {
-    if (endpoint->type == ET_UNIX_SOCKET) {
-        endpoint->entity.client->entity = NULL;
-        us_cleanup_client(srv->us_srv, (USClient*)endpoint->entity.client);
-    }
-    else if (endpoint->type == ET_WEB_SOCKET) {
+    if (endpoint->type == ET_UNIX_SOCKET || endpoint->type == ET_WEB_SOCKET) {
         endpoint->entity.client->entity = NULL;
-        ws_cleanup_client(srv->ws_srv, (WSClient*)endpoint->entity.client);
+        close_endpoint_client(srv, endpoint);
     }
 
     purc_log_warn("The endpoint (@%s/%s/%s) client cleaned up\n",
             endpoint->host_name, endpoint->app_name, endpoint->runner_name);
 }
 
-int check_no_responding_endpoints(purcmc_server *srv)
+/*
+ * The timer of an endpoint fires when it fails to authenticate in time, or
+ * when it has been idle for PCRDR_MAX_PING_TIME or
+ * PCRDR_MAX_NO_RESPONDING_TIME seconds. The living time is updated without
+ * touching the timer; the timer is armed again for the new living time
+ * when it fires too early.
+ */
+static void on_endpoint_timer(TimerNode *node, void *ctxt)
 {
-    int n = 0;
+    purcmc_server *srv = ctxt;
+    purcmc_endpoint *endpoint = container_of(node, purcmc_endpoint, timer);
     time_t t_curr = purc_get_monotoic_time();
-    purcmc_endpoint *endpoint, *tmp;
+    char name [PURC_LEN_ENDPOINT_NAME + 1];
 
-    purc_log_info("Checking no responding endpoints...\n");
+    assert (endpoint->type != ET_BUILTIN);
 
-    avl_for_each_element_safe(&srv->living_avl, endpoint, avl, tmp) {
-        char name [PURC_LEN_ENDPOINT_NAME + 1];
+    if (!list_empty(&endpoint->dangling)) {
+        list_del_init(&endpoint->dangling);
+        cleanup_endpoint_client(srv, endpoint);
+        del_endpoint(srv, endpoint, CDE_NO_RESPONDING);
 
-        assert (endpoint->type != ET_BUILTIN);
-
-        assemble_endpoint_name(endpoint, name);
-        if (t_curr > endpoint->t_living + PCRDR_MAX_NO_RESPONDING_TIME) {
+        purc_log_info("A client failed to authenticate in time\n");
+        return;
+    }
 
-            kvlist_delete(&srv->endpoint_list, name);
-            cleanup_endpoint_client(srv, endpoint);
-            del_endpoint(srv, endpoint, CDE_NO_RESPONDING);
-            srv->nr_endpoints--;
-            n++;
+    assemble_endpoint_name(endpoint, name);
+    if (t_curr > endpoint->t_living + PCRDR_MAX_NO_RESPONDING_TIME) {
+        ep_table_remove(&srv->endpoint_table, endpoint->name_atom);
+        cleanup_endpoint_client(srv, endpoint);
+        del_endpoint(srv, endpoint, CDE_NO_RESPONDING);
+        srv->nr_endpoints--;
 
-            purc_log_info("A no-responding client: %s\n", name);
-        }
-        else if (t_curr > endpoint->t_living + PCRDR_MAX_PING_TIME) {
-            if (endpoint->type == ET_UNIX_SOCKET) {
-                us_ping_client(srv->us_srv, (USClient *)endpoint->entity.client);
-            }
-            else if (endpoint->type == ET_WEB_SOCKET) {
-                ws_ping_client(srv->ws_srv, (WSClient *)endpoint->entity.client);
-            }
-
-            purc_log_info("Ping client: %s\n", name);
-        }
-        else {
-            purc_log_info("Skip left endpoints since (%s): %ld\n",
-                    name, endpoint->t_living);
-            break;
-        }
+        purc_log_info("A no-responding client: %s\n", name);
     }
+    else if (t_curr > endpoint->t_living + PCRDR_MAX_PING_TIME) {
+        ping_endpoint_client(srv, endpoint);
+        timer_wheel_add(&srv->timers, &endpoint->timer,
+                endpoint->t_living + PCRDR_MAX_NO_RESPONDING_TIME + 1);
 
-    purc_log_info("Total endpoints removed: %d\n", n);
-    return n;
+        purc_log_info("Ping client: %s\n", name);
+    }
+    else {
+        timer_wheel_add(&srv->timers, &endpoint->timer,
+                endpoint->t_living + PCRDR_MAX_PING_TIME + 1);
+    }
 }
 
-int check_dangling_endpoints(purcmc_server *srv)
+int check_endpoint_timers(purcmc_server *srv)
 {
-    int n = 0;
-    time_t t_curr = purc_get_monotoic_time();
-    gs_list* node = srv->dangling_endpoints;
-
-    while (node) {
-        gs_list *next = node->next;
-        purcmc_endpoint* endpoint = (purcmc_endpoint *)node->data;
-
-        if (t_curr > endpoint->t_created + PCRDR_MAX_NO_RESPONDING_TIME) {
-            gslist_remove_node(&srv->dangling_endpoints, node);
-            cleanup_endpoint_client(srv, endpoint);
-            del_endpoint(srv, endpoint, CDE_NO_RESPONDING);
-            n++;
-        }
-
-        node = next;
-    }
-
-    return n;
+    return timer_wheel_advance(&srv->timers, purc_get_monotoic_time(),
+            on_endpoint_timer, srv);
 }
 
 int send_initial_response(purcmc_server* srv, purcmc_endpoint* endpoint)
@@ -378,7 +387,7 @@ static int authenticate_endpoint(purcmc_server* srv, purcmc_endpoint* endpoint,
 {
     const char* prot_name = NULL;
     const char *host_name = NULL, *app_name = NULL, *runner_name = NULL;
-    uint64_t prot_ver = 0;
+    uint64_t prot_ver = 0, sz_ring = 0;
     char norm_host_name [PURC_LEN_HOST_NAME + 1];
     char norm_app_name [PURC_LEN_APP_NAME + 1];
     char norm_runner_name [PURC_LEN_RUNNER_NAME + 1];
@@ -405,6 +414,10 @@ static int authenticate_endpoint(purcmc_server* srv, purcmc_endpoint* endpoint,
         runner_name = purc_variant_get_string_const(tmp);
     }
 
+    if ((tmp = purc_variant_object_get_by_ckey(data, "sharedRing"))) {
+        purc_variant_cast_to_ulongint(tmp, &sz_ring, true);
+    }
+
     if (prot_name == NULL || prot_ver > PCRDR_PURCMC_PROTOCOL_VERSION ||
             host_name == NULL || app_name == NULL || runner_name == NULL ||
             strcasecmp (prot_name, PCRDR_PURCMC_PROTOCOL_NAME)) {
@@ -446,7 +459,7 @@ static int authenticate_endpoint(purcmc_server* srv, purcmc_endpoint* endpoint,
 
     purc_log_info ("New endpoint: %s (%p)\n", endpoint_name, endpoint);
 
-    if (kvlist_get (&srv->endpoint_list, endpoint_name)) {
+    if (purcmc_endpoint_from_name (srv, endpoint_name)) {
         purc_log_warn ("Duplicated endpoint: %s\n", endpoint_name);
         return PCRDR_SC_CONFLICT;
     }
@@ -464,6 +477,12 @@ static int authenticate_endpoint(purcmc_server* srv, purcmc_endpoint* endpoint,
     endpoint->runner_name = strdup (runner_name);
     endpoint->status = ES_READY;
 
+    /* the client gets the memfd of the ring before the response */
+    if (sz_ring > 0 && endpoint->type == ET_UNIX_SOCKET &&
+            setup_endpoint_shm_ring (srv, endpoint, sz_ring)) {
+        purc_log_warn ("No shared ring granted to %s\n", endpoint_name);
+    }
+
     return PCRDR_SC_OK;
 }
 
@@ -1267,163 +1286,162 @@ failed:
     return purcmc_endpoint_send_response(srv, endpoint, &response);
 }
 
-static int on_load(purcmc_server* srv, purcmc_endpoint* endpoint,
-        const pcrdr_msg *msg)
+/*
+ * The fields of a request used by the pass-through operations (`load`,
+ * `writeBegin/More/End`, and the operations updating the DOM), which pass
+ * the data to the renderer as a whole string.
+ *
+ * The request is either taken from a parsed message, or from the header
+ * of a text packet by parse_request_header(). In the later case, the
+ * strings point into the packet, and the data is a slice of the packet.
+ */
+typedef struct request_view {
+    const char             *operation;
+    const char             *requestId;
+    pcrdr_msg_target        target;
+    uint64_t                targetValue;
+    pcrdr_msg_element_type  elementType;
+    const char             *elementValue;
+    const char             *property;
+    pcrdr_msg_data_type     dataType;
+    /* null-terminated at `dataLen` */
+    const char             *data;
+    size_t                  dataLen;
+} request_view;
+
+static const request_view *
+msg_to_request_view(const pcrdr_msg *msg, request_view *req)
 {
-    pcrdr_msg response = { };
-    int retv = PCRDR_SC_OK;
-    const char *doc_text;
-    size_t doc_len;
-    purcmc_page *page = NULL;
-    purcmc_dom *dom = NULL;
-
-    if (msg->dataType != PCRDR_MSG_DATA_TYPE_HTML ||
-            msg->data == PURC_VARIANT_INVALID) {
-        retv = PCRDR_SC_BAD_REQUEST;
-        goto failed;
-    }
-
-    doc_text = purc_variant_get_string_const_ex(msg->data, &doc_len);
-    if (doc_text == NULL || doc_len == 0) {
-        retv = PCRDR_SC_BAD_REQUEST;
-        goto failed;
-    }
-
-    if (msg->target == PCRDR_MSG_TARGET_PLAINWINDOW) {
-        purcmc_plainwin *win = (void *)(uintptr_t)msg->targetValue;
-        page = srv->cbs.get_plainwin_page(endpoint->session, win, &retv);
-
-        if (page == NULL) {
-            goto failed;
-        }
-    }
-    else if (msg->target == PCRDR_MSG_TARGET_WIDGET) {
-        page = (void *)(uintptr_t)msg->targetValue;
-        if (page == NULL) {
-            retv = PCRDR_SC_BAD_REQUEST;
-            goto failed;
-        }
-    }
+    req->operation = purc_variant_get_string_const(msg->operation);
+    req->requestId = purc_variant_get_string_const(msg->requestId);
+    req->target = msg->target;
+    req->targetValue = msg->targetValue;
+    req->elementType = msg->elementType;
+    req->elementValue = purc_variant_get_string_const(msg->elementValue);
+    req->property = purc_variant_get_string_const(msg->property);
+    req->dataType = msg->dataType;
+    req->data = NULL;
+    req->dataLen = 0;
+    if (msg->dataType != PCRDR_MSG_DATA_TYPE_VOID &&
+            msg->dataType != PCRDR_MSG_DATA_TYPE_JSON &&
+            msg->data != PURC_VARIANT_INVALID) {
+        req->data = purc_variant_get_string_const_ex(msg->data,
+                &req->dataLen);
+    }
+
+    return req;
+}
 
-    dom = srv->cbs.load(endpoint->session, page,
-            PCRDR_K_OPERATION_LOAD, PCRDR_OPERATION_LOAD,
-            purc_variant_get_string_const(msg->requestId),
-            doc_text, doc_len, &retv);
-    if (retv == 0) {
-        srv->cbs.pend_response(endpoint->session,
-                purc_variant_get_string_const(msg->operation),
-                purc_variant_get_string_const(msg->requestId),
-                dom);
-        return PCRDR_SC_OK;
-    }
+/* The request identifier is only made a variant for the response */
+static int send_view_response(purcmc_server* srv, purcmc_endpoint* endpoint,
+        const request_view *req, int retv, void *result)
+{
+    pcrdr_msg response = { };
 
-failed:
     response.type = PCRDR_MSG_TYPE_RESPONSE;
-    response.requestId = purc_variant_ref(msg->requestId);
+    response.requestId = purc_variant_make_string(req->requestId, false);
+    if (response.requestId == PURC_VARIANT_INVALID)
+        return PCRDR_SC_INSUFFICIENT_STORAGE;
     response.sourceURI = PURC_VARIANT_INVALID;
     response.retCode = retv;
-    response.resultValue = (uint64_t)(uintptr_t)dom;
+    response.resultValue = (uint64_t)(uintptr_t)result;
     response.dataType = PCRDR_MSG_DATA_TYPE_VOID;
 
     return purcmc_endpoint_send_response(srv, endpoint, &response);
 }
 
-static inline int write_xxx(purcmc_server* srv, purcmc_endpoint* endpoint,
-        int op, const char* op_name, const pcrdr_msg *msg)
+static int load_or_write(purcmc_server* srv, purcmc_endpoint* endpoint,
+        const request_view *req, int op, const char* op_name)
 {
-    pcrdr_msg response = { };
     int retv = PCRDR_SC_OK;
-    const char *doc_text;
-    size_t doc_len;
     purcmc_page *page = NULL;
     purcmc_dom *dom = NULL;
 
-    if (msg->dataType != PCRDR_MSG_DATA_TYPE_HTML ||
-            msg->data == PURC_VARIANT_INVALID) {
+    if (req->dataType != PCRDR_MSG_DATA_TYPE_HTML ||
+            req->data == NULL || req->dataLen == 0) {
         retv = PCRDR_SC_BAD_REQUEST;
         goto failed;
     }
 
-    doc_text = purc_variant_get_string_const_ex(msg->data, &doc_len);
-    if (doc_text == NULL || doc_len == 0) {
-        retv = PCRDR_SC_BAD_REQUEST;
-        goto failed;
-    }
-
-    if (msg->target == PCRDR_MSG_TARGET_PLAINWINDOW) {
-        purcmc_plainwin *win = (void *)(uintptr_t)msg->targetValue;
+    if (req->target == PCRDR_MSG_TARGET_PLAINWINDOW) {
+        purcmc_plainwin *win = (void *)(uintptr_t)req->targetValue;
         page = srv->cbs.get_plainwin_page(endpoint->session, win, &retv);
 
         if (page == NULL) {
             goto failed;
         }
     }
-    else if (msg->target == PCRDR_MSG_TARGET_WIDGET) {
-        page = (void *)(uintptr_t)msg->targetValue;
+    else if (req->target == PCRDR_MSG_TARGET_WIDGET) {
+        page = (void *)(uintptr_t)req->targetValue;
         if (page == NULL) {
             retv = PCRDR_SC_BAD_REQUEST;
             goto failed;
         }
     }
 
-    dom = srv->cbs.write(endpoint->session, page, op, op_name,
-            purc_variant_get_string_const(msg->requestId),
-            doc_text, doc_len, &retv);
+    if (op == PCRDR_K_OPERATION_LOAD) {
+        dom = srv->cbs.load(endpoint->session, page, op, op_name,
+                req->requestId, req->data, req->dataLen, &retv);
+    }
+    else {
+        dom = srv->cbs.write(endpoint->session, page, op, op_name,
+                req->requestId, req->data, req->dataLen, &retv);
+    }
+
     if (retv == 0) {
-        srv->cbs.pend_response(endpoint->session,
-                purc_variant_get_string_const(msg->operation),
-                purc_variant_get_string_const(msg->requestId),
-                dom);
+        srv->cbs.pend_response(endpoint->session, req->operation,
+                req->requestId, dom);
         return PCRDR_SC_OK;
     }
 
 failed:
-    response.type = PCRDR_MSG_TYPE_RESPONSE;
-    response.requestId = purc_variant_ref(msg->requestId);
-    response.sourceURI = PURC_VARIANT_INVALID;
-    response.retCode = retv;
-    response.resultValue = (uint64_t)(uintptr_t)dom;
-    response.dataType = PCRDR_MSG_DATA_TYPE_VOID;
+    return send_view_response(srv, endpoint, req, retv, dom);
+}
 
-    return purcmc_endpoint_send_response(srv, endpoint, &response);
+static int on_load(purcmc_server* srv, purcmc_endpoint* endpoint,
+        const pcrdr_msg *msg)
+{
+    request_view req;
+    return load_or_write(srv, endpoint, msg_to_request_view(msg, &req),
+            PCRDR_K_OPERATION_LOAD,
+            PCRDR_OPERATION_LOAD);
 }
 
 static int on_write_begin(purcmc_server* srv, purcmc_endpoint* endpoint,
         const pcrdr_msg *msg)
 {
-    return write_xxx(srv, endpoint,
+    request_view req;
+    return load_or_write(srv, endpoint, msg_to_request_view(msg, &req),
             PCRDR_K_OPERATION_WRITEBEGIN,
-            PCRDR_OPERATION_WRITEBEGIN,
-            msg);
+            PCRDR_OPERATION_WRITEBEGIN);
 }
 
 static int on_write_more(purcmc_server* srv, purcmc_endpoint* endpoint,
         const pcrdr_msg *msg)
 {
-    return write_xxx(srv, endpoint,
+    request_view req;
+    return load_or_write(srv, endpoint, msg_to_request_view(msg, &req),
             PCRDR_K_OPERATION_WRITEMORE,
-            PCRDR_OPERATION_WRITEMORE,
-            msg);
+            PCRDR_OPERATION_WRITEMORE);
 }
 
 static int on_write_end(purcmc_server* srv, purcmc_endpoint* endpoint,
         const pcrdr_msg *msg)
 {
-    return write_xxx(srv, endpoint,
+    request_view req;
+    return load_or_write(srv, endpoint, msg_to_request_view(msg, &req),
             PCRDR_K_OPERATION_WRITEEND,
-            PCRDR_OPERATION_WRITEEND,
-            msg);
+            PCRDR_OPERATION_WRITEEND);
 }
 
 static int update_dom(purcmc_server* srv, purcmc_endpoint* endpoint,
-        const pcrdr_msg *msg, int op, const char *op_name)
+        const request_view *req, int op, const char *op_name)
 {
     int retv;
     purcmc_dom *dom = NULL;
-    pcrdr_msg response = { };
 
-    if (msg->target == PCRDR_MSG_TARGET_DOM) {
-        dom = (purcmc_dom *)(uintptr_t)msg->targetValue;
+    if (req->target == PCRDR_MSG_TARGET_DOM) {
+        dom = (purcmc_dom *)(uintptr_t)req->targetValue;
     }
     else {
         retv = PCRDR_SC_BAD_REQUEST;
@@ -1438,22 +1456,19 @@ static int update_dom(purcmc_server* srv, purcmc_endpoint* endpoint,
     const char *content = NULL;
     size_t content_len = 0;
     if (op != PCRDR_K_OPERATION_ERASE && op != PCRDR_K_OPERATION_CLEAR) {
-        if (msg->dataType == PCRDR_MSG_DATA_TYPE_JSON ||
-                msg->dataType == PCRDR_MSG_DATA_TYPE_VOID ||
-                msg->data == PURC_VARIANT_INVALID) {
+        if (req->dataType == PCRDR_MSG_DATA_TYPE_JSON ||
+                req->dataType == PCRDR_MSG_DATA_TYPE_VOID ||
+                req->data == NULL || req->dataLen == 0) {
             retv = PCRDR_SC_BAD_REQUEST;
             goto done;
         }
 
-        content = purc_variant_get_string_const_ex(msg->data, &content_len);
-        if (content == NULL || content_len == 0) {
-            retv = PCRDR_SC_BAD_REQUEST;
-            goto done;
-        }
+        content = req->data;
+        content_len = req->dataLen;
     }
 
     const char *element_type = NULL;
-    switch (msg->elementType) {
+    switch (req->elementType) {
         case PCRDR_MSG_ELEMENT_TYPE_HANDLE:
             element_type = "handle";
             break;
@@ -1474,40 +1489,30 @@ static int update_dom(purcmc_server* srv, purcmc_endpoint* endpoint,
             break;
     }
 
-    const char *element_value = purc_variant_get_string_const(msg->elementValue);
-    if (element_type == NULL || element_value == NULL) {
+    if (element_type == NULL || req->elementValue == NULL) {
         retv = PCRDR_SC_BAD_REQUEST;
         goto done;
     }
 
-    const char *request_id = purc_variant_get_string_const(msg->requestId);
     retv = srv->cbs.update_dom(endpoint->session, dom,
-            op, op_name, request_id,
-            element_type, element_value,
-            purc_variant_get_string_const(msg->property),
-            msg->dataType, content, content_len);
+            op, op_name, req->requestId,
+            element_type, req->elementValue, req->property,
+            req->dataType, content, content_len);
     if (retv == 0) {
-        srv->cbs.pend_response(endpoint->session,
-                purc_variant_get_string_const(msg->operation),
-                request_id,
-                dom);
+        srv->cbs.pend_response(endpoint->session, req->operation,
+                req->requestId, dom);
         return PCRDR_SC_OK;
     }
 
 done:
-    response.type = PCRDR_MSG_TYPE_RESPONSE;
-    response.requestId = purc_variant_ref(msg->requestId);
-    response.sourceURI = PURC_VARIANT_INVALID;
-    response.retCode = retv;
-    response.resultValue = (uint64_t)(uintptr_t)dom;
-    response.dataType = PCRDR_MSG_DATA_TYPE_VOID;
-    return purcmc_endpoint_send_response(srv, endpoint, &response);
+    return send_view_response(srv, endpoint, req, retv, dom);
 }
 
 static int on_append(purcmc_server* srv, purcmc_endpoint* endpoint,
         const pcrdr_msg *msg)
 {
-    return update_dom(srv, endpoint, msg,
+    request_view req;
+    return update_dom(srv, endpoint, msg_to_request_view(msg, &req),
             PCRDR_K_OPERATION_APPEND,
             PCRDR_OPERATION_APPEND);
 }
@@ -1515,7 +1520,8 @@ static int on_append(purcmc_server* srv, purcmc_endpoint* endpoint,
 static int on_prepend(purcmc_server* srv, purcmc_endpoint* endpoint,
         const pcrdr_msg *msg)
 {
-    return update_dom(srv, endpoint, msg,
+    request_view req;
+    return update_dom(srv, endpoint, msg_to_request_view(msg, &req),
             PCRDR_K_OPERATION_PREPEND,
             PCRDR_OPERATION_PREPEND);
 }
@@ -1523,7 +1529,8 @@ static int on_prepend(purcmc_server* srv, purcmc_endpoint* endpoint,
 static int on_insert_after(purcmc_server* srv, purcmc_endpoint* endpoint,
         const pcrdr_msg *msg)
 {
-    return update_dom(srv, endpoint, msg,
+    request_view req;
+    return update_dom(srv, endpoint, msg_to_request_view(msg, &req),
             PCRDR_K_OPERATION_INSERTAFTER,
             PCRDR_OPERATION_INSERTAFTER);
 }
@@ -1531,7 +1538,8 @@ static int on_insert_after(purcmc_server* srv, purcmc_endpoint* endpoint,
 static int on_insert_before(purcmc_server* srv, purcmc_endpoint* endpoint,
         const pcrdr_msg *msg)
 {
-    return update_dom(srv, endpoint, msg,
+    request_view req;
+    return update_dom(srv, endpoint, msg_to_request_view(msg, &req),
             PCRDR_K_OPERATION_INSERTBEFORE,
             PCRDR_OPERATION_INSERTBEFORE);
 }
@@ -1539,7 +1547,8 @@ static int on_insert_before(purcmc_server* srv, purcmc_endpoint* endpoint,
 static int on_displace(purcmc_server* srv, purcmc_endpoint* endpoint,
         const pcrdr_msg *msg)
 {
-    return update_dom(srv, endpoint, msg,
+    request_view req;
+    return update_dom(srv, endpoint, msg_to_request_view(msg, &req),
             PCRDR_K_OPERATION_DISPLACE,
             PCRDR_OPERATION_DISPLACE);
 }
@@ -1547,7 +1556,8 @@ static int on_displace(purcmc_server* srv, purcmc_endpoint* endpoint,
 static int on_clear(purcmc_server* srv, purcmc_endpoint* endpoint,
         const pcrdr_msg *msg)
 {
-    return update_dom(srv, endpoint, msg,
+    request_view req;
+    return update_dom(srv, endpoint, msg_to_request_view(msg, &req),
             PCRDR_K_OPERATION_CLEAR,
             PCRDR_OPERATION_CLEAR);
 }
@@ -1555,7 +1565,8 @@ static int on_clear(purcmc_server* srv, purcmc_endpoint* endpoint,
 static int on_erase(purcmc_server* srv, purcmc_endpoint* endpoint,
         const pcrdr_msg *msg)
 {
-    return update_dom(srv, endpoint, msg,
+    request_view req;
+    return update_dom(srv, endpoint, msg_to_request_view(msg, &req),
             PCRDR_K_OPERATION_ERASE,
             PCRDR_OPERATION_ERASE);
 }
@@ -1563,7 +1574,8 @@ static int on_erase(purcmc_server* srv, purcmc_endpoint* endpoint,
 static int on_update(purcmc_server* srv, purcmc_endpoint* endpoint,
         const pcrdr_msg *msg)
 {
-    return update_dom(srv, endpoint, msg,
+    request_view req;
+    return update_dom(srv, endpoint, msg_to_request_view(msg, &req),
             PCRDR_K_OPERATION_UPDATE,
             PCRDR_OPERATION_UPDATE);
 }
@@ -1876,39 +1888,37 @@ failed:
     return purcmc_endpoint_send_response(srv, endpoint, &response);
 }
 
-static struct request_handler {
-    const char *operation;
-    request_handler handler;
-} handlers[] = {
-    { PCRDR_OPERATION_ADDPAGEGROUPS, on_add_page_groups },
-    { PCRDR_OPERATION_APPEND, on_append },
-    { PCRDR_OPERATION_CALLMETHOD, on_call_method },
-    { PCRDR_OPERATION_CLEAR, on_clear },
-    { PCRDR_OPERATION_CREATEPLAINWINDOW, on_create_plain_window },
-    { PCRDR_OPERATION_CREATEWIDGET, on_create_page },
-    { PCRDR_OPERATION_CREATEWORKSPACE, on_create_workspace },
-    { PCRDR_OPERATION_DESTROYPLAINWINDOW, on_destroy_plain_window },
-    { PCRDR_OPERATION_DESTROYWIDGET, on_destroy_page },
-    { PCRDR_OPERATION_DESTROYWORKSPACE, on_destroy_workspace },
-    { PCRDR_OPERATION_DISPLACE, on_displace },
-    { PCRDR_OPERATION_ENDSESSION, on_end_session },
-    { PCRDR_OPERATION_ERASE, on_erase },
-    { PCRDR_OPERATION_GETPROPERTY, on_get_property },
-    { PCRDR_OPERATION_INSERTAFTER, on_insert_after },
-    { PCRDR_OPERATION_INSERTBEFORE, on_insert_before },
-    { PCRDR_OPERATION_LOAD, on_load },
-    { PCRDR_OPERATION_PREPEND, on_prepend },
-    { PCRDR_OPERATION_REMOVEPAGEGROUP, on_remove_page_group },
-    { PCRDR_OPERATION_SETPAGEGROUPS, on_set_page_groups },
-    { PCRDR_OPERATION_SETPROPERTY, on_set_property },
-    { PCRDR_OPERATION_STARTSESSION, on_start_session },
-    { PCRDR_OPERATION_UPDATE, on_update },
-    { PCRDR_OPERATION_UPDATEPLAINWINDOW, on_update_plain_window },
-    { PCRDR_OPERATION_UPDATEWIDGET, on_update_page },
-    { PCRDR_OPERATION_UPDATEWORKSPACE, on_update_workspace },
-    { PCRDR_OPERATION_WRITEBEGIN, on_write_begin },
-    { PCRDR_OPERATION_WRITEEND, on_write_end },
-    { PCRDR_OPERATION_WRITEMORE, on_write_more },
+/* The handlers indexed by the identifiers of the operations */
+static const request_handler handlers[] = {
+    [PCRDR_K_OPERATION_ADDPAGEGROUPS] = on_add_page_groups,
+    [PCRDR_K_OPERATION_APPEND] = on_append,
+    [PCRDR_K_OPERATION_CALLMETHOD] = on_call_method,
+    [PCRDR_K_OPERATION_CLEAR] = on_clear,
+    [PCRDR_K_OPERATION_CREATEPLAINWINDOW] = on_create_plain_window,
+    [PCRDR_K_OPERATION_CREATEWIDGET] = on_create_page,
+    [PCRDR_K_OPERATION_CREATEWORKSPACE] = on_create_workspace,
+    [PCRDR_K_OPERATION_DESTROYPLAINWINDOW] = on_destroy_plain_window,
+    [PCRDR_K_OPERATION_DESTROYWIDGET] = on_destroy_page,
+    [PCRDR_K_OPERATION_DESTROYWORKSPACE] = on_destroy_workspace,
+    [PCRDR_K_OPERATION_DISPLACE] = on_displace,
+    [PCRDR_K_OPERATION_ENDSESSION] = on_end_session,
+    [PCRDR_K_OPERATION_ERASE] = on_erase,
+    [PCRDR_K_OPERATION_GETPROPERTY] = on_get_property,
+    [PCRDR_K_OPERATION_INSERTAFTER] = on_insert_after,
+    [PCRDR_K_OPERATION_INSERTBEFORE] = on_insert_before,
+    [PCRDR_K_OPERATION_LOAD] = on_load,
+    [PCRDR_K_OPERATION_PREPEND] = on_prepend,
+    [PCRDR_K_OPERATION_REMOVEPAGEGROUP] = on_remove_page_group,
+    [PCRDR_K_OPERATION_SETPAGEGROUPS] = on_set_page_groups,
+    [PCRDR_K_OPERATION_SETPROPERTY] = on_set_property,
+    [PCRDR_K_OPERATION_STARTSESSION] = on_start_session,
+    [PCRDR_K_OPERATION_UPDATE] = on_update,
+    [PCRDR_K_OPERATION_UPDATEPLAINWINDOW] = on_update_plain_window,
+    [PCRDR_K_OPERATION_UPDATEWIDGET] = on_update_page,
+    [PCRDR_K_OPERATION_UPDATEWORKSPACE] = on_update_workspace,
+    [PCRDR_K_OPERATION_WRITEBEGIN] = on_write_begin,
+    [PCRDR_K_OPERATION_WRITEEND] = on_write_end,
+    [PCRDR_K_OPERATION_WRITEMORE] = on_write_more,
 };
 
 /* Make sure the number of handlers matches the number of operations */
@@ -1920,45 +1930,44 @@ _COMPILE_TIME_ASSERT(hdl,
 
 #define NOT_FOUND_HANDLER   ((request_handler)-1)
 
-static request_handler find_request_handler(const char* operation)
+static request_handler find_request_handler(int op_id)
 {
-    static ssize_t max = sizeof(handlers)/sizeof(handlers[0]) - 1;
+    if (op_id < 0 || op_id >= PCRDR_NR_OPERATIONS)
+        return NOT_FOUND_HANDLER;
 
-    ssize_t low = 0, high = max, mid;
-    while (low <= high) {
-        int cmp;
+    return handlers[op_id];
+}
 
-        mid = (low + high) / 2;
-        cmp = strcasecmp(operation, handlers[mid].operation);
-        if (cmp == 0) {
-            goto found;
-        }
-        else {
-            if (cmp < 0) {
-                high = mid - 1;
-            }
-            else {
-                low = mid + 1;
-            }
-        }
-    }
+/* The operation is given by its name, or by its identifier in a message
+   in the binary format. */
+static int get_operation_id(pcrdr_msg *msg)
+{
+    uint64_t id;
+
+    if (!purc_variant_is_type(msg->operation, PURC_VARIANT_TYPE_ULONGINT))
+        return purcmc_operation_id(
+                purc_variant_get_string_const(msg->operation));
 
-    return NOT_FOUND_HANDLER;
+    if (!purc_variant_cast_to_ulongint(msg->operation, &id, false) ||
+            id >= PCRDR_NR_OPERATIONS)
+        return -1;
 
-found:
-    return handlers[mid].handler;
+    /* the handlers use the name of the operation */
+    purc_variant_unref(msg->operation);
+    msg->operation = purc_variant_make_string_static(
+            purcmc_operation_name(id), false);
+    return (int)id;
 }
 
-int on_got_message(purcmc_server* srv, purcmc_endpoint* endpoint, const pcrdr_msg *msg)
+int on_got_message(purcmc_server* srv, purcmc_endpoint* endpoint, pcrdr_msg *msg)
 {
     if (msg->type == PCRDR_MSG_TYPE_REQUEST) {
-        request_handler handler = find_request_handler(
-                purc_variant_get_string_const(msg->operation));
-
-        purc_log_info("Got a request message: %s (handler: %p)\n",
-                purc_variant_get_string_const(msg->operation), handler);
+        request_handler handler = find_request_handler(get_operation_id(msg));
 
         if (handler == NOT_FOUND_HANDLER) {
+            purc_log_info("Got a request of unknown operation: %s\n",
+                    purc_variant_get_string_const(msg->operation));
+
             pcrdr_msg response = { };
             response.type = PCRDR_MSG_TYPE_RESPONSE;
             response.requestId = purc_variant_ref(msg->requestId);
@@ -1997,3 +2006,280 @@ int on_got_message(purcmc_server* srv, purcmc_endpoint* endpoint, const pcrdr_ms
     return PCRDR_SC_OK;
 }
 
+
+/* The pass-through operations which can be handled with the header only */
+static const struct pass_through_op {
+    const char *operation;
+    int op;
+    int (*handler)(purcmc_server* srv, purcmc_endpoint* endpoint,
+            const request_view *req, int op, const char *op_name);
+} pass_through_ops[] = {
+    { PCRDR_OPERATION_APPEND, PCRDR_K_OPERATION_APPEND, update_dom },
+    { PCRDR_OPERATION_CLEAR, PCRDR_K_OPERATION_CLEAR, update_dom },
+    { PCRDR_OPERATION_DISPLACE, PCRDR_K_OPERATION_DISPLACE, update_dom },
+    { PCRDR_OPERATION_ERASE, PCRDR_K_OPERATION_ERASE, update_dom },
+    { PCRDR_OPERATION_INSERTAFTER, PCRDR_K_OPERATION_INSERTAFTER,
+        update_dom },
+    { PCRDR_OPERATION_INSERTBEFORE, PCRDR_K_OPERATION_INSERTBEFORE,
+        update_dom },
+    { PCRDR_OPERATION_LOAD, PCRDR_K_OPERATION_LOAD, load_or_write },
+    { PCRDR_OPERATION_PREPEND, PCRDR_K_OPERATION_PREPEND, update_dom },
+    { PCRDR_OPERATION_UPDATE, PCRDR_K_OPERATION_UPDATE, update_dom },
+    { PCRDR_OPERATION_WRITEBEGIN, PCRDR_K_OPERATION_WRITEBEGIN,
+        load_or_write },
+    { PCRDR_OPERATION_WRITEEND, PCRDR_K_OPERATION_WRITEEND, load_or_write },
+    { PCRDR_OPERATION_WRITEMORE, PCRDR_K_OPERATION_WRITEMORE,
+        load_or_write },
+};
+
+/* A value in the header of a text packet; not null-terminated */
+typedef struct header_value {
+    char   *str;
+    size_t  len;
+} header_value;
+
+static inline bool value_is(const header_value *value, const char *str)
+{
+    return value->len == strlen(str) &&
+        strncasecmp(value->str, str, value->len) == 0;
+}
+
+/* Split a value like `dom/0x1234` at the first slash */
+static bool split_value(const header_value *value,
+        header_value *name, header_value *rest)
+{
+    char *slash = memchr(value->str, '/', value->len);
+
+    if (slash == NULL)
+        return false;
+
+    name->str = value->str;
+    name->len = slash - value->str;
+    rest->str = slash + 1;
+    rest->len = value->len - name->len - 1;
+    return true;
+}
+
+static int find_name(const char * const names[], int nr_names,
+        const header_value *value)
+{
+    for (int i = 0; i < nr_names; i++) {
+        if (names[i] && value_is(value, names[i]))
+            return i;
+    }
+
+    return -1;
+}
+
+static const char *target_names[] = {
+    [PCRDR_MSG_TARGET_PLAINWINDOW] = "plainwindow",
+    [PCRDR_MSG_TARGET_WIDGET] = "widget",
+    [PCRDR_MSG_TARGET_DOM] = "dom",
+};
+
+static const char *element_type_names[] = {
+    [PCRDR_MSG_ELEMENT_TYPE_CSS] = "css",
+    [PCRDR_MSG_ELEMENT_TYPE_XPATH] = "xpath",
+    [PCRDR_MSG_ELEMENT_TYPE_HANDLE] = "handle",
+    [PCRDR_MSG_ELEMENT_TYPE_HANDLES] = "handles",
+    [PCRDR_MSG_ELEMENT_TYPE_ID] = "id",
+};
+
+static const char *data_type_names[] = {
+    [PCRDR_MSG_DATA_TYPE_VOID] = "void",
+    [PCRDR_MSG_DATA_TYPE_PLAIN] = "plain",
+    [PCRDR_MSG_DATA_TYPE_HTML] = "html",
+};
+
+#define NR_NAMES(names)     ((int)(sizeof(names)/sizeof(names[0])))
+
+/*
+ * Parse the header of a text packet if it is a request of a pass-through
+ * operation. Only the header lines are scanned; the data is left in the
+ * packet as a slice.
+ *
+ * The packet is not changed unless the request is accepted; then the
+ * values in the header are null-terminated in place. Returns NULL if the
+ * packet should be parsed by pcrdr_parse_packet(), e.g., it is not such a
+ * request or it has a field not known here.
+ */
+static const struct pass_through_op *
+parse_request_header(char *packet, size_t sz_packet, request_view *req)
+{
+    header_value type = { }, target = { }, operation = { }, element = { };
+    header_value property = { }, request_id = { }, data_type = { };
+    header_value data_len = { };
+    header_value name, rest;
+    const struct pass_through_op *pt_op = NULL;
+    char *p = packet, *end = packet + sz_packet;
+    char *data = NULL;
+
+    /* the terminator of a text packet is not a part of the data */
+    if (end > packet && end[-1] == '\0')
+        end--;
+
+    while (p < end) {
+        char *eol = memchr(p, '\n', end - p);
+        char *colon, *value;
+        header_value *field;
+        size_t key_len;
+
+        if (eol == NULL)
+            return NULL;
+
+        /* a blank line (or a line of a space) separates the data */
+        if (eol == p || (eol == p + 1 && *p == ' ')) {
+            data = eol + 1;
+            break;
+        }
+
+        colon = memchr(p, ':', eol - p);
+        if (colon == NULL)
+            return NULL;
+
+        key_len = colon - p;
+#define KEY_IS(key) \
+        (key_len == sizeof(key) - 1 && strncasecmp(p, key, key_len) == 0)
+        if (KEY_IS("type"))
+            field = &type;
+        else if (KEY_IS("target"))
+            field = &target;
+        else if (KEY_IS("operation"))
+            field = &operation;
+        else if (KEY_IS("element"))
+            field = &element;
+        else if (KEY_IS("property"))
+            field = &property;
+        else if (KEY_IS("requestId"))
+            field = &request_id;
+        else if (KEY_IS("dataType"))
+            field = &data_type;
+        else if (KEY_IS("dataLen"))
+            field = &data_len;
+        else
+            return NULL;
+#undef KEY_IS
+
+        value = colon + 1;
+        while (value < eol && *value == ' ')
+            value++;
+        field->str = value;
+        field->len = eol - value;
+        while (field->len > 0 && (value[field->len - 1] == ' ' ||
+                    value[field->len - 1] == '\r'))
+            field->len--;
+
+        p = eol + 1;
+    }
+
+    if (data == NULL || !value_is(&type, "request") ||
+            operation.len == 0 || request_id.len == 0)
+        return NULL;
+
+    for (int i = 0; i < NR_NAMES(pass_through_ops); i++) {
+        if (value_is(&operation, pass_through_ops[i].operation)) {
+            pt_op = pass_through_ops + i;
+            break;
+        }
+    }
+    if (pt_op == NULL)
+        return NULL;
+
+    memset(req, 0, sizeof(*req));
+    req->elementType = PCRDR_MSG_ELEMENT_TYPE_VOID;
+    req->dataType = PCRDR_MSG_DATA_TYPE_VOID;
+
+    if (target.str) {
+        char *end_value;
+        int i;
+
+        if (!split_value(&target, &name, &rest) || rest.len == 0 ||
+                (i = find_name(target_names, NR_NAMES(target_names),
+                    &name)) < 0)
+            return NULL;
+
+        req->target = i;
+        req->targetValue = strtoull(rest.str, &end_value, 16);
+        if (end_value != rest.str + rest.len)
+            return NULL;
+    }
+
+    if (element.str) {
+        int i;
+
+        if (!split_value(&element, &name, &rest) ||
+                (i = find_name(element_type_names,
+                    NR_NAMES(element_type_names), &name)) < 0)
+            return NULL;
+
+        req->elementType = i;
+        req->elementValue = rest.str;
+        element = rest;
+    }
+
+    if (data_type.str) {
+        int i = find_name(data_type_names, NR_NAMES(data_type_names),
+                &data_type);
+        if (i < 0)
+            return NULL;
+        req->dataType = i;
+    }
+
+    req->data = data;
+    req->dataLen = end - data;
+    if (data_len.str) {
+        char *end_value;
+        unsigned long long len = strtoull(data_len.str, &end_value, 10);
+
+        if (end_value != data_len.str + data_len.len || len > req->dataLen)
+            return NULL;
+        req->dataLen = len;
+    }
+
+    /* now it is safe to terminate the values in place */
+    operation.str[operation.len] = '\0';
+    request_id.str[request_id.len] = '\0';
+    req->operation = operation.str;
+    req->requestId = request_id.str;
+    if (element.str)
+        element.str[element.len] = '\0';
+    if (property.str) {
+        property.str[property.len] = '\0';
+        req->property = property.str;
+    }
+
+    return pt_op;
+}
+
+#undef NR_NAMES
+
+int on_got_text_packet(purcmc_server* srv, purcmc_endpoint* endpoint,
+        char *packet, size_t sz_packet)
+{
+    const struct pass_through_op *pt_op;
+    request_view req;
+    char *data_end, *copy = NULL;
+    int ret;
+
+    pt_op = parse_request_header(packet, sz_packet, &req);
+    if (pt_op == NULL)
+        return 0;
+
+    /* the callbacks take the data as a null-terminated string; copy it
+       if there is no room in the packet for the terminator */
+    data_end = (char *)req.data + req.dataLen;
+    if (data_end < packet + sz_packet) {
+        *data_end = '\0';
+    }
+    else {
+        if ((copy = malloc(req.dataLen + 1)) == NULL)
+            return PCRDR_SC_INSUFFICIENT_STORAGE;
+        memcpy(copy, req.data, req.dataLen);
+        copy[req.dataLen] = '\0';
+        req.data = copy;
+    }
+
+    ret = pt_op->handler(srv, endpoint, &req, pt_op->op, pt_op->operation);
+    free(copy);
+    return ret;
+}
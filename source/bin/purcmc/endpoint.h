@@ -45,18 +45,33 @@ enum {
 
 int del_endpoint (purcmc_server* srv, purcmc_endpoint* endpoint, int cause);
 
-bool store_dangling_endpoint (purcmc_server* srv, purcmc_endpoint* endpoint);
+void store_dangling_endpoint (purcmc_server* srv, purcmc_endpoint* endpoint);
 bool remove_dangling_endpoint (purcmc_server* srv, purcmc_endpoint* endpoint);
 bool make_endpoint_ready (purcmc_server* srv,
         const char* endpoint_name, purcmc_endpoint* endpoint);
 
-int check_no_responding_endpoints (purcmc_server *srv);
-int check_dangling_endpoints (purcmc_server *srv);
+/* Fire the expired timers of the endpoints; returns the number fired */
+int check_endpoint_timers (purcmc_server *srv);
 
+/* The body must be allocated by malloc(); it is taken over by the callee */
 int send_packet_to_endpoint (purcmc_server* srv,
-        purcmc_endpoint* endpoint, const char* body, int len_body);
+        purcmc_endpoint* endpoint, char* body, int len_body);
+/* Serialize and send a message; returns a status code */
+int send_message_to_endpoint (purcmc_server* srv,
+        purcmc_endpoint* endpoint, const pcrdr_msg *msg);
+int ping_endpoint_client (purcmc_server* srv, purcmc_endpoint* endpoint);
+int close_endpoint_client (purcmc_server* srv, purcmc_endpoint* endpoint);
+/* Grant a shared ring to the client of a Unix socket endpoint; the memfd
+   is sent before the data sent to the endpoint after this call */
+int setup_endpoint_shm_ring (purcmc_server* srv, purcmc_endpoint* endpoint,
+        size_t size);
 int send_initial_response (purcmc_server* srv, purcmc_endpoint* endpoint);
-int on_got_message(purcmc_server* srv, purcmc_endpoint* endpoint, const pcrdr_msg *msg);
+/* The operation of the request may be replaced by its name */
+int on_got_message(purcmc_server* srv, purcmc_endpoint* endpoint, pcrdr_msg *msg);
+/* Handle a text packet of a pass-through request with its header only;
+   returns 0 if the packet should be parsed as a whole message. */
+int on_got_text_packet(purcmc_server* srv, purcmc_endpoint* endpoint,
+        char *packet, size_t sz_packet);
 
 static inline int
 assemble_endpoint_name (purcmc_endpoint *endpoint, char *buff)
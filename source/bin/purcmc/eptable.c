@@ -0,0 +1,178 @@
+/*
+** eptable.c -- the hash table of the endpoints keyed by their names.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#include <config.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eptable.h"
+
+/* Fibonacci hashing of the atom to the index of its home slot */
+static inline unsigned home_slot(const EndpointTable *table,
+        purc_atom_t name)
+{
+    return (unsigned)(((uint64_t)name * 0x9E3779B97F4A7C15ULL) >> 32) &
+        (table->nr_slots - 1);
+}
+
+static bool alloc_slots(EndpointTable *table, unsigned nr_slots)
+{
+    table->slots = calloc(nr_slots, sizeof(EPTableSlot));
+    if (table->slots == NULL)
+        return false;
+
+    table->nr_slots = nr_slots;
+    table->nr_used = 0;
+    return true;
+}
+
+void ep_name_release(purc_atom_t name)
+{
+    char buf[PURC_LEN_ENDPOINT_NAME + 1];
+    const char *str;
+
+    if (name == 0 || (str = purc_atom_to_string(name)) == NULL)
+        return;
+
+    /* the string of the atom is freed by the removal */
+    strncpy(buf, str, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = 0;
+    purc_atom_remove_string_ex(EP_NAME_ATOM_BUCKET, buf);
+}
+
+bool ep_table_init(EndpointTable *table)
+{
+    return alloc_slots(table, EP_TABLE_MIN_SLOTS);
+}
+
+void ep_table_destroy(EndpointTable *table)
+{
+    for (unsigned i = 0; i < table->nr_slots; i++) {
+        if (table->slots[i].name)
+            ep_name_release(table->slots[i].name);
+    }
+
+    free(table->slots);
+    table->slots = NULL;
+    table->nr_slots = 0;
+    table->nr_used = 0;
+}
+
+/* Return the slot of the name, or the empty slot to insert it */
+static EPTableSlot *find_slot(const EndpointTable *table, purc_atom_t name)
+{
+    unsigned mask = table->nr_slots - 1;
+    unsigned i = home_slot(table, name);
+
+    while (table->slots[i].name && table->slots[i].name != name)
+        i = (i + 1) & mask;
+
+    return table->slots + i;
+}
+
+purcmc_endpoint *ep_table_get(const EndpointTable *table, purc_atom_t name)
+{
+    if (name == 0)
+        return NULL;
+
+    return find_slot(table, name)->endpoint;
+}
+
+static bool grow(EndpointTable *table)
+{
+    EPTableSlot *old_slots = table->slots;
+    unsigned old_nr_slots = table->nr_slots;
+
+    if (!alloc_slots(table, old_nr_slots * 2)) {
+        table->slots = old_slots;
+        table->nr_slots = old_nr_slots;
+        return false;
+    }
+
+    for (unsigned i = 0; i < old_nr_slots; i++) {
+        if (old_slots[i].name) {
+            *find_slot(table, old_slots[i].name) = old_slots[i];
+            table->nr_used++;
+        }
+    }
+
+    free(old_slots);
+    return true;
+}
+
+bool ep_table_add(EndpointTable *table, purc_atom_t name,
+        purcmc_endpoint *endpoint)
+{
+    EPTableSlot *slot;
+
+    if (name == 0 || endpoint == NULL)
+        return false;
+
+    if ((table->nr_used + 1) * 2 > table->nr_slots && !grow(table))
+        return false;
+
+    slot = find_slot(table, name);
+    if (slot->name)
+        return false;
+
+    slot->name = name;
+    slot->endpoint = endpoint;
+    table->nr_used++;
+    return true;
+}
+
+bool ep_table_remove(EndpointTable *table, purc_atom_t name)
+{
+    unsigned mask = table->nr_slots - 1;
+    unsigned i, j;
+
+    if (name == 0)
+        return false;
+
+    i = find_slot(table, name) - table->slots;
+    if (table->slots[i].name == 0)
+        return false;
+
+    ep_name_release(name);
+
+    /* shift the following slots whose home is not in (i, j] backward */
+    j = i;
+    for (;;) {
+        unsigned home;
+
+        j = (j + 1) & mask;
+        if (table->slots[j].name == 0)
+            break;
+
+        home = home_slot(table, table->slots[j].name);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            table->slots[i] = table->slots[j];
+            i = j;
+        }
+    }
+
+    table->slots[i].name = 0;
+    table->slots[i].endpoint = NULL;
+    table->nr_used--;
+    return true;
+}
@@ -0,0 +1,103 @@
+/*
+** eptable.h -- the hash table of the endpoints keyed by their names.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#ifndef XGUIPRO_PURCMC_EPTABLE_H
+#define XGUIPRO_PURCMC_EPTABLE_H
+
+#include <stdbool.h>
+
+#include <purc/purc-utils.h>
+
+#include "purcmc.h"
+
+/* the initial number of the slots; must be a power of two */
+#define EP_TABLE_MIN_SLOTS      16
+
+/*
+ * The endpoint names are interned in the user bucket of the atoms, apart
+ * from the ones of PurC, and each atom is owned by the endpoint in the
+ * table: it is removed with the endpoint, so the clients connecting with
+ * new names again and again do not grow the atoms without bound.
+ */
+#define EP_NAME_ATOM_BUCKET     PURC_ATOM_BUCKET_USER
+
+/* Intern an endpoint name; returns 0 if out of memory */
+static inline purc_atom_t ep_name_intern(const char *name)
+{
+    return purc_atom_from_string_ex(EP_NAME_ATOM_BUCKET, name);
+}
+
+/* Return the atom of an endpoint name, or 0 if not interned */
+static inline purc_atom_t ep_name_try(const char *name)
+{
+    return purc_atom_try_string_ex(EP_NAME_ATOM_BUCKET, name);
+}
+
+/* Remove the atom of an endpoint name not stored in a table */
+void ep_name_release(purc_atom_t name);
+
+typedef struct EPTableSlot_ {
+    /* the atom of the endpoint name; 0 if the slot is empty */
+    purc_atom_t         name;
+    purcmc_endpoint    *endpoint;
+} EPTableSlot;
+
+/*
+ * An open-addressing hash table of the endpoints keyed by the atoms of
+ * their names, with linear probing. A slot is emptied by shifting the
+ * following slots of its cluster backward, so there is no tombstone.
+ * The table is grown to keep its load factor under 1/2.
+ */
+typedef struct EndpointTable_ {
+    EPTableSlot        *slots;
+    unsigned            nr_slots;
+    unsigned            nr_used;
+} EndpointTable;
+
+bool ep_table_init(EndpointTable *table);
+/* Destroy the table, and release the atoms of the names left */
+void ep_table_destroy(EndpointTable *table);
+
+/* Return the endpoint having the name, or NULL if not found */
+purcmc_endpoint *ep_table_get(const EndpointTable *table, purc_atom_t name);
+
+/*
+ * Add an endpoint; the table owns the atom of the name from then on.
+ * Returns false if the name exists or out of memory.
+ */
+bool ep_table_add(EndpointTable *table, purc_atom_t name,
+        purcmc_endpoint *endpoint);
+
+/*
+ * Remove the endpoint having the name, and release the atom of the name;
+ * returns false if not found.
+ */
+bool ep_table_remove(EndpointTable *table, purc_atom_t name);
+
+/*
+ * Iterate over all endpoints; `i` is an unsigned index. The table must
+ * not be changed in the loop.
+ */
+#define ep_table_for_each(table, i, ep)                                 \
+    for ((i) = 0; (i) < (table)->nr_slots; (i)++)                       \
+        if (((ep) = (table)->slots[(i)].endpoint) != NULL)
+
+#endif /* !XGUIPRO_PURCMC_EPTABLE_H */
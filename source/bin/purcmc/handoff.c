@@ -0,0 +1,332 @@
+/*
+** handoff.c -- handing off the sockets to a new server process.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "handoff.h"
+
+extern char **environ;
+
+// Make the environment of the new server; the string for the socket is
+// placed first, and the stale one inherited is skipped.
+static char **make_handoff_env(int fd)
+{
+    static const char prefix[] = PURCMC_HANDOFF_ENV "=";
+    char **envp;
+    size_t n = 0, i, j;
+
+    while (environ[n])
+        n++;
+
+    if ((envp = calloc(n + 2, sizeof(char *))) == NULL)
+        return NULL;
+
+    if (asprintf(&envp[0], "%s%d", prefix, fd) < 0) {
+        free(envp);
+        return NULL;
+    }
+
+    for (i = 0, j = 1; i < n; i++) {
+        if (strncmp(environ[i], prefix, sizeof(prefix) - 1))
+            envp[j++] = environ[i];
+    }
+    envp[j] = NULL;
+    return envp;
+}
+
+int handoff_spawn(char *const argv[], pid_t *pid)
+{
+    HandoffRecord rec;
+    int sv[2], status, fds[HANDOFF_MAX_FDS];
+    char **envp;
+    pid_t child, ret;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        purc_log_error("Failed to create the socket pair for handoff: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    /* prepared before forking; only async-signal-safe calls in the child */
+    if ((envp = make_handoff_env(sv[1])) == NULL) {
+        purc_log_error("Failed to make the environment for handoff\n");
+        goto error;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = HANDOFF_MAGIC;
+    rec.kind = HOR_SPAWNED;
+
+    if ((child = fork()) < 0) {
+        purc_log_error("Failed to fork the new server: %s\n", strerror(errno));
+        free(envp[0]);
+        free(envp);
+        goto error;
+    }
+
+    if (child == 0) {
+        /* fork again, so that the new server is not a child of this one,
+           and tell the pid of it before exiting */
+        if ((rec.pid = fork()) == 0) {
+            /* the end of the new server survives the exec */
+            if (fcntl(sv[1], F_SETFD, 0) == 0)
+                execvpe(argv[0], argv, envp);
+            _exit(127);
+        }
+
+        if (rec.pid < 0 || send(sv[1], &rec, sizeof(rec), MSG_NOSIGNAL) !=
+                (ssize_t)sizeof(rec))
+            _exit(127);
+        _exit(0);
+    }
+
+    free(envp[0]);
+    free(envp);
+    close(sv[1]);
+
+    do {
+        ret = waitpid(child, &status, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+            handoff_recv(sv[0], &rec, fds, HANDOFF_TIMEOUT) ||
+            rec.kind != HOR_SPAWNED) {
+        purc_log_error("Failed to spawn the new server\n");
+        close(sv[0]);
+        return -1;
+    }
+
+    *pid = rec.pid;
+    return sv[0];
+
+error:
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
+}
+
+int handoff_inherited_socket(void)
+{
+    const char *str = getenv(PURCMC_HANDOFF_ENV);
+    char *end;
+    long fd;
+
+    if (str == NULL)
+        return -1;
+
+    fd = strtol(str, &end, 10);
+    /* not for the processes started by this one */
+    unsetenv(PURCMC_HANDOFF_ENV);
+
+    if (*end || fd < 0 || fd > INT32_MAX ||
+            fcntl((int)fd, F_SETFD, FD_CLOEXEC) < 0) {
+        purc_log_error("Bad socket inherited for handoff: %s\n", str);
+        return -1;
+    }
+
+    return (int)fd;
+}
+
+int handoff_send(int sock, HandoffRecord *rec, const int *fds, int nr_fds)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    } cmsgbuf;
+    ssize_t n;
+
+    rec->magic = HANDOFF_MAGIC;
+    rec->nr_fds = nr_fds;
+
+    iov.iov_base = rec;
+    iov.iov_len = sizeof(*rec);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (nr_fds > 0) {
+        struct cmsghdr *cmsg;
+
+        memset(&cmsgbuf, 0, sizeof(cmsgbuf));
+        msg.msg_control = cmsgbuf.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nr_fds);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nr_fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nr_fds);
+    }
+
+    do {
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+
+    if (n != (ssize_t)sizeof(*rec)) {
+        purc_log_error("Failed to send the handoff record (%d): %s\n",
+                rec->kind, n < 0 ? strerror(errno) : "truncated");
+        return -1;
+    }
+
+    return 0;
+}
+
+int handoff_recv(int sock, HandoffRecord *rec, int *fds, int timeout)
+{
+    struct pollfd pfd = { sock, POLLIN, 0 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    } cmsgbuf;
+    unsigned nr_fds = 0;
+    ssize_t n;
+
+    do {
+        n = poll(&pfd, 1, timeout * 1000);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0) {
+        purc_log_error("No handoff record in time: %s\n",
+                n < 0 ? strerror(errno) : "timed out");
+        return -1;
+    }
+
+    iov.iov_base = rec;
+    iov.iov_len = sizeof(*rec);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgbuf.buf;
+    msg.msg_controllen = sizeof(cmsgbuf.buf);
+
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        purc_log_error("Failed to receive the handoff record: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        const int *data = (const int *)CMSG_DATA(cmsg);
+        size_t i, count;
+
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < count; i++) {
+            if (nr_fds < HANDOFF_MAX_FDS)
+                fds[nr_fds++] = data[i];
+            else
+                close(data[i]);
+        }
+    }
+
+    if (n != (ssize_t)sizeof(*rec) || rec->magic != HANDOFF_MAGIC ||
+            rec->nr_fds != nr_fds || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        purc_log_error("Bad handoff record: %s\n",
+                n == 0 ? "the peer exited" : "malformed");
+        while (nr_fds > 0)
+            close(fds[--nr_fds]);
+        return -1;
+    }
+
+    return 0;
+}
+
+bool handoff_peer_closed(int sock)
+{
+    char byte;
+    ssize_t n;
+
+    do {
+        n = recv(sock, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+
+    return n == 0;
+}
+
+int handoff_notify_main_pid(pid_t pid)
+{
+    const char *path = getenv("NOTIFY_SOCKET");
+    struct sockaddr_un addr;
+    socklen_t len;
+    char buf[32];
+    int fd, n;
+    ssize_t sent;
+
+    /* not started by a service manager */
+    if (path == NULL)
+        return 0;
+
+    len = strlen(path);
+    if ((path[0] != '/' && path[0] != '@') || len < 2 ||
+            len >= sizeof(addr.sun_path)) {
+        purc_log_error("Bad notify socket: %s\n", path);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, len);
+    /* an abstract socket */
+    if (addr.sun_path[0] == '@')
+        addr.sun_path[0] = 0;
+    len += offsetof(struct sockaddr_un, sun_path);
+
+    n = snprintf(buf, sizeof(buf), "MAINPID=%d", (int)pid);
+    if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+        purc_log_error("Failed to create the notify socket: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    sent = sendto(fd, buf, n, MSG_NOSIGNAL, (struct sockaddr *)&addr, len);
+    close(fd);
+    if (sent != n) {
+        purc_log_error("Failed to notify the main pid: %s\n",
+                sent < 0 ? strerror(errno) : "truncated");
+        return -1;
+    }
+
+    return 0;
+}
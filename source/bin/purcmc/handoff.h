@@ -0,0 +1,125 @@
+/*
+** handoff.h -- handing off the sockets to a new server process.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#ifndef XGUIPRO_PURCMC_HANDOFF_H
+#define XGUIPRO_PURCMC_HANDOFF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <purc/purc.h>
+
+/*
+ * For a hot upgrade, the running server execs the new server with the
+ * environment variable PURCMC_HANDOFF_ENV set to the number of an
+ * inherited SOCK_SEQPACKET socket, and sends the following records
+ * over it; each record is one packet, and the file descriptors go with
+ * the packet as SCM_RIGHTS:
+ *
+ *  - HOR_LISTENERS: the Unix socket listener, and the WebSocket listener
+ *    if there is one (`nr_fds` is 1 or 2).
+ *
+ * The new server answers HOR_END after it watched the listeners, then the
+ * old one stops watching them, and serves the endpoints it has until they
+ * disconnect. No connection of an endpoint is handed off. Once the
+ * listeners are sent, the new server may be accepting on them, so it is
+ * never killed: the old one stops watching the listeners even if no answer
+ * came in time, unless the new one closed the socket, i.e., failed to start.
+ *
+ * The new server is forked twice, so it is not a child of the old one; the
+ * intermediate process sends HOR_SPAWNED with the pid of the new server
+ * before exiting. When the old server runs under systemd, it sends
+ * `MAINPID=` of the new server to $NOTIFY_SOCKET after the exchange, so
+ * that systemd does not take the exit of the old server for the end of the
+ * service. The supported unit configuration is:
+ *
+ *      [Service]
+ *      Type=simple
+ *      ExecStart=/usr/bin/xguipro ...
+ *      ExecReload=/bin/kill -USR2 $MAINPID
+ *      NotifyAccess=main
+ *      KillMode=control-group
+ *
+ * `NotifyAccess=main` is required: systemd ignores the notification with
+ * the default `NotifyAccess=none` of `Type=simple`, then it stops the
+ * service, and kills the new server with the control group, when the old
+ * server exits. Stopping the service still kills both servers.
+ */
+#define PURCMC_HANDOFF_ENV      "PURCMC_HANDOFF_FD"
+
+/* wait for the new server in this time (seconds) */
+#define HANDOFF_TIMEOUT         10
+
+#define HANDOFF_MAGIC           0x484D4350  /* "PCMH" */
+
+enum {
+    HOR_LISTENERS = 0,
+    HOR_SPAWNED,
+    HOR_END,
+};
+
+/* A record handed off */
+typedef struct HandoffRecord_ {
+    uint32_t    magic;
+    uint16_t    kind;
+    uint16_t    reserved;
+    /* the number of the file descriptors with this record */
+    uint32_t    nr_fds;
+    /* the pid of the new server; for HOR_SPAWNED */
+    int32_t     pid;
+} HandoffRecord;
+
+#define HANDOFF_MAX_FDS         2
+
+/*
+ * Exec the new server with `argv` in a grandchild process, whose pid is
+ * stored in `pid`; returns the socket connected to it, or -1 on error.
+ */
+int handoff_spawn(char *const argv[], pid_t *pid);
+
+/*
+ * Tell the service manager that `pid` is the main process of the service
+ * now. Returns 0 if all OK or not started by a service manager, -1 on error.
+ */
+int handoff_notify_main_pid(pid_t pid);
+
+/* Get the socket inherited from the old server; -1 if not handed off */
+int handoff_inherited_socket(void);
+
+/* Returns 0 if all OK, -1 on error */
+int handoff_send(int sock, HandoffRecord *rec, const int *fds, int nr_fds);
+
+/*
+ * Wait for a record in `timeout` seconds; the file descriptors received
+ * are stored in `fds`, which must hold HANDOFF_MAX_FDS ones.
+ * Returns 0 if all OK, -1 on error.
+ */
+int handoff_recv(int sock, HandoffRecord *rec, int *fds, int timeout);
+
+/*
+ * Whether the peer closed the socket, e.g., the new server failed to start
+ * and is exiting; does not consume any record.
+ */
+bool handoff_peer_closed(int sock);
+
+#endif /* !XGUIPRO_PURCMC_HANDOFF_H */
+
@@ -0,0 +1,123 @@
+/*
+** ioqueue.c -- the lock-free queues between the main thread and
+**      the socket I/O thread.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <config.h>
+
+#if HAVE(SYS_EVENTFD_H)
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <purc/purc.h>
+
+#include "ioqueue.h"
+
+int io_queue_init(IOQueue *queue)
+{
+    memset(queue, 0, sizeof(*queue));
+
+    queue->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->efd < 0) {
+        purc_log_error("Failed to create eventfd: %s\n", strerror(errno));
+        return -1;
+    }
+
+    queue->head = queue->tail = &queue->stub;
+    return 0;
+}
+
+void io_queue_destroy(IOQueue *queue)
+{
+    IOMessage msg;
+
+    while (io_queue_pop(queue, &msg))
+        io_message_free_data(&msg);
+
+    if (queue->tail != &queue->stub)
+        free(queue->tail);
+
+    if (queue->efd >= 0) {
+        close(queue->efd);
+        queue->efd = -1;
+    }
+}
+
+void io_queue_push(IOQueue *queue, IOMessage *msg)
+{
+    IOMessage *prev = queue->head;
+
+    msg->next = NULL;
+    queue->head = msg;
+
+    /* publish the message after all its fields are written */
+    __atomic_store_n(&prev->next, msg, __ATOMIC_RELEASE);
+    queue->unnotified = true;
+}
+
+void io_queue_notify(IOQueue *queue)
+{
+    uint64_t one = 1;
+
+    if (!queue->unnotified)
+        return;
+
+    queue->unnotified = false;
+    if (write(queue->efd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        purc_log_error("Failed to write to eventfd: %s\n", strerror(errno));
+    }
+}
+
+void io_queue_clear(IOQueue *queue)
+{
+    uint64_t count;
+
+    if (read(queue->efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        purc_log_error("Failed to read from eventfd: %s\n", strerror(errno));
+    }
+}
+
+bool io_queue_pop(IOQueue *queue, IOMessage *msg)
+{
+    IOMessage *tail = queue->tail;
+    IOMessage *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (next == NULL)
+        return false;
+
+    /* `next` becomes the dummy head of the queue; free the old one.
+       The producer may be linking a new message to `next->next`, so
+       copy the fields after it only */
+    memcpy(&msg->type, &next->type,
+            sizeof(IOMessage) - offsetof(IOMessage, type));
+    msg->next = NULL;
+    queue->tail = next;
+
+    if (tail != &queue->stub)
+        free(tail);
+    return true;
+}
+
+#endif /* HAVE(SYS_EVENTFD_H) */
+
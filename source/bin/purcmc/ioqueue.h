@@ -0,0 +1,128 @@
+/*
+** ioqueue.h -- the lock-free queues between the main thread and
+**      the socket I/O thread.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef XGUIPRO_PURCMC_IOQUEUE_H
+#define XGUIPRO_PURCMC_IOQUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+struct IOProxy_;
+
+/* types of the messages sent by the I/O thread to the main thread */
+enum {
+    IOE_ACCEPTED = 0,   // a new client accepted.
+    IOE_PACKET,         // got a packet; `data` and `sz_data` hold the packet,
+                        // which may be a mapping released by `release`.
+    IOE_LIVING,         // got data from the client; refresh its living time.
+    IOE_CLOSED,         // the client was closed.
+};
+
+/* types of the messages sent by the main thread to the I/O thread */
+enum {
+    IOC_SEND = 0,       // send the packet in `data`; `code` is 1 if in binary.
+    IOC_SEND_FRAGMENT,  // send a fragment of a packet; `code` is the kind.
+    IOC_SHM_RING,       // set up a shared ring of `sz_data` bytes for the client.
+    IOC_PING,           // ping the client.
+    IOC_PAUSE,          // stop reading the client until resumed.
+    IOC_RESUME,         // read the client again.
+    IOC_CLOSE,          // close the client; report `code` first if not zero.
+    IOC_RELEASE,        // the main thread will never refer to the proxy.
+    IOC_UNLISTEN,       // stop watching the listeners handed off.
+    IOC_QUIT,           // quit the I/O thread.
+};
+
+/* A message passed via IOQueue */
+typedef struct IOMessage_ {
+    struct IOMessage_  *next;
+
+    int                 type;
+    /* status code or packet type */
+    int                 code;
+    struct IOProxy_    *proxy;
+
+    char               *data;
+    size_t              sz_data;
+
+    /* the size of the whole packet for the first fragment; 0 if unknown */
+    size_t              sz_packet;
+
+    /* releases `data` instead of free() if not NULL, e.g. to unmap a body */
+    void              (*release)(char *data, size_t sz_alloc);
+    /* the size allocated or mapped for `data`; passed to `release` */
+    size_t              sz_alloc;
+} IOMessage;
+
+/* Release the data carried by a message popped */
+static inline void io_message_free_data(IOMessage *msg)
+{
+    if (msg->release)
+        msg->release(msg->data, msg->sz_alloc);
+    else if (msg->data)
+        free(msg->data);
+}
+
+/*
+ * A single-producer, single-consumer queue; the producer wakes up
+ * the consumer by writing to the eventfd.
+ */
+typedef struct IOQueue_ {
+    /* the last message pushed; only touched by the producer */
+    IOMessage          *head;
+    /* whether there are messages not notified yet; only for the producer */
+    bool                unnotified;
+
+    /* keep the consumer side in another cache line */
+    char                padding_[64];
+
+    /* the last message popped; only touched by the consumer */
+    IOMessage          *tail;
+
+    /* the eventfd to wake up the consumer */
+    int                 efd;
+
+    /* the initial dummy message */
+    IOMessage           stub;
+} IOQueue;
+
+int io_queue_init(IOQueue *queue);
+
+/* Release the messages left in the queue and close the eventfd */
+void io_queue_destroy(IOQueue *queue);
+
+/* Called by the producer; the message must be allocated by malloc() */
+void io_queue_push(IOQueue *queue, IOMessage *msg);
+
+/* Called by the producer to wake up the consumer if there are new messages */
+void io_queue_notify(IOQueue *queue);
+
+/* Called by the consumer to clear the eventfd before draining the queue */
+void io_queue_clear(IOQueue *queue);
+
+/*
+ * Called by the consumer; copies the next message to `msg`.
+ * Returns false if the queue is empty.
+ */
+bool io_queue_pop(IOQueue *queue, IOMessage *msg);
+
+#endif /* !XGUIPRO_PURCMC_IOQUEUE_H */
+
@@ -0,0 +1,143 @@
+/*
+** operations.c -- the lookup of the operations of PurCMC requests.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <config.h>
+
+#include <string.h>
+#include <strings.h>
+
+#include "operations.h"
+
+#define _COMPILE_TIME_ASSERT(name, x)               \
+       typedef int _dummy_ ## name[(x) * 2 - 1]
+
+static const char *operation_names[] = {
+    [PCRDR_K_OPERATION_STARTSESSION] = PCRDR_OPERATION_STARTSESSION,
+    [PCRDR_K_OPERATION_ENDSESSION] = PCRDR_OPERATION_ENDSESSION,
+    [PCRDR_K_OPERATION_CREATEWORKSPACE] = PCRDR_OPERATION_CREATEWORKSPACE,
+    [PCRDR_K_OPERATION_UPDATEWORKSPACE] = PCRDR_OPERATION_UPDATEWORKSPACE,
+    [PCRDR_K_OPERATION_DESTROYWORKSPACE] = PCRDR_OPERATION_DESTROYWORKSPACE,
+    [PCRDR_K_OPERATION_CREATEPLAINWINDOW] = PCRDR_OPERATION_CREATEPLAINWINDOW,
+    [PCRDR_K_OPERATION_UPDATEPLAINWINDOW] = PCRDR_OPERATION_UPDATEPLAINWINDOW,
+    [PCRDR_K_OPERATION_DESTROYPLAINWINDOW] = PCRDR_OPERATION_DESTROYPLAINWINDOW,
+    [PCRDR_K_OPERATION_SETPAGEGROUPS] = PCRDR_OPERATION_SETPAGEGROUPS,
+    [PCRDR_K_OPERATION_ADDPAGEGROUPS] = PCRDR_OPERATION_ADDPAGEGROUPS,
+    [PCRDR_K_OPERATION_REMOVEPAGEGROUP] = PCRDR_OPERATION_REMOVEPAGEGROUP,
+    [PCRDR_K_OPERATION_CREATEWIDGET] = PCRDR_OPERATION_CREATEWIDGET,
+    [PCRDR_K_OPERATION_UPDATEWIDGET] = PCRDR_OPERATION_UPDATEWIDGET,
+    [PCRDR_K_OPERATION_DESTROYWIDGET] = PCRDR_OPERATION_DESTROYWIDGET,
+    [PCRDR_K_OPERATION_LOAD] = PCRDR_OPERATION_LOAD,
+    [PCRDR_K_OPERATION_WRITEBEGIN] = PCRDR_OPERATION_WRITEBEGIN,
+    [PCRDR_K_OPERATION_WRITEMORE] = PCRDR_OPERATION_WRITEMORE,
+    [PCRDR_K_OPERATION_WRITEEND] = PCRDR_OPERATION_WRITEEND,
+    [PCRDR_K_OPERATION_APPEND] = PCRDR_OPERATION_APPEND,
+    [PCRDR_K_OPERATION_PREPEND] = PCRDR_OPERATION_PREPEND,
+    [PCRDR_K_OPERATION_INSERTBEFORE] = PCRDR_OPERATION_INSERTBEFORE,
+    [PCRDR_K_OPERATION_INSERTAFTER] = PCRDR_OPERATION_INSERTAFTER,
+    [PCRDR_K_OPERATION_DISPLACE] = PCRDR_OPERATION_DISPLACE,
+    [PCRDR_K_OPERATION_UPDATE] = PCRDR_OPERATION_UPDATE,
+    [PCRDR_K_OPERATION_ERASE] = PCRDR_OPERATION_ERASE,
+    [PCRDR_K_OPERATION_CLEAR] = PCRDR_OPERATION_CLEAR,
+    [PCRDR_K_OPERATION_CALLMETHOD] = PCRDR_OPERATION_CALLMETHOD,
+    [PCRDR_K_OPERATION_GETPROPERTY] = PCRDR_OPERATION_GETPROPERTY,
+    [PCRDR_K_OPERATION_SETPROPERTY] = PCRDR_OPERATION_SETPROPERTY,
+};
+
+/* Make sure all operations have names */
+_COMPILE_TIME_ASSERT(names,
+        sizeof(operation_names)/sizeof(operation_names[0]) ==
+        PCRDR_NR_OPERATIONS);
+
+/*
+ * The hash of a name is computed from its length and the lower cases of
+ * its first and the last characters. The multipliers are chosen so that
+ * the hashes of all operations are different in a table of 64 slots.
+ */
+#define NR_OP_SLOTS         64
+#define OP_HASH(len, first, last)   \
+    (((len) + 4 * (first) + 16 * (last)) & (NR_OP_SLOTS - 1))
+
+/*
+ * The length of a name is taken from the name itself, so only its first
+ * and last characters are given here. A slot holds the identifier plus 1;
+ * a collision would initialize a slot twice, which -Woverride-init
+ * (enabled by -Wextra) reports.
+ */
+#define OP_SLOT(op, first, last)                                        \
+    [OP_HASH(sizeof(PCRDR_OPERATION_ ## op) - 1, first, last)] =        \
+        PCRDR_K_OPERATION_ ## op + 1
+
+static const unsigned char op_slots[NR_OP_SLOTS] = {
+    OP_SLOT(STARTSESSION, 's', 'n'),
+    OP_SLOT(ENDSESSION, 'e', 'n'),
+    OP_SLOT(CREATEWORKSPACE, 'c', 'e'),
+    OP_SLOT(UPDATEWORKSPACE, 'u', 'e'),
+    OP_SLOT(DESTROYWORKSPACE, 'd', 'e'),
+    OP_SLOT(CREATEPLAINWINDOW, 'c', 'w'),
+    OP_SLOT(UPDATEPLAINWINDOW, 'u', 'w'),
+    OP_SLOT(DESTROYPLAINWINDOW, 'd', 'w'),
+    OP_SLOT(SETPAGEGROUPS, 's', 's'),
+    OP_SLOT(ADDPAGEGROUPS, 'a', 's'),
+    OP_SLOT(REMOVEPAGEGROUP, 'r', 'p'),
+    OP_SLOT(CREATEWIDGET, 'c', 't'),
+    OP_SLOT(UPDATEWIDGET, 'u', 't'),
+    OP_SLOT(DESTROYWIDGET, 'd', 't'),
+    OP_SLOT(LOAD, 'l', 'd'),
+    OP_SLOT(WRITEBEGIN, 'w', 'n'),
+    OP_SLOT(WRITEMORE, 'w', 'e'),
+    OP_SLOT(WRITEEND, 'w', 'd'),
+    OP_SLOT(APPEND, 'a', 'd'),
+    OP_SLOT(PREPEND, 'p', 'd'),
+    OP_SLOT(INSERTBEFORE, 'i', 'e'),
+    OP_SLOT(INSERTAFTER, 'i', 'r'),
+    OP_SLOT(DISPLACE, 'd', 'e'),
+    OP_SLOT(UPDATE, 'u', 'e'),
+    OP_SLOT(ERASE, 'e', 'e'),
+    OP_SLOT(CLEAR, 'c', 'r'),
+    OP_SLOT(CALLMETHOD, 'c', 'd'),
+    OP_SLOT(GETPROPERTY, 'g', 'y'),
+    OP_SLOT(SETPROPERTY, 's', 'y'),
+};
+
+#undef OP_SLOT
+
+int purcmc_operation_id(const char *operation)
+{
+    size_t len;
+    int slot;
+
+    if (operation == NULL || (len = strlen(operation)) == 0)
+        return -1;
+
+    /* all names begin and end with letters; fold them to lower cases */
+    slot = op_slots[OP_HASH(len, operation[0] | 0x20,
+            operation[len - 1] | 0x20)];
+    if (slot == 0 || strcasecmp(operation, operation_names[slot - 1]))
+        return -1;
+
+    return slot - 1;
+}
+
+const char *purcmc_operation_name(unsigned int id)
+{
+    if (id >= PCRDR_NR_OPERATIONS)
+        return NULL;
+    return operation_names[id];
+}
@@ -0,0 +1,39 @@
+/*
+** operations.h -- the lookup of the operations of PurCMC requests.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#ifndef XGUIPRO_PURCMC_OPERATIONS_H
+#define XGUIPRO_PURCMC_OPERATIONS_H
+
+#include <purc/purc-pcrdr.h>
+
+/*
+ * Return the identifier (PCRDR_K_OPERATION_*) of the operation given by
+ * its name, ignoring case, or -1 if it is not a known operation.
+ *
+ * The name is looked up in a perfect hash table built at compile time
+ * from the length, the first, and the last characters of the names.
+ */
+int purcmc_operation_id(const char *operation);
+
+/* Return the name of the operation, or NULL if `id` is not valid */
+const char *purcmc_operation_name(unsigned int id);
+
+#endif /* !XGUIPRO_PURCMC_OPERATIONS_H */
@@ -24,6 +24,7 @@
 #define XGUIPRO_PURCMC_PURCMC_H
 
 #include <purc/purc-pcrdr.h>
+#include <purc/purc-utils.h>
 
 /* The PurcMC Server */
 struct purcmc_server;
@@ -53,6 +54,10 @@ typedef struct purcmc_page purcmc_page;
 struct purcmc_dom;
 typedef struct purcmc_dom purcmc_dom;
 
+/* The connection of a builtin endpoint */
+struct purcmc_builtin_conn;
+typedef struct purcmc_builtin_conn purcmc_builtin_conn;
+
 /* Config Options */
 typedef struct purcmc_server_config {
     const char* app_name;
@@ -69,8 +74,43 @@ typedef struct purcmc_server_config {
     char *sslkey;
     int max_frm_size;
     int backlog;
+    int threaded;
+    int nodeflate;
+    int deflate_threshold;
+    /* the maximal number of the clients of each transport */
+    int max_clients;
+    /* the budget of messages and bytes handled for an endpoint per turn */
+    int sched_msgs;
+    int sched_bytes;
 } purcmc_server_config;
 
+/* The counters of the scheduler of the packets from the endpoints */
+typedef struct purcmc_sched_stats {
+    /* the main-loop turns */
+    uint64_t nr_turns;
+    /* the packets handled, and the ones handled in the interactive lane */
+    uint64_t nr_handled;
+    uint64_t nr_prioritized;
+    /* the packets deferred to later turns, and their bytes */
+    uint64_t nr_deferred;
+    uint64_t sz_deferred;
+    /* the times an endpoint ran out of its budget */
+    uint64_t nr_preempted;
+    /* the deferred packets dropped since their endpoints went away */
+    uint64_t nr_dropped;
+    /* the times the input of an endpoint was paused for its backlog */
+    uint64_t nr_throttled;
+    /* the packets refused since the backlogs would exceed the cap */
+    uint64_t nr_refused;
+
+    /* the deferred packets now, their bytes, and the peak */
+    unsigned nr_backlog;
+    size_t   sz_backlog;
+    unsigned max_backlog;
+    /* the endpoints having backlogs now */
+    unsigned nr_backlogged;
+} purcmc_sched_stats;
+
 typedef struct purcmc_server_callbacks {
     int  (*prepare)(purcmc_server *);
     void (*cleanup)(purcmc_server *);
@@ -184,16 +224,77 @@ purcmc_server *purcmc_rdrsrv_init(purcmc_server_config* srvcfg,
 /* Check and dispatch messages from clients */
 bool purcmc_rdrsrv_check(purcmc_server *srv);
 
+/* Return the file descriptor which becomes readable when there are events
+   to dispatch by calling purcmc_rdrsrv_check(); -1 if not available. */
+int purcmc_rdrsrv_get_fd(purcmc_server *srv);
+
+/* The interval (in seconds) to call purcmc_rdrsrv_check_endpoints() */
+#define PURCMC_CHECK_ENDPOINTS_INTERVAL     1
+
+/* Fire the expired timers of the endpoints: ping the idle endpoints, and
+   remove the no-responding ones and the ones which failed to authenticate
+   in time. purcmc_rdrsrv_check() does this too; call this one periodically
+   when the server may stay idle. */
+bool purcmc_rdrsrv_check_endpoints(purcmc_server *srv);
+
+/* Whether there are packets deferred, or endpoints to resume reading, at
+   the next purcmc_rdrsrv_check(); the caller should not wait for the fd
+   of the server if so */
+bool purcmc_rdrsrv_has_deferred(purcmc_server *srv);
+
 /* Deinitialize the PurCMC renderer server */
 int purcmc_rdrsrv_deinit(purcmc_server *srv);
 
 /* retrieve the user data attached to the renederer server */
 void *purcmc_rdrsrv_get_user_data(purcmc_server *srv);
 
+/* retrieve the counters of the scheduler, e.g., of the deferred work */
+void purcmc_rdrsrv_get_sched_stats(purcmc_server *srv,
+        purcmc_sched_stats *stats);
+
+/*
+ * Hand off the listeners to a new server for a hot upgrade: exec `argv` in
+ * a new process and pass the listeners to it. The new server accepts the
+ * new connections from then on, while this server keeps serving the
+ * endpoints it has; it should exit when purcmc_rdrsrv_nr_socket_endpoints()
+ * returns 0, or after PURCMC_HANDOFF_DRAIN_TIMEOUT seconds. Returns 0 if the
+ * listeners were handed off, even if the new server did not answer in time,
+ * or -1 if failed and this server goes on listening.
+ */
+int purcmc_rdrsrv_hand_off(purcmc_server *srv, char *const argv[]);
+
+/* The longest time (in seconds) to serve the endpoints after handing off;
+   the endpoints left are disconnected at once, and reconnect to the new
+   server by themselves */
+#define PURCMC_HANDOFF_DRAIN_TIMEOUT        600
+
+/* Return the number of the endpoints connected over the sockets */
+unsigned purcmc_rdrsrv_nr_socket_endpoints(purcmc_server *srv);
+
 /* retrieve the endpoint by endpoint name */
 purcmc_endpoint *purcmc_endpoint_from_name(purcmc_server *srv,
         const char *endpoint_name);
 
+/*
+ * A reference to an endpoint which can be kept after the endpoint is
+ * removed, e.g., by a session. It is checked against the registry of the
+ * endpoints by the atom of the name and the generation, so resolving it
+ * involves no string operation.
+ */
+typedef struct purcmc_endpoint_ref {
+    purc_atom_t         name;
+    uint64_t            generation;
+    purcmc_endpoint    *endpoint;
+} purcmc_endpoint_ref;
+
+/* Make a reference to the endpoint */
+void purcmc_endpoint_get_ref(purcmc_endpoint *endpoint,
+        purcmc_endpoint_ref *ref);
+
+/* Return the referenced endpoint, or NULL if it has been removed */
+purcmc_endpoint *purcmc_endpoint_from_ref(purcmc_server *srv,
+        const purcmc_endpoint_ref *ref);
+
 /* Send a response message to HVML interpreter */
 int purcmc_endpoint_send_response(purcmc_server *srv,
         purcmc_endpoint *endpoint, const pcrdr_msg *msg);
@@ -211,6 +312,43 @@ const char *purcmc_endpoint_app_name(purcmc_endpoint *endpoint);
 /* Return the runner name of the specified endpoint */
 const char *purcmc_endpoint_runner_name(purcmc_endpoint *endpoint);
 
+/*
+ * Create a builtin endpoint for an HVML interpreter running on another
+ * thread of this process; the messages are passed as pcrdr_msg pointers,
+ * without being serialized to text or parsed. The messages sent by the
+ * interpreter are taken over as they are, but every message posted by
+ * the server is copied once by pcrdr_clone_message(), since the server
+ * may still refer to its own. The interpreter starts a session by sending
+ * the `startSession` request as a client of the Unix socket does, after
+ * it received the initial response.
+ *
+ * Called by the thread running the server. Returns NULL if not supported.
+ * The interpreter should close the connection before the server is
+ * deinitialized.
+ */
+purcmc_builtin_conn *purcmc_rdrsrv_new_builtin(purcmc_server *srv);
+
+/* The following functions are called by the thread of the interpreter. */
+
+/* Return the eventfd which becomes readable when there are messages to
+   receive by calling purcmc_builtin_conn_recv(). */
+int purcmc_builtin_conn_get_fd(purcmc_builtin_conn *conn);
+
+/* Send a message to the server; the message made by pcrdr_make_*() is
+   taken over. Returns PCRDR_SC_OK, or PCRDR_SC_NOT_READY if the server
+   closed the connection. */
+int purcmc_builtin_conn_send(purcmc_builtin_conn *conn, pcrdr_msg *msg);
+
+/* Receive a message from the server; NULL if there is none. The message
+   should be released by calling pcrdr_release_message(). */
+pcrdr_msg *purcmc_builtin_conn_recv(purcmc_builtin_conn *conn);
+
+/* Whether the server closed the connection, e.g., it is exiting */
+bool purcmc_builtin_conn_is_closed(purcmc_builtin_conn *conn);
+
+/* Close the connection; it must not be used after */
+void purcmc_builtin_conn_close(purcmc_builtin_conn *conn);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,281 @@
+/*
+** sched.c -- the fair scheduling of the packets from the endpoints.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sched.h"
+
+void sched_init(Scheduler *sched, unsigned budget_msgs, size_t budget_bytes)
+{
+    sched->turn = 0;
+    sched->budget_msgs = budget_msgs;
+    sched->budget_bytes = budget_bytes;
+    for (int i = 0; i < SCHED_NR_LANES; i++)
+        list_head_init(&sched->lanes[i]);
+    sched->running = NULL;
+    list_head_init(&sched->drained);
+    memset(&sched->stats, 0, sizeof(sched->stats));
+}
+
+void sched_entity_init(SchedEntity *entity)
+{
+    list_head_init(&entity->lane);
+    list_head_init(&entity->backlog);
+    entity->nr_backlog = 0;
+    entity->sz_backlog = 0;
+    entity->turn = 0;
+    entity->msgs_left = 0;
+    entity->bytes_left = 0;
+    entity->interactive = false;
+    entity->throttled = false;
+    list_head_init(&entity->drained);
+}
+
+static void unlink_entity(Scheduler *sched, SchedEntity *entity)
+{
+    if (!list_empty(&entity->lane)) {
+        list_del_init(&entity->lane);
+        sched->stats.nr_backlogged--;
+    }
+}
+
+void sched_entity_cleanup(Scheduler *sched, SchedEntity *entity)
+{
+    SchedPacket *packet, *tmp;
+
+    list_for_each_entry_safe(packet, tmp, &entity->backlog, link) {
+        list_del(&packet->link);
+        free(packet);
+    }
+
+    sched->stats.nr_backlog -= entity->nr_backlog;
+    sched->stats.sz_backlog -= entity->sz_backlog;
+    sched->stats.nr_dropped += entity->nr_backlog;
+    entity->nr_backlog = 0;
+    entity->sz_backlog = 0;
+
+    unlink_entity(sched, entity);
+    list_del_init(&entity->drained);
+    entity->throttled = false;
+    if (sched->running == entity)
+        sched->running = NULL;
+}
+
+void sched_mark_interactive(Scheduler *sched, SchedEntity *entity)
+{
+    entity->interactive = true;
+    if (!list_empty(&entity->lane)) {
+        list_del(&entity->lane);
+        list_add_tail(&entity->lane, &sched->lanes[SCHED_LANE_INTERACTIVE]);
+    }
+}
+
+/* Grant the budget of the current turn if not yet */
+static inline void refill_budget(Scheduler *sched, SchedEntity *entity)
+{
+    if (entity->turn != sched->turn) {
+        entity->turn = sched->turn;
+        entity->msgs_left = sched->budget_msgs;
+        entity->bytes_left = sched->budget_bytes;
+    }
+}
+
+/* A packet larger than the bytes left takes all of them */
+static inline bool charge_budget(SchedEntity *entity, unsigned int sz_body)
+{
+    if (entity->msgs_left == 0 || entity->bytes_left == 0)
+        return false;
+
+    entity->msgs_left--;
+    entity->bytes_left -= (sz_body < entity->bytes_left) ?
+        sz_body : entity->bytes_left;
+    return true;
+}
+
+bool sched_admit(Scheduler *sched, SchedEntity *entity, unsigned int sz_body)
+{
+    if (entity->nr_backlog > 0)
+        return false;
+
+    refill_budget(sched, entity);
+    if (!charge_budget(entity, sz_body)) {
+        sched->stats.nr_preempted++;
+        return false;
+    }
+
+    /* it has no backlog; the reaction to the input will be handled now */
+    entity->interactive = false;
+    sched->stats.nr_handled++;
+    return true;
+}
+
+void sched_admit_oversized(Scheduler *sched, SchedEntity *entity)
+{
+    refill_budget(sched, entity);
+    entity->msgs_left = 0;
+    entity->bytes_left = 0;
+
+    entity->interactive = false;
+    sched->stats.nr_handled++;
+}
+
+bool sched_defer(Scheduler *sched, SchedEntity *entity,
+        const char *body, unsigned int sz_body, int type)
+{
+    SchedPacket *packet;
+
+    /* the packets read before the input was paused are still coming */
+    if (!entity->throttled &&
+            sz_body > SCHED_MAX_BACKLOG_BYTES - entity->sz_backlog) {
+        sched->stats.nr_refused++;
+        return false;
+    }
+
+    if ((packet = malloc(sizeof(SchedPacket) + sz_body + 1)) == NULL)
+        return false;
+
+    packet->type = type;
+    packet->sz_body = sz_body;
+    memcpy(packet->body, body, sz_body);
+    /* the text parsers expect a null-terminated packet */
+    packet->body[sz_body] = '\0';
+    list_add_tail(&packet->link, &entity->backlog);
+
+    entity->nr_backlog++;
+    entity->sz_backlog += sz_body;
+    sched->stats.nr_deferred++;
+    sched->stats.sz_deferred += sz_body;
+    sched->stats.nr_backlog++;
+    sched->stats.sz_backlog += sz_body;
+    if (sched->stats.nr_backlog > sched->stats.max_backlog)
+        sched->stats.max_backlog = sched->stats.nr_backlog;
+
+    if (list_empty(&entity->lane)) {
+        list_add_tail(&entity->lane, &sched->lanes[entity->interactive ?
+                SCHED_LANE_INTERACTIVE : SCHED_LANE_BULK]);
+        sched->stats.nr_backlogged++;
+    }
+
+    /* it will be resumed when the new backlog is drained */
+    list_del_init(&entity->drained);
+    return true;
+}
+
+bool sched_throttle(Scheduler *sched, SchedEntity *entity)
+{
+    if (entity->throttled)
+        return false;
+
+    entity->throttled = true;
+    sched->stats.nr_throttled++;
+
+    /* out of its budget but nothing deferred; resume after the next turn */
+    if (entity->nr_backlog == 0)
+        list_add_tail(&entity->drained, &sched->drained);
+    return true;
+}
+
+void sched_resume_drained(Scheduler *sched, sched_resume_fn fn, void *ctxt)
+{
+    struct list_head drained;
+
+    /* the ones throttled again by `fn` are left to the next turn */
+    list_head_init(&drained);
+    list_splice_tail_init(&sched->drained, &drained);
+    while (!list_empty(&drained)) {
+        SchedEntity *entity = list_first_entry(&drained,
+                SchedEntity, drained);
+
+        list_del_init(&entity->drained);
+        entity->throttled = false;
+        fn(entity, ctxt);
+    }
+}
+
+/* Serve the backlog of an entity within its budget */
+static void serve_entity(Scheduler *sched, SchedEntity *entity, int lane,
+        sched_handle_fn fn, void *ctxt)
+{
+    refill_budget(sched, entity);
+    sched->running = entity;
+
+    while (entity->nr_backlog > 0) {
+        SchedPacket *packet = list_first_entry(&entity->backlog,
+                SchedPacket, link);
+
+        if (!charge_budget(entity, packet->sz_body)) {
+            sched->stats.nr_preempted++;
+            break;
+        }
+
+        list_del(&packet->link);
+        entity->nr_backlog--;
+        entity->sz_backlog -= packet->sz_body;
+        sched->stats.nr_backlog--;
+        sched->stats.sz_backlog -= packet->sz_body;
+        sched->stats.nr_handled++;
+        if (lane == SCHED_LANE_INTERACTIVE)
+            sched->stats.nr_prioritized++;
+
+        fn(entity, packet->body, packet->sz_body, packet->type, ctxt);
+        free(packet);
+
+        /* the entity was removed when handling the packet */
+        if (sched->running != entity)
+            return;
+    }
+
+    sched->running = NULL;
+    if (entity->nr_backlog == 0) {
+        entity->interactive = false;
+        unlink_entity(sched, entity);
+        if (entity->throttled)
+            list_add_tail(&entity->drained, &sched->drained);
+    }
+}
+
+void sched_run_turn(Scheduler *sched, sched_handle_fn fn, void *ctxt)
+{
+    sched->turn++;
+    sched->stats.nr_turns++;
+
+    for (int lane = 0; lane < SCHED_NR_LANES; lane++) {
+        struct list_head served;
+
+        /* every entity in the lane is served once in this turn */
+        list_head_init(&served);
+        while (!list_empty(&sched->lanes[lane])) {
+            SchedEntity *entity = list_first_entry(&sched->lanes[lane],
+                    SchedEntity, lane);
+
+            list_del(&entity->lane);
+            list_add_tail(&entity->lane, &served);
+            serve_entity(sched, entity, lane, fn, ctxt);
+        }
+
+        /* the ones still having backlogs; at the tail of the lane */
+        list_splice_tail_init(&served, &sched->lanes[lane]);
+    }
+}
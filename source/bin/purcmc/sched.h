@@ -0,0 +1,174 @@
+/*
+** sched.h -- the fair scheduling of the packets from the endpoints.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+
+
+#ifndef XGUIPRO_PURCMC_SCHED_H
+#define XGUIPRO_PURCMC_SCHED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "utils/list.h"
+#include "purcmc.h"
+
+/* the default budget of an endpoint per turn */
+#define SCHED_DEF_BUDGET_MSGS       32
+#define SCHED_DEF_BUDGET_BYTES      (256 * 1024)
+
+/* the max bytes of the deferred packets of an endpoint */
+#define SCHED_MAX_BACKLOG_BYTES     (16 * SCHED_DEF_BUDGET_BYTES)
+
+/* A packet deferred to a later turn */
+typedef struct SchedPacket_ {
+    struct list_head    link;
+    int                 type;
+    unsigned int        sz_body;
+    char                body[];
+} SchedPacket;
+
+/* The scheduling state embedded in an endpoint */
+typedef struct SchedEntity_ {
+    /* the node in a lane of the scheduler; empty if no backlog */
+    struct list_head    lane;
+    /* the deferred packets in the order of arrival */
+    struct list_head    backlog;
+    unsigned            nr_backlog;
+    size_t              sz_backlog;
+
+    /* the turn in which the budget left was granted */
+    uint64_t            turn;
+    unsigned            msgs_left;
+    size_t              bytes_left;
+
+    /* an event of user input was posted and not caught up yet */
+    bool                interactive;
+
+    /* the input is paused until the backlog is drained */
+    bool                throttled;
+    /* the node in the list of the throttled entities drained */
+    struct list_head    drained;
+} SchedEntity;
+
+enum {
+    SCHED_LANE_INTERACTIVE = 0,
+    SCHED_LANE_BULK,
+    SCHED_NR_LANES,
+};
+
+/*
+ * The scheduler of the packets from the endpoints.
+ *
+ * A main-loop turn grants each endpoint a budget of messages and bytes.
+ * A packet is handled at once if its endpoint has budget left and no
+ * backlog; otherwise it is deferred to the backlog of the endpoint, so
+ * the packets of an endpoint are always handled in order.
+ *
+ * At the start of a turn, the backlogs are served round-robin within
+ * the budgets: first the endpoints in the interactive lane, which have
+ * been posted an event of user input, then the ones in the bulk lane.
+ * An endpoint still having a backlog is moved to the tail of its lane.
+ *
+ * The caller throttles an endpoint when a packet of it is deferred, and
+ * stops reading its input; the input is resumed after the turn in which
+ * the backlog is drained. So the backlog of an endpoint is bounded, and
+ * a packet which would make it exceed SCHED_MAX_BACKLOG_BYTES is refused,
+ * unless the endpoint is throttled already: then the packet was read
+ * before the input was paused, e.g., by the I/O thread.
+ *
+ * A packet larger than SCHED_MAX_BACKLOG_BYTES with no backlog ahead of
+ * it is handled at once instead of being copied, but it takes the whole
+ * budget of the turn, and the caller throttles the endpoint too.
+ */
+typedef struct Scheduler_ {
+    uint64_t            turn;
+    unsigned            budget_msgs;
+    size_t              budget_bytes;
+
+    struct list_head    lanes[SCHED_NR_LANES];
+
+    /* the entity of which a packet is being handled */
+    SchedEntity        *running;
+
+    /* the throttled entities of which the backlogs were drained */
+    struct list_head    drained;
+
+    purcmc_sched_stats  stats;
+} Scheduler;
+
+/* Handle a deferred packet; returns a status code */
+typedef int (*sched_handle_fn)(SchedEntity *entity,
+        char *body, unsigned int sz_body, int type, void *ctxt);
+
+/* Resume the input of a throttled entity */
+typedef void (*sched_resume_fn)(SchedEntity *entity, void *ctxt);
+
+void sched_init(Scheduler *sched, unsigned budget_msgs, size_t budget_bytes);
+
+void sched_entity_init(SchedEntity *entity);
+
+/* Drop the backlog of an entity which is going away */
+void sched_entity_cleanup(Scheduler *sched, SchedEntity *entity);
+
+/* Move the entity to the interactive lane until it is caught up */
+void sched_mark_interactive(Scheduler *sched, SchedEntity *entity);
+
+/*
+ * Check whether a packet can be handled at once, and charge the budget
+ * of the entity if so. Otherwise, the caller should defer the packet.
+ */
+bool sched_admit(Scheduler *sched, SchedEntity *entity, unsigned int sz_body);
+
+/*
+ * Take the whole budget of the turn for a packet too large to defer, which
+ * is handled at once even if the entity ran out of its budget. The caller
+ * should throttle the entity.
+ */
+void sched_admit_oversized(Scheduler *sched, SchedEntity *entity);
+
+/*
+ * Defer a copy of the packet; returns false if out of memory, or if the
+ * backlog of the entity would exceed SCHED_MAX_BACKLOG_BYTES and the
+ * entity is not throttled.
+ */
+bool sched_defer(Scheduler *sched, SchedEntity *entity,
+        const char *body, unsigned int sz_body, int type);
+
+/*
+ * Mark the input of the entity paused until its backlog is drained;
+ * returns false if it is throttled already.
+ */
+bool sched_throttle(Scheduler *sched, SchedEntity *entity);
+
+/*
+ * Resume the input of the throttled entities of which the backlogs were
+ * drained. `fn` may remove any entity, or throttle the one again; the
+ * latter will be resumed after the next turn.
+ */
+void sched_resume_drained(Scheduler *sched, sched_resume_fn fn, void *ctxt);
+
+/*
+ * Start a new turn and serve the backlogs within the budgets. `fn` may
+ * remove any entity, including the one of the packet being handled.
+ */
+void sched_run_turn(Scheduler *sched, sched_handle_fn fn, void *ctxt);
+
+#endif /* !XGUIPRO_PURCMC_SCHED_H */
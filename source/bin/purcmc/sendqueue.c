@@ -0,0 +1,287 @@
+/*
+** sendqueue.c -- the gather queue of the data to send to a client.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils/misc.h"
+#include "sendqueue.h"
+
+/* the min size of the buffer of a chunk holding copied data */
+#define SEND_CHUNK_MIN_ROOM     256
+
+void send_queue_init(SendQueue *queue)
+{
+    memset(queue, 0, sizeof(*queue));
+}
+
+static void free_chunk(SendChunk *chunk)
+{
+    if (chunk->to_free)
+        free(chunk->to_free);
+    free(chunk);
+}
+
+/* Release the ring buffer and forget the blocking once the queue drains */
+static void release_ring(SendQueue *queue)
+{
+    if (queue->ring) {
+        cbuf_free(queue->ring, SEND_QUEUE_RING_ORDER);
+        queue->ring = NULL;
+        queue->sz_ring = 0;
+    }
+
+    queue->ring_head = 0;
+    queue->ring_used = 0;
+    queue->blocked = false;
+}
+
+void send_queue_clear(SendQueue *queue)
+{
+    SendChunk *chunk = queue->head;
+
+    while (chunk) {
+        SendChunk *next = chunk->next;
+        free_chunk(chunk);
+        chunk = next;
+    }
+
+    queue->head = queue->tail = NULL;
+    queue->sz_pending = 0;
+    release_ring(queue);
+}
+
+void send_queue_destroy(SendQueue *queue)
+{
+    send_queue_clear(queue);
+}
+
+static inline void append_chunk(SendQueue *queue, SendChunk *chunk)
+{
+    chunk->next = NULL;
+    if (queue->tail)
+        queue->tail->next = chunk;
+    else
+        queue->head = chunk;
+    queue->tail = chunk;
+}
+
+static bool append_to_ring(SendQueue *queue, const char *data, size_t sz)
+{
+    SendChunk *chunk = queue->tail;
+    char *tail;
+
+    /* the data held only for corking are sent soon */
+    if (!queue->blocked)
+        return false;
+
+    if (queue->ring == NULL) {
+        queue->ring = cbuf_alloc(SEND_QUEUE_RING_ORDER);
+        if (queue->ring == NULL)
+            return false;
+        queue->sz_ring = cbuf_size(SEND_QUEUE_RING_ORDER);
+        queue->ring_head = 0;
+        queue->ring_used = 0;
+    }
+
+    if (queue->sz_ring - queue->ring_used < sz)
+        return false;
+
+    /* the ring is mirrored, so the data at `tail` are always contiguous */
+    tail = queue->ring +
+        (queue->ring_head + queue->ring_used) % queue->sz_ring;
+    memcpy(tail, data, sz);
+    queue->ring_used += sz;
+
+    /* extend the last chunk if it ends at the tail of the ring */
+    if (chunk && chunk->in_ring &&
+            (size_t)(chunk->data + chunk->sz_data - queue->ring) %
+                queue->sz_ring == (size_t)(tail - queue->ring)) {
+        chunk->sz_data += sz;
+        return true;
+    }
+
+    chunk = malloc(sizeof(SendChunk));
+    if (chunk == NULL) {
+        queue->ring_used -= sz;
+        return false;
+    }
+
+    chunk->data = tail;
+    chunk->sz_data = sz;
+    chunk->to_free = NULL;
+    chunk->sz_room = 0;
+    chunk->in_ring = true;
+    append_chunk(queue, chunk);
+    return true;
+}
+
+static bool append_copy(SendQueue *queue, const char *data, size_t sz)
+{
+    SendChunk *chunk = queue->tail;
+    size_t sz_room;
+
+    if (append_to_ring(queue, data, sz))
+        return true;
+
+    /* not blocked or the ring is full; try to append the data to the
+       last chunk */
+    if (chunk && !chunk->in_ring && chunk->to_free == NULL &&
+            chunk->sz_room >= sz) {
+        memcpy((char *)chunk->data + chunk->sz_data, data, sz);
+        chunk->sz_data += sz;
+        chunk->sz_room -= sz;
+        return true;
+    }
+
+    sz_room = (sz < SEND_CHUNK_MIN_ROOM) ? SEND_CHUNK_MIN_ROOM : sz;
+    chunk = malloc(sizeof(SendChunk) + sz_room);
+    if (chunk == NULL)
+        return false;
+
+    memcpy(chunk->buff, data, sz);
+    chunk->data = chunk->buff;
+    chunk->sz_data = sz;
+    chunk->to_free = NULL;
+    chunk->sz_room = sz_room - sz;
+    chunk->in_ring = false;
+    append_chunk(queue, chunk);
+    return true;
+}
+
+static SendChunk *append_ref(SendQueue *queue, const char *data, size_t sz)
+{
+    SendChunk *chunk = malloc(sizeof(SendChunk));
+    if (chunk == NULL)
+        return NULL;
+
+    chunk->data = data;
+    chunk->sz_data = sz;
+    chunk->to_free = NULL;
+    chunk->sz_room = 0;
+    chunk->in_ring = false;
+    append_chunk(queue, chunk);
+    return chunk;
+}
+
+bool send_queue_append(SendQueue *queue, const struct iovec *iov, int iovcnt,
+        size_t skip, const char *ref, size_t sz_ref, void *to_free)
+{
+    SendChunk *last_ref = NULL;
+
+    for (int i = 0; i < iovcnt; i++) {
+        const char *data = iov[i].iov_base;
+        size_t sz = iov[i].iov_len;
+
+        if (skip >= sz) {
+            skip -= sz;
+            continue;
+        }
+
+        data += skip;
+        sz -= skip;
+        skip = 0;
+
+        if (ref && data >= ref && data < ref + sz_ref) {
+            SendChunk *chunk = append_ref(queue, data, sz);
+            if (chunk == NULL)
+                goto failed;
+            last_ref = chunk;
+        }
+        else if (!append_copy(queue, data, sz)) {
+            goto failed;
+        }
+
+        queue->sz_pending += sz;
+    }
+
+    if (last_ref)
+        last_ref->to_free = to_free;
+    else if (to_free)
+        free(to_free);
+    return true;
+
+failed:
+    if (to_free)
+        free(to_free);
+    return false;
+}
+
+int send_queue_get_iovs(const SendQueue *queue, struct iovec *iov,
+        int max_iovs)
+{
+    SendChunk *chunk = queue->head;
+    int n = 0;
+
+    while (chunk && n < max_iovs) {
+        iov[n].iov_base = (void *)chunk->data;
+        iov[n].iov_len = chunk->sz_data;
+        n++;
+        chunk = chunk->next;
+    }
+
+    return n;
+}
+
+/* The data in the ring are consumed in the same order as appended */
+static inline void consume_ring(SendQueue *queue, size_t sz)
+{
+    queue->ring_head = (queue->ring_head + sz) % queue->sz_ring;
+    queue->ring_used -= sz;
+    if (queue->ring_used == 0)
+        queue->ring_head = 0;
+}
+
+void send_queue_consume(SendQueue *queue, size_t sz)
+{
+    while (sz > 0 && queue->head) {
+        SendChunk *chunk = queue->head;
+
+        if (sz < chunk->sz_data) {
+            chunk->data += sz;
+            chunk->sz_data -= sz;
+            queue->sz_pending -= sz;
+
+            /* keep the data start in the first copy of the ring, since
+               the last chunk may be extended again and again */
+            if (chunk->in_ring) {
+                consume_ring(queue, sz);
+                if (chunk->data >= queue->ring + queue->sz_ring)
+                    chunk->data -= queue->sz_ring;
+            }
+            break;
+        }
+
+        if (chunk->in_ring)
+            consume_ring(queue, chunk->sz_data);
+        sz -= chunk->sz_data;
+        queue->sz_pending -= chunk->sz_data;
+        queue->head = chunk->next;
+        if (queue->head == NULL)
+            queue->tail = NULL;
+        free_chunk(chunk);
+    }
+
+    if (queue->head == NULL)
+        release_ring(queue);
+}
+
@@ -0,0 +1,134 @@
+/*
+** sendqueue.h -- the gather queue of the data to send to a client.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef XGUIPRO_PURCMC_SENDQUEUE_H
+#define XGUIPRO_PURCMC_SENDQUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/* the max number of iovecs for a call of writev() */
+#define SEND_QUEUE_MAX_IOVS     64
+
+/* the order of the size of the ring buffer for copied data (64KiB) */
+#define SEND_QUEUE_RING_ORDER   16
+
+/* A chunk of the data to send */
+typedef struct SendChunk_ {
+    struct SendChunk_  *next;
+
+    /* the data not sent yet */
+    const char         *data;
+    size_t              sz_data;
+
+    /* the buffer to free after the data sent; NULL for copied data */
+    void               *to_free;
+    /* the room left in `buff` for appending more copied data */
+    size_t              sz_room;
+    /* whether the data are in the ring buffer of the queue */
+    bool                in_ring;
+
+    char                buff[0];
+} SendChunk;
+
+/*
+ * A queue of chunks which can be sent by one call of writev().
+ *
+ * Once the socket would block, the copied data are kept in a mirrored ring
+ * buffer allocated by cbuf_alloc(), so both appending and consuming are
+ * O(1) without moving data; the ring is released when the queue drains.
+ * The data held only for corking, or copied when the ring is full, are
+ * copied to heap chunks.
+ */
+typedef struct SendQueue_ {
+    SendChunk          *head;
+    SendChunk          *tail;
+
+    /* the total size of the data not sent yet */
+    size_t              sz_pending;
+
+    /* the socket would block; set by the user until the queue drains */
+    bool                blocked;
+
+    /* the ring buffer; allocated for the data copied after blocked */
+    char               *ring;
+    size_t              sz_ring;
+    /* the offset of the first byte and the number of bytes in use */
+    size_t              ring_head;
+    size_t              ring_used;
+} SendQueue;
+
+void send_queue_init(SendQueue *queue);
+
+/* Release all chunks in the queue and the ring buffer */
+void send_queue_clear(SendQueue *queue);
+
+/* Release all chunks and the ring buffer */
+void send_queue_destroy(SendQueue *queue);
+
+static inline bool send_queue_is_empty(const SendQueue *queue)
+{
+    return queue->head == NULL;
+}
+
+/* Tell the queue that the socket would block, i.e., the data may stay in
+   the queue for a while; it is reset when the queue drains */
+static inline void send_queue_set_blocked(SendQueue *queue)
+{
+    queue->blocked = true;
+}
+
+/*
+ * Append the iovecs after skipping the first `skip` bytes.
+ *
+ * The data within [ref, ref + sz_ref) are referred instead of copied.
+ * The queue takes the ownership of `to_free`: it will be freed after
+ * all data referring to it are sent, or at once if there is no such data.
+ *
+ * Returns false if failed to allocate memory; the queue should be cleared
+ * in this case.
+ */
+bool send_queue_append(SendQueue *queue, const struct iovec *iov, int iovcnt,
+        size_t skip, const char *ref, size_t sz_ref, void *to_free);
+
+/*
+ * Fill the iovecs with the pending data.
+ *
+ * Returns the number of iovecs filled.
+ */
+int send_queue_get_iovs(const SendQueue *queue, struct iovec *iov,
+        int max_iovs);
+
+/* Remove the first `sz` bytes which were sent */
+void send_queue_consume(SendQueue *queue, size_t sz);
+
+/* Return the total size of the data in the iovecs */
+static inline size_t iovs_size(const struct iovec *iov, int iovcnt)
+{
+    size_t sz = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+        sz += iov[i].iov_len;
+    return sz;
+}
+
+#endif /* !XGUIPRO_PURCMC_SENDQUEUE_H */
+
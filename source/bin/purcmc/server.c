@@ -24,24 +24,34 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
 #include <assert.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
 
 #include <purc/purc.h>
 #include <glib.h>
 
-#include "utils/kvlist.h"
 
 #include "server.h"
 #include "websocket.h"
 #include "unixsocket.h"
 #include "endpoint.h"
+#include "handoff.h"
+
+#if HAVE(BUILTIN_ENDPOINT)
+#include <sys/eventfd.h>
+#endif
 
 static purcmc_server the_server;
 static purcmc_server_config* the_srvcfg;
 
 #define PTR_FOR_US_LISTENER ((void *)1)
 #define PTR_FOR_WS_LISTENER ((void *)2)
+#define PTR_FOR_IO_COMMANDS ((void *)3)
+#define PTR_FOR_BUILTINS    ((void *)4)
+#define PTR_FOR_WS_HANDSHAKES   ((void *)5)
 
 /* callbacks for socket servers */
 // Allocate a purcmc_endpoint structure for a new client and send `auth` packet.
@@ -63,93 +73,236 @@ on_accepted(void* sock_srv, SockClient* client)
 }
 
 static int
-on_packet(void* sock_srv, SockClient* client,
+handle_packet(purcmc_endpoint *endpoint,
             char* body, unsigned int sz_body, int type)
 {
-    assert(client->entity);
-
-    (void)sock_srv;
-    (void)client;
+    int ret;
+    pcrdr_msg *msg;
 
     if (type == PT_TEXT) {
-        int ret;
-        pcrdr_msg *msg;
-        purcmc_endpoint *endpoint = container_of(client->entity, purcmc_endpoint, entity);
-
         if (the_srvcfg->accesslog) {
             purc_log_info("Got a packet from @%s/%s/%s:\n%s\n",
                     endpoint->host_name, endpoint->app_name,
                     endpoint->runner_name, body);
         }
 
+        /* the pass-through requests need no full parsing */
+        if ((ret = on_got_text_packet(&the_server, endpoint, body, sz_body)))
+            return ret;
+
         if ((ret = pcrdr_parse_packet(body, sz_body, &msg))) {
             purc_log_error("Failed pcrdr_parse_packet: %s\n",
                     purc_get_error_message(ret));
             return PCRDR_SC_UNPROCESSABLE_PACKET;
         }
-
-        ret = on_got_message(&the_server, endpoint, msg);
-        pcrdr_release_message(msg);
-        return ret;
     }
     else {
-        /* discard all packet in binary */
-        return PCRDR_SC_NOT_ACCEPTABLE;
+        if (the_srvcfg->accesslog) {
+            purc_log_info("Got a binary packet (%u bytes) from @%s/%s/%s\n",
+                    sz_body, endpoint->host_name, endpoint->app_name,
+                    endpoint->runner_name);
+        }
+
+        if ((ret = purcmc_binmsg_parse(body, sz_body, &msg))) {
+            purc_log_error("Failed purcmc_binmsg_parse: %s\n",
+                    purc_get_error_message(ret));
+            return PCRDR_SC_UNPROCESSABLE_PACKET;
+        }
+
+        /* answer the client in the binary format from now on */
+        endpoint->binary_msg = true;
+    }
+
+    ret = on_got_message(&the_server, endpoint, msg);
+    pcrdr_release_message(msg);
+    return ret;
+}
+
+// Handle a packet deferred by the scheduler.
+static int
+handle_deferred_packet(SchedEntity *entity,
+            char* body, unsigned int sz_body, int type, void *ctxt)
+{
+    purcmc_endpoint *endpoint = container_of(entity, purcmc_endpoint, sched);
+    int ret;
+
+    (void)ctxt;
+    ret = handle_packet(endpoint, body, sz_body, type);
+    if (ret != PCRDR_SC_OK) {
+        purc_log_warn("Internal error after got a deferred packet: %d\n", ret);
+        close_endpoint_client(&the_server, endpoint);
+    }
+
+    return ret;
+}
+
+static void pause_endpoint_input(purcmc_endpoint *endpoint);
+
+// Handle the packet now, or defer it and pause the input of the endpoint
+// if the endpoint ran out of its budget.
+static int
+on_packet(void* sock_srv, SockClient* client,
+            char* body, unsigned int sz_body, int type)
+{
+    purcmc_endpoint *endpoint;
+
+    (void)sock_srv;
+    assert(client->entity);
+    endpoint = container_of(client->entity, purcmc_endpoint, entity);
+
+    if (sched_admit(&the_server.sched, &endpoint->sched, sz_body))
+        return handle_packet(endpoint, body, sz_body, type);
+
+    /* nothing ahead of it; not worth a copy of a body beyond the cap, but
+       it takes the budget of this turn, and the input is paused before
+       handling it, which may remove the endpoint */
+    if (endpoint->sched.nr_backlog == 0 && sz_body > SCHED_MAX_BACKLOG_BYTES) {
+        sched_admit_oversized(&the_server.sched, &endpoint->sched);
+        pause_endpoint_input(endpoint);
+        return handle_packet(endpoint, body, sz_body, type);
     }
 
+    if (!sched_defer(&the_server.sched, &endpoint->sched, body, sz_body, type)) {
+        purc_log_warn("Refused a packet (%u bytes) of endpoint %p; "
+                "%u packets (%zu bytes) in its backlog\n", sz_body, endpoint,
+                endpoint->sched.nr_backlog, endpoint->sched.sz_backlog);
+        return PCRDR_SC_INSUFFICIENT_STORAGE;
+    }
+
+    pause_endpoint_input(endpoint);
     return PCRDR_SC_OK;
 }
 
-#if !HAVE(SYS_EPOLL_H) && HAVE(SYS_SELECT_H)
+#if !HAVE(SYS_EPOLL_H) && HAVE(POLL_H)
+// Watch the socket, or watch its writability too if it is watched already.
 static int
 listen_new_client(int fd, void *ptr, bool rw)
 {
-    if (sorted_array_add(the_server.fd2clients, (void *)(intptr_t)fd, ptr)) {
+    PollSlot *slot = client_table_slot(&the_server.fd2clients, fd, true);
+
+    if (slot == NULL)
         return -1;
+
+    if (slot->ptr == NULL) {
+        if (the_server.nr_pollfds == the_server.sz_pollfds) {
+            unsigned n = the_server.sz_pollfds ? the_server.sz_pollfds * 2 : 64;
+            struct pollfd *pollfds;
+
+            pollfds = realloc(the_server.pollfds, sizeof(struct pollfd) * n);
+            if (pollfds == NULL)
+                return -1;
+
+            the_server.pollfds = pollfds;
+            the_server.sz_pollfds = n;
+        }
+
+        slot->index = the_server.nr_pollfds++;
+        the_server.pollfds[slot->index].fd = fd;
+        the_server.pollfds[slot->index].events = POLLIN;
+        the_server.pollfds[slot->index].revents = 0;
     }
 
-    FD_SET(fd, &the_server.rfdset);
+    slot->ptr = ptr;
     if (rw)
-        FD_SET(fd, &the_server.wfdset);
-
-    if (the_server.maxfd < fd)
-        the_server.maxfd = fd;
+        the_server.pollfds[slot->index].events |= POLLOUT;
 
     return 0;
 }
 
+// Stop watching the socket; the last entry of pollfds fills the hole.
 static int
 remove_listening_client(int fd)
 {
-    if (sorted_array_remove(the_server.fd2clients, (void *)(intptr_t)fd)) {
-        FD_CLR(fd, &the_server.rfdset);
-        FD_CLR(fd, &the_server.wfdset);
-        return 0;
+    PollSlot *slot = client_table_slot(&the_server.fd2clients, fd, false);
+    unsigned last;
+
+    if (slot == NULL || slot->ptr == NULL)
+        return -1;
+
+    last = --the_server.nr_pollfds;
+    if (slot->index != last) {
+        struct pollfd *moved = the_server.pollfds + last;
+        PollSlot *moved_slot;
+
+        moved_slot = client_table_slot(&the_server.fd2clients, moved->fd, false);
+        moved_slot->index = slot->index;
+        the_server.pollfds[slot->index] = *moved;
     }
 
-    return -1;
+    slot->ptr = NULL;
+    return 0;
 }
 #endif
 
+#if HAVE(SYS_EPOLL_H)
+// Watch the readability of a socket; `ptr` will be passed back with events.
 static int
-on_pending(void* sock_srv, SockClient* client)
+watch_socket(int fd, void *ptr)
 {
-#if HAVE(SYS_EPOLL_H)
     struct epoll_event ev;
 
+    /* the Unix socket reader drains the socket and is safe for EPOLLET,
+       but the WebSocket reader still reads one chunk per wakeup. */
+    ev.events = EPOLLIN;
+    ev.data.ptr = ptr;
+    if (epoll_ctl(the_server.epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        purc_log_error("Failed to call epoll_ctl to add fd (%d): %s\n",
+                fd, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+unwatch_socket(int fd)
+{
+    if (epoll_ctl(the_server.epollfd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+        purc_log_warn("Failed to call epoll_ctl to delete the client fd (%d): %s\n",
+                fd, strerror(errno));
+    }
+}
+
+// Start or stop watching the writability of a watched socket; a client
+// whose input is paused is not watched until resumed.
+static int
+update_socket_writable(int fd, void *ptr, bool writable)
+{
+    SockClient *client = ptr;
+    struct epoll_event ev;
+
+    if (client->entity && client->entity->paused)
+        return 0;
+
+    ev.events = writable ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.ptr = ptr;
+    if (epoll_ctl(the_server.epollfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+        purc_log_error("Failed to call epoll_ctl for fd (%d): %s\n",
+                fd, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+#endif /* HAVE(SYS_EPOLL_H) */
+
+static int
+on_pending(void* sock_srv, SockClient* client)
+{
+#if HAVE(SYS_EPOLL_H)
     (void)sock_srv;
-    ev.events = EPOLLIN | EPOLLOUT;
-    ev.data.ptr = client;
-    if (epoll_ctl(the_server.epollfd, EPOLL_CTL_MOD, client->fd, &ev) == -1) {
-        purc_log_error("Failed epoll_ctl to the client fd (%d): %s\n",
-                client->fd, strerror(errno));
+    if (update_socket_writable(client->fd, client, true)) {
         assert(0);
     }
-#elif HAVE(SYS_SELECT_H)
+#elif HAVE(POLL_H)
     (void)sock_srv;
 
+    /* watched again with the writability when the input is resumed */
+    if (client->entity && client->entity->paused)
+        return 0;
+
     if (listen_new_client(client->fd, client, TRUE)) {
-        purc_log_error("Failed to insert to the client AVL tree: %d\n", client->fd);
+        purc_log_error("Failed to watch the writability of client: %d\n", client->fd);
         assert(0);
     }
 #endif
@@ -157,47 +310,126 @@ on_pending(void* sock_srv, SockClient* client)
     return 0;
 }
 
-static int
-on_close(void* sock_srv, SockClient* client)
+static void
+stop_watching_client(SockClient* client)
 {
-#if HAVE(SYS_EPOLL_H)
-    (void)sock_srv;
-
-    if (epoll_ctl(the_server.epollfd, EPOLL_CTL_DEL, client->fd, NULL) == -1) {
-        purc_log_warn("Failed to call epoll_ctl to delete the client fd (%d): %s\n",
-                client->fd, strerror(errno));
-    }
-#elif HAVE(SYS_SELECT_H)
-    (void)sock_srv;
+    /* not watched since the input was paused */
+    if (client->entity && client->entity->paused)
+        return;
 
+#if HAVE(SYS_EPOLL_H)
+    unwatch_socket(client->fd);
+#elif HAVE(POLL_H)
     if (remove_listening_client(client->fd)) {
         purc_log_warn("Failed to delete the client fd (%d) from the listening fdset\n",
                 client->fd);
     }
 #endif
+}
 
-    if (client->entity) {
-        purcmc_endpoint *endpoint = container_of(client->entity, purcmc_endpoint, entity);
-        char endpoint_name [PURC_LEN_ENDPOINT_NAME + 1];
-
-        if (assemble_endpoint_name(endpoint, endpoint_name) > 0) {
-            if (kvlist_delete(&the_server.endpoint_list, endpoint_name)) {
-                the_server.nr_endpoints--;
-                purc_log_info("An authenticated endpoint removed: %s (%p), %d endpoints left.\n",
-                        endpoint_name, endpoint, the_server.nr_endpoints);
-            }
-        }
-        else {
-            remove_dangling_endpoint(&the_server, endpoint);
-            purc_log_info("An endpoint not authenticated removed: (%p, %d), %d endpoints left.\n",
-                    endpoint, endpoint->status, the_server.nr_endpoints);
+// Close the clients accepted but failed to watch, with their endpoints.
+static void
+close_new_clients(SockClient **clients, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (clients[i]->ct == CT_UNIX_SOCKET)
+            us_cleanup_client(the_server.us_srv, (USClient *)clients[i]);
+        else
+            ws_cleanup_client(the_server.ws_srv, (WSClient *)clients[i]);
+    }
+}
+
+// Stop watching the client until its input is resumed; called by the thread
+// handling the socket.
+static void
+pause_client_input(SockClient* client)
+{
+    if (client->entity->paused)
+        return;
+
+    stop_watching_client(client);
+    client->entity->paused = true;
+}
+
+// Watch the client again, and handle the input left when it was paused.
+static void
+resume_client_input(SockClient* client)
+{
+    bool sending;
+
+    if (!client->entity->paused)
+        return;
+
+    client->entity->paused = false;
+    if (client->ct == CT_UNIX_SOCKET)
+        sending = ((USClient *)client)->status & US_SENDING;
+    else
+        sending = ((WSClient *)client)->status & WS_SENDING;
+
+#if HAVE(SYS_EPOLL_H)
+    if (watch_socket(client->fd, client) ||
+            (sending && update_socket_writable(client->fd, client, true)))
+        goto failed;
+#elif HAVE(POLL_H)
+    if (listen_new_client(client->fd, client, FALSE) ||
+            (sending && listen_new_client(client->fd, client, TRUE)))
+        goto failed;
+#endif
+
+    /* the client is freed on error */
+    if (client->ct == CT_UNIX_SOCKET)
+        us_handle_reads(the_server.us_srv, (USClient *)client);
+    else
+        ws_handle_reads(the_server.ws_srv, (WSClient *)client);
+    return;
+
+failed:
+    purc_log_error("Failed to watch the client (%d) again\n", client->fd);
+    close_new_clients(&client, 1);
+}
+
+// Remove an endpoint whether it is authenticated or not.
+static void
+remove_endpoint(purcmc_endpoint *endpoint)
+{
+    char endpoint_name [PURC_LEN_ENDPOINT_NAME + 1];
+
+    if (assemble_endpoint_name(endpoint, endpoint_name) > 0) {
+        if (ep_table_remove(&the_server.endpoint_table,
+                    endpoint->name_atom)) {
+            the_server.nr_endpoints--;
+            purc_log_info("An authenticated endpoint removed: %s (%p), %d endpoints left.\n",
+                    endpoint_name, endpoint, the_server.nr_endpoints);
         }
+    }
+    else {
+        remove_dangling_endpoint(&the_server, endpoint);
+        purc_log_info("An endpoint not authenticated removed: (%p, %d), %d endpoints left.\n",
+                endpoint, endpoint->status, the_server.nr_endpoints);
+    }
 
-        del_endpoint(&the_server, endpoint, CDE_LOST_CONNECTION);
+    del_endpoint(&the_server, endpoint, CDE_LOST_CONNECTION);
+}
 
+// Remove the endpoint of a closed client.
+static void
+remove_client_endpoint(SockClient* client)
+{
+    if (client->entity) {
+        remove_endpoint(container_of(client->entity, purcmc_endpoint, entity));
         client->entity = NULL;
     }
+}
+
+static int
+on_close(void* sock_srv, SockClient* client)
+{
+    (void)sock_srv;
 
+    stop_watching_client(client);
+    remove_client_endpoint(client);
     return 0;
 }
 
@@ -234,111 +466,866 @@ on_error(void* sock_srv, SockClient* client, int err_code)
     }
 }
 
-int send_packet_to_endpoint(purcmc_server* srv,
-        purcmc_endpoint* endpoint, const char* body, int len_body)
+/* The timer of the endpoint checks the living time when it fires */
+static inline void
+update_endpoint_living_time(purcmc_server *srv, purcmc_endpoint* endpoint)
 {
-    if (the_srvcfg->accesslog) {
-        char *tmp = strndup(body, len_body);
-        purc_log_info("Sending a packet to @%s/%s/%s:\n%s\n",
-                endpoint->host_name, endpoint->app_name,
-                endpoint->runner_name, tmp);
-        free(tmp);
-    }
+    (void)srv;
+    if (endpoint)
+        endpoint->t_living = purc_get_monotoic_time();
+}
 
-    if (endpoint->type == ET_UNIX_SOCKET) {
-        return us_send_packet(srv->us_srv, (USClient *)endpoint->entity.client,
-                US_OPCODE_TEXT, body, len_body);
-    }
-    else if (endpoint->type == ET_WEB_SOCKET) {
-        return ws_send_packet(srv->ws_srv, (WSClient *)endpoint->entity.client,
-                WS_OPCODE_TEXT, body, len_body);
+#if HAVE(IO_THREAD)
+static int
+post_io_message(IOQueue *queue, int type, IOProxy *proxy, int code,
+        char *data, size_t sz_data)
+{
+    IOMessage *msg = malloc(sizeof(IOMessage));
+
+    if (msg == NULL) {
+        purc_log_error("Failed to allocate memory for I/O message (%d)\n", type);
+        return -1;
     }
 
-    return -1;
+    msg->type = type;
+    msg->code = code;
+    msg->proxy = proxy;
+    msg->data = data;
+    msg->sz_data = sz_data;
+    msg->sz_packet = 0;
+    msg->release = NULL;
+    msg->sz_alloc = 0;
+    io_queue_push(queue, msg);
+    return 0;
 }
 
-static inline void
-update_endpoint_living_time(purcmc_server *srv, purcmc_endpoint* endpoint)
+static inline int
+post_io_command(int type, IOProxy *proxy, int code, char *data, size_t sz_data)
 {
-    if (endpoint && endpoint->avl.key) {
-        time_t t_curr = purc_get_monotoic_time();
+    if (post_io_message(&the_server.io_commands, type, proxy, code,
+                data, sz_data))
+        return -1;
 
-        if (endpoint->t_living != t_curr) {
-            endpoint->t_living = t_curr;
-            avl_delete(&srv->living_avl, &endpoint->avl);
-            avl_insert(&srv->living_avl, &endpoint->avl);
-        }
-    }
+    io_queue_notify(&the_server.io_commands);
+    return 0;
 }
 
-static struct sigaction old_pipe_sa;
-
-static void
-sig_handler_ignore(int sig_number)
+/* callbacks for socket servers in the I/O thread */
+// Allocate a proxy for a new client and pass it to the main thread.
+static int
+io_on_accepted(void* sock_srv, SockClient* client)
 {
-    if (sig_number == SIGINT) {
-        the_server.running = false;
-    }
-    else if (sig_number == SIGPIPE) {
-        if (old_pipe_sa.sa_handler) {
-            old_pipe_sa.sa_handler(sig_number);
-        }
+    IOProxy *proxy;
+
+    (void)sock_srv;
+    proxy = calloc(1, sizeof(IOProxy));
+    if (proxy == NULL)
+        return PCRDR_SC_INSUFFICIENT_STORAGE;
+
+    proxy->client.ct = client->ct;
+    proxy->client.fd = client->fd;
+    proxy->entity.client = client;
+    client->entity = &proxy->entity;
+
+    if (post_io_message(&the_server.io_events, IOE_ACCEPTED, proxy, 0,
+                NULL, 0)) {
+        client->entity = NULL;
+        free(proxy);
+        return PCRDR_SC_INSUFFICIENT_STORAGE;
     }
+
+    return PCRDR_SC_OK;
 }
 
 static int
-setup_signal_pipe(void)
+io_on_packet(void* sock_srv, SockClient* client,
+            char* body, unsigned int sz_body, int type)
 {
-    struct sigaction sa;
+    IOProxy *proxy;
+    char *data;
 
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = sig_handler_ignore;
-    sigemptyset(&sa.sa_mask);
+    (void)sock_srv;
+    assert(client->entity);
 
-#if 0
-    if (sigaction(SIGPIPE, &sa, &old_pipe_sa) != 0) {
-        perror("sigaction()");
-        return -1;
+    proxy = container_of(client->entity, IOProxy, entity);
+    if ((data = malloc(sz_body)) == NULL)
+        return PCRDR_SC_INSUFFICIENT_STORAGE;
+
+    memcpy(data, body, sz_body);
+    if (post_io_message(&the_server.io_events, IOE_PACKET, proxy, type,
+                data, sz_body)) {
+        free(data);
+        return PCRDR_SC_INSUFFICIENT_STORAGE;
     }
-#endif
 
-    return 0;
+    return PCRDR_SC_OK;
 }
 
-/* max events for epoll */
-#define MAX_EVENTS          10
+// Pass a body mapped from a memfd to the main thread without copying it;
+// the main thread unmaps it after handled.
+static int
+io_on_mapped_packet(void* sock_srv, SockClient* client,
+            char* body, unsigned int sz_body, int type, size_t sz_mapped)
+{
+    IOMessage *msg;
+
+    (void)sock_srv;
+    assert(client->entity);
+
+    if ((msg = malloc(sizeof(IOMessage))) == NULL) {
+        us_unmap_body(body, sz_mapped);
+        return PCRDR_SC_INSUFFICIENT_STORAGE;
+    }
+
+    msg->type = IOE_PACKET;
+    msg->code = type;
+    msg->proxy = container_of(client->entity, IOProxy, entity);
+    msg->data = body;
+    msg->sz_data = sz_body;
+    msg->sz_packet = 0;
+    msg->release = us_unmap_body;
+    msg->sz_alloc = sz_mapped;
+    io_queue_push(&the_server.io_events, msg);
+    return PCRDR_SC_OK;
+}
 
 static int
-prepare_server(void)
+io_on_close(void* sock_srv, SockClient* client)
 {
-#if HAVE(SYS_EPOLL_H)
-    struct epoll_event ev;
-#endif
-    the_server.us_listener = the_server.ws_listener = -1;
-    the_server.t_start = purc_get_monotoic_time();
-    the_server.t_elapsed = the_server.t_elapsed_last = 0;
+    (void)sock_srv;
 
-    // create unix socket
-    if ((the_server.us_listener = us_listen(the_server.us_srv)) < 0) {
-        purc_log_error("Unable to listen on Unix socket (%s)\n",
-                the_srvcfg->unixsocket);
-        goto error;
+    stop_watching_client(client);
+    if (client->entity) {
+        IOProxy *proxy = container_of(client->entity, IOProxy, entity);
+
+        /* the socket layer will free the client after returning */
+        proxy->entity.client = NULL;
+        client->entity = NULL;
+        post_io_message(&the_server.io_events, IOE_CLOSED, proxy, 0, NULL, 0);
     }
-    purc_log_info("Listening on Unix Socket (%s)...\n", the_srvcfg->unixsocket);
 
-    the_server.us_srv->on_accepted = on_accepted;
-    the_server.us_srv->on_packet = on_packet;
-    the_server.us_srv->on_pending = on_pending;
-    the_server.us_srv->on_close = on_close;
-    the_server.us_srv->on_error = on_error;
+    return 0;
+}
 
-    // create web socket listener if enabled
-    if (the_server.ws_srv) {
-#if HAVE(LIBSSL)
-        if (the_srvcfg->sslcert && the_srvcfg->sslkey) {
-            purc_log_info("==Using TLS/SSL==\n");
-            the_srvcfg->use_ssl = 1;
-            if (ws_initialize_ssl_ctx(the_server.ws_srv)) {
+static inline void *
+sock_server_of_client(SockClient* client)
+{
+    if (client->ct == CT_UNIX_SOCKET)
+        return the_server.us_srv;
+    return the_server.ws_srv;
+}
+
+// Handle the events posted by the I/O thread in the main thread.
+static void
+dispatch_io_events(void)
+{
+    IOMessage msg;
+
+    io_queue_clear(&the_server.io_events);
+    while (io_queue_pop(&the_server.io_events, &msg)) {
+        SockClient *client = &msg.proxy->client;
+        int ret;
+
+        switch (msg.type) {
+        case IOE_ACCEPTED:
+            ret = on_accepted(sock_server_of_client(client), client);
+            if (ret != PCRDR_SC_OK) {
+                purc_log_warn("Internal error after accepted a client (%d): %d\n",
+                        client->fd, ret);
+                post_io_command(IOC_CLOSE, msg.proxy, ret, NULL, 0);
+            }
+            break;
+
+        case IOE_PACKET:
+            if (client->entity) {
+                ret = on_packet(sock_server_of_client(client), client,
+                        msg.data, msg.sz_data, msg.code);
+                if (ret != PCRDR_SC_OK) {
+                    purc_log_warn("Internal error after got a packet: %d\n",
+                            ret);
+                    post_io_command(IOC_CLOSE, msg.proxy, ret, NULL, 0);
+                }
+            }
+            io_message_free_data(&msg);
+            break;
+
+        case IOE_LIVING:
+            if (client->entity) {
+                update_endpoint_living_time(&the_server,
+                        container_of(client->entity, purcmc_endpoint, entity));
+            }
+            break;
+
+        case IOE_CLOSED:
+            remove_client_endpoint(client);
+            /* the commands already queued may still refer to the proxy */
+            post_io_command(IOC_RELEASE, msg.proxy, 0, NULL, 0);
+            break;
+
+        default:
+            purc_log_error("Bad I/O event type: %d\n", msg.type);
+            break;
+        }
+    }
+}
+#endif /* HAVE(IO_THREAD) */
+
+static void
+refresh_client_living_time(SockClient* client)
+{
+    if (client->entity == NULL)
+        return;
+
+#if HAVE(IO_THREAD)
+    if (the_server.threaded) {
+        IOProxy *proxy = container_of(client->entity, IOProxy, entity);
+        time_t t_curr = purc_get_monotoic_time();
+
+        /* post at most one event per second for a client */
+        if (proxy->t_living != t_curr) {
+            proxy->t_living = t_curr;
+            post_io_message(&the_server.io_events, IOE_LIVING, proxy, 0,
+                    NULL, 0);
+        }
+        return;
+    }
+#endif
+
+    update_endpoint_living_time(&the_server,
+            container_of(client->entity, purcmc_endpoint, entity));
+}
+
+int send_packet_to_endpoint(purcmc_server* srv,
+        purcmc_endpoint* endpoint, char* body, int len_body)
+{
+    bool binary = endpoint->binary_msg;
+
+    if (the_srvcfg->accesslog && binary) {
+        purc_log_info("Sending a binary packet (%d bytes) to @%s/%s/%s\n",
+                len_body, endpoint->host_name, endpoint->app_name,
+                endpoint->runner_name);
+    }
+    else if (the_srvcfg->accesslog) {
+        char *tmp = strndup(body, len_body);
+        purc_log_info("Sending a packet to @%s/%s/%s:\n%s\n",
+                endpoint->host_name, endpoint->app_name,
+                endpoint->runner_name, tmp);
+        free(tmp);
+    }
+
+#if HAVE(IO_THREAD)
+    if (the_server.threaded) {
+        if (post_io_command(IOC_SEND, (IOProxy *)endpoint->entity.client,
+                    binary, body, len_body)) {
+            free(body);
+            return -1;
+        }
+        return 0;
+    }
+#endif
+
+    if (endpoint->type == ET_UNIX_SOCKET) {
+        return us_send_owned_packet(srv->us_srv,
+                (USClient *)endpoint->entity.client,
+                binary ? US_OPCODE_BIN : US_OPCODE_TEXT, body, len_body);
+    }
+    else if (endpoint->type == ET_WEB_SOCKET) {
+        return ws_send_owned_packet(srv->ws_srv,
+                (WSClient *)endpoint->entity.client,
+                binary ? WS_OPCODE_BIN : WS_OPCODE_TEXT, body, len_body);
+    }
+
+    free(body);
+    return -1;
+}
+
+/* the kinds of the fragments of a packet streamed to a client */
+enum {
+    PF_FIRST = 0,
+    PF_MIDDLE,
+    PF_LAST,
+    PF_KIND_MASK = 0x0F,
+
+    /* or'd with the kind if the packet is in the binary format */
+    PF_BINARY = 0x10,
+};
+
+// Send a fragment of a packet to the client; the data are taken over.
+static int
+send_fragment_to_client(SockClient* client, int kind, size_t sz_packet,
+        char *data, size_t sz_data)
+{
+    bool binary = kind & PF_BINARY;
+
+    kind &= PF_KIND_MASK;
+    if (client->ct == CT_UNIX_SOCKET) {
+        USOpcode op;
+
+        /* the first frame tells the size of the whole packet */
+        if (kind == PF_FIRST)
+            op = binary ? US_OPCODE_BIN : US_OPCODE_TEXT;
+        else if (kind == PF_MIDDLE)
+            op = US_OPCODE_CONTINUATION;
+        else
+            op = US_OPCODE_END;
+
+        return us_send_owned_frame(the_server.us_srv, (USClient *)client, op,
+                (kind == PF_FIRST) ? sz_packet : 0, data, sz_data);
+    }
+
+    return ws_send_owned_frame(the_server.ws_srv, (WSClient *)client,
+            (kind != PF_FIRST) ? WS_OPCODE_CONTINUATION :
+                (binary ? WS_OPCODE_BIN : WS_OPCODE_TEXT),
+            kind == PF_LAST, data, sz_data);
+}
+
+#if HAVE(IO_THREAD)
+static int
+post_io_fragment(IOProxy *proxy, int kind, size_t sz_packet,
+        char *data, size_t sz_data)
+{
+    IOMessage *msg = malloc(sizeof(IOMessage));
+
+    if (msg == NULL) {
+        purc_log_error("Failed to allocate memory for I/O message (%d)\n",
+                IOC_SEND_FRAGMENT);
+        return -1;
+    }
+
+    msg->type = IOC_SEND_FRAGMENT;
+    msg->code = kind;
+    msg->proxy = proxy;
+    msg->data = data;
+    msg->sz_data = sz_data;
+    msg->sz_packet = sz_packet;
+    msg->release = NULL;
+    msg->sz_alloc = 0;
+    io_queue_push(&the_server.io_commands, msg);
+
+    /* wake up the I/O thread once for a packet */
+    if ((kind & PF_KIND_MASK) == PF_LAST)
+        io_queue_notify(&the_server.io_commands);
+    return 0;
+}
+#endif
+
+/* the size of the chunks when streaming a message */
+#define SZ_MESSAGE_CHUNK    PCRDR_MAX_FRAME_PAYLOAD_SIZE
+
+/* The context to stream a serialized message to an endpoint */
+typedef struct MessageStream {
+    purcmc_endpoint    *endpoint;
+
+    /* the current chunk and the size of the data in it */
+    char               *chunk;
+    size_t              len;
+
+    /* the size of the whole packet; 0 if not known yet */
+    size_t              sz_packet;
+    /* the size of the data serialized so far */
+    size_t              sz_serialized;
+    /* the number of the fragments sent */
+    int                 nr_sent;
+    /* PF_BINARY if the message is serialized in the binary format */
+    int                 format;
+
+    /* only count the size of the packet */
+    bool                counting;
+    bool                failed;
+} MessageStream;
+
+static int
+send_stream_chunk(MessageStream *stream, int kind)
+{
+    purcmc_endpoint *endpoint = stream->endpoint;
+    char *chunk = stream->chunk;
+    int ret;
+
+    stream->chunk = NULL;
+#if HAVE(IO_THREAD)
+    if (the_server.threaded) {
+        ret = post_io_fragment((IOProxy *)endpoint->entity.client,
+                kind | stream->format, stream->sz_packet, chunk, stream->len);
+        if (ret)
+            free(chunk);
+    }
+    else
+#endif
+    {
+        ret = send_fragment_to_client(endpoint->entity.client,
+                kind | stream->format, stream->sz_packet, chunk, stream->len);
+    }
+
+    stream->len = 0;
+    stream->nr_sent++;
+    return ret;
+}
+
+static ssize_t
+stream_message_data(void *ctxt, const void *buf, size_t count)
+{
+    MessageStream *stream = ctxt;
+    const char *data = buf;
+    size_t left = count;
+
+    if (stream->failed)
+        return -1;
+
+    while (left > 0) {
+        size_t n;
+
+        if (stream->len == SZ_MESSAGE_CHUNK) {
+            if (stream->counting) {
+                stream->sz_serialized += left;
+                break;
+            }
+
+            if (stream->endpoint->type == ET_UNIX_SOCKET &&
+                    stream->sz_packet == 0) {
+                /* a Unix socket frame needs the size of the whole packet */
+                stream->counting = true;
+                continue;
+            }
+
+            /* the chunk is sent only if there are more data, so that the
+               last fragment can be marked */
+            if (send_stream_chunk(stream,
+                        stream->nr_sent ? PF_MIDDLE : PF_FIRST))
+                goto failed;
+        }
+
+        if (stream->chunk == NULL) {
+            stream->chunk = malloc(SZ_MESSAGE_CHUNK);
+            if (stream->chunk == NULL)
+                goto failed;
+        }
+
+        n = SZ_MESSAGE_CHUNK - stream->len;
+        if (n > left)
+            n = left;
+
+        memcpy(stream->chunk + stream->len, data, n);
+        stream->len += n;
+        stream->sz_serialized += n;
+        data += n;
+        left -= n;
+    }
+
+    return count;
+
+failed:
+    stream->failed = true;
+    return -1;
+}
+
+static int
+serialize_message(const pcrdr_msg *msg, MessageStream *stream)
+{
+    if (stream->format == PF_BINARY)
+        return purcmc_binmsg_serialize(msg, stream_message_data, stream);
+    return pcrdr_serialize_message(msg, stream_message_data, stream);
+}
+
+int send_message_to_endpoint(purcmc_server* srv,
+        purcmc_endpoint* endpoint, const pcrdr_msg *msg)
+{
+    MessageStream stream = { endpoint, NULL, 0, 0, 0, 0,
+        endpoint->binary_msg ? PF_BINARY : 0, false, false };
+
+#if HAVE(BUILTIN_ENDPOINT)
+    /* the interpreter in this process gets the message as is */
+    if (endpoint->type == ET_BUILTIN) {
+        return builtin_conn_post(endpoint->conn, msg) ?
+            PCRDR_SC_INSUFFICIENT_STORAGE : PCRDR_SC_OK;
+    }
+#endif
+
+    if (serialize_message(msg, &stream) || stream.failed)
+        goto failed;
+
+    /* it is a small message; send it as a whole packet */
+    if (stream.nr_sent == 0 && !stream.counting) {
+        char *body = stream.chunk;
+
+        if (body == NULL)
+            return PCRDR_SC_INTERNAL_SERVER_ERROR;
+        return send_packet_to_endpoint(srv, endpoint, body, stream.len) ?
+            PCRDR_SC_IOERR : PCRDR_SC_OK;
+    }
+
+    if (stream.counting) {
+        /* serialize again with the size of the whole packet known */
+        stream.sz_packet = stream.sz_serialized;
+        stream.sz_serialized = 0;
+        stream.len = 0;
+        stream.counting = false;
+
+        if (serialize_message(msg, &stream) ||
+                stream.failed || stream.sz_serialized != stream.sz_packet)
+            goto failed;
+    }
+
+    if (the_srvcfg->accesslog) {
+        purc_log_info("Sending a packet (%u bytes in %d fragments) to @%s/%s/%s\n",
+                (unsigned)stream.sz_serialized, stream.nr_sent + 1,
+                endpoint->host_name, endpoint->app_name,
+                endpoint->runner_name);
+    }
+
+    if (send_stream_chunk(&stream, PF_LAST))
+        return PCRDR_SC_IOERR;
+    return PCRDR_SC_OK;
+
+failed:
+    if (stream.chunk)
+        free(stream.chunk);
+
+    /* the fragments sent can not be taken back */
+    if (stream.nr_sent > 0)
+        return PCRDR_SC_IOERR;
+
+    purc_log_error("Failed to serialize the message for @%s/%s/%s\n",
+            endpoint->host_name, endpoint->app_name, endpoint->runner_name);
+    return PCRDR_SC_INTERNAL_SERVER_ERROR;
+}
+
+int ping_endpoint_client(purcmc_server* srv, purcmc_endpoint* endpoint)
+{
+#if HAVE(IO_THREAD)
+    if (the_server.threaded) {
+        return post_io_command(IOC_PING, (IOProxy *)endpoint->entity.client,
+                0, NULL, 0);
+    }
+#endif
+
+    if (endpoint->type == ET_UNIX_SOCKET) {
+        return us_ping_client(srv->us_srv, (USClient *)endpoint->entity.client);
+    }
+    else if (endpoint->type == ET_WEB_SOCKET) {
+        return ws_ping_client(srv->ws_srv, (WSClient *)endpoint->entity.client);
+    }
+
+    return -1;
+}
+
+int close_endpoint_client(purcmc_server* srv, purcmc_endpoint* endpoint)
+{
+    /* the interpreter is told by the connection when the endpoint removed */
+    if (endpoint->type == ET_BUILTIN) {
+        remove_endpoint(endpoint);
+        return 0;
+    }
+
+#if HAVE(IO_THREAD)
+    if (the_server.threaded) {
+        return post_io_command(IOC_CLOSE, (IOProxy *)endpoint->entity.client,
+                0, NULL, 0);
+    }
+#endif
+
+    if (endpoint->type == ET_UNIX_SOCKET) {
+        return us_cleanup_client(srv->us_srv,
+                (USClient *)endpoint->entity.client);
+    }
+    else if (endpoint->type == ET_WEB_SOCKET) {
+        ws_cleanup_client(srv->ws_srv, (WSClient *)endpoint->entity.client);
+        return 0;
+    }
+
+    return -1;
+}
+
+int setup_endpoint_shm_ring(purcmc_server* srv, purcmc_endpoint* endpoint,
+        size_t size)
+{
+    if (endpoint->type != ET_UNIX_SOCKET)
+        return -1;
+
+#if HAVE(IO_THREAD)
+    /* the I/O thread sends the memfd before the response queued later */
+    if (the_server.threaded) {
+        return post_io_command(IOC_SHM_RING,
+                (IOProxy *)endpoint->entity.client, 0, NULL, size);
+    }
+#endif
+
+    return us_setup_shm_ring(srv->us_srv,
+            (USClient *)endpoint->entity.client, size);
+}
+
+#if HAVE(BUILTIN_ENDPOINT)
+// Handle the messages from an interpreter in this process within the budget
+// of its endpoint; the rest are left in the queue until it is resumed.
+static void
+dispatch_builtin_conn(BuiltinConn *conn)
+{
+    purcmc_endpoint *endpoint = conn->endpoint;
+    pcrdr_msg *msg;
+
+    while (builtin_conn_fetch(conn, &msg)) {
+        int ret;
+
+        if (msg == NULL) {
+            purc_log_info("The builtin endpoint closed: %p\n", endpoint);
+            remove_endpoint(endpoint);
+            return;
+        }
+
+        /* a message is not serialized; only the budget of messages applies */
+        if (!sched_admit(&the_server.sched, &endpoint->sched, 0)) {
+            builtin_conn_unfetch(conn, msg);
+            pause_endpoint_input(endpoint);
+            return;
+        }
+
+        ret = on_got_message(&the_server, endpoint, msg);
+        pcrdr_release_message(msg);
+        if (ret != PCRDR_SC_OK) {
+            purc_log_warn("Internal error after got a message: %d\n", ret);
+            remove_endpoint(endpoint);
+            return;
+        }
+    }
+}
+
+// Handle the messages from the interpreters in this process.
+static void
+dispatch_builtin_messages(void)
+{
+    BuiltinConn *conn, *tmp;
+    uint64_t count;
+
+    /* the eventfd of the I/O events has been cleared in the threaded mode */
+    if (the_server.builtin_efd >= 0 &&
+            read(the_server.builtin_efd, &count, sizeof(count)) < 0 &&
+            errno != EAGAIN) {
+        purc_log_error("Failed to read from eventfd: %s\n", strerror(errno));
+    }
+
+    list_for_each_entry_safe(conn, tmp, &the_server.builtins, link) {
+        /* dispatched when resumed after the next turn */
+        if (!conn->endpoint->sched.throttled)
+            dispatch_builtin_conn(conn);
+    }
+}
+
+// Get the eventfd to wake up the server for the builtin connections.
+static int
+builtin_wake_fd(void)
+{
+#if HAVE(IO_THREAD)
+    /* purcmc_rdrsrv_check() is called for the events of the I/O thread */
+    if (the_server.threaded)
+        return the_server.io_events.efd;
+#endif
+
+    if (the_server.builtin_efd >= 0)
+        return the_server.builtin_efd;
+
+    the_server.builtin_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (the_server.builtin_efd < 0) {
+        purc_log_error("Failed to create eventfd: %s\n", strerror(errno));
+        return -1;
+    }
+
+#if HAVE(SYS_EPOLL_H)
+    if (watch_socket(the_server.builtin_efd, PTR_FOR_BUILTINS))
+#else
+    if (listen_new_client(the_server.builtin_efd, PTR_FOR_BUILTINS, false))
+#endif
+    {
+        close(the_server.builtin_efd);
+        the_server.builtin_efd = -1;
+        return -1;
+    }
+
+    return the_server.builtin_efd;
+}
+
+purcmc_builtin_conn *purcmc_rdrsrv_new_builtin(purcmc_server *srv)
+{
+    purcmc_endpoint *endpoint;
+    BuiltinConn *conn;
+    int wake_fd;
+
+    if ((wake_fd = builtin_wake_fd()) < 0 ||
+            (conn = builtin_conn_new(wake_fd)) == NULL)
+        return NULL;
+
+    endpoint = new_endpoint(srv, ET_BUILTIN, conn);
+    if (endpoint == NULL) {
+        /* drop the references of both sides */
+        builtin_conn_detach(conn);
+        purcmc_builtin_conn_close(conn);
+        return NULL;
+    }
+
+    list_add_tail(&conn->link, &srv->builtins);
+    if (send_initial_response(srv, endpoint) != PCRDR_SC_OK) {
+        remove_endpoint(endpoint);
+        purcmc_builtin_conn_close(conn);
+        return NULL;
+    }
+
+    return conn;
+}
+#else
+purcmc_builtin_conn *purcmc_rdrsrv_new_builtin(purcmc_server *srv)
+{
+    (void)srv;
+    return NULL;
+}
+#endif /* HAVE(BUILTIN_ENDPOINT) */
+
+// Pause the input of an endpoint which ran out of its budget, until its
+// backlog is drained.
+static void
+pause_endpoint_input(purcmc_endpoint *endpoint)
+{
+    if (!sched_throttle(&the_server.sched, &endpoint->sched))
+        return;
+
+#if HAVE(BUILTIN_ENDPOINT)
+    /* the messages are left in the queue of the connection */
+    if (endpoint->type == ET_BUILTIN)
+        return;
+#endif
+
+#if HAVE(IO_THREAD)
+    if (the_server.threaded) {
+        post_io_command(IOC_PAUSE, (IOProxy *)endpoint->entity.client,
+                0, NULL, 0);
+        return;
+    }
+#endif
+
+    pause_client_input(endpoint->entity.client);
+}
+
+static void
+resume_endpoint_input(SchedEntity *entity, void *ctxt)
+{
+    purcmc_endpoint *endpoint = container_of(entity, purcmc_endpoint, sched);
+
+    (void)ctxt;
+#if HAVE(BUILTIN_ENDPOINT)
+    if (endpoint->type == ET_BUILTIN) {
+        dispatch_builtin_conn(endpoint->conn);
+        return;
+    }
+#endif
+
+#if HAVE(IO_THREAD)
+    if (the_server.threaded) {
+        post_io_command(IOC_RESUME, (IOProxy *)endpoint->entity.client,
+                0, NULL, 0);
+        return;
+    }
+#endif
+
+    resume_client_input(endpoint->entity.client);
+}
+
+static struct sigaction old_pipe_sa;
+
+static void
+sig_handler_ignore(int sig_number)
+{
+    if (sig_number == SIGINT) {
+        the_server.running = false;
+    }
+    else if (sig_number == SIGPIPE) {
+        if (old_pipe_sa.sa_handler) {
+            old_pipe_sa.sa_handler(sig_number);
+        }
+    }
+}
+
+static int
+setup_signal_pipe(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sig_handler_ignore;
+    sigemptyset(&sa.sa_mask);
+
+#if 0
+    if (sigaction(SIGPIPE, &sa, &old_pipe_sa) != 0) {
+        perror("sigaction()");
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+/* max events for epoll */
+#define MAX_EVENTS          10
+
+// Take over the listeners from the old server for a hot upgrade.
+static int
+adopt_listeners(int handoff_sock)
+{
+    HandoffRecord rec;
+    int fds[HANDOFF_MAX_FDS];
+
+    if (handoff_recv(handoff_sock, &rec, fds, HANDOFF_TIMEOUT))
+        goto failed;
+
+    if (rec.kind != HOR_LISTENERS || rec.nr_fds == 0) {
+        while (rec.nr_fds > 0)
+            close(fds[--rec.nr_fds]);
+        goto failed;
+    }
+
+    the_server.us_listener = the_server.us_srv->listener = fds[0];
+    if (rec.nr_fds > 1) {
+        if (the_server.ws_srv)
+            the_server.ws_listener = fds[1];
+        else
+            close(fds[1]);
+    }
+
+    return 0;
+
+failed:
+    purc_log_error("Failed to take over the listeners\n");
+    return -1;
+}
+
+static int
+prepare_server(int handoff_sock)
+{
+    the_server.us_listener = the_server.ws_listener = -1;
+    the_server.t_start = purc_get_monotoic_time();
+
+    if (handoff_sock >= 0) {
+        if (adopt_listeners(handoff_sock))
+            goto error;
+        purc_log_info("Took over the listeners from the old server\n");
+    }
+    // create unix socket
+    else if ((the_server.us_listener = us_listen(the_server.us_srv)) < 0) {
+        purc_log_error("Unable to listen on Unix socket (%s)\n",
+                the_srvcfg->unixsocket);
+        goto error;
+    }
+    purc_log_info("Listening on Unix Socket (%s)...\n", the_srvcfg->unixsocket);
+
+    the_server.us_srv->on_accepted = on_accepted;
+    the_server.us_srv->on_packet = on_packet;
+    the_server.us_srv->on_pending = on_pending;
+    the_server.us_srv->on_close = on_close;
+    the_server.us_srv->on_error = on_error;
+
+    // create web socket listener if enabled
+    if (the_server.ws_srv) {
+#if HAVE(LIBSSL)
+        if (the_srvcfg->sslcert && the_srvcfg->sslkey) {
+            purc_log_info("==Using TLS/SSL==\n");
+            the_srvcfg->use_ssl = 1;
+            if (ws_initialize_ssl_ctx(the_server.ws_srv)) {
                 purc_log_error("Unable to initialize_ssl_ctx\n");
                 goto error;
             }
@@ -347,362 +1334,782 @@ prepare_server(void)
         the_srvcfg->sslcert = the_srvcfg->sslkey = NULL;
 #endif
 
-        if ((the_server.ws_listener = ws_listen(the_server.ws_srv)) < 0) {
-            purc_log_error("Unable to listen on Web socket (%s, %s)\n",
-                    the_srvcfg->addr, the_srvcfg->port);
-            goto error;
-        }
+        if (the_server.ws_listener < 0 &&
+                (the_server.ws_listener = ws_listen(the_server.ws_srv)) < 0) {
+            purc_log_error("Unable to listen on Web socket (%s, %s)\n",
+                    the_srvcfg->addr, the_srvcfg->port);
+            goto error;
+        }
+
+        the_server.ws_srv->on_accepted = on_accepted;
+        the_server.ws_srv->on_packet = on_packet;
+        the_server.ws_srv->on_pending = on_pending;
+        the_server.ws_srv->on_close = on_close;
+        the_server.ws_srv->on_error = on_error;
+
+        purc_log_info("Listening on Web Socket (%s, %s) %s SSL...\n",
+                the_srvcfg->addr, the_srvcfg->port,
+                the_srvcfg->sslcert ? "with" : "without");
+    }
+
+#if HAVE(SYS_EPOLL_H)
+    the_server.epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (the_server.epollfd == -1) {
+        purc_log_error("Failed to call epoll_create1: %s\n", strerror(errno));
+        goto error;
+    }
+
+    if (watch_socket(the_server.us_listener, PTR_FOR_US_LISTENER)) {
+        purc_log_error("Failed to watch us_listener (%d)\n",
+                the_server.us_listener);
+        goto error;
+    }
+
+    if (the_server.ws_listener >= 0 &&
+            watch_socket(the_server.ws_listener, PTR_FOR_WS_LISTENER)) {
+        purc_log_error("Failed to watch ws_listener (%d)\n",
+                the_server.ws_listener);
+        goto error;
+    }
+
+    if (the_server.ws_srv && ws_handshake_fd(the_server.ws_srv) >= 0 &&
+            watch_socket(ws_handshake_fd(the_server.ws_srv),
+                PTR_FOR_WS_HANDSHAKES)) {
+        purc_log_error("Failed to watch the eventfd of TLS handshaker\n");
+        goto error;
+    }
+#elif HAVE(POLL_H)
+    listen_new_client(the_server.us_listener, PTR_FOR_US_LISTENER, FALSE);
+    if (the_server.ws_listener >= 0) {
+        listen_new_client(the_server.ws_listener, PTR_FOR_WS_LISTENER, FALSE);
+    }
+    if (the_server.ws_srv && ws_handshake_fd(the_server.ws_srv) >= 0) {
+        listen_new_client(ws_handshake_fd(the_server.ws_srv),
+                PTR_FOR_WS_HANDSHAKES, FALSE);
+    }
+#endif
+
+    return 0;
+
+error:
+    return -1;
+}
+
+// Stop watching the listeners handed off to the new server; called by the
+// thread handling the sockets. They are kept open until this server exits.
+static void
+unwatch_listeners(void)
+{
+#if HAVE(SYS_EPOLL_H)
+    unwatch_socket(the_server.us_listener);
+    if (the_server.ws_listener >= 0)
+        unwatch_socket(the_server.ws_listener);
+#elif HAVE(POLL_H)
+    remove_listening_client(the_server.us_listener);
+    if (the_server.ws_listener >= 0)
+        remove_listening_client(the_server.ws_listener);
+#endif
+}
+
+#if HAVE(SYS_EPOLL_H)
+#if HAVE(IO_THREAD)
+// Handle the commands posted by the main thread; return true for quitting.
+static bool
+handle_io_commands(void)
+{
+    IOMessage msg;
+
+    io_queue_clear(&the_server.io_commands);
+    while (io_queue_pop(&the_server.io_commands, &msg)) {
+        SockClient *client;
+
+        if (msg.type == IOC_QUIT) {
+            return true;
+        }
+        else if (msg.type == IOC_UNLISTEN) {
+            unwatch_listeners();
+            continue;
+        }
+        else if (msg.type == IOC_RELEASE) {
+            free(msg.proxy);
+            continue;
+        }
+
+        /* the client may have been closed by the I/O thread */
+        client = msg.proxy->entity.client;
+        if (client == NULL) {
+            if (msg.data)
+                free(msg.data);
+            continue;
+        }
+
+        switch (msg.type) {
+        case IOC_SEND:
+            /* the data are taken over by the send queue of the client */
+            if (client->ct == CT_UNIX_SOCKET) {
+                us_send_owned_packet(the_server.us_srv, (USClient *)client,
+                        msg.code ? US_OPCODE_BIN : US_OPCODE_TEXT,
+                        msg.data, msg.sz_data);
+            }
+            else {
+                ws_send_owned_packet(the_server.ws_srv, (WSClient *)client,
+                        msg.code ? WS_OPCODE_BIN : WS_OPCODE_TEXT,
+                        msg.data, msg.sz_data);
+            }
+            break;
+
+        case IOC_SEND_FRAGMENT:
+            send_fragment_to_client(client, msg.code, msg.sz_packet,
+                    msg.data, msg.sz_data);
+            break;
+
+        case IOC_SHM_RING:
+            if (client->ct == CT_UNIX_SOCKET)
+                us_setup_shm_ring(the_server.us_srv, (USClient *)client,
+                        msg.sz_data);
+            break;
+
+        case IOC_PING:
+            if (client->ct == CT_UNIX_SOCKET)
+                us_ping_client(the_server.us_srv, (USClient *)client);
+            else
+                ws_ping_client(the_server.ws_srv, (WSClient *)client);
+            break;
+
+        case IOC_PAUSE:
+            pause_client_input(client);
+            break;
+
+        case IOC_RESUME:
+            /* the client is freed on error */
+            resume_client_input(client);
+            break;
+
+        case IOC_CLOSE:
+            if (msg.code)
+                on_error(sock_server_of_client(client), client, msg.code);
+
+            if (client->ct == CT_UNIX_SOCKET)
+                us_cleanup_client(the_server.us_srv, (USClient *)client);
+            else
+                ws_cleanup_client(the_server.ws_srv, (WSClient *)client);
+            break;
+
+        default:
+            purc_log_error("Bad I/O command type: %d\n", msg.type);
+            break;
+        }
+    }
+
+    return false;
+}
+#endif /* HAVE(IO_THREAD) */
+
+// Watch the clients just accepted.
+static int
+watch_new_clients(SockClient **clients, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (watch_socket(clients[i]->fd, clients[i])) {
+            purc_log_error("Failed to watch connected %s socket (%d)\n",
+                    clients[i]->ct == CT_UNIX_SOCKET ? "unix" : "web",
+                    clients[i]->fd);
+            /* the rest of the batch are never watched */
+            close_new_clients(clients + i, n - i);
+            break;
+        }
+    }
+
+    return (i == n) ? 0 : -1;
+}
+
+static int
+handle_socket_event(void *ptr, uint32_t events)
+{
+#if HAVE(IO_THREAD)
+    if (ptr == PTR_FOR_IO_COMMANDS) {
+        if (handle_io_commands())
+            the_server.io_quitting = true;
+    }
+    else
+#endif
+#if HAVE(BUILTIN_ENDPOINT)
+    if (ptr == PTR_FOR_BUILTINS) {
+        dispatch_builtin_messages();
+    }
+    else
+#endif
+    if (ptr == PTR_FOR_US_LISTENER) {
+        USClient *clients[SZ_ACCEPT_BATCH];
+        int n;
+
+        /* drain the backlog */
+        do {
+            n = us_handle_accepts(the_server.us_srv, clients, SZ_ACCEPT_BATCH);
+            if (watch_new_clients((SockClient **)clients, n))
+                goto error;
+        } while (n == SZ_ACCEPT_BATCH);
+    }
+    else if (ptr == PTR_FOR_WS_LISTENER) {
+        WSClient *clients[SZ_ACCEPT_BATCH];
+        int n;
+
+        /* drain the backlog */
+        do {
+            n = ws_handle_accepts(the_server.ws_srv, the_server.ws_listener,
+                    clients, SZ_ACCEPT_BATCH);
+            if (watch_new_clients((SockClient **)clients, n))
+                goto error;
+        } while (n == SZ_ACCEPT_BATCH);
+    }
+    else if (ptr == PTR_FOR_WS_HANDSHAKES) {
+        WSClient *clients[SZ_ACCEPT_BATCH];
+        int n;
+
+        do {
+            n = ws_handle_handshakes(the_server.ws_srv,
+                    clients, SZ_ACCEPT_BATCH);
+            if (watch_new_clients((SockClient **)clients, n))
+                goto error;
+        } while (n == SZ_ACCEPT_BATCH);
+    }
+    else {
+        USClient *usc = (USClient *)ptr;
+        if (usc->ct == CT_UNIX_SOCKET) {
+
+            if (events & EPOLLIN) {
+                refresh_client_living_time((SockClient *)usc);
+                /* the client is freed if returns non-zero */
+                if (us_handle_reads(the_server.us_srv, usc))
+                    return 0;
+            }
+
+            if (events & EPOLLOUT) {
+                /* the client is freed if returns non-zero */
+                if (us_handle_writes(the_server.us_srv, usc) == 0 &&
+                        !(usc->status & US_SENDING) &&
+                        !(usc->status & US_CLOSE)) {
+                    if (update_socket_writable(usc->fd, usc, false))
+                        goto error;
+                }
+            }
+        }
+        else if (usc->ct == CT_WEB_SOCKET) {
+            WSClient *wsc = (WSClient *)ptr;
+
+            if (events & EPOLLIN) {
+                refresh_client_living_time((SockClient *)wsc);
+                ws_handle_reads(the_server.ws_srv, wsc);
+            }
+
+            if (events & EPOLLOUT) {
+                ws_handle_writes(the_server.ws_srv, wsc);
+
+                if (!(wsc->status & WS_SENDING) && !(wsc->status & WS_CLOSE)) {
+                    if (update_socket_writable(wsc->fd, wsc, false))
+                        goto error;
+                }
+            }
+        }
+        else {
+            purc_log_error("Bad socket type (%d): %s\n",
+                    usc->ct, strerror(errno));
+            goto error;
+        }
+    }
+
+    return 0;
+
+error:
+    return -1;
+}
+
+static int
+epoll_dispatch_events(bool wait)
+{
+    int nfds, n;
+    struct epoll_event events[MAX_EVENTS];
+
+again:
+    nfds = epoll_wait(the_server.epollfd, events, MAX_EVENTS, wait ? -1 : 0);
+    if (nfds < 0) {
+        if (errno == EINTR) {
+            goto again;
+        }
+
+        purc_log_error("Failed to call epoll_wait: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (n = 0; n < nfds; ++n) {
+        if (handle_socket_event(events[n].data.ptr, events[n].events))
+            return -1;
+    }
+
+    return nfds;
+}
+
+// Hold the data sent while handling a batch of events in the gather
+// queues of the clients, and flush them with one writev() per client.
+static inline void
+cork_sockets(void)
+{
+    us_cork(the_server.us_srv);
+    if (the_server.ws_srv)
+        ws_cork(the_server.ws_srv);
+}
+
+static inline void
+uncork_sockets(void)
+{
+    us_uncork(the_server.us_srv);
+    if (the_server.ws_srv)
+        ws_uncork(the_server.ws_srv);
+}
+
+// Handle the ready sockets; returns the number of events, or -1 on error.
+static int
+dispatch_socket_events(bool wait)
+{
+    int nfds;
+
+    cork_sockets();
+    nfds = epoll_dispatch_events(wait);
+    uncork_sockets();
+
+    return nfds;
+}
+
+bool purcmc_rdrsrv_check(purcmc_server *srv)
+{
+    bool ok = true;
+
+    /* serve the deferred packets first within the budgets of this turn */
+    sched_run_turn(&srv->sched, handle_deferred_packet, NULL);
+    sched_resume_drained(&srv->sched, resume_endpoint_input, NULL);
+
+#if HAVE(IO_THREAD)
+    if (the_server.threaded) {
+        dispatch_io_events();
+        /* the builtin connections wake up the server via `io_events` */
+        dispatch_builtin_messages();
+    }
+    else
+#endif
+        ok = dispatch_socket_events(false) >= 0;
+
+    /* the timers fire on time even if the server is always busy */
+    check_endpoint_timers(srv);
+    return ok;
+}
 
-        the_server.ws_srv->on_accepted = on_accepted;
-        the_server.ws_srv->on_packet = on_packet;
-        the_server.ws_srv->on_pending = on_pending;
-        the_server.ws_srv->on_close = on_close;
-        the_server.ws_srv->on_error = on_error;
+#if HAVE(IO_THREAD)
+static void *
+io_thread_main(void *arg)
+{
+    (void)arg;
 
-        purc_log_info("Listening on Web Socket (%s, %s) %s SSL...\n",
-                the_srvcfg->addr, the_srvcfg->port,
-                the_srvcfg->sslcert ? "with" : "without");
+    /* a PurC instance for logging in this thread */
+    purc_init_ex(PURC_MODULE_UTILS,
+            the_srvcfg->app_name ? the_srvcfg->app_name : SERVER_APP_NAME,
+            SERVER_IO_RUNNER_NAME, NULL);
+    purc_enable_log(true, false);
+
+    while (!the_server.io_quitting) {
+        if (dispatch_socket_events(true) < 0)
+            break;
+
+        /* wake up the main thread once for a batch of events */
+        io_queue_notify(&the_server.io_events);
     }
 
-#if HAVE(SYS_EPOLL_H)
-    the_server.epollfd = epoll_create1(EPOLL_CLOEXEC);
-    if (the_server.epollfd == -1) {
-        purc_log_error("Failed to call epoll_create1: %s\n", strerror(errno));
-        goto error;
+    purc_log_info("The socket I/O thread exits\n");
+    purc_cleanup();
+    return NULL;
+}
+
+static void
+set_socket_callbacks(bool threaded)
+{
+    the_server.us_srv->on_accepted = threaded ? io_on_accepted : on_accepted;
+    the_server.us_srv->on_packet = threaded ? io_on_packet : on_packet;
+    the_server.us_srv->on_mapped_packet = threaded ? io_on_mapped_packet : NULL;
+    the_server.us_srv->on_close = threaded ? io_on_close : on_close;
+
+    if (the_server.ws_srv) {
+        the_server.ws_srv->on_accepted = threaded ? io_on_accepted : on_accepted;
+        the_server.ws_srv->on_packet = threaded ? io_on_packet : on_packet;
+        the_server.ws_srv->on_close = threaded ? io_on_close : on_close;
     }
+}
 
-    ev.events = EPOLLIN;
-    ev.data.ptr = PTR_FOR_US_LISTENER;
-    if (epoll_ctl(the_server.epollfd, EPOLL_CTL_ADD, the_server.us_listener, &ev) == -1) {
-        purc_log_error("Failed to call epoll_ctl with us_listener (%d): %s\n",
-                the_server.us_listener, strerror(errno));
+static int
+start_io_thread(void)
+{
+    if (io_queue_init(&the_server.io_events) ||
+            io_queue_init(&the_server.io_commands)) {
         goto error;
     }
 
-    if (the_server.ws_listener >= 0) {
-        ev.events = EPOLLIN;
-        ev.data.ptr = PTR_FOR_WS_LISTENER;
-        if (epoll_ctl(the_server.epollfd, EPOLL_CTL_ADD, the_server.ws_listener, &ev) == -1) {
-            purc_log_error("Failed to call epoll_ctl with ws_listener (%d): %s\n",
-                    the_server.ws_listener, strerror(errno));
-            goto error;
-        }
+    if (watch_socket(the_server.io_commands.efd, PTR_FOR_IO_COMMANDS)) {
+        purc_log_error("Failed to watch the eventfd (%d)\n",
+                the_server.io_commands.efd);
+        goto error;
     }
-#elif HAVE(SYS_SELECT_H)
-    listen_new_client(the_server.us_listener, PTR_FOR_US_LISTENER, FALSE);
-    if (the_server.ws_listener >= 0) {
-        listen_new_client(the_server.ws_listener, PTR_FOR_WS_LISTENER, FALSE);
+
+    set_socket_callbacks(true);
+    the_server.threaded = true;
+    the_server.io_quitting = false;
+    if (pthread_create(&the_server.io_thread, NULL, io_thread_main, NULL)) {
+        purc_log_error("Failed to create the socket I/O thread\n");
+        set_socket_callbacks(false);
+        the_server.threaded = false;
+        goto error;
     }
-#endif
 
+    purc_log_info("Handling sockets in a dedicated I/O thread\n");
     return 0;
 
 error:
+    io_queue_destroy(&the_server.io_events);
+    io_queue_destroy(&the_server.io_commands);
     return -1;
 }
 
-#if HAVE(SYS_EPOLL_H)
-bool purcmc_rdrsrv_check(purcmc_server *srv)
+static void
+attach_endpoint_client(purcmc_endpoint *endpoint)
 {
-    int nfds, n;
-    struct epoll_event ev, events[MAX_EVENTS];
+    IOProxy *proxy = (IOProxy *)endpoint->entity.client;
+
+    if (proxy) {
+        endpoint->entity.client = proxy->entity.client;
+        /* the I/O thread stopped watching a client paused */
+        endpoint->entity.paused = proxy->entity.paused;
+        if (endpoint->entity.client)
+            endpoint->entity.client->entity = &endpoint->entity;
+        free(proxy);
+    }
+}
 
-    (void)srv;
+// Stop the I/O thread and give the clients back to the main thread.
+static void
+stop_io_thread(void)
+{
+    IOMessage msg;
+    purcmc_endpoint *endpoint;
+    unsigned i;
+
+    post_io_command(IOC_QUIT, NULL, 0, NULL, 0);
+    pthread_join(the_server.io_thread, NULL);
+    the_server.threaded = false;
+    set_socket_callbacks(false);
+
+    while (io_queue_pop(&the_server.io_events, &msg)) {
+        IOProxy *proxy = msg.proxy;
+
+        switch (msg.type) {
+        case IOE_ACCEPTED:
+            /* if closed already, the proxy is freed for IOE_CLOSED */
+            if (proxy->entity.client) {
+                SockClient *client = proxy->entity.client;
+
+                client->entity = NULL;
+                if (client->ct == CT_UNIX_SOCKET)
+                    us_cleanup_client(the_server.us_srv, (USClient *)client);
+                else
+                    ws_cleanup_client(the_server.ws_srv, (WSClient *)client);
+                free(proxy);
+            }
+            break;
 
-again:
-    nfds = epoll_wait(the_server.epollfd, events, MAX_EVENTS, 0);
-    if (nfds < 0) {
-        if (errno == EINTR) {
-            goto again;
+        case IOE_PACKET:
+            io_message_free_data(&msg);
+            break;
+
+        case IOE_CLOSED:
+            remove_client_endpoint(&proxy->client);
+            free(proxy);
+            break;
+
+        default:
+            break;
         }
+    }
 
-        purc_log_error("Failed to call epoll_wait: %s\n", strerror(errno));
-        goto error;
+    ep_table_for_each(&the_server.endpoint_table, i, endpoint) {
+        attach_endpoint_client(endpoint);
     }
-    else if (nfds == 0) {
-        the_server.t_elapsed = purc_get_monotoic_time() - the_server.t_start;
-        if (the_server.t_elapsed != the_server.t_elapsed_last) {
-            if (the_server.t_elapsed % 10 == 0) {
-                check_no_responding_endpoints(&the_server);
-            }
-            else if (the_server.t_elapsed % 5 == 0) {
-                check_dangling_endpoints(&the_server);
-            }
 
-            the_server.t_elapsed_last = the_server.t_elapsed;
-        }
+    list_for_each_entry(endpoint, &the_server.dangling_endpoints, dangling) {
+        attach_endpoint_client(endpoint);
     }
 
-    for (n = 0; n < nfds; ++n) {
-        if (events[n].data.ptr == PTR_FOR_US_LISTENER) {
-            USClient * client = us_handle_accept(the_server.us_srv);
-            if (client == NULL) {
-                purc_log_info("Refused a client\n");
-            }
-            else {
-                ev.events = EPOLLIN; /* do not use EPOLLET */
-                ev.data.ptr = client;
-                if (epoll_ctl(the_server.epollfd,
-                            EPOLL_CTL_ADD, client->fd, &ev) == -1) {
-                    purc_log_error("Failed epoll_ctl for connected unix socket (%d): %s\n",
-                            client->fd, strerror(errno));
-                    goto error;
+    io_queue_destroy(&the_server.io_events);
+    io_queue_destroy(&the_server.io_commands);
+}
+#endif /* HAVE(IO_THREAD) */
+
+#elif HAVE(POLL_H)
+
+/* A socket ready when poll() returned */
+typedef struct ReadySocket_ {
+    int     fd;
+    short   revents;
+    void   *ptr;
+} ReadySocket;
+
+// Look up the slot of a ready socket again; NULL if it was closed, or the
+// fd was reused, when handling the sockets before. The slots and pollfds
+// may move when a socket is watched or unwatched by the handlers.
+static PollSlot *
+ready_socket_slot(const ReadySocket *ready)
+{
+    PollSlot *slot = client_table_slot(&the_server.fd2clients, ready->fd, false);
+
+    if (slot == NULL || slot->ptr != ready->ptr)
+        return NULL;
+    return slot;
+}
+
+static bool
+handle_ready_socket(const ReadySocket *ready)
+{
+    PollSlot *slot;
+
+    if (ready_socket_slot(ready) == NULL)
+        return true;
+
+    if (ready->revents & (POLLIN | POLLHUP | POLLERR)) {
+#if HAVE(BUILTIN_ENDPOINT)
+        if (ready->ptr == PTR_FOR_BUILTINS) {
+            dispatch_builtin_messages();
+        }
+        else
+#endif
+        if (ready->ptr == PTR_FOR_US_LISTENER) {
+            USClient *clients[SZ_ACCEPT_BATCH];
+            int i, n;
+
+            do {
+                n = us_handle_accepts(the_server.us_srv, clients, SZ_ACCEPT_BATCH);
+                for (i = 0; i < n; i++) {
+                    if (listen_new_client(clients[i]->fd, clients[i], FALSE)) {
+                        purc_log_error("Failed to watch connected unix socket (%d): %s\n",
+                                clients[i]->fd, strerror(errno));
+                        /* the rest of the batch are never watched */
+                        close_new_clients((SockClient **)clients + i, n - i);
+                        return false;
+                    }
                 }
-            }
+            } while (n == SZ_ACCEPT_BATCH);
         }
-        else if (events[n].data.ptr == PTR_FOR_WS_LISTENER) {
-            WSClient * client = ws_handle_accept(the_server.ws_srv,
-                    the_server.ws_listener);
-            if (client == NULL) {
-                purc_log_info("Refused a client\n");
-            }
-            else {
-                ev.events = EPOLLIN; /* do not use EPOLLET */
-                ev.data.ptr = client;
-                if (epoll_ctl(the_server.epollfd,
-                            EPOLL_CTL_ADD, client->fd, &ev) == -1) {
-                    purc_log_error("Failed epoll_ctl for connected web socket (%d): %s\n",
-                            client->fd, strerror(errno));
-                    goto error;
+        else if (ready->ptr == PTR_FOR_WS_LISTENER) {
+            WSClient *clients[SZ_ACCEPT_BATCH];
+            int i, n;
+
+            do {
+                n = ws_handle_accepts(the_server.ws_srv, the_server.ws_listener,
+                        clients, SZ_ACCEPT_BATCH);
+                for (i = 0; i < n; i++) {
+                    if (listen_new_client(clients[i]->fd, clients[i], FALSE)) {
+                        purc_log_error("Failed to watch connected web socket (%d): %s\n",
+                                clients[i]->fd, strerror(errno));
+                        /* the rest of the batch are never watched */
+                        close_new_clients((SockClient **)clients + i, n - i);
+                        return false;
+                    }
                 }
-            }
+            } while (n == SZ_ACCEPT_BATCH);
+        }
+        else if (ready->ptr == PTR_FOR_WS_HANDSHAKES) {
+            WSClient *clients[SZ_ACCEPT_BATCH];
+            int i, n;
+
+            do {
+                n = ws_handle_handshakes(the_server.ws_srv,
+                        clients, SZ_ACCEPT_BATCH);
+                for (i = 0; i < n; i++) {
+                    if (listen_new_client(clients[i]->fd, clients[i], FALSE)) {
+                        purc_log_error("Failed to watch handshaken web socket (%d): %s\n",
+                                clients[i]->fd, strerror(errno));
+                        /* the rest of the batch are never watched */
+                        close_new_clients((SockClient **)clients + i, n - i);
+                        return false;
+                    }
+                }
+            } while (n == SZ_ACCEPT_BATCH);
         }
         else {
-            USClient *usc = (USClient *)events[n].data.ptr;
+            USClient *usc = (USClient *)ready->ptr;
             if (usc->ct == CT_UNIX_SOCKET) {
+                refresh_client_living_time((SockClient *)usc);
 
-                if (events[n].events & EPOLLIN) {
+                us_handle_reads(the_server.us_srv, usc);
+            }
+            else if (usc->ct == CT_WEB_SOCKET) {
+                WSClient *wsc = (WSClient *)ready->ptr;
+                refresh_client_living_time((SockClient *)wsc);
 
-                    if (usc->entity) {
-                        purcmc_endpoint *endpoint = container_of(usc->entity,
-                                purcmc_endpoint, entity);
-                        update_endpoint_living_time(&the_server, endpoint);
-                    }
+                ws_handle_reads(the_server.ws_srv, wsc);
+            }
+            else {
+                purc_log_error("Bad socket type (%d): %s\n",
+                        usc->ct, strerror(errno));
+                return false;
+            }
+        }
 
-                    us_handle_reads(the_server.us_srv, usc);
-                }
+        /* the client may be closed when handling the reads */
+        if (ready_socket_slot(ready) == NULL)
+            return true;
+    }
 
-                if (events[n].events & EPOLLOUT) {
-                    us_handle_writes(the_server.us_srv, usc);
-
-                    if (!(usc->status & US_SENDING) && !(usc->status & US_CLOSE)) {
-                        ev.events = EPOLLIN;
-                        ev.data.ptr = usc;
-                        if (epoll_ctl(the_server.epollfd,
-                                    EPOLL_CTL_MOD, usc->fd, &ev) == -1) {
-                            purc_log_error("Failed epoll_ctl for unix socket (%d): %s\n",
-                                    usc->fd, strerror(errno));
-                            goto error;
-                        }
-                    }
+    if (ready->revents & POLLOUT) {
+        if (ready->ptr == PTR_FOR_US_LISTENER ||
+                ready->ptr == PTR_FOR_WS_LISTENER ||
+                ready->ptr == PTR_FOR_WS_HANDSHAKES) {
+            assert(0);
+        }
+        else {
+            USClient *usc = (USClient *)ready->ptr;
+            if (usc->ct == CT_UNIX_SOCKET) {
+                us_handle_writes(the_server.us_srv, usc);
+
+                if ((slot = ready_socket_slot(ready)) &&
+                        !(usc->status & US_SENDING) &&
+                        !(usc->status & US_CLOSE)) {
+                    the_server.pollfds[slot->index].events &= ~POLLOUT;
                 }
             }
             else if (usc->ct == CT_WEB_SOCKET) {
-                WSClient *wsc = (WSClient *)events[n].data.ptr;
+                WSClient *wsc = (WSClient *)ready->ptr;
+                ws_handle_writes(the_server.ws_srv, wsc);
 
-                if (events[n].events & EPOLLIN) {
-                    if (wsc->entity) {
-                        purcmc_endpoint *endpoint = container_of(usc->entity,
-                                purcmc_endpoint, entity);
-                        update_endpoint_living_time(&the_server, endpoint);
-                    }
-
-                    ws_handle_reads(the_server.ws_srv, wsc);
-                }
-
-                if (events[n].events & EPOLLOUT) {
-                    ws_handle_writes(the_server.ws_srv, wsc);
-
-                    if (!(wsc->status & WS_SENDING) && !(wsc->status & WS_CLOSE)) {
-                        ev.events = EPOLLIN;
-                        ev.data.ptr = wsc;
-                        if (epoll_ctl(the_server.epollfd,
-                                    EPOLL_CTL_MOD, wsc->fd, &ev) == -1) {
-                            purc_log_error("Failed epoll_ctl for web socket (%d): %s\n",
-                                    usc->fd, strerror(errno));
-                            goto error;
-                        }
-                    }
+                if ((slot = ready_socket_slot(ready)) &&
+                        !(wsc->status & WS_SENDING) &&
+                        !(wsc->status & WS_CLOSE)) {
+                    the_server.pollfds[slot->index].events &= ~POLLOUT;
                 }
             }
-            else {
-                purc_log_error("Bad socket type (%d): %s\n",
-                        usc->ct, strerror(errno));
-                goto error;
-            }
         }
     }
 
     return true;
-
-error:
-    return false;
 }
 
-#elif HAVE(SYS_SELECT_H)
-
 bool purcmc_rdrsrv_check(purcmc_server *srv)
 {
     int retval;
-    fd_set rset, wset;
-    fd_set* rsetptr = NULL;
-    fd_set* wsetptr = NULL;
-    fd_set* esetptr = NULL;
-    struct timeval sel_timeout = { 0, 0 };
+    unsigned i, nr_ready = 0;
+    ReadySocket *ready;
 
-    /* a fdset got modified each time around */
-    FD_COPY(&the_server.rfdset, &rset);
-    rsetptr = &rset;
-
-    FD_COPY(&the_server.wfdset, &wset);
-    wsetptr = &wset;
+    /* serve the deferred packets first within the budgets of this turn */
+    sched_run_turn(&srv->sched, handle_deferred_packet, NULL);
+    sched_resume_drained(&srv->sched, resume_endpoint_input, NULL);
 
 again:
-    if ((retval = select(the_server.maxfd + 1,
-            rsetptr, wsetptr, esetptr, &sel_timeout)) < 0) {
-        /* no event. */
+    if ((retval = poll(the_server.pollfds, the_server.nr_pollfds, 0)) < 0) {
         if (errno == EINTR) {
             goto again;
         }
 
-        purc_log_error("unexpected error of select(): %m\n");
+        purc_log_error("unexpected error of poll(): %m\n");
         goto error;
     }
-    else if (retval == 0) {
-        the_server.t_elapsed = purc_get_monotoic_time() - the_server.t_start;
-        if (the_server.t_elapsed != the_server.t_elapsed_last) {
-            if (the_server.t_elapsed % 10 == 0) {
-                check_no_responding_endpoints(&the_server);
-            }
-            else if (the_server.t_elapsed % 5 == 0) {
-                check_dangling_endpoints(&the_server);
-            }
-
-            the_server.t_elapsed_last = the_server.t_elapsed;
-        }
-    }
-    else {
-        size_t i, nr_fds = sorted_array_count(the_server.fd2clients);
-        int *fds = alloca(sizeof(int) * nr_fds);
-
-        for (i = 0; i < nr_fds; i++) {
-            fds[i] = (int)(intptr_t)sorted_array_get(the_server.fd2clients, i, NULL);
+    else if (retval > 0) {
+        /* handling a socket may add or remove the entries of pollfds */
+        ready = alloca(sizeof(ReadySocket) * retval);
+        for (i = 0; i < the_server.nr_pollfds && nr_ready < (unsigned)retval;
+                i++) {
+            struct pollfd *pfd = the_server.pollfds + i;
+            PollSlot *slot;
+
+            if (pfd->revents == 0)
+                continue;
+
+            slot = client_table_slot(&the_server.fd2clients, pfd->fd, false);
+            ready[nr_ready].fd = pfd->fd;
+            ready[nr_ready].revents = pfd->revents;
+            ready[nr_ready].ptr = slot->ptr;
+            nr_ready++;
         }
 
-        for (i = 0; i < nr_fds; i++) {
-            int fd = fds[i];
-            void *cli_node;
-
-            if (FD_ISSET(fd, rsetptr)) {
-                sorted_array_find(the_server.fd2clients, (void *)(intptr_t)fd, &cli_node);
-                if (cli_node == PTR_FOR_US_LISTENER) {
-                    USClient * client = us_handle_accept(the_server.us_srv);
-                    if (client == NULL) {
-                        purc_log_info("Refused a client\n");
-                    }
-                    else if (listen_new_client(client->fd, client, FALSE)) {
-                        purc_log_error("Failed epoll_ctl for connected unix socket (%d): %s\n",
-                                client->fd, strerror(errno));
-                        goto error;
-                    }
-                }
-                else if (cli_node == PTR_FOR_WS_LISTENER) {
-                    WSClient * client = ws_handle_accept(the_server.ws_srv, the_server.ws_listener);
-                    if (client == NULL) {
-                        purc_log_info("Refused a client\n");
-                    }
-                    else if (listen_new_client(client->fd, client, FALSE)) {
-                        purc_log_error("Failed epoll_ctl for connected web socket (%d): %s\n",
-                                client->fd, strerror(errno));
-                        goto error;
-                    }
-                }
-                else {
-                    USClient *usc = (USClient *)cli_node;
-                    if (usc->ct == CT_UNIX_SOCKET) {
-                        if (usc->entity) {
-                            purcmc_endpoint *endpoint = container_of(usc->entity,
-                                    purcmc_endpoint, entity);
-                            update_endpoint_living_time(&the_server, endpoint);
-                        }
-
-                        us_handle_reads(the_server.us_srv, usc);
-                    }
-                    else if (usc->ct == CT_WEB_SOCKET) {
-                        WSClient *wsc = (WSClient *)cli_node;
-                        if (wsc->entity) {
-                            purcmc_endpoint *endpoint = container_of(usc->entity,
-                                    purcmc_endpoint, entity);
-                            update_endpoint_living_time(&the_server, endpoint);
-                        }
-
-                        ws_handle_reads(the_server.ws_srv, wsc);
-                    }
-                    else {
-                        purc_log_error("Bad socket type (%d): %s\n",
-                                usc->ct, strerror(errno));
-                        goto error;
-                    }
-                }
-            }
-
-            if (FD_ISSET(fd, wsetptr)) {
-                if (cli_node == PTR_FOR_US_LISTENER ||
-                        cli_node == PTR_FOR_WS_LISTENER) {
-                    assert(0);
-                }
-                else {
-                    USClient *usc = (USClient *)cli_node;
-                    if (usc->ct == CT_UNIX_SOCKET) {
-                        us_handle_writes(the_server.us_srv, usc);
-
-                        if (!(usc->status & US_SENDING) &&
-                                !(usc->status & US_CLOSE)) {
-                            FD_CLR(fd, &the_server.wfdset);
-                        }
-                    }
-                    else if (usc->ct == CT_WEB_SOCKET) {
-                        WSClient *wsc = (WSClient *)cli_node;
-                        ws_handle_writes(the_server.ws_srv, wsc);
-
-                        if (!(wsc->status & WS_SENDING) &&
-                                !(wsc->status & WS_CLOSE)) {
-                            FD_CLR(fd, &the_server.wfdset);
-                        }
-                    }
-                }
-            }
+        for (i = 0; i < nr_ready; i++) {
+            if (!handle_ready_socket(ready + i))
+                goto error;
         }
     }
 
+    check_endpoint_timers(srv);
     return true;
 
 error:
     return false;
 }
 
-#endif /* HAVE(SYS_SELECT_H) */
+#endif /* HAVE(POLL_H) */
 
-static int
-comp_living_time(const void *k1, const void *k2, void *ptr)
+int purcmc_rdrsrv_get_fd(purcmc_server *srv)
+{
+#if HAVE(IO_THREAD)
+    if (srv->threaded)
+        return srv->io_events.efd;
+#endif
+
+#if HAVE(SYS_EPOLL_H)
+    /* the epoll fd becomes readable when any fd in its interest list is ready */
+    return srv->epollfd;
+#else
+    (void)srv;
+    return -1;
+#endif
+}
+
+bool purcmc_rdrsrv_check_endpoints(purcmc_server *srv)
+{
+    check_endpoint_timers(srv);
+    return true;
+}
+
+bool purcmc_rdrsrv_has_deferred(purcmc_server *srv)
 {
-    const purcmc_endpoint *e1 = k1;
-    const purcmc_endpoint *e2 = k2;
+    /* the throttled endpoints drained will be resumed after the next turn */
+    return srv->sched.stats.nr_backlog > 0 || !list_empty(&srv->sched.drained);
+}
 
-    (void)ptr;
-    return e1->t_living - e2->t_living;
+void purcmc_rdrsrv_get_sched_stats(purcmc_server *srv,
+        purcmc_sched_stats *stats)
+{
+    *stats = srv->sched.stats;
 }
 
-#if !HAVE(SYS_EPOLL_H) && HAVE(SYS_SELECT_H)
-static int
-intcmp(const void *sortv1, const void *sortv2)
+// Raise the soft limit of the open files to serve the clients of both
+// transports; it is capped by the hard limit.
+static void
+raise_nofile_limit(int max_clients)
 {
-    int fd1 = (int)(intptr_t)sortv1;
-    int fd2 = (int)(intptr_t)sortv2;
+    struct rlimit rlim;
+    rlim_t wanted = (rlim_t)max_clients * 2 + 64;
+
+    if (getrlimit(RLIMIT_NOFILE, &rlim) || rlim.rlim_cur >= wanted)
+        return;
+
+    if (rlim.rlim_max != RLIM_INFINITY && rlim.rlim_max < wanted)
+        wanted = rlim.rlim_max;
 
-    return fd1 - fd2;
+    rlim.rlim_cur = wanted;
+    if (setrlimit(RLIMIT_NOFILE, &rlim)) {
+        purc_log_warn("Failed to raise the limit of open files to %lu: %s\n",
+                (unsigned long)wanted, strerror(errno));
+    }
+    else if (wanted < (rlim_t)max_clients * 2 + 64) {
+        purc_log_warn("The limit of open files (%lu) may be less than "
+                "needed by %d clients of each transport\n",
+                (unsigned long)wanted, max_clients);
+    }
 }
-#endif
 
 static int
 init_server(void)
@@ -722,15 +2129,11 @@ init_server(void)
 
     purc_enable_log(true, false);
 
-#if !HAVE(SYS_EPOLL_H) && HAVE(SYS_SELECT_H)
-    the_server.maxfd = -1;
-    the_server.fd2clients = sorted_array_create(SAFLAG_DEFAULT, 4, NULL,
-            intcmp);
-    if (the_server.fd2clients == NULL)
-        return -1;
-
-    FD_ZERO(&the_server.rfdset);
-    FD_ZERO(&the_server.wfdset);
+#if !HAVE(SYS_EPOLL_H) && HAVE(POLL_H)
+    the_server.pollfds = NULL;
+    the_server.nr_pollfds = 0;
+    the_server.sz_pollfds = 0;
+    client_table_init(&the_server.fd2clients, sizeof(PollSlot));
 #endif
 
     if (the_srvcfg->unixsocket == NULL) {
@@ -753,13 +2156,38 @@ init_server(void)
         the_srvcfg->backlog = SOMAXCONN;
     }
 
+    if (the_srvcfg->deflate_threshold <= 0) {
+        the_srvcfg->deflate_threshold = WS_DEFLATE_THRESHOLD;
+    }
+
+    if (the_srvcfg->max_clients <= 0) {
+        the_srvcfg->max_clients = DEF_MAX_CLIENTS_EACH;
+    }
+
+    if (the_srvcfg->sched_msgs <= 0) {
+        the_srvcfg->sched_msgs = SCHED_DEF_BUDGET_MSGS;
+    }
+
+    if (the_srvcfg->sched_bytes <= 0) {
+        the_srvcfg->sched_bytes = SCHED_DEF_BUDGET_BYTES;
+    }
+    sched_init(&the_server.sched, the_srvcfg->sched_msgs,
+            the_srvcfg->sched_bytes);
+    raise_nofile_limit(the_srvcfg->max_clients);
+
     the_server.nr_endpoints = 0;
     the_server.running = true;
 
     /* TODO for host name */
     the_server.server_name = strdup(PCRDR_LOCALHOST);
-    kvlist_init(&the_server.endpoint_list, NULL);
-    avl_init(&the_server.living_avl, comp_living_time, true, NULL);
+    if (!ep_table_init(&the_server.endpoint_table))
+        return -1;
+    list_head_init(&the_server.dangling_endpoints);
+    timer_wheel_init(&the_server.timers, purc_get_monotoic_time());
+#if HAVE(BUILTIN_ENDPOINT)
+    list_head_init(&the_server.builtins);
+    the_server.builtin_efd = -1;
+#endif
 
     return 0;
 }
@@ -767,15 +2195,50 @@ init_server(void)
 static void
 deinit_server(void)
 {
-    const char* name;
-    void *next, *data;
+    EndpointTable *table = &the_server.endpoint_table;
     purcmc_endpoint *endpoint, *tmp;
+    unsigned i;
+
+#if HAVE(BUILTIN_ENDPOINT)
+    BuiltinConn *conn, *tmp_conn;
+
+    /* the interpreters never write the eventfd after the connections
+       were detached when removing the endpoints */
+    list_for_each_entry_safe(conn, tmp_conn, &the_server.builtins, link) {
+        remove_endpoint(conn->endpoint);
+    }
+
+    if (the_server.builtin_efd >= 0) {
+        close(the_server.builtin_efd);
+        the_server.builtin_efd = -1;
+    }
+#endif
+
+#if HAVE(IO_THREAD)
+    if (the_server.threaded)
+        stop_io_thread();
+#endif
 
-#if !HAVE(SYS_EPOLL_H) && HAVE(SYS_SELECT_H)
-    sorted_array_destroy(the_server.fd2clients);
+    purc_log_info("Scheduler: %llu turns, %llu packets handled "
+            "(%llu prioritized), %llu deferred (%llu bytes), %llu preempted, "
+            "%llu throttled, %llu refused, %u in backlogs at most\n",
+            (unsigned long long)the_server.sched.stats.nr_turns,
+            (unsigned long long)the_server.sched.stats.nr_handled,
+            (unsigned long long)the_server.sched.stats.nr_prioritized,
+            (unsigned long long)the_server.sched.stats.nr_deferred,
+            (unsigned long long)the_server.sched.stats.sz_deferred,
+            (unsigned long long)the_server.sched.stats.nr_preempted,
+            (unsigned long long)the_server.sched.stats.nr_throttled,
+            (unsigned long long)the_server.sched.stats.nr_refused,
+            the_server.sched.stats.max_backlog);
+
+#if !HAVE(SYS_EPOLL_H) && HAVE(POLL_H)
+    client_table_destroy(&the_server.fd2clients);
+    free(the_server.pollfds);
+    the_server.pollfds = NULL;
 #endif
 
-    avl_remove_all_elements(&the_server.living_avl, endpoint, avl, tmp) {
+    ep_table_for_each(table, i, endpoint) {
         if (endpoint->type == ET_UNIX_SOCKET) {
             us_close_client(the_server.us_srv, (USClient *)endpoint->entity.client);
         }
@@ -784,14 +2247,21 @@ deinit_server(void)
         }
     }
 
-    kvlist_for_each_safe(&the_server.endpoint_list, name, next, data) {
-        //memcpy (&endpoint, data, sizeof(purcmc_endpoint*));
-        endpoint = *(purcmc_endpoint **)data;
+    /* removing an endpoint may shift the next one to the same slot */
+    for (i = 0; i < table->nr_slots; ) {
+        if ((endpoint = table->slots[i].endpoint) == NULL) {
+            i++;
+            continue;
+        }
 
         if (endpoint->type != ET_BUILTIN) {
             purc_log_info("Deleting endpoint: %s (%p) in deinit_server\n",
-                    name, endpoint);
+                    purc_atom_to_string(endpoint->name_atom), endpoint);
+        }
 
+        /* the atom of the name is released here */
+        ep_table_remove(table, endpoint->name_atom);
+        if (endpoint->type != ET_BUILTIN) {
             if (endpoint->type == ET_UNIX_SOCKET && endpoint->entity.client) {
                 // avoid a duplicated call of del_endpoint
                 endpoint->entity.client->entity = NULL;
@@ -806,39 +2276,31 @@ deinit_server(void)
             }
 
             del_endpoint(&the_server, endpoint, CDE_EXITING);
-            kvlist_delete(&the_server.endpoint_list, name);
             the_server.nr_endpoints--;
         }
     }
 
-    kvlist_free(&the_server.endpoint_list);
-
-    if (the_server.dangling_endpoints) {
-        gs_list* node = the_server.dangling_endpoints;
-
-        while (node) {
-            endpoint = (purcmc_endpoint *)node->data;
-            purc_log_warn("Removing dangling endpoint: %p, type (%d), status (%d)\n",
-                    endpoint, endpoint->type, endpoint->status);
-
-            if (endpoint->type == ET_UNIX_SOCKET) {
-                USClient* usc = (USClient *)endpoint->entity.client;
-                us_remove_dangling_client(the_server.us_srv, usc);
-            }
-            else if (endpoint->type == ET_WEB_SOCKET) {
-                WSClient* wsc = (WSClient *)endpoint->entity.client;
-                ws_remove_dangling_client(the_server.ws_srv, wsc);
-            }
-            else {
-                purc_log_warn("Bad type of dangling endpoint\n");
-            }
+    ep_table_destroy(table);
 
-            del_endpoint(&the_server, endpoint, CDE_EXITING);
+    list_for_each_entry_safe(endpoint, tmp,
+            &the_server.dangling_endpoints, dangling) {
+        purc_log_warn("Removing dangling endpoint: %p, type (%d), status (%d)\n",
+                endpoint, endpoint->type, endpoint->status);
 
-            node = node->next;
+        if (endpoint->type == ET_UNIX_SOCKET) {
+            USClient* usc = (USClient *)endpoint->entity.client;
+            us_remove_dangling_client(the_server.us_srv, usc);
+        }
+        else if (endpoint->type == ET_WEB_SOCKET) {
+            WSClient* wsc = (WSClient *)endpoint->entity.client;
+            ws_remove_dangling_client(the_server.ws_srv, wsc);
+        }
+        else {
+            purc_log_warn("Bad type of dangling endpoint\n");
         }
 
-        gslist_remove_nodes(the_server.dangling_endpoints);
+        list_del_init(&endpoint->dangling);
+        del_endpoint(&the_server, endpoint, CDE_EXITING);
     }
 
     us_stop(the_server.us_srv);
@@ -872,6 +2334,90 @@ deinit_server(void)
 
 }
 
+unsigned purcmc_rdrsrv_nr_socket_endpoints(purcmc_server *srv)
+{
+    purcmc_endpoint *endpoint;
+    unsigned i, n = 0;
+
+    ep_table_for_each(&srv->endpoint_table, i, endpoint) {
+        if (endpoint->type != ET_BUILTIN)
+            n++;
+    }
+
+    list_for_each_entry(endpoint, &srv->dangling_endpoints, dangling) {
+        if (endpoint->type != ET_BUILTIN)
+            n++;
+    }
+
+    return n;
+}
+
+int purcmc_rdrsrv_hand_off(purcmc_server *srv, char *const argv[])
+{
+    HandoffRecord rec;
+    int sock, fds[HANDOFF_MAX_FDS];
+    pid_t pid;
+
+    if (srv->handed_off) {
+        purc_log_warn("The listeners were handed off already\n");
+        return -1;
+    }
+
+    if ((sock = handoff_spawn(argv, &pid)) < 0)
+        return -1;
+
+    /* both servers accept the connections until the new one answers */
+    memset(&rec, 0, sizeof(rec));
+    rec.kind = HOR_LISTENERS;
+    fds[0] = srv->us_listener;
+    fds[1] = srv->ws_listener;
+    if (handoff_send(sock, &rec, fds, (srv->ws_listener >= 0) ? 2 : 1)) {
+        purc_log_error("Failed to hand off to the new server (%d)\n",
+                (int)pid);
+        close(sock);
+        /* the new server never got the listeners; not a child to reap */
+        kill(pid, SIGKILL);
+        return -1;
+    }
+
+    /*
+     * The new server may accept the connections on the listeners from now
+     * on, so it is never killed. If it closed the socket, it failed to start
+     * and is exiting; otherwise it is the server from now on, even if it
+     * did not answer in time.
+     */
+    if (handoff_recv(sock, &rec, fds, HANDOFF_TIMEOUT) ||
+            rec.kind != HOR_END) {
+        if (handoff_peer_closed(sock)) {
+            purc_log_error("The new server (%d) failed to start; "
+                    "go on listening\n", (int)pid);
+            close(sock);
+            return -1;
+        }
+
+        purc_log_warn("The new server (%d) did not answer; "
+                "leave the listeners to it anyway\n", (int)pid);
+    }
+
+    close(sock);
+    if (handoff_notify_main_pid(pid))
+        purc_log_warn("The service manager may stop the new server (%d)\n",
+                (int)pid);
+
+#if HAVE(IO_THREAD)
+    if (srv->threaded)
+        post_io_command(IOC_UNLISTEN, NULL, 0, NULL, 0);
+    else
+#endif
+        unwatch_listeners();
+    srv->handed_off = true;
+
+    purc_log_info("Handed off the listeners to the new server (%d); "
+            "%u endpoints left to serve\n", (int)pid,
+            purcmc_rdrsrv_nr_socket_endpoints(srv));
+    return 0;
+}
+
 purcmc_server *
 purcmc_rdrsrv_init(purcmc_server_config* srvcfg,
         void *user_data, const purcmc_server_callbacks *cbs,
@@ -879,7 +2425,8 @@ purcmc_rdrsrv_init(purcmc_server_config* srvcfg,
         int nr_workspaces, int nr_plainwindows,
         int nr_tabbedwindows, int nr_tabbedpages)
 {
-    int retval;
+    HandoffRecord rec;
+    int retval, handoff_sock = -1;
 
     srandom(time(NULL));
 
@@ -921,17 +2468,41 @@ purcmc_rdrsrv_init(purcmc_server_config* srvcfg,
         purc_log_info("Skip web socket\n");
     }
 
+    /* the listeners are handed off for a hot upgrade */
+    handoff_sock = handoff_inherited_socket();
+
     setup_signal_pipe();
-    if (prepare_server()) {
+    if (prepare_server(handoff_sock)) {
         goto error;
     }
 
+    if (the_srvcfg->threaded) {
+#if HAVE(IO_THREAD)
+        if (start_io_thread()) {
+            goto error;
+        }
+#else
+        purc_log_warn("The socket I/O thread is not supported; ignored\n");
+#endif
+    }
+
     the_server.user_data = user_data;
     the_server.cbs = *cbs;
 
+    /* the old server stops accepting the connections once answered */
+    if (handoff_sock >= 0) {
+        memset(&rec, 0, sizeof(rec));
+        rec.kind = HOR_END;
+        if (handoff_send(handoff_sock, &rec, NULL, 0))
+            goto error;
+        close(handoff_sock);
+    }
+
     return &the_server;
 
 error:
+    if (handoff_sock >= 0)
+        close(handoff_sock);
     return NULL;
 }
 
@@ -29,31 +29,61 @@
 #include <unistd.h>
 #if HAVE(SYS_EPOLL_H)
 #include <sys/epoll.h>
-#elif HAVE(SYS_SELECT_H)
-#include <sys/select.h>
+#elif HAVE(POLL_H)
+#include <poll.h>
 #else
-#error no `epoll` either `select` found.
+#error no `epoll` either `poll` found.
+#endif
+
+/* the socket I/O thread relies on epoll and eventfd */
+#if HAVE(SYS_EPOLL_H) && HAVE(SYS_EVENTFD_H)
+#define HAVE_IO_THREAD      1
+#include <pthread.h>
+#endif
+
+/* the TLS handshakes are done in a thread like the socket I/O */
+#if HAVE(LIBSSL) && HAVE(IO_THREAD)
+#define HAVE_TLS_HANDSHAKER 1
+#endif
+
+/* the builtin endpoints rely on eventfd */
+#if HAVE(SYS_EVENTFD_H)
+#define HAVE_BUILTIN_ENDPOINT   1
 #endif
 
 #include <purc/purc-pcrdr.h>
 
 #include "utils/list.h"
 #include "utils/kvlist.h"
-#include "utils/gslist.h"
-#include "utils/sorted-array.h"
 
 #include "purcmc.h"
+#include "ioqueue.h"
+#include "binmsg.h"
+#include "eptable.h"
+#include "timerwheel.h"
+#include "clienttable.h"
+#include "sched.h"
+#include "shmring.h"
+#include "builtin.h"
 
 #define SERVER_APP_NAME     "cn.fmsoft.hvml.renderer"
 #define SERVER_RUNNER_NAME  "purcmc"
+#define SERVER_IO_RUNNER_NAME   "purcmcio"
+#define SERVER_TLS_RUNNER_NAME  "purcmctls"
 
 #define SERVER_FEATURES_FORMAT \
     PCRDR_PURCMC_PROTOCOL_NAME ":" PCRDR_PURCMC_PROTOCOL_VERSION_STRING "\n" \
     "%s\n" \
     "workspace:%d/tabbedWindow:%d/widgetInTabbedWindow:%d/plainWindow:%d\n" \
+    "binaryMessage:" PURCMC_BINMSG_FORMAT "\n" \
+    "sharedRing:" PURCMC_SHM_RING_FORMAT "\n" \
+    "sealedBody:" PURCMC_SEALED_BODY_FORMAT "\n"
 
-/* max clients for each web socket and unix socket */
-#define MAX_CLIENTS_EACH    512
+/* the default maximal number of the clients of each transport */
+#define DEF_MAX_CLIENTS_EACH    4096
+
+/* the number of the clients accepted and watched in a batch */
+#define SZ_ACCEPT_BATCH         64
 
 /* 1 MiB throttle threshold per client */
 #define SOCK_THROTTLE_THLD  (1024 * 1024)
@@ -86,6 +116,10 @@ typedef struct UpperEntity_ {
 
     /* the pointer to the socket client */
     struct SockClient_     *client;
+
+    /* the socket layer stops reading the client until resumed; only
+       touched by the thread handling the socket */
+    bool                    paused;
 } UpperEntity;
 
 static inline void update_upper_entity_stats (UpperEntity *entity,
@@ -113,6 +147,20 @@ typedef struct SockClient_ {
     struct UpperEntity_    *entity;
 } SockClient;
 
+#if HAVE(IO_THREAD)
+/* The proxy of a socket client handled by the I/O thread */
+typedef struct IOProxy_ {
+    /* the client seen by the main thread; `entity` points to the endpoint */
+    SockClient              client;
+
+    /* the entity seen by the socket layer; `client` points to the real one */
+    UpperEntity             entity;
+
+    /* the last time posted IOE_LIVING; only used by the I/O thread */
+    time_t                  t_living;
+} IOProxy;
+#endif
+
 /* A PurcMC purcmc_endpoint */
 struct purcmc_endpoint
 {
@@ -127,12 +175,40 @@ struct purcmc_endpoint
     char*   app_name;
     char*   runner_name;
 
+    /* the atom of the endpoint name; 0 if not authenticated */
+    purc_atom_t name_atom;
+    /* the generation given when the endpoint was registered */
+    uint64_t    generation;
+
     purcmc_session *session;
 
-    /* AVL node for the AVL tree sorted by living time */
-    struct avl_node avl;
+    /* whether to send the messages in the binary format; set after the
+       client sent a message in the binary format */
+    bool    binary_msg;
+
+    /* the timer of the authentication, ping, or no-responding timeout */
+    TimerNode timer;
+
+    /* the node in the list of the dangling endpoints */
+    struct list_head dangling;
+
+    /* the budget and the deferred packets of this endpoint */
+    SchedEntity sched;
+
+    /* the connection of a builtin endpoint */
+    BuiltinConn *conn;
 };
 
+#if !HAVE(SYS_EPOLL_H) && HAVE(POLL_H)
+/* A socket watched by poll() */
+typedef struct PollSlot_ {
+    /* the listener tag or the client; NULL if not watched */
+    void       *ptr;
+    /* the index in the array of pollfd */
+    unsigned    index;
+} PollSlot;
+#endif
+
 struct WSServer_;
 struct USServer_;
 
@@ -144,32 +220,59 @@ struct purcmc_server
     int ws_listener;
 #if HAVE(SYS_EPOLL_H)
     int epollfd;
-#elif HAVE(SYS_SELECT_H)
-    int maxfd;
-    fd_set rfdset, wfdset;
-    /* the AVL tree for the map from fd to client */
-    struct sorted_array *fd2clients;
+#elif HAVE(POLL_H)
+    /* the watched sockets packed for poll() */
+    struct pollfd *pollfds;
+    unsigned nr_pollfds;
+    unsigned sz_pollfds;
+    /* the PollSlot of the watched sockets, indexed by fd */
+    ClientTable fd2clients;
+#endif
+#if HAVE(IO_THREAD)
+    /* whether the sockets are handled by the I/O thread */
+    bool threaded;
+    /* set by the I/O thread when it got IOC_QUIT */
+    bool io_quitting;
+    pthread_t io_thread;
+
+    /* the events from the I/O thread to the main thread */
+    IOQueue io_events;
+    /* the commands from the main thread to the I/O thread */
+    IOQueue io_commands;
 #endif
     unsigned int nr_endpoints;
     bool running;
+    /* whether the listeners were handed off to a new server */
+    bool handed_off;
 
     time_t t_start;
-    time_t t_elapsed;
-    time_t t_elapsed_last;
 
     char* server_name;
 
     struct WSServer_ *ws_srv;
     struct USServer_ *us_srv;
 
-    /* The KV list using endpoint name as the key, and purcmc_endpoint* as the value */
-    struct kvlist endpoint_list;
+    /* The authenticated endpoints keyed by the atoms of their names */
+    EndpointTable endpoint_table;
+    /* the last generation given to an endpoint */
+    uint64_t endpoint_gen;
 
     /* The accepted endpoints but waiting for authentification */
-    gs_list *dangling_endpoints;
+    struct list_head dangling_endpoints;
+
+    /* the timers of the endpoints */
+    TimerWheel timers;
 
-    /* the AVL tree of endpoints sorted by living time */
-    struct avl_tree living_avl;
+    /* the scheduler of the packets from the endpoints */
+    Scheduler sched;
+
+#if HAVE(BUILTIN_ENDPOINT)
+    /* the connections of the builtin endpoints */
+    struct list_head builtins;
+    /* the eventfd to wake up the server for the builtin connections;
+       the one of `io_events` is used instead in the threaded mode */
+    int builtin_efd;
+#endif
 
     /* the user data */
     void *user_data;
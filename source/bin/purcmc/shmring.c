@@ -0,0 +1,145 @@
+/*
+** shmring.c -- the shared-memory ring carrying the packets of a local client.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "shmring.h"
+
+#if HAVE(LINUX_MEMFD_H) && defined(MFD_ALLOW_SEALING)
+static size_t round_ring_size(size_t size, size_t sz_page)
+{
+    size_t sz_ring = SHM_RING_MIN_SIZE;
+
+    if (size > SHM_RING_MAX_SIZE)
+        size = SHM_RING_MAX_SIZE;
+    while (sz_ring < size || sz_ring < sz_page)
+        sz_ring <<= 1;
+    return sz_ring;
+}
+
+ShmRing *shm_ring_create(size_t size)
+{
+    size_t sz_page = (size_t)sysconf(_SC_PAGESIZE);
+    ShmRing *ring;
+    char *base, *p;
+
+    ring = calloc(1, sizeof(ShmRing));
+    if (ring == NULL)
+        return NULL;
+
+    ring->size = round_ring_size(size, sz_page);
+    ring->fd = memfd_create("purcmc-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (ring->fd < 0)
+        goto failed;
+
+    /* the client can not shrink the memfd to make the server get SIGBUS */
+    if (ftruncate(ring->fd, sz_page + ring->size) ||
+            fcntl(ring->fd, F_ADD_SEALS,
+                F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL))
+        goto failed;
+
+    /* reserve the space for the header and two copies of the data area */
+    ring->sz_mapped = sz_page + ring->size * 2;
+    base = mmap(NULL, ring->sz_mapped, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        goto failed;
+
+    p = mmap(base, sz_page + ring->size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED, ring->fd, 0);
+    if (p != MAP_FAILED)
+        p = mmap(base + sz_page + ring->size, ring->size,
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                ring->fd, sz_page);
+    if (p == MAP_FAILED) {
+        munmap(base, ring->sz_mapped);
+        goto failed;
+    }
+
+    ring->header = (ShmRingHeader *)base;
+    ring->data = base + sz_page;
+    ring->consumed = 0;
+
+    /* the memfd is zero-filled */
+    ring->header->magic = SHM_RING_MAGIC;
+    ring->header->version = PURCMC_SHM_RING_VERSION;
+    ring->header->data_offset = sz_page;
+    ring->header->size = ring->size;
+    return ring;
+
+failed:
+    if (ring->fd >= 0)
+        close(ring->fd);
+    free(ring);
+    return NULL;
+}
+
+#else
+ShmRing *shm_ring_create(size_t size)
+{
+    (void)size;
+    return NULL;
+}
+#endif /* HAVE(LINUX_MEMFD_H) */
+
+void shm_ring_destroy(ShmRing *ring)
+{
+    if (ring->fd >= 0)
+        close(ring->fd);
+    munmap(ring->header, ring->sz_mapped);
+    free(ring);
+}
+
+int shm_ring_read(ShmRing *ring, const ShmRingDesc *desc, char *buf)
+{
+    /* checked against this snapshot only */
+    uint64_t head = __atomic_load_n(&ring->header->head, __ATOMIC_ACQUIRE);
+
+    /* the client may skip some bytes, but never go back */
+    if (desc->pos < ring->consumed || head < desc->pos)
+        return -1;
+
+    if (desc->size == 0 || desc->size > head - desc->pos ||
+            head - ring->consumed > ring->size)
+        return -1;
+
+    /* the bytes may change under the copy, but not the copy later */
+    memcpy(buf, ring->data + (desc->pos & (ring->size - 1)), desc->size);
+    buf[desc->size] = '\0';
+    return 0;
+}
+
+bool shm_ring_release(ShmRing *ring, const ShmRingDesc *desc)
+{
+    ring->consumed = desc->pos + desc->size;
+
+    /* pairs with the client setting `waiting` and checking `tail` again */
+    __atomic_store_n(&ring->header->tail, ring->consumed, __ATOMIC_SEQ_CST);
+    return __atomic_exchange_n(&ring->header->waiting, 0,
+            __ATOMIC_SEQ_CST) != 0;
+}
@@ -0,0 +1,145 @@
+/*
+** shmring.h -- the shared-memory ring carrying the packets of a local client.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#ifndef XGUIPRO_PURCMC_SHMRING_H
+#define XGUIPRO_PURCMC_SHMRING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The name of the shared ring advertised in the features of the server.
+ *
+ * A client connected via the Unix socket asks for a shared ring by giving
+ * the size wanted in the key `sharedRing` of the data of `startSession`.
+ * If granted, the server sends a US_OPCODE_SHM_SETUP frame carrying a
+ * sealed memfd (SCM_RIGHTS) before the response to `startSession`.
+ *
+ * The memfd starts with a ShmRingHeader, followed by the data area at
+ * `data_offset`. The positions are the counts of the bytes ever produced
+ * or released; the offset of a position in the data area is the position
+ * modulo `size`. A packet may wrap around the end of the data area.
+ *
+ * To send a packet, the client copies the body to the ring at `head`,
+ * advances `head`, and sends a US_OPCODE_SHM_PACKET frame with a
+ * ShmRingDesc as the payload. A text packet must reserve the last byte
+ * for the terminating null character.
+ *
+ * The server copies the body out of the ring before parsing it, and then
+ * releases the space of the packet by advancing `tail`; rewriting a body
+ * after sending its descriptor has no effect. A client short of space
+ * sets `waiting`, checks `tail` again, and then waits for a
+ * US_OPCODE_SHM_DOORBELL frame.
+ */
+#define PURCMC_SHM_RING_FORMAT      "memfd-1"
+#define PURCMC_SHM_RING_VERSION     1
+
+/*
+ * The name of the sealed bodies advertised in the features of the server.
+ *
+ * A client connected via the Unix socket can send the body of a packet,
+ * e.g., a large document for `load`, `writeBegin`, or `update`, in a memfd
+ * sealed with F_SEAL_WRITE and F_SEAL_SHRINK. The memfd is passed with
+ * SCM_RIGHTS along with a US_OPCODE_FD_TEXT or US_OPCODE_FD_BIN frame,
+ * which has no payload; the body is the whole content of the memfd, and
+ * a text body needs no terminating null character.
+ *
+ * Such a body is mapped by the server instead of being copied, and it can
+ * be larger than PCRDR_MAX_INMEM_PAYLOAD_SIZE.
+ */
+#define PURCMC_SEALED_BODY_FORMAT   "memfd-1"
+
+#define SHM_RING_MAGIC              0x52534350  /* "PCSR" */
+
+#define SHM_RING_MIN_SIZE           (64 * 1024)
+#define SHM_RING_MAX_SIZE           (64 * 1024 * 1024)
+
+/* The header at the start of the memfd */
+typedef struct ShmRingHeader_ {
+    uint32_t    magic;
+    uint32_t    version;
+    /* the offset of the data area in the memfd */
+    uint32_t    data_offset;
+    /* the size of the data area; a power of two */
+    uint32_t    size;
+
+    /* the position after the last byte produced; written by the client */
+    uint64_t    head __attribute__ ((aligned (64)));
+    /* the position after the last byte released; written by the server */
+    uint64_t    tail __attribute__ ((aligned (64)));
+    /* set by the client before waiting for the space released */
+    uint32_t    waiting;
+} ShmRingHeader;
+
+/* The descriptor of a packet in the ring */
+typedef struct ShmRingDesc_ {
+    /* the position of the body */
+    uint64_t    pos;
+    /* the size of the body */
+    uint32_t    size;
+    /* US_OPCODE_TEXT or US_OPCODE_BIN */
+    uint32_t    op;
+} ShmRingDesc;
+
+/* The shared ring seen by the server */
+typedef struct ShmRing_ {
+    /* the memfd; closed once sent to the client */
+    int             fd;
+    uint32_t        size;
+
+    ShmRingHeader  *header;
+    /* the data area mapped twice in a row, so a body wrapped around
+       the end is still contiguous */
+    char           *data;
+    size_t          sz_mapped;
+
+    /* the position after the last packet released */
+    uint64_t        consumed;
+} ShmRing;
+
+/*
+ * Create a shared ring with a data area of about `size` bytes.
+ *
+ * Returns NULL if the memfd is not supported or failed to map it.
+ */
+ShmRing *shm_ring_create(size_t size);
+
+void shm_ring_destroy(ShmRing *ring);
+
+/*
+ * Copy the body of the packet described by `desc` to `buf`, which must
+ * hold `desc->size + 1` bytes, and append a null character. The client
+ * can still write to the ring, so the body is never parsed in place.
+ *
+ * Returns -1 if the descriptor is not in the space produced.
+ */
+int shm_ring_read(ShmRing *ring, const ShmRingDesc *desc, char *buf);
+
+/*
+ * Release the space of the packet read and all before it.
+ *
+ * Returns true if the client is waiting for the space released.
+ */
+bool shm_ring_release(ShmRing *ring, const ShmRingDesc *desc);
+
+#endif /* !XGUIPRO_PURCMC_SHMRING_H */
+
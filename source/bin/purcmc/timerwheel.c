@@ -0,0 +1,120 @@
+/*
+** timerwheel.c -- the hierarchical timer wheel of the endpoint timeouts.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#include <config.h>
+
+#include "timerwheel.h"
+
+void timer_wheel_init(TimerWheel *wheel, time_t now)
+{
+    wheel->now = now;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int i = 0; i < TIMER_WHEEL_SLOTS; i++)
+            list_head_init(&wheel->slots[level][i]);
+    }
+}
+
+static inline int slot_index(time_t t, int level)
+{
+    return (int)((t >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK);
+}
+
+static void queue_timer(TimerWheel *wheel, TimerNode *node)
+{
+    time_t expires = node->expires;
+    time_t delta;
+    int level;
+
+    /* an expired timer fires in the next second processed */
+    if (expires < wheel->now)
+        expires = wheel->now;
+
+    delta = expires - wheel->now;
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+        if (delta < ((time_t)1 << ((level + 1) * TIMER_WHEEL_BITS)))
+            break;
+    }
+
+    if (level == TIMER_WHEEL_LEVELS - 1 &&
+            delta >= ((time_t)1 << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS))) {
+        /* clamp it to the last slot before the top level wraps */
+        expires = wheel->now +
+            ((time_t)1 << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1;
+    }
+
+    list_add_tail(&node->link, &wheel->slots[level][slot_index(expires, level)]);
+}
+
+void timer_wheel_add(TimerWheel *wheel, TimerNode *node, time_t expires)
+{
+    list_del_init(&node->link);
+    node->expires = expires;
+    queue_timer(wheel, node);
+}
+
+/* Move the timers of a slot of the higher level to the lower levels */
+static void cascade(TimerWheel *wheel, int level, int index)
+{
+    struct list_head list;
+    TimerNode *node, *next;
+
+    list_head_init(&list);
+    list_splice_init(&wheel->slots[level][index], &list);
+
+    list_for_each_entry_safe(node, next, &list, link) {
+        list_del_init(&node->link);
+        queue_timer(wheel, node);
+    }
+}
+
+int timer_wheel_advance(TimerWheel *wheel, time_t now,
+        timer_wheel_fire_fn fn, void *ctxt)
+{
+    struct list_head expired;
+    int n = 0;
+
+    list_head_init(&expired);
+    while (wheel->now <= now) {
+        int index = slot_index(wheel->now, 0);
+
+        /* cascade the next slot of a level when the lower one wraps */
+        for (int level = 1; index == 0 && level < TIMER_WHEEL_LEVELS;
+                level++) {
+            index = slot_index(wheel->now, level);
+            cascade(wheel, level, index);
+        }
+
+        list_splice_tail_init(&wheel->slots[0][slot_index(wheel->now, 0)],
+                &expired);
+        wheel->now++;
+
+        /* fire one by one, since `fn` may delete the others */
+        while (!list_empty(&expired)) {
+            TimerNode *node = list_first_entry(&expired, TimerNode, link);
+
+            list_del_init(&node->link);
+            fn(node, ctxt);
+            n++;
+        }
+    }
+
+    return n;
+}
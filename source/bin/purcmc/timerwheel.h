@@ -0,0 +1,91 @@
+/*
+** timerwheel.h -- the hierarchical timer wheel of the endpoint timeouts.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+
+#ifndef XGUIPRO_PURCMC_TIMERWHEEL_H
+#define XGUIPRO_PURCMC_TIMERWHEEL_H
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "utils/list.h"
+
+/* the number of the slots of a level is 1 << TIMER_WHEEL_BITS */
+#define TIMER_WHEEL_BITS        6
+#define TIMER_WHEEL_SLOTS       (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK        (TIMER_WHEEL_SLOTS - 1)
+
+/* 4 levels cover 2^24 seconds (194 days); later timers are clamped */
+#define TIMER_WHEEL_LEVELS      4
+
+/* A timer embedded in the object to time out */
+typedef struct TimerNode_ {
+    struct list_head    link;
+    time_t              expires;
+} TimerNode;
+
+/*
+ * A hierarchical timer wheel with the resolution of one second.
+ *
+ * The level 0 has a slot for each of the next 64 seconds, and a slot of
+ * the level N covers 64^N seconds. When the level 0 wraps, the timers in
+ * the next slot of the level 1 are cascaded down, and so on. Adding and
+ * deleting a timer are O(1).
+ */
+typedef struct TimerWheel_ {
+    /* the next second to process; all earlier timers have fired */
+    time_t              now;
+    struct list_head    slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} TimerWheel;
+
+typedef void (*timer_wheel_fire_fn)(TimerNode *node, void *ctxt);
+
+void timer_wheel_init(TimerWheel *wheel, time_t now);
+
+static inline void timer_node_init(TimerNode *node)
+{
+    list_head_init(&node->link);
+    node->expires = 0;
+}
+
+static inline bool timer_node_pending(const TimerNode *node)
+{
+    return !list_empty(&node->link);
+}
+
+/* Arm the timer to fire at `expires`; a pending timer is moved */
+void timer_wheel_add(TimerWheel *wheel, TimerNode *node, time_t expires);
+
+/* Disarm the timer if it is pending */
+static inline void timer_wheel_del(TimerNode *node)
+{
+    list_del_init(&node->link);
+}
+
+/*
+ * Fire the timers expired at or before `now` by calling `fn`. A timer is
+ * disarmed before it fires, so `fn` can arm it again or delete any timer.
+ *
+ * Returns the number of the timers fired.
+ */
+int timer_wheel_advance(TimerWheel *wheel, time_t now,
+        timer_wheel_fire_fn fn, void *ctxt);
+
+#endif /* !XGUIPRO_PURCMC_TIMERWHEEL_H */
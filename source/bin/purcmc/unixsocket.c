@@ -20,6 +20,7 @@
 ** along with this program.  If not, see http://www.gnu.org/licenses/.
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -34,6 +35,8 @@
 #include <sys/fcntl.h>
 #include <sys/un.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 
 #include "server.h"
 #include "unixsocket.h"
@@ -43,6 +46,9 @@ USServer *us_init (const purcmc_server_config* config)
     USServer *server = calloc (1, sizeof (USServer));
 
     server->listener = -1;
+    list_head_init (&server->gathering);
+    buf_pool_init (&server->pool, BUF_POOL_DEF_MAX_CACHED);
+    client_table_init (&server->clients, sizeof (USClient));
     server->config = config;
     return server;
 }
@@ -50,6 +56,8 @@ USServer *us_init (const purcmc_server_config* config)
 void us_stop (USServer * server)
 {
     close (server->listener);
+    buf_pool_destroy (&server->pool);
+    client_table_destroy (&server->clients);
     free (server);
 }
 
@@ -66,6 +74,8 @@ int us_listen (USServer* server)
     }
 
     fcntl (fd, F_SETFD, FD_CLOEXEC);
+    /* the pending connections are accepted until EAGAIN */
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL, 0) | O_NONBLOCK);
 
     /* in case it already exists */
     unlink (server->config->unixsocket);
@@ -100,13 +110,27 @@ error:
     return (-1);
 }
 
+/* Set the given file descriptor as NON BLOCKING. */
+inline static int
+set_nonblocking (int sock)
+{
+    if (fcntl (sock, F_SETFL, fcntl (sock, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        purc_log_error ("Unable to set socket as non-blocking: %s.",
+                strerror (errno));
+        return -1;
+    }
+
+    return 0;
+}
+
 #define    STALE    30    /* client's name can't be older than this (sec) */
 
 /* Wait for a client connection to arrive, and accept it.
  * We also obtain the client's pid from the pathname
  * that it must bind before calling us.
  */
-/* returns new fd if all OK, < 0 on error */
+/* returns new fd if all OK; -1 if failed to accept (see errno),
+   -2 if the peer is rejected */
 static int us_accept (int listenfd, pid_t *pidptr, uid_t *uidptr)
 {
     int                clifd;
@@ -117,10 +141,18 @@ static int us_accept (int listenfd, pid_t *pidptr, uid_t *uidptr)
     const char*        pid_str;
 
     len = sizeof (unix_addr);
+#if HAVE(ACCEPT4)
+    if ((clifd = accept4 (listenfd, (struct sockaddr *) &unix_addr, &len,
+                    SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+        return (-1);        /* often errno=EAGAIN, if drained */
+#else
     if ((clifd = accept (listenfd, (struct sockaddr *) &unix_addr, &len)) < 0)
         return (-1);        /* often errno=EINTR, if signal caught */
 
     fcntl (clifd, F_SETFD, FD_CLOEXEC);
+    if (set_nonblocking (clifd))
+        goto error;
+#endif
 
     /* obtain the client's uid from its calling address */
     len -= sizeof(unix_addr.sun_family);
@@ -169,58 +201,35 @@ static int us_accept (int listenfd, pid_t *pidptr, uid_t *uidptr)
 
 error:
     close (clifd);
-    return -1;
-}
-
-/* Set the given file descriptor as NON BLOCKING. */
-inline static int
-set_nonblocking (int sock)
-{
-    if (fcntl (sock, F_SETFL, fcntl (sock, F_GETFL, 0) | O_NONBLOCK) == -1) {
-        purc_log_error ("Unable to set socket as non-blocking: %s.",
-                strerror (errno));
-        return -1;
-    }
-
-    return 0;
+    return -2;
 }
 
 /* Handle a new UNIX socket connection. */
-USClient *
-us_handle_accept (USServer* server)
+static USClient *
+handle_new_client (USServer* server, int newfd, pid_t pid, uid_t uid)
 {
     USClient *usc = NULL;
-    pid_t pid;
-    uid_t uid;
-    int newfd = -1;
 
-    usc = (USClient *)calloc (sizeof (USClient), 1);
+    usc = (USClient *)client_table_alloc (&server->clients, newfd);
     if (usc == NULL) {
-        purc_log_error ("Failed to callocate memory for Unix socket client\n");
+        purc_log_error ("Failed to allocate memory for Unix socket client\n");
+        close (newfd);
         return NULL;
     }
 
-    list_head_init (&usc->pending);
+    send_queue_init (&usc->sendq);
+    list_head_init (&usc->gathering);
     usc->sz_pending = 0;
 
-    newfd = us_accept (server->listener, &pid, &uid);
-    if (newfd < 0) {
-        purc_log_error ("Failed to accept Unix socket: %d\n", newfd);
-        goto failed;
-    }
-
-    if (set_nonblocking (newfd)) {
-        goto cleanup;
-    }
-
     usc->ct = CT_UNIX_SOCKET;
     usc->fd = newfd;
     usc->pid = pid;
     usc->uid = uid;
     server->nr_clients++;
 
-    if (server->nr_clients > MAX_CLIENTS_EACH) {
-        purc_log_warn ("Too many clients (maximal clients allowed: %d)\n", MAX_CLIENTS_EACH);
+    if (server->nr_clients > server->config->max_clients) {
+        purc_log_warn ("Too many clients (maximal clients allowed: %d)\n",
+                server->config->max_clients);
         server->on_error (server, (SockClient *)usc, PCRDR_SC_SERVICE_UNAVAILABLE);
         goto cleanup;
     }
@@ -244,10 +253,39 @@ us_handle_accept (USServer* server)
 cleanup:
     us_cleanup_client (server, usc);
     return NULL;
+}
 
-failed:
-    free (usc);
-    return NULL;
+/* Accept the pending UNIX socket connections. */
+int
+us_handle_accepts (USServer* server, USClient **clients, int max)
+{
+    int n = 0;
+
+    while (n < max) {
+        USClient *usc;
+        pid_t pid;
+        uid_t uid;
+        int newfd;
+
+        newfd = us_accept (server->listener, &pid, &uid);
+        if (newfd == -2) {
+            continue;
+        }
+        else if (newfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                purc_log_error ("Failed to accept Unix socket: %s\n",
+                        strerror (errno));
+            break;
+        }
+
+        usc = handle_new_client (server, newfd, pid, uid);
+        if (usc)
+            clients[n++] = usc;
+    }
+
+    return n;
 }
 
 /*
@@ -255,374 +293,749 @@ failed:
  */
 static void us_clear_pending_data (USClient *client)
 {
-    struct list_head *p, *n;
-
-    list_for_each_safe (p, n, &client->pending) {
-        list_del (p);
-        free (p);
-    }
-
+    send_queue_clear (&client->sendq);
     client->sz_pending = 0;
 
     update_upper_entity_stats (client->entity, client->sz_pending, client->sz_packet);
 }
 
 /*
- * Queue new data.
+ * Send the data in the gather queue to the socket by calling writev().
  *
- * On success, true is returned.
- * On error, false is returned and the connection status is set.
+ * On error, -1 is returned and the connection status is set.
+ * On success, the number of bytes sent is returned.
  */
-static bool us_queue_data (USClient *client, const char *buf, size_t len)
+static ssize_t us_write_pending (USServer *server, USClient *client)
 {
-    USPendingData *pending_data;
+    struct iovec iov [SEND_QUEUE_MAX_IOVS];
+    ssize_t total_bytes = 0;
 
-    if ((pending_data = malloc (sizeof (USPendingData) + len)) == NULL) {
-        us_clear_pending_data (client);
-        client->status = US_ERR | US_CLOSE;
-        return false;
-    }
+    (void)server;
 
-    memcpy (pending_data->data, buf, len);
-    pending_data->szdata = len;
-    pending_data->szsent = 0;
+    while (!send_queue_is_empty (&client->sendq)) {
+        int iovcnt = send_queue_get_iovs (&client->sendq, iov,
+                SEND_QUEUE_MAX_IOVS);
+        ssize_t bytes = writev (client->fd, iov, iovcnt);
 
-    list_add_tail (&pending_data->list, &client->pending);
-    client->sz_pending += len;
-    update_upper_entity_stats (client->entity, client->sz_pending, client->sz_packet);
-    client->status |= US_SENDING;
+        if (bytes > 0) {
+            send_queue_consume (&client->sendq, bytes);
+            total_bytes += bytes;
+            if ((size_t)bytes < iovs_size (iov, iovcnt)) {
+                send_queue_set_blocked (&client->sendq);
+                break;
+            }
+        }
+        else if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        else if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            send_queue_set_blocked (&client->sendq);
+            break;
+        }
+        else {
+            us_clear_pending_data (client);
+            client->status = US_ERR | US_CLOSE;
+            return -1;
+        }
+    }
 
-    /* client probably is too slow, so stop queueing until everything is
-     * sent */
-    if (client->sz_pending >= SOCK_THROTTLE_THLD)
-        client->status |= US_THROTTLING;
+    client->sz_pending = client->sendq.sz_pending;
+    if (client->sz_pending < SOCK_THROTTLE_THLD)
+        client->status &= ~US_THROTTLING;
+    update_upper_entity_stats (client->entity, client->sz_pending, client->sz_packet);
+    return total_bytes;
+}
 
-    return true;
+/*
+ * Mark the client to flush its gather queue when the server is uncorked.
+ */
+static void us_gather (USServer *server, USClient *client)
+{
+    if (list_empty (&client->gathering))
+        list_add_tail (&client->gathering, &server->gathering);
 }
 
 /*
- * Send the given buffer to the given socket.
+ * Send the iovecs to the given socket, or append them to the gather
+ * queue if the server is corked or there is pending data.
+ *
+ * The data within [ref, ref + sz_ref) will be referred instead of copied
+ * when queued, and `to_free` will be freed after the data sent.
  *
  * On error, -1 is returned and the connection status is set.
- * On success, the number of bytes sent is returned.
+ * On success, zero is returned.
  */
-static ssize_t us_write_data (USServer *server, USClient *client,
-        const char *buffer, size_t len)
+static int us_writev (USServer *server, USClient *client,
+        const struct iovec *iov, int iovcnt,
+        const char *ref, size_t sz_ref, void *to_free)
 {
+    size_t total = iovs_size (iov, iovcnt);
     ssize_t bytes = 0;
 
-    bytes = write (client->fd, buffer, len);
-    if (bytes == -1 && errno == EPIPE) {
+    if (client->status & US_ERR) {
+        goto failed;
+    }
+
+    /* attempt to send the whole data */
+    if (!server->corked && send_queue_is_empty (&client->sendq)) {
+        do {
+            bytes = writev (client->fd, iov, iovcnt);
+        } while (bytes == -1 && errno == EINTR);
+
+        if (bytes == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                client->status = US_ERR | US_CLOSE;
+                goto failed;
+            }
+            bytes = 0;
+        }
+
+        if ((size_t)bytes == total) {
+            if (to_free)
+                free (to_free);
+            return 0;
+        }
+
+        send_queue_set_blocked (&client->sendq);
+    }
+
+    /* queue the data not sent for a later attempt */
+    if (!send_queue_append (&client->sendq, iov, iovcnt, bytes,
+                ref, sz_ref, to_free)) {
+        us_clear_pending_data (client);
         client->status = US_ERR | US_CLOSE;
         return -1;
     }
 
-    /* did not send all of it... buffer it for a later attempt */
-    if ((bytes > 0 && (size_t)bytes < len) ||
-            (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
-        us_queue_data (client, buffer + bytes, len - bytes);
+    client->sz_pending = client->sendq.sz_pending;
+    update_upper_entity_stats (client->entity, client->sz_pending, client->sz_packet);
+    client->status |= US_SENDING;
+
+    /* client probably is too slow */
+    if (client->sz_pending >= SOCK_THROTTLE_THLD)
+        client->status |= US_THROTTLING;
 
-        if (client->status & US_SENDING && server->on_pending)
-            server->on_pending (server, (SockClient *)client);
-    }
+    if (server->corked)
+        us_gather (server, client);
+    else if (server->on_pending)
+        server->on_pending (server, (SockClient *)client);
 
-    return bytes;
+    return 0;
+
+failed:
+    if (to_free)
+        free (to_free);
+    return -1;
 }
 
 /*
- * Send the queued up client's data to the given socket.
+ * Send a buffer to the given socket.
  *
  * On error, -1 is returned and the connection status is set.
- * On success, the number of bytes sent is returned.
+ * On success, zero is returned.
  */
-static ssize_t us_write_pending (USServer *server, USClient *client)
+static inline int us_write (USServer *server, USClient *client,
+        const void *buffer, size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)buffer;
+    iov.iov_len = len;
+    return us_writev (server, client, &iov, 1, NULL, 0, NULL);
+}
+
+/*
+ * Hold the data sent to the clients in their gather queues until
+ * us_uncork () is called.
+ */
+void us_cork (USServer *server)
+{
+    server->corked = true;
+}
+
+/*
+ * Flush the gather queues of the clients got data when the server
+ * was corked; one writev () for each client.
+ */
+void us_uncork (USServer *server)
 {
-    ssize_t total_bytes = 0;
     struct list_head *p, *n;
 
-    (void)server;
+    server->corked = false;
 
-    list_for_each_safe (p, n, &client->pending) {
-        ssize_t bytes;
-        USPendingData *pending = (USPendingData *)p;
+    list_for_each_safe (p, n, &server->gathering) {
+        USClient *usc = list_entry (p, USClient, gathering);
 
-        bytes = write (client->fd,
-                pending->data + pending->szsent, pending->szdata - pending->szsent);
+        list_del_init (p);
+        us_write_pending (server, usc);
+        if (!send_queue_is_empty (&usc->sendq) && server->on_pending)
+            server->on_pending (server, (SockClient *)usc);
+    }
+}
 
-        if (bytes > 0) {
-            pending->szsent += bytes;
-            if (pending->szsent >= pending->szdata) {
-                list_del (p);
-                free (p);
-            }
-            else {
-                break;
-            }
+/* the size of the input buffer for each client */
+#define US_INBUF_SIZE       4096
 
-            total_bytes += bytes;
-            client->sz_pending -= bytes;
-            update_upper_entity_stats (client->entity,
-                    client->sz_pending, client->sz_packet);
-        }
-        else if (bytes == -1 && errno == EPIPE) {
-            client->status = US_ERR | US_CLOSE;
-            return -1;
-        }
-        else if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            return -1;
-        }
+/*
+ * Return the buffer of the current packet to the pool.
+ */
+static inline void us_release_packet (USServer* server, USClient* usc)
+{
+    if (usc->packet) {
+        /* the space for null character was reserved */
+        buf_pool_put (&server->pool, usc->packet, usc->sz_packet + 1);
+        usc->packet = NULL;
     }
+    usc->sz_packet = 0;
+    usc->sz_read = 0;
+}
 
-    return total_bytes;
+/*
+ * Take the file descriptor received first.
+ */
+static int us_pop_fd (USClient* usc)
+{
+    int fd = usc->fds [0];
+
+    usc->nr_fds--;
+    memmove (usc->fds, usc->fds + 1, sizeof (int) * usc->nr_fds);
+    return fd;
 }
 
 /*
- * A wrapper of the system call write or send.
+ * Map the body in a sealed memfd, followed by at least one null byte.
  *
- * On error, -1 is returned and the connection status is set as error.
- * On success, the number of bytes sent is returned.
+ * A text body is mapped private and writable, because the parser changes
+ * the packet in place; the pages written are copied and the memfd is
+ * never changed. A binary body is mapped read-only.
+ *
+ * Returns the mapped body, or NULL if the memfd is not sealed or too large.
  */
-static ssize_t us_write (USServer *server, USClient *client,
-        const void *buffer, size_t len)
+static char *us_map_sealed_body (int fd, bool text,
+        size_t *sz_body, size_t *sz_mapped)
 {
-    ssize_t bytes = 0;
+#ifdef F_GET_SEALS
+    size_t sz_page = (size_t)sysconf (_SC_PAGESIZE);
+    int prot = text ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    struct stat st;
+    int seals;
+    char *base;
+
+    /* the client must not change the content or shrink the memfd */
+    seals = fcntl (fd, F_GET_SEALS);
+    if (seals == -1 ||
+            (seals & (F_SEAL_WRITE | F_SEAL_SHRINK)) !=
+            (F_SEAL_WRITE | F_SEAL_SHRINK))
+        return NULL;
 
-    /* attempt to send the whole buffer */
-    if (list_empty (&client->pending)) {
-        bytes = us_write_data (server, client, buffer, len);
-    }
-    /* the pending list not empty, just append new data if we're not
-     * throttling the client */
-    else if (client->sz_pending < SOCK_THROTTLE_THLD) {
-        if (us_queue_data (client, buffer, len))
-            return bytes;
-    }
-    /* send from cache buffer */
-    else {
-        bytes = us_write_pending (server, client);
+    if (fstat (fd, &st) || !S_ISREG (st.st_mode) || st.st_size <= 0 ||
+            st.st_size > US_MAX_FD_PACKET_SIZE)
+        return NULL;
+
+    /* the pages of zeros after the body keep the null character */
+    *sz_body = st.st_size;
+    *sz_mapped = (*sz_body + sz_page) & ~(sz_page - 1);
+    base = mmap (NULL, *sz_mapped, prot,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    if (mmap (base, *sz_body, prot, MAP_PRIVATE | MAP_FIXED,
+                fd, 0) == MAP_FAILED) {
+        munmap (base, *sz_mapped);
+        return NULL;
     }
 
-    return bytes;
+    return base;
+#else
+    (void)fd;
+    (void)text;
+    (void)sz_body;
+    (void)sz_mapped;
+    return NULL;
+#endif
 }
 
-/* TODO: tune this for noblocking read */
-#if 0
-static inline ssize_t my_read (int fd, void* buff, size_t sz)
+void us_unmap_body (char *body, size_t sz_mapped)
 {
-    ssize_t bytes;
+    munmap (body, sz_mapped);
+}
 
-again:
-    bytes = read (fd, buff, sz);
-    if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
-        goto again;
+/*
+ * Call on_packet() with the body in the memfd received along with
+ * a US_OPCODE_FD_TEXT or US_OPCODE_FD_BIN frame, or hand the mapping
+ * over to on_mapped_packet() if set.
+ */
+static int us_handle_fd_packet (USServer* server, USClient* usc,
+        int *sta_code)
+{
+    bool text = (usc->header.op == US_OPCODE_FD_TEXT);
+    size_t sz_body, sz_mapped;
+    char *body;
+    int fd;
 
-    return bytes;
+    if (usc->header.sz_payload != 0 || usc->nr_fds == 0) {
+        *sta_code = PCRDR_SC_EXPECTATION_FAILED;
+        return PCRDR_ERROR_PROTOCOL;
+    }
+
+    fd = us_pop_fd (usc);
+    body = us_map_sealed_body (fd, text, &sz_body, &sz_mapped);
+    close (fd);
+    if (body == NULL) {
+        purc_log_warn ("Bad memfd for the body from client: fd (%d)\n",
+                usc->fd);
+        *sta_code = PCRDR_SC_NOT_ACCEPTABLE;
+        return PCRDR_ERROR_PROTOCOL;
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, &usc->ts);
+    if (server->on_mapped_packet) {
+        /* the mapping is released by the callee, even if failed */
+        *sta_code = server->on_mapped_packet (server, (SockClient *)usc, body,
+                text ? (sz_body + 1) : sz_body, text ? PT_TEXT : PT_BINARY,
+                sz_mapped);
+    }
+    else {
+        *sta_code = server->on_packet (server, (SockClient *)usc, body,
+                text ? (sz_body + 1) : sz_body, text ? PT_TEXT : PT_BINARY);
+        munmap (body, sz_mapped);
+    }
+
+    if (*sta_code != PCRDR_SC_OK) {
+        purc_log_warn ("Internal error after got a packet: %d\n", *sta_code);
+        return PCRDR_ERROR_SERVER_ERROR;
+    }
+
+    return 0;
 }
-#endif
 
 /*
- * return values:
- * < 0: error
- * 0: payload read
- * 1: got packet;
+ * Start a new frame after got its header.
+ *
+ * On error, the error code is returned and the status code to report
+ * is stored in `sta_code`.
  */
-static int try_to_read_payload (USServer* server, USClient* usc)
+static int us_start_frame (USServer* server, USClient* usc, int *sta_code)
 {
     ssize_t n;
 
-    (void)server;
     switch (usc->header.op) {
+    case US_OPCODE_PING: {
+        USFrameHeader header;
+        header.op = US_OPCODE_PONG;
+        header.fragmented = 0;
+        header.sz_payload = 0;
+        n = us_write (server, usc, &header, sizeof (USFrameHeader));
+        if (n < 0) {
+            purc_log_error ("Error when wirting socket: %s\n", strerror (errno));
+            *sta_code = PCRDR_SC_IOERR;
+            return PCRDR_ERROR_IO;
+        }
+        break;
+    }
+
+    case US_OPCODE_CLOSE:
+        purc_log_warn ("Peer closed\n");
+        *sta_code = 0;
+        return PCRDR_ERROR_PEER_CLOSED;
+
     case US_OPCODE_TEXT:
     case US_OPCODE_BIN:
-        if ((n = read (usc->fd, usc->packet, usc->header.sz_payload))
-                < usc->header.sz_payload) {
-            purc_log_error ("Failed to read payload from Unix socket: %s\n",
-                    strerror (errno));
-            return PCRDR_ERROR_IO;
+        /* discard the unfinished packet if there is one */
+        us_release_packet (server, usc);
+
+        if (usc->header.fragmented > 0 &&
+                usc->header.fragmented > usc->header.sz_payload) {
+            usc->sz_packet = usc->header.fragmented;
+        }
+        else {
+            usc->sz_packet = usc->header.sz_payload;
         }
 
-        usc->sz_read = usc->header.sz_payload;
-        if (usc->header.fragmented == 0) {
-            return 1;
+        if (usc->sz_packet > PCRDR_MAX_INMEM_PAYLOAD_SIZE ||
+                usc->sz_packet == 0 ||
+                usc->header.sz_payload == 0) {
+            *sta_code = PCRDR_SC_PACKET_TOO_LARGE;
+            return PCRDR_ERROR_PROTOCOL;
         }
+
+        clock_gettime (CLOCK_MONOTONIC, &usc->ts);
+        if (usc->header.op == US_OPCODE_TEXT)
+            usc->t_packet = PT_TEXT;
+        else
+            usc->t_packet = PT_BINARY;
+
+        /* always reserve a space for null character */
+        usc->packet = buf_pool_get (&server->pool, usc->sz_packet + 1);
+        if (usc->packet == NULL) {
+            purc_log_error ("Failed to allocate memory for packet (size: %u)\n",
+                    usc->sz_packet);
+            *sta_code = PCRDR_SC_INSUFFICIENT_STORAGE;
+            return PCRDR_ERROR_NOMEM;
+        }
+
+        update_upper_entity_stats (usc->entity, usc->sz_pending, usc->sz_packet);
         break;
 
     case US_OPCODE_CONTINUATION:
     case US_OPCODE_END:
+        if (usc->header.sz_payload == 0) {
+            *sta_code = PCRDR_SC_PACKET_TOO_LARGE;
+            return PCRDR_ERROR_PROTOCOL;
+        }
+
         if (usc->packet == NULL ||
                 (usc->sz_read + usc->header.sz_payload) > usc->sz_packet) {
+            *sta_code = PCRDR_SC_EXPECTATION_FAILED;
             return PCRDR_ERROR_PROTOCOL;
         }
+        break;
 
-        if ((n = read (usc->fd, usc->packet + usc->sz_read,
-                usc->header.sz_payload)) < usc->header.sz_payload) {
-            purc_log_error ("Failed to read payload from Unix socket: %s\n",
-                    strerror (errno));
-            return PCRDR_ERROR_IO;
-        }
+    case US_OPCODE_FD_TEXT:
+    case US_OPCODE_FD_BIN:
+        /* the frame has no payload */
+        return us_handle_fd_packet (server, usc, sta_code);
 
-        usc->sz_read += usc->header.sz_payload;
-        if (usc->header.op == US_OPCODE_END) {
-            return 1;
+    case US_OPCODE_SHM_PACKET:
+        if (usc->ring == NULL ||
+                usc->header.sz_payload != sizeof (ShmRingDesc)) {
+            *sta_code = PCRDR_SC_EXPECTATION_FAILED;
+            return PCRDR_ERROR_PROTOCOL;
         }
         break;
 
+    case US_OPCODE_PONG:
+        /* the entity may be a proxy when handled by the I/O thread */
+        purc_log_info ("Got a PONG frame from client: fd (%d), pid (%d)\n",
+                usc->fd, usc->pid);
+        break;
+
     default:
+        purc_log_error ("Unknown frame opcode: %d\n", usc->header.op);
+        *sta_code = PCRDR_SC_EXPECTATION_FAILED;
         return PCRDR_ERROR_PROTOCOL;
     }
 
+    /* the payload of a control frame will be discarded */
+    if (usc->header.sz_payload > 0) {
+        usc->sz_frm_read = 0;
+        usc->status |= US_WATING_FOR_PAYLOAD;
+    }
+
     return 0;
 }
 
-int us_handle_reads (USServer* server, USClient* usc)
+static inline bool us_frame_has_data (const USClient* usc)
 {
-    int retv, err_code = 0, sta_code = 0;
-    ssize_t n = 0;
+    return usc->header.op == US_OPCODE_TEXT ||
+        usc->header.op == US_OPCODE_BIN ||
+        usc->header.op == US_OPCODE_CONTINUATION ||
+        usc->header.op == US_OPCODE_END;
+}
 
-    /* if it is not waiting for payload, read a frame header */
-    if (usc->status & US_WATING_FOR_PAYLOAD) {
+/*
+ * Send a frame without payload to tell the client the space of the shared
+ * ring was released.
+ */
+static int us_ring_doorbell (USServer* server, USClient* usc)
+{
+    USFrameHeader header;
 
-        usc->status &= ~US_WATING_FOR_PAYLOAD;
-        retv = try_to_read_payload (server, usc);
-        if (retv > 0) {
-            goto got_packet;
-        }
-        else if (retv == 0) {
-            goto done;
-        }
-        else if (retv < 0) {
-            err_code = retv;
-            sta_code = PCRDR_SC_EXPECTATION_FAILED;
-            goto done;
-        }
+    header.op = US_OPCODE_SHM_DOORBELL;
+    header.fragmented = 0;
+    header.sz_payload = 0;
+    return us_write (server, usc, &header, sizeof (USFrameHeader));
+}
+
+/*
+ * Copy the body in the shared ring, release the space of the packet, and
+ * call on_packet() with the copy; the client can still write to the ring.
+ */
+static int us_finish_shm_packet (USServer* server, USClient* usc,
+        int *sta_code)
+{
+    ShmRingDesc *desc = &usc->shm_desc;
+    char *body;
+
+    if (desc->op != US_OPCODE_TEXT && desc->op != US_OPCODE_BIN) {
+        *sta_code = PCRDR_SC_EXPECTATION_FAILED;
+        return PCRDR_ERROR_PROTOCOL;
     }
-    else {
-        n = read (usc->fd, &usc->header, sizeof (USFrameHeader));
-        if (n < (ssize_t)sizeof (USFrameHeader)) {
-            purc_log_error ("Failed to read frame header from Unix socket.\n");
-            err_code = PCRDR_ERROR_IO;
-            sta_code = PCRDR_SC_EXPECTATION_FAILED;
-            goto done;
-        }
 
-        switch (usc->header.op) {
-        case US_OPCODE_PING: {
-            USFrameHeader header;
-            header.op = US_OPCODE_PONG;
-            header.fragmented = 0;
-            header.sz_payload = 0;
-            n = us_write (server, usc, &header, sizeof (USFrameHeader));
-            if (n < 0) {
-                purc_log_error ("Error when wirting socket: %s\n", strerror (errno));
-                err_code = PCRDR_ERROR_IO;
-                sta_code = PCRDR_SC_IOERR;
-            }
-            break;
-        }
+    if (desc->size > PCRDR_MAX_INMEM_PAYLOAD_SIZE) {
+        *sta_code = PCRDR_SC_PACKET_TOO_LARGE;
+        return PCRDR_ERROR_PROTOCOL;
+    }
 
-        case US_OPCODE_CLOSE:
-            purc_log_warn ("Peer closed\n");
-            err_code = PCRDR_ERROR_PEER_CLOSED;
-            sta_code = 0;
-            break;
+    if ((body = buf_pool_get (&server->pool, desc->size + 1)) == NULL) {
+        *sta_code = PCRDR_SC_INSUFFICIENT_STORAGE;
+        return PCRDR_ERROR_NOMEM;
+    }
 
-        case US_OPCODE_TEXT:
-        case US_OPCODE_BIN: {
-            if (usc->header.fragmented > 0 &&
-                    usc->header.fragmented > usc->header.sz_payload) {
-                usc->sz_packet = usc->header.fragmented;
+    if (shm_ring_read (usc->ring, desc, body)) {
+        buf_pool_put (&server->pool, body, desc->size + 1);
+        *sta_code = PCRDR_SC_PACKET_TOO_LARGE;
+        return PCRDR_ERROR_PROTOCOL;
+    }
+
+    /* the space can be used by the client again */
+    if (shm_ring_release (usc->ring, desc))
+        us_ring_doorbell (server, usc);
+
+    clock_gettime (CLOCK_MONOTONIC, &usc->ts);
+
+    /* the last byte of a text packet is reserved by the client */
+    if (desc->op == US_OPCODE_TEXT)
+        body [desc->size - 1] = '\0';
+
+    *sta_code = server->on_packet (server, (SockClient *)usc, body,
+            desc->size, (desc->op == US_OPCODE_TEXT) ? PT_TEXT : PT_BINARY);
+    buf_pool_put (&server->pool, body, desc->size + 1);
+
+    if (*sta_code != PCRDR_SC_OK) {
+        purc_log_warn ("Internal error after got a packet: %d\n", *sta_code);
+        return PCRDR_ERROR_SERVER_ERROR;
+    }
+
+    return 0;
+}
+
+/*
+ * Finish the current frame after got all of its payload, and call
+ * on_packet() if the packet is complete.
+ */
+static int us_finish_frame (USServer* server, USClient* usc, int *sta_code)
+{
+    usc->status &= ~US_WATING_FOR_PAYLOAD;
+
+    switch (usc->header.op) {
+    case US_OPCODE_TEXT:
+    case US_OPCODE_BIN:
+        usc->sz_read = usc->header.sz_payload;
+        if (usc->header.fragmented > 0)
+            return 0;
+        break;
+
+    case US_OPCODE_CONTINUATION:
+        usc->sz_read += usc->header.sz_payload;
+        return 0;
+
+    case US_OPCODE_END:
+        usc->sz_read += usc->header.sz_payload;
+        break;
+
+    case US_OPCODE_SHM_PACKET:
+        return us_finish_shm_packet (server, usc, sta_code);
+
+    default:
+        return 0;
+    }
+
+    usc->packet [usc->sz_read] = '\0';
+    *sta_code = server->on_packet (server, (SockClient *)usc, usc->packet,
+            (usc->t_packet == PT_TEXT) ? (usc->sz_read + 1) : usc->sz_read,
+            usc->t_packet);
+    us_release_packet (server, usc);
+    update_upper_entity_stats (usc->entity, usc->sz_pending, usc->sz_packet);
+
+    if (*sta_code != PCRDR_SC_OK) {
+        purc_log_warn ("Internal error after got a packet: %d\n", *sta_code);
+        return PCRDR_ERROR_SERVER_ERROR;
+    }
+
+    return 0;
+}
+
+/* The upper entity paused the input; see the `paused` of UpperEntity */
+static inline bool us_input_paused (USClient* usc)
+{
+    return usc->entity && usc->entity->paused;
+}
+
+/*
+ * Decode all complete frames in the input buffer; the partial frame
+ * is kept for the next read. The frames left after the input was paused
+ * are kept too, and decoded after resumed.
+ */
+static int us_decode_inbuf (USServer* server, USClient* usc, int *sta_code)
+{
+    int err_code = 0;
+
+    while (err_code == 0 && !us_input_paused (usc)) {
+        size_t avail = usc->nr_inbuf - usc->pos_inbuf;
+
+        if (usc->status & US_WATING_FOR_PAYLOAD) {
+            size_t n = usc->header.sz_payload - usc->sz_frm_read;
+
+            if (n > avail)
+                n = avail;
+            if (n > 0 && us_frame_has_data (usc)) {
+                memcpy (usc->packet + usc->sz_read + usc->sz_frm_read,
+                        usc->inbuf + usc->pos_inbuf, n);
             }
-            else {
-                usc->sz_packet = usc->header.sz_payload;
+            else if (n > 0 && usc->header.op == US_OPCODE_SHM_PACKET) {
+                memcpy ((char *)&usc->shm_desc + usc->sz_frm_read,
+                        usc->inbuf + usc->pos_inbuf, n);
             }
+            usc->pos_inbuf += n;
+            usc->sz_frm_read += n;
 
-            if (usc->sz_packet > PCRDR_MAX_INMEM_PAYLOAD_SIZE ||
-                    usc->sz_packet == 0 ||
-                    usc->header.sz_payload == 0) {
-                err_code = PCRDR_ERROR_PROTOCOL;
-                sta_code = PCRDR_SC_PACKET_TOO_LARGE;
+            if (usc->sz_frm_read < usc->header.sz_payload)
                 break;
-            }
 
-            clock_gettime (CLOCK_MONOTONIC, &usc->ts);
-            if (usc->header.op == US_OPCODE_TEXT)
-                usc->t_packet = PT_TEXT;
-            else
-                usc->t_packet = PT_BINARY;
-
-            /* always reserve a space for null character */
-            usc->packet = malloc (usc->sz_packet + 1);
-            if (usc->packet == NULL) {
-                purc_log_error ("Failed to allocate memory for packet (size: %u)\n",
-                        usc->sz_packet);
-                err_code = PCRDR_ERROR_NOMEM;
-                sta_code = PCRDR_SC_INSUFFICIENT_STORAGE;
+            err_code = us_finish_frame (server, usc, sta_code);
+        }
+        else {
+            if (avail < sizeof (USFrameHeader))
                 break;
-            }
-
-            update_upper_entity_stats (usc->entity, usc->sz_pending, usc->sz_packet);
 
-            retv = try_to_read_payload (server, usc);
-            if (retv > 0) {
-                goto got_packet;
-            }
-            else if (retv == 0) {
-                goto done;
-            }
-            else if (retv == PCRDR_ERROR_IO) {
-                usc->status |= US_WATING_FOR_PAYLOAD;
-                goto done;
-            }
-            else {
-                err_code = retv;
-                sta_code = PCRDR_SC_EXPECTATION_FAILED;
-                goto done;
-            }
-            break;
+            memcpy (&usc->header, usc->inbuf + usc->pos_inbuf,
+                    sizeof (USFrameHeader));
+            usc->pos_inbuf += sizeof (USFrameHeader);
+            err_code = us_start_frame (server, usc, sta_code);
         }
+    }
 
-        case US_OPCODE_CONTINUATION:
-        case US_OPCODE_END:
-            if (usc->header.sz_payload == 0) {
-                err_code = PCRDR_ERROR_PROTOCOL;
-                sta_code = PCRDR_SC_PACKET_TOO_LARGE;
-                break;
-            }
+    /* move the partial frame header to the head of the buffer */
+    if (usc->pos_inbuf == usc->nr_inbuf) {
+        usc->pos_inbuf = usc->nr_inbuf = 0;
+    }
+    else if (usc->pos_inbuf > 0) {
+        memmove (usc->inbuf, usc->inbuf + usc->pos_inbuf,
+                usc->nr_inbuf - usc->pos_inbuf);
+        usc->nr_inbuf -= usc->pos_inbuf;
+        usc->pos_inbuf = 0;
+    }
 
-            retv = try_to_read_payload (server, usc);
-            if (retv > 0) {
-                goto got_packet;
-            }
-            else if (retv == 0) {
-                goto done;
-            }
-            else if (retv == PCRDR_ERROR_IO) {
-                usc->status |= US_WATING_FOR_PAYLOAD;
-                goto done;
-            }
-            else {
-                err_code = retv;
-                sta_code = PCRDR_SC_EXPECTATION_FAILED;
-                goto done;
-            }
-            break;
+    return err_code;
+}
 
-        case US_OPCODE_PONG: {
-            purcmc_endpoint *endpoint = container_of (usc->entity, purcmc_endpoint, entity);
+/*
+ * Read data from the socket, and keep the file descriptors passed along
+ * with the data for the frames using them.
+ */
+static ssize_t us_recv (USClient* usc, void *buf, size_t len)
+{
+    union {
+        char buf [CMSG_SPACE (sizeof (int) * US_MAX_PENDING_FDS)];
+        struct cmsghdr align;
+    } ctrl;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t n;
 
-            assert (endpoint);
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof (ctrl.buf);
 
-            purc_log_info ("Got a PONG frame from endpoint @%s/%s/%s\n",
-                    endpoint->host_name, endpoint->app_name, endpoint->runner_name);
-            break;
+    n = recvmsg (usc->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0 || msg.msg_controllen == 0)
+        return n;
+
+    for (cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+        size_t i, nr_fds;
+
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        nr_fds = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+        for (i = 0; i < nr_fds; i++) {
+            int fd;
+
+            memcpy (&fd, CMSG_DATA (cmsg) + sizeof (int) * i, sizeof (int));
+            /* the frame expecting an extra one will fail */
+            if (usc->nr_fds < US_MAX_PENDING_FDS)
+                usc->fds [usc->nr_fds++] = fd;
+            else
+                close (fd);
         }
+    }
 
-        default:
-            purc_log_error ("Unknown frame opcode: %d\n", usc->header.op);
-            err_code = PCRDR_ERROR_PROTOCOL;
-            sta_code = PCRDR_SC_EXPECTATION_FAILED;
+    return n;
+}
+
+/*
+ * Read all available data from the socket until EAGAIN, and handle
+ * every complete frame and packet in one pass; safe for edge-triggered
+ * notifications. Stops reading once the upper entity paused the input;
+ * called again after resumed to handle the frames left in the buffer.
+ *
+ * On error, the client is cleaned up and a non-zero error code is returned.
+ */
+int us_handle_reads (USServer* server, USClient* usc)
+{
+    int err_code = 0, sta_code = 0;
+    ssize_t n;
+
+    if (usc->inbuf == NULL) {
+        usc->inbuf = buf_pool_get (&server->pool, US_INBUF_SIZE);
+        if (usc->inbuf == NULL) {
+            err_code = PCRDR_ERROR_NOMEM;
+            sta_code = PCRDR_SC_INSUFFICIENT_STORAGE;
+            goto done;
+        }
+    }
+    else if (usc->nr_inbuf > 0 &&
+            (err_code = us_decode_inbuf (server, usc, &sta_code))) {
+        goto done;
+    }
+
+    while (!us_input_paused (usc)) {
+        size_t left = usc->header.sz_payload - usc->sz_frm_read;
+
+        /* read a large payload directly to the packet buffer */
+        if ((usc->status & US_WATING_FOR_PAYLOAD) && us_frame_has_data (usc) &&
+                usc->nr_inbuf == 0 && left >= US_INBUF_SIZE) {
+            n = us_recv (usc, usc->packet + usc->sz_read + usc->sz_frm_read,
+                    left);
+            if (n > 0) {
+                usc->sz_frm_read += n;
+                if (usc->sz_frm_read == usc->header.sz_payload &&
+                        (err_code = us_finish_frame (server, usc, &sta_code)))
+                    goto done;
+                continue;
+            }
+        }
+        else {
+            n = us_recv (usc, usc->inbuf + usc->nr_inbuf,
+                    US_INBUF_SIZE - usc->nr_inbuf);
+            if (n > 0) {
+                usc->nr_inbuf += n;
+                if ((err_code = us_decode_inbuf (server, usc, &sta_code)))
+                    goto done;
+                continue;
+            }
+        }
+
+        if (n == 0) {
+            purc_log_warn ("Peer closed the Unix socket: fd (%d)\n", usc->fd);
+            err_code = PCRDR_ERROR_PEER_CLOSED;
+            sta_code = 0;
+            goto done;
+        }
+        else if (errno == EINTR) {
+            continue;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            /* an idle client does not hold the input buffer */
+            if (usc->nr_inbuf == 0) {
+                buf_pool_put (&server->pool, usc->inbuf, US_INBUF_SIZE);
+                usc->inbuf = NULL;
+            }
             break;
         }
+
+        purc_log_error ("Failed to read from Unix socket: %s\n",
+                strerror (errno));
+        err_code = PCRDR_ERROR_IO;
+        sta_code = PCRDR_SC_IOERR;
+        goto done;
     }
 
 done:
@@ -634,28 +1047,6 @@ done:
         us_cleanup_client (server, usc);
     }
 
-    return err_code;
-
-got_packet:
-    usc->packet [usc->sz_read] = '\0';
-    sta_code = server->on_packet (server, (SockClient *)usc, usc->packet,
-            (usc->t_packet == PT_TEXT) ? (usc->sz_read + 1) : usc->sz_read,
-            usc->t_packet);
-    free (usc->packet);
-    usc->packet = NULL;
-    usc->sz_packet = 0;
-    usc->sz_read = 0;
-    update_upper_entity_stats (usc->entity, usc->sz_pending, usc->sz_packet);
-
-    if (sta_code != PCRDR_SC_OK) {
-        purc_log_warn ("Internal error after got a packet: %d\n", sta_code);
-
-        server->on_error (server, (SockClient*)usc, sta_code);
-        err_code = PCRDR_ERROR_SERVER_ERROR;
-
-        us_cleanup_client (server, usc);
-    }
-
     return err_code;
 }
 
@@ -667,7 +1058,7 @@ got_packet:
 int us_handle_writes (USServer *server, USClient *usc)
 {
     us_write_pending (server, usc);
-    if (list_empty (&usc->pending)) {
+    if (send_queue_is_empty (&usc->sendq)) {
         usc->status &= ~US_SENDING;
     }
 
@@ -717,66 +1108,89 @@ int us_close_client (USServer* server, USClient* usc)
     return 0;
 }
 
+/* the max number of frames sent by one call of writev () */
+#define US_MAX_FRAMES_PER_WRITE     (SEND_QUEUE_MAX_IOVS / 2)
+
 /*
- * Send a packet
+ * Send the frames of a packet with the headers and the payloads
+ * gathered in iovecs.
  *
- * return zero on success; none-zero on error.
+ * If `owned` is not NULL, it is the buffer of the data given up by
+ * the caller; the payload will be referred instead of copied when queued.
  */
-int us_send_packet (USServer* server, USClient* usc,
-        USOpcode op, const void* data, unsigned int sz)
+static int us_send_frames (USServer* server, USClient* usc,
+        USOpcode op, const char* data, unsigned int sz, void *owned)
 {
-    USFrameHeader header;
+    USFrameHeader headers [US_MAX_FRAMES_PER_WRITE];
+    struct iovec iov [SEND_QUEUE_MAX_IOVS];
+    unsigned int left = sz;
 
     switch (op) {
         case US_OPCODE_TEXT:
         case US_OPCODE_BIN:
             break;
         case US_OPCODE_PING:
+            if (owned)
+                free (owned);
             return us_ping_client (server, usc);
         case US_OPCODE_CLOSE:
+            if (owned)
+                free (owned);
             return us_close_client (server, usc);
         default:
             purc_log_warn ("Unknown UnixSocket op code: %d\n", op);
+            if (owned)
+                free (owned);
             return -1;
     }
 
-    if (sz > PCRDR_MAX_FRAME_PAYLOAD_SIZE) {
-        const char* buff = data;
-        unsigned int left = sz;
+    do {
+        int nr_frames = 0;
 
-        do {
-            if (left == sz) {
-                header.op = op;
-                header.fragmented = sz;
-                header.sz_payload = PCRDR_MAX_FRAME_PAYLOAD_SIZE;
-                left -= PCRDR_MAX_FRAME_PAYLOAD_SIZE;
+        while (nr_frames < US_MAX_FRAMES_PER_WRITE) {
+            USFrameHeader *header = headers + nr_frames;
+
+            if (sz <= PCRDR_MAX_FRAME_PAYLOAD_SIZE) {
+                header->op = op;
+                header->fragmented = 0;
+                header->sz_payload = sz;
+            }
+            else if (left == sz) {
+                header->op = op;
+                header->fragmented = sz;
+                header->sz_payload = PCRDR_MAX_FRAME_PAYLOAD_SIZE;
             }
             else if (left > PCRDR_MAX_FRAME_PAYLOAD_SIZE) {
-                header.op = US_OPCODE_CONTINUATION;
-                header.fragmented = 0;
-                header.sz_payload = PCRDR_MAX_FRAME_PAYLOAD_SIZE;
-                left -= PCRDR_MAX_FRAME_PAYLOAD_SIZE;
+                header->op = US_OPCODE_CONTINUATION;
+                header->fragmented = 0;
+                header->sz_payload = PCRDR_MAX_FRAME_PAYLOAD_SIZE;
             }
             else {
-                header.op = US_OPCODE_END;
-                header.fragmented = 0;
-                header.sz_payload = left;
-                left = 0;
+                header->op = US_OPCODE_END;
+                header->fragmented = 0;
+                header->sz_payload = left;
             }
 
-            us_write (server, usc, &header, sizeof (USFrameHeader));
-            us_write (server, usc, buff, header.sz_payload);
-            buff += header.sz_payload;
+            iov [nr_frames * 2].iov_base = header;
+            iov [nr_frames * 2].iov_len = sizeof (USFrameHeader);
+            iov [nr_frames * 2 + 1].iov_base = (char *)data + (sz - left);
+            iov [nr_frames * 2 + 1].iov_len = header->sz_payload;
+            left -= header->sz_payload;
+            nr_frames++;
 
-        } while (left > 0);
-    }
-    else {
-        header.op = op;
-        header.fragmented = 0;
-        header.sz_payload = sz;
-        us_write (server, usc, &header, sizeof (USFrameHeader));
-        us_write (server, usc, data, sz);
-    }
+            if (left == 0)
+                break;
+        }
+
+        /* the buffer will be freed after the last frame sent */
+        if (us_writev (server, usc, iov, nr_frames * 2,
+                    owned ? data : NULL, sz, left ? NULL : owned)) {
+            if (left && owned)
+                free (owned);
+            break;
+        }
+
+    } while (left > 0);
 
     if (usc->status & US_ERR) {
         purc_log_error ("Error when sending data to client: fd (%d), pid (%d)\n",
@@ -787,19 +1201,155 @@ int us_send_packet (USServer* server, USClient* usc,
     return 0;
 }
 
+/*
+ * Send a packet
+ *
+ * return zero on success; none-zero on error.
+ */
+int us_send_packet (USServer* server, USClient* usc,
+        USOpcode op, const void* data, unsigned int sz)
+{
+    /* the payload will be copied if it can not be sent at once */
+    return us_send_frames (server, usc, op, data, sz, NULL);
+}
+
+/*
+ * Send a single frame and take the ownership of the data, which must be
+ * allocated by malloc (); used to stream a fragmented packet.
+ *
+ * return zero on success; none-zero on error.
+ */
+int us_send_owned_frame (USServer* server, USClient* usc,
+        USOpcode op, unsigned int fragmented, char* data, unsigned int sz)
+{
+    USFrameHeader header;
+    struct iovec iov [2];
+
+    header.op = op;
+    header.fragmented = fragmented;
+    header.sz_payload = sz;
+
+    iov [0].iov_base = &header;
+    iov [0].iov_len = sizeof (USFrameHeader);
+    iov [1].iov_base = data;
+    iov [1].iov_len = sz;
+    return us_writev (server, usc, iov, 2, data, sz, data);
+}
+
+/*
+ * Send a packet and take the ownership of the data, which must be
+ * allocated by malloc ().
+ *
+ * return zero on success; none-zero on error.
+ */
+int us_send_owned_packet (USServer* server, USClient* usc,
+        USOpcode op, char* data, unsigned int sz)
+{
+    return us_send_frames (server, usc, op, data, sz, data);
+}
+
+/*
+ * Create a shared ring for the client, and send the memfd of the ring
+ * in the ancillary data of a US_OPCODE_SHM_SETUP frame.
+ *
+ * The ring is only granted to a client of the same user, which can do
+ * anything to the server anyway. The frame can not be queued with the
+ * file descriptor, so it is sent at once even if the server is corked,
+ * and there must be no data pending for the client.
+ *
+ * return zero on success; none-zero on error.
+ */
+int us_setup_shm_ring (USServer* server, USClient* usc, size_t size)
+{
+    USFrameHeader header;
+    struct iovec iov;
+    struct msghdr msg;
+    union {
+        char buf [CMSG_SPACE (sizeof (int))];
+        struct cmsghdr align;
+    } ctrl;
+    struct cmsghdr *cmsg;
+    ssize_t bytes;
+
+    if (usc->ring || usc->uid != geteuid () || (usc->status & US_ERR) ||
+            !send_queue_is_empty (&usc->sendq))
+        return -1;
+
+    usc->ring = shm_ring_create (size);
+    if (usc->ring == NULL) {
+        purc_log_warn ("Failed to create the shared ring for client: fd (%d)\n",
+                usc->fd);
+        return -1;
+    }
+
+    header.op = US_OPCODE_SHM_SETUP;
+    header.fragmented = 0;
+    header.sz_payload = 0;
+    iov.iov_base = &header;
+    iov.iov_len = sizeof (USFrameHeader);
+
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof (ctrl.buf);
+    cmsg = CMSG_FIRSTHDR (&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+    memcpy (CMSG_DATA (cmsg), &usc->ring->fd, sizeof (int));
+
+    do {
+        bytes = sendmsg (usc->fd, &msg, MSG_NOSIGNAL);
+    } while (bytes == -1 && errno == EINTR);
+
+    /* the memfd is held by the client from now on */
+    close (usc->ring->fd);
+    usc->ring->fd = -1;
+
+    if (bytes <= 0) {
+        shm_ring_destroy (usc->ring);
+        usc->ring = NULL;
+        return -1;
+    }
+
+    /* the file descriptor went with the first byte; queue the rest */
+    if ((size_t)bytes < sizeof (USFrameHeader))
+        return us_write (server, usc, (char *)&header + bytes,
+                sizeof (USFrameHeader) - bytes);
+
+    return 0;
+}
+
 int us_remove_dangling_client (USServer *server, USClient *usc)
 {
+    /* try to send the data held by corking, e.g., the error response */
+    list_del_init (&usc->gathering);
+    if (!send_queue_is_empty (&usc->sendq))
+        us_write_pending (server, usc);
     us_clear_pending_data (usc);
+    send_queue_destroy (&usc->sendq);
+
+    us_release_packet (server, usc);
+    if (usc->inbuf)
+        buf_pool_put (&server->pool, usc->inbuf, US_INBUF_SIZE);
+    usc->inbuf = NULL;
+
+    if (usc->ring)
+        shm_ring_destroy (usc->ring);
+    usc->ring = NULL;
+
+    while (usc->nr_fds > 0)
+        close (us_pop_fd (usc));
 
     if (usc->fd >= 0) {
         close (usc->fd);
     }
 
+    /* the slot is taken again by the next client of the fd */
     usc->fd = -1;
     server->nr_clients--;
     assert (server->nr_clients >= 0);
-
-    free (usc);
     return 0;
 }
 
@@ -28,6 +28,26 @@
 #include <unistd.h>
 
 #include "utils/list.h"
+#include "sendqueue.h"
+#include "bufpool.h"
+#include "shmring.h"
+#include "clienttable.h"
+
+/* the opcodes of the frames for the shared ring, after those of USOpcode */
+#define US_OPCODE_SHM_SETUP     0x10    /* to client: the memfd of the ring */
+#define US_OPCODE_SHM_PACKET    0x11    /* to server: a ShmRingDesc */
+#define US_OPCODE_SHM_DOORBELL  0x12    /* to client: the space released */
+
+/* the opcodes of the frames carrying a sealed memfd as the body; see
+   PURCMC_SEALED_BODY_FORMAT */
+#define US_OPCODE_FD_TEXT       0x13
+#define US_OPCODE_FD_BIN        0x14
+
+/* the max size of a body in a sealed memfd */
+#define US_MAX_FD_PACKET_SIZE   (1024 * 1024 * 1024)
+
+/* the max number of the file descriptors received but not used yet */
+#define US_MAX_PENDING_FDS      4
 
 typedef enum USSTATUS {
     US_OK = 0,
@@ -39,17 +59,6 @@ typedef enum USSTATUS {
     US_WATING_FOR_PAYLOAD = (1 << 5),
 } USStatus;
 
-typedef struct USPendingData_ {
-    struct list_head list;
-
-    /* the size of data */
-    size_t  szdata;
-    /* the size of sent */
-    size_t  szsent;
-    /* pointer to the pending data */
-    unsigned char data[0];
-} USPendingData;
-
 /* A UnixSocket Client */
 typedef struct USClient_
 {
@@ -65,18 +74,36 @@ typedef struct USClient_
 
     /* fields for pending data to write */
     size_t              sz_pending;
-    struct list_head    pending;
+    SendQueue           sendq;
+    /* the node in the list of the clients to flush after uncorked */
+    struct list_head    gathering;
 
     /* current frame header */
     USFrameHeader   header;
+    /* read size of the payload of current frame */
+    uint32_t        sz_frm_read;
+
+    /* the input buffer holding the data not decoded yet;
+       borrowed from the pool of the server when there are data to read */
+    char           *inbuf;
+    size_t          nr_inbuf;   /* the size of valid data in inbuf */
+    size_t          pos_inbuf;  /* the position of the data to decode */
 
     /* fields for current reading packet */
     int         t_packet;   /* type of packet */
     int         padding_;
     uint32_t    sz_packet;  /* total size of current packet */
     uint32_t    sz_read;    /* read size of current packet */
-    char*       packet;     /* packet data */
+    char*       packet;     /* packet data; borrowed from the pool */
 
+    /* the shared ring; NULL if not granted */
+    ShmRing    *ring;
+    /* the descriptor in the payload of current US_OPCODE_SHM_PACKET frame */
+    ShmRingDesc shm_desc;
+
+    /* the file descriptors received and not used yet, in order */
+    int         fds[US_MAX_PENDING_FDS];
+    int         nr_fds;
 } USClient;
 
 struct SockClient_;
@@ -87,10 +114,24 @@ typedef struct USServer_
     int listener;
     int nr_clients;
 
+    /* whether to hold the data sent in the gather queues */
+    bool corked;
+    /* the clients to flush after uncorked */
+    struct list_head gathering;
+
+    /* the buffers for the input and the packets of the clients */
+    BufPool pool;
+    /* the clients, allocated in the slots of their fds */
+    ClientTable clients;
+
     /* Callbacks */
     int (*on_accepted) (void *server, struct SockClient_ *client);
     int (*on_packet) (void *server, struct SockClient_ *client,
             char* body, unsigned int sz_body, int type);
+    /* Optional; takes over a body mapped from a memfd instead of
+       on_packet(), and releases it later by calling us_unmap_body() */
+    int (*on_mapped_packet) (void *server, struct SockClient_ *client,
+            char* body, unsigned int sz_body, int type, size_t sz_mapped);
     int (*on_pending) (void *server, struct SockClient_* client);
     int (*on_close) (void *server, struct SockClient_ *client);
     void (*on_error) (void *server, struct SockClient_ *client, int err_code);
@@ -102,7 +143,9 @@ USServer *us_init (const purcmc_server_config* config);
 int us_listen (USServer* server);
 void us_stop (USServer *server);
 
-USClient *us_handle_accept (USServer *server);
+/* Accept the pending connections until the backlog is drained or `max`
+   clients are accepted; returns the number of the clients accepted */
+int us_handle_accepts (USServer *server, USClient **clients, int max);
 int us_handle_reads (USServer *server, USClient* usc);
 int us_handle_writes (USServer *server, USClient *usc);
 int us_remove_dangling_client (USServer * server, USClient *usc);
@@ -112,6 +155,22 @@ int us_ping_client (USServer* server, USClient* usc);
 int us_close_client (USServer* server, USClient* usc);
 int us_send_packet (USServer* server, USClient* usc,
         USOpcode op, const void *data, unsigned int sz);
+int us_send_owned_packet (USServer* server, USClient* usc,
+        USOpcode op, char *data, unsigned int sz);
+
+int us_send_owned_frame (USServer* server, USClient* usc,
+        USOpcode op, unsigned int fragmented, char *data, unsigned int sz);
+
+/* Release a body passed to on_mapped_packet(); may be called
+   in any thread */
+void us_unmap_body (char *body, size_t sz_mapped);
+
+/* Create a shared ring for the client and send the memfd to it;
+   must be called before any data queued for the client */
+int us_setup_shm_ring (USServer* server, USClient* usc, size_t size);
+
+void us_cork (USServer *server);
+void us_uncork (USServer *server);
 
 #endif /* XGUIPRO_PURCMC_UNIXSOCKET_H */
 
@@ -28,6 +28,7 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <config.h>
 
 #include <stdio.h>
@@ -49,132 +50,52 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#if HAVE(ZLIB)
+#include <zlib.h>
+#endif
 
 #include "utils/sha1.h"
 #include "utils/base64.h"
 
 #include "server.h"
 #include "websocket.h"
+#include "wsmask.h"
+#include "wsutf8.h"
 
-/* *INDENT-OFF* */
-
-/* UTF-8 Decoder */
-/* Copyright (c) 2008-2009 Bjoern Hoehrmann <bjoern@hoehrmann.de>
- * See http://bjoern.hoehrmann.de/utf-8/decoder/dfa/ for details. */
-#define UTF8_VALID 0
-#define UTF8_INVAL 1
-static const uint8_t utf8d[] = {
-  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 00..1f */
-  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 20..3f */
-  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 40..5f */
-  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 60..7f */
-  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, /* 80..9f */
-  7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, /* a0..bf */
-  8,8,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2, /* c0..df */
-  0xa,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x4,0x3,0x3, /* e0..ef */
-  0xb,0x6,0x6,0x6,0x5,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8, /* f0..ff */
-  0x0,0x1,0x2,0x3,0x5,0x8,0x7,0x1,0x1,0x1,0x4,0x6,0x1,0x1,0x1,0x1, /* s0..s0 */
-  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,0,1,1,1,1,1,0,1,0,1,1,1,1,1,1, /* s1..s2 */
-  1,2,1,1,1,1,1,2,1,2,1,1,1,1,1,1,1,1,1,1,1,1,1,2,1,1,1,1,1,1,1,1, /* s3..s4 */
-  1,2,1,1,1,1,1,1,1,2,1,1,1,1,1,1,1,1,1,1,1,1,1,3,1,3,1,1,1,1,1,1, /* s5..s6 */
-  1,3,1,1,1,1,1,3,1,3,1,1,1,1,1,1,1,3,1,1,1,1,1,1,1,1,1,1,1,1,1,1, /* s7..s8 */
-};
-/* *INDENT-ON* */
+#if HAVE(TLS_HANDSHAKER)
+#include <purc/purc.h>
+#endif
 
 static void handle_ws_read_close (WSServer * server, WSClient * client);
 #if HAVE(LIBSSL)
 static int shutdown_ssl (WSClient * client);
 #endif
+#if HAVE(TLS_HANDSHAKER)
+static int ws_start_handshaker (WSServer * server);
+static void ws_stop_handshaker (WSServer * server);
+#endif
 
-/* Determine if the given string is valid UTF-8.
- *
- * The state after the by has been processed is returned. */
-static uint32_t
-verify_utf8 (uint32_t * state, const char *str, int len)
-{
-  int i;
-  uint32_t type;
-
-  for (i = 0; i < len; ++i) {
-    type = utf8d[(uint8_t) str[i]];
-    *state = utf8d[256 + (*state) * 16 + type];
-
-    if (*state == UTF8_INVAL)
-      break;
-  }
-
-  return *state;
-}
-
-/* Decode a character maintaining state and a byte, and returns the
- * state achieved after processing the byte.
- *
- * The state after the by has been processed is returned. */
-static uint32_t
-utf8_decode (uint32_t * state, uint32_t * p, uint32_t b)
-{
-  uint32_t type = utf8d[(uint8_t) b];
-
-  *p = (*state != UTF8_VALID) ? (b & 0x3fu) | (*p << 6) : (0xff >> type) & (b);
-  *state = utf8d[256 + *state * 16 + type];
-
-  return *state;
-}
-
-/* Replace malformed sequences with a substitute character.
- *
- * On success, it replaces the whole sequence and return a malloc'd buffer. */
-static char *
-sanitize_utf8 (const char *str, int len)
-{
-  char *buf = NULL;
-  uint32_t state = UTF8_VALID, prev = UTF8_VALID, cp = 0;
-  int i = 0, j = 0, k = 0, l = 0;
-
-  buf = calloc (len + 1, sizeof (char));
-  for (; i < len; prev = state, ++i) {
-    switch (utf8_decode (&state, &cp, (unsigned char) str[i])) {
-    case UTF8_INVAL:
-      /* replace the whole sequence */
-      if (k) {
-        for (l = i - k; l < i; ++l)
-          buf[j++] = '?';
-      } else {
-        buf[j++] = '?';
-      }
-      state = UTF8_VALID;
-      if (prev != UTF8_VALID)
-        i--;
-      k = 0;
-      break;
-    case UTF8_VALID:
-      /* fill i - k valid continuation bytes */
-      if (k)
-        for (l = i - k; l < i; ++l)
-          buf[j++] = str[l];
-      buf[j++] = str[i];
-      k = 0;
-      break;
-    default:
-      /* UTF8_VALID + continuation bytes */
-      k++;
-      break;
-    }
-  }
-
-  return buf;
-}
-
-/* Allocate memory for a websocket client */
+/* Allocate memory for a websocket client in the slot of its fd */
 static WSClient *
-new_wsclient (void)
+new_wsclient (WSServer * server, int fd)
 {
     WSClient *ws_client;
 
-    ws_client = calloc (1, sizeof (WSClient));
+    ws_client = client_table_alloc (&server->clients, fd);
+    if (ws_client == NULL)
+        return NULL;
+
+    ws_client->fd = fd;
 
     ws_client->ct = CT_WEB_SOCKET;
     ws_client->status = WS_OK;
+    send_queue_init (&ws_client->sendq);
+    list_head_init (&ws_client->gathering);
+#if HAVE(LIBSSL)
+    list_head_init (&ws_client->handshaking);
+#endif
 
     return ws_client;
 }
@@ -282,22 +203,6 @@ strtoupper (char *str)
   return str;
 }
 
-/* Chop n characters from the beginning of the supplied buffer.
- *
- * The new length of the string is returned. */
-static size_t
-chop_nchars (char *str, size_t n, size_t len)
-{
-  if (n == 0 || str == 0)
-    return 0;
-
-  if (n > len)
-    n = len;
-  memmove (str, str + n, len - n);
-
-  return (len - n);
-}
-
 /* Free a frame structure and its data for the given client. */
 static void
 ws_free_frame (WSClient * client)
@@ -318,7 +223,7 @@ ws_free_message (WSClient * client)
   client->message = NULL;
 
   update_upper_entity_stats (client->entity,
-          client->sockqueue ? client->sockqueue->qlen : 0, 0);
+          client->sendq.sz_pending, 0);
 }
 
 /* Free all HTTP handshake headers data for the given client. */
@@ -351,6 +256,10 @@ ws_free_header_fields (WSHeaders * headers)
     free (headers->ws_resp);
   if (headers->ws_sock_ver)
     free (headers->ws_sock_ver);
+  if (headers->ws_extensions)
+    free (headers->ws_extensions);
+  if (headers->ws_ext_resp)
+    free (headers->ws_ext_resp);
   if (headers->referer)
     free (headers->referer);
 }
@@ -359,17 +268,7 @@ ws_free_header_fields (WSHeaders * headers)
 static void
 ws_clear_queue (WSClient * client)
 {
-  WSQueue **queue = &client->sockqueue;
-  if (!(*queue))
-    return;
-
-  if ((*queue)->queued)
-    free ((*queue)->queued);
-  (*queue)->queued = NULL;
-  (*queue)->qlen = 0;
-
-  free ((*queue));
-  (*queue) = NULL;
+  send_queue_clear (&client->sendq);
 
   /* done sending the whole queue, stop throttling */
   client->status &= ~WS_THROTTLING;
@@ -378,10 +277,341 @@ ws_clear_queue (WSClient * client)
     client->status = WS_CLOSE;
 
   update_upper_entity_stats (client->entity,
-          client->sockqueue ? client->sockqueue->qlen : 0,
+          client->sendq.sz_pending,
           client->message ? client->message->payloadsz : 0);
 }
 
+#if HAVE(ZLIB)
+/* The zlib memory level for compressing; uses 128KiB + 2 << window bits */
+#define WS_DEFLATE_MEM_LEVEL  8
+
+/* The context of permessage-deflate (RFC 7692) of a connection */
+typedef struct WSDeflate_
+{
+  z_stream tx;                  /* compressing the messages sent */
+  z_stream rx;                  /* decompressing the messages received */
+  int tx_inited;
+  int rx_inited;
+
+  int server_no_context_takeover;
+  int client_no_context_takeover;
+  int server_max_window_bits;
+
+  int tx_compressing;           /* compressing the current sent message? */
+} WSDeflate;
+
+/* Free the permessage-deflate context of the given client. */
+static void
+ws_free_deflate (WSClient * client)
+{
+  WSDeflate *pmd = client->deflate;
+
+  if (pmd == NULL)
+    return;
+
+  if (pmd->tx_inited)
+    deflateEnd (&pmd->tx);
+  if (pmd->rx_inited)
+    inflateEnd (&pmd->rx);
+  free (pmd);
+  client->deflate = NULL;
+}
+
+/* Create the permessage-deflate context with the negotiated parameters.
+ *
+ * On error, NULL is returned. */
+static WSDeflate *
+ws_new_deflate (int server_no_context_takeover,
+                int client_no_context_takeover, int server_max_window_bits)
+{
+  WSDeflate *pmd = calloc (1, sizeof (WSDeflate));
+
+  if (pmd == NULL)
+    return NULL;
+
+  pmd->server_no_context_takeover = server_no_context_takeover;
+  pmd->client_no_context_takeover = client_no_context_takeover;
+  pmd->server_max_window_bits = server_max_window_bits;
+
+  /* negative window bits for the raw deflate data without zlib header */
+  if (deflateInit2 (&pmd->tx, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                    -server_max_window_bits, WS_DEFLATE_MEM_LEVEL,
+                    Z_DEFAULT_STRATEGY) != Z_OK)
+    goto failed;
+  pmd->tx_inited = 1;
+
+  /* the client never uses a window larger than the maximum */
+  if (inflateInit2 (&pmd->rx, -MAX_WBITS) != Z_OK)
+    goto failed;
+  pmd->rx_inited = 1;
+
+  return pmd;
+
+failed:
+  if (pmd->tx_inited)
+    deflateEnd (&pmd->tx);
+  free (pmd);
+  return NULL;
+}
+
+/* Parse the value of a window bits parameter of permessage-deflate.
+ *
+ * On error, -1 is returned. */
+static int
+ws_parse_window_bits (const char *value)
+{
+  char *end = NULL;
+  long bits;
+
+  if (value == NULL || *value == '\0')
+    return -1;
+
+  bits = strtol (value, &end, 10);
+  if (*end != '\0' || bits < 8 || bits > 15)
+    return -1;
+
+  return (int) bits;
+}
+
+/* Strip the leading and trailing whitespaces and quotes of a token. */
+static char *
+ws_trim_token (char *str)
+{
+  char *end;
+
+  while (isspace ((unsigned char) *str) || *str == '"')
+    str++;
+
+  end = str + strlen (str);
+  while (end > str && (isspace ((unsigned char) end[-1]) || end[-1] == '"'))
+    end--;
+  *end = '\0';
+
+  return str;
+}
+
+/* Accept the given offer of permessage-deflate if we support all of the
+ * parameters in it.
+ *
+ * On success, 0 is returned and the permessage-deflate context and the
+ * response to the offer are set. */
+static int
+ws_accept_deflate_offer (WSClient * client, char *offer)
+{
+  WSHeaders *headers = client->headers;
+  char *saveptr = NULL, *param;
+  char resp[128];
+  int server_no_context_takeover = -1, client_no_context_takeover = -1;
+  int server_max_window_bits = -1, client_max_window_bits = -1;
+
+  param = strtok_r (offer, ";", &saveptr);
+  if (param == NULL || strcasecmp (ws_trim_token (param),
+                                   "permessage-deflate") != 0)
+    return 1;
+
+  /* unknown or duplicate parameters make the offer invalid */
+  while ((param = strtok_r (NULL, ";", &saveptr)) != NULL) {
+    char *value = strchr (param, '=');
+
+    if (value) {
+      *value++ = '\0';
+      value = ws_trim_token (value);
+    }
+    param = ws_trim_token (param);
+
+    if (strcasecmp (param, "server_no_context_takeover") == 0) {
+      if (value || server_no_context_takeover != -1)
+        return 1;
+      server_no_context_takeover = 1;
+    } else if (strcasecmp (param, "client_no_context_takeover") == 0) {
+      if (value || client_no_context_takeover != -1)
+        return 1;
+      client_no_context_takeover = 1;
+    } else if (strcasecmp (param, "server_max_window_bits") == 0) {
+      if (server_max_window_bits != -1)
+        return 1;
+      /* zlib does not support a window of 256 bytes for raw deflate */
+      server_max_window_bits = ws_parse_window_bits (value);
+      if (server_max_window_bits < 9)
+        return 1;
+    } else if (strcasecmp (param, "client_max_window_bits") == 0) {
+      if (client_max_window_bits != -1)
+        return 1;
+      /* the value is optional; it limits the client's window only */
+      client_max_window_bits = value ? ws_parse_window_bits (value) : 15;
+      if (client_max_window_bits < 0)
+        return 1;
+    } else {
+      return 1;
+    }
+  }
+
+  client->deflate = ws_new_deflate (server_no_context_takeover == 1,
+                                    client_no_context_takeover == 1,
+                                    server_max_window_bits > 0 ?
+                                    server_max_window_bits : MAX_WBITS);
+  if (client->deflate == NULL)
+    return 1;
+
+  strcpy (resp, "permessage-deflate");
+  if (server_no_context_takeover == 1)
+    strcat (resp, "; server_no_context_takeover");
+  if (client_no_context_takeover == 1)
+    strcat (resp, "; client_no_context_takeover");
+  if (server_max_window_bits > 0)
+    sprintf (resp + strlen (resp), "; server_max_window_bits=%d",
+             server_max_window_bits);
+  headers->ws_ext_resp = strdup (resp);
+
+  return 0;
+}
+
+/* Negotiate permessage-deflate by accepting the first offer we support
+ * in the Sec-WebSocket-Extensions headers. */
+static void
+ws_negotiate_deflate (WSServer * server, WSClient * client)
+{
+  WSHeaders *headers = client->headers;
+  char *exts, *saveptr = NULL, *offer;
+
+  if (server->config->nodeflate || headers->ws_extensions == NULL)
+    return;
+
+  if ((exts = strdup (headers->ws_extensions)) == NULL)
+    return;
+
+  for (offer = strtok_r (exts, ",", &saveptr); offer != NULL;
+       offer = strtok_r (NULL, ",", &saveptr)) {
+    if (ws_accept_deflate_offer (client, offer) == 0)
+      break;
+  }
+
+  free (exts);
+}
+
+/* Compress a frame of a message.  The data of the last frame are stripped
+ * off the trailing 0x00 0x00 0xff 0xff of the sync flush.
+ *
+ * On error, 1 is returned.
+ * On success, 0 is returned and the malloc'd compressed data are set. */
+static int
+ws_deflate_frame (WSDeflate * pmd, int fin, const char *p, int sz,
+                  char **out, int *outsz)
+{
+  z_stream *zs = &pmd->tx;
+  size_t room = deflateBound (zs, sz) + 16, len = 0;
+  char *buf = malloc (room), *tmp;
+  int ret;
+
+  if (buf == NULL)
+    return 1;
+
+  zs->next_in = (Bytef *) p;
+  zs->avail_in = sz;
+  for (;;) {
+    zs->next_out = (Bytef *) buf + len;
+    zs->avail_out = room - len;
+    ret = deflate (zs, Z_SYNC_FLUSH);
+    if (ret != Z_OK && ret != Z_BUF_ERROR)
+      goto failed;
+
+    len = room - zs->avail_out;
+    if (zs->avail_out > 0)
+      break;
+
+    /* no room for the pending output */
+    if ((tmp = realloc (buf, room * 2)) == NULL)
+      goto failed;
+    buf = tmp;
+    room *= 2;
+  }
+
+  if (fin) {
+    if (len >= 4 && memcmp (buf + len - 4, "\x00\x00\xff\xff", 4) == 0)
+      len -= 4;
+    if (pmd->server_no_context_takeover)
+      deflateReset (zs);
+  }
+
+  *out = buf;
+  *outsz = len;
+  return 0;
+
+failed:
+  free (buf);
+  deflateReset (zs);
+  return 1;
+}
+
+/* Decompress the whole message received.
+ *
+ * On error, the close code is returned.
+ * On success, 0 is returned and the malloc'd decompressed data are set. */
+static int
+ws_inflate_message (WSDeflate * pmd, const char *p, int sz,
+                    char **out, int *outsz)
+{
+  static const unsigned char trailer[4] = { 0x00, 0x00, 0xff, 0xff };
+  z_stream *zs = &pmd->rx;
+  size_t room = (size_t) sz * 4 + 64, len = 0;
+  char *buf = malloc (room), *tmp;
+  int code = WS_CLOSE_PROTO_ERR, ended = 0, ret;
+
+  if (buf == NULL)
+    return WS_CLOSE_UNEXPECTED;
+
+  /* append the trailer stripped off by the client */
+  for (int i = 0; i < 2 && !ended; i++) {
+    zs->next_in = (Bytef *) (i == 0 ? (const unsigned char *) p : trailer);
+    zs->avail_in = (i == 0) ? (uInt) sz : sizeof (trailer);
+
+    for (;;) {
+      zs->next_out = (Bytef *) buf + len;
+      zs->avail_out = room - len;
+      ret = inflate (zs, Z_SYNC_FLUSH);
+      len = room - zs->avail_out;
+
+      if (ret == Z_STREAM_END) {
+        /* the client set BFINAL; the next message starts a new stream */
+        inflateReset (zs);
+        ended = 1;
+        break;
+      }
+      if (ret != Z_OK && ret != Z_BUF_ERROR)
+        goto failed;
+      if (zs->avail_out > 0)
+        break;
+
+      /* a decompression bomb? */
+      if (room >= PCRDR_MAX_INMEM_PAYLOAD_SIZE) {
+        code = WS_CLOSE_TOO_LARGE;
+        goto failed;
+      }
+      room *= 2;
+      if (room > PCRDR_MAX_INMEM_PAYLOAD_SIZE)
+        room = PCRDR_MAX_INMEM_PAYLOAD_SIZE;
+      if ((tmp = realloc (buf, room)) == NULL) {
+        code = WS_CLOSE_UNEXPECTED;
+        goto failed;
+      }
+      buf = tmp;
+    }
+  }
+
+  if (pmd->client_no_context_takeover && !ended)
+    inflateReset (zs);
+
+  *out = buf;
+  *outsz = len;
+  return 0;
+
+failed:
+  free (buf);
+  inflateReset (zs);
+  return code;
+}
+#endif /* HAVE(ZLIB) */
+
 /* Free all HTTP handshake headers and structure. */
 static void
 ws_clear_handshake_headers (WSHeaders * headers)
@@ -435,8 +665,16 @@ ws_remove_dangling_client (WSServer * server, WSClient *client)
 
   if (client->headers)
     ws_clear_handshake_headers (client->headers);
-  if (client->sockqueue)
+  list_del_init (&client->gathering);
+  if (!send_queue_is_empty (&client->sendq))
     ws_clear_queue (client);
+  send_queue_destroy (&client->sendq);
+#if HAVE(ZLIB)
+  ws_free_deflate (client);
+#endif
+  if (client->inbuf)
+    free (client->inbuf);
+  client->inbuf = NULL;
 #if HAVE(LIBSSL)
   if (client->ssl)
     ws_shutdown_dangling_clients (client);
@@ -451,10 +689,14 @@ ws_remove_dangling_client (WSServer * server, WSClient *client)
 void
 ws_stop (WSServer * server)
 {
+#if HAVE(TLS_HANDSHAKER)
+  ws_stop_handshaker (server);
+#endif
 #if HAVE(LIBSSL)
   ws_ssl_cleanup (server);
 #endif
 
+  client_table_destroy (&server->clients);
   free (server);
 }
 
@@ -524,8 +766,30 @@ ws_initialize_ssl_ctx (WSServer * server)
   SSL_CTX_set_mode (ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
                     SSL_MODE_ENABLE_PARTIAL_WRITE);
 
+  /* let the runners reconnecting often resume their sessions, either by
+   * the session IDs cached here or by the stateless session tickets */
+  SSL_CTX_set_session_cache_mode (ctx, SSL_SESS_CACHE_SERVER);
+  if (!SSL_CTX_set_session_id_context (ctx,
+          (const unsigned char *) WS_TLS_SESSION_ID_CONTEXT,
+          sizeof (WS_TLS_SESSION_ID_CONTEXT) - 1))
+    goto out;
+  SSL_CTX_sess_set_cache_size (ctx, WS_TLS_SESSION_CACHE_SIZE);
+  SSL_CTX_set_timeout (ctx, WS_TLS_SESSION_TIMEOUT);
+  SSL_CTX_clear_options (ctx, SSL_OP_NO_TICKET);
+
+#ifdef SSL_OP_ENABLE_KTLS
+  /* move the bulk encryption into the kernel if it supports TLS offload */
+  SSL_CTX_set_options (ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
   server->ctx = ctx;
   ret = 0;
+
+#if HAVE(TLS_HANDSHAKER)
+  /* fall back to the handshakes in the thread handling the sockets */
+  if (ws_start_handshaker (server))
+    purc_log_warn ("Doing the TLS handshakes without a dedicated thread\n");
+#endif
 out:
   if (ret) {
     SSL_CTX_free (ctx);
@@ -669,27 +933,363 @@ accept_ssl (WSClient * client)
   return ret;
 }
 
+/* Check whether the kernel took over the record layer after the handshake,
+ * so that the data can be sent by the plain socket calls. */
+static void
+check_ktls (WSClient * client)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && defined(BIO_get_ktls_send)
+  client->ktls_tx = BIO_get_ktls_send (SSL_get_wbio (client->ssl)) != 0;
+  client->ktls_rx = BIO_get_ktls_recv (SSL_get_rbio (client->ssl)) != 0;
+#else
+  client->ktls_tx = client->ktls_rx = false;
+#endif
+}
+
+/* Create a new SSL structure for a connection.
+ *
+ * On error, 1 is returned.
+ * On success, the SSL structure is attached to the client and 0 is returned */
+static int
+new_client_ssl (WSServer * server, WSClient * client)
+{
+  if (!(client->ssl = SSL_new (server->ctx))) {
+    purc_log_info ("SSL: SSL_new, new SSL structure failed.\n");
+    return 1;
+  }
+  if (!SSL_set_fd (client->ssl, client->fd)) {
+    purc_log_info ("SSL: unable to set file descriptor\n");
+    SSL_free (client->ssl);
+    client->ssl = NULL;
+    return 1;
+  }
+
+  return 0;
+}
+
 /* Create a new SSL structure for a connection and perform handshake */
 static void
 handle_accept_ssl (WSServer * server, WSClient * client)
 {
   /* attempt to create SSL connection if we don't have one yet */
-  if (!client->ssl) {
-    if (!(client->ssl = SSL_new (server->ctx))) {
-      purc_log_info ("SSL: SSL_new, new SSL structure failed.\n");
+  if (!client->ssl && new_client_ssl (server, client))
+    return;
+
+  /* attempt to initiate the TLS/SSL handshake */
+  if (accept_ssl (client) == 0) {
+    check_ktls (client);
+    purc_log_info ("SSL Accepted: %d %s%s\n", client->fd, client->remote_ip,
+        client->ktls_tx ? " (kTLS)" : "");
+  }
+}
+
+#if HAVE(TLS_HANDSHAKER)
+/* the max number of the events handled by one epoll_wait() */
+#define WS_HANDSHAKER_EVENTS  64
+
+/* The thread doing the TLS handshakes off the loop handling the sockets.
+ *
+ * The clients accepted are passed to the handshaker in the `data` of the
+ * messages with their SSL structures, and given back in the same way when
+ * the handshakes are finished or failed.  A client is only touched by one
+ * thread at a time. */
+typedef struct WSHandshaker_
+{
+  pthread_t thread;
+  int epollfd;
+
+  /* the clients accepted; pushed by the thread handling the sockets */
+  IOQueue requests;
+  /* the clients handshaken or failed; popped by the same thread */
+  IOQueue results;
+
+  /* the clients in handshaking; only touched by the handshaker */
+  struct list_head handshaking;
+  /* set by the thread stopping the handshaker */
+  bool quitting;
+
+  purcmc_server_config *config;
+} WSHandshaker;
+
+/* Give a client back to the thread handling the sockets */
+static void
+handshaker_finish (WSHandshaker * hs, WSClient * client)
+{
+  IOMessage *msg;
+
+  /* the client may not be watched yet if finished at once */
+  epoll_ctl (hs->epollfd, EPOLL_CTL_DEL, client->fd, NULL);
+
+  if ((msg = calloc (1, sizeof (IOMessage))) == NULL) {
+    purc_log_error ("SSL: no memory to give back the client: %d\n",
+        client->fd);
+    /* try again when checking the expired handshakes */
+    client->handshake_expire = 0;
+    list_move (&client->handshaking, &hs->handshaking);
+    return;
+  }
+
+  list_del_init (&client->handshaking);
+  msg->data = (char *) client;
+  io_queue_push (&hs->results, msg);
+}
+
+/* Go on with the handshake of a client; `fresh` if it is not watched yet */
+static void
+handshaker_step (WSHandshaker * hs, WSClient * client, bool fresh)
+{
+  struct epoll_event ev;
+
+  accept_ssl (client);
+  if (client->sslstatus & WS_TLS_ACCEPTING) {
+    /* wait for the direction wanted by OpenSSL only */
+    ev.events = (SSL_want_write (client->ssl) ? EPOLLOUT : EPOLLIN) |
+      EPOLLONESHOT;
+    ev.data.ptr = client;
+    if (epoll_ctl (hs->epollfd, fresh ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+            client->fd, &ev) == 0)
       return;
+
+    purc_log_error ("SSL: failed to watch the client (%d): %s\n",
+        client->fd, strerror (errno));
+    client->sslstatus &= ~WS_TLS_ACCEPTING;
+    ws_set_status (client, WS_ERR | WS_CLOSE, 0);
+  }
+
+  handshaker_finish (hs, client);
+}
+
+/* Take the clients accepted */
+static void
+handshaker_take (WSHandshaker * hs)
+{
+  IOMessage msg;
+  time_t expire = purc_get_monotoic_time () + WS_TLS_HANDSHAKE_TIMEOUT;
+
+  io_queue_clear (&hs->requests);
+  while (io_queue_pop (&hs->requests, &msg)) {
+    WSClient *client = (WSClient *) msg.data;
+
+    client->handshake_expire = expire;
+    list_add_tail (&client->handshaking, &hs->handshaking);
+    handshaker_step (hs, client, true);
+  }
+}
+
+/* Give up the handshakes taking too long */
+static void
+handshaker_expire (WSHandshaker * hs)
+{
+  WSClient *client, *tmp;
+  time_t now = purc_get_monotoic_time ();
+
+  /* the clients are in the order of the expiring time */
+  list_for_each_entry_safe (client, tmp, &hs->handshaking, handshaking) {
+    if (client->handshake_expire > now)
+      break;
+
+    purc_log_warn ("SSL: handshake timed out: %d %s\n", client->fd,
+        client->remote_ip);
+    client->sslstatus &= ~WS_TLS_ACCEPTING;
+    ws_set_status (client, WS_ERR | WS_CLOSE, 0);
+    handshaker_finish (hs, client);
+  }
+}
+
+static void *
+handshaker_main (void *arg)
+{
+  WSHandshaker *hs = arg;
+  struct epoll_event events[WS_HANDSHAKER_EVENTS];
+
+  purc_init_ex (PURC_MODULE_UTILS,
+      hs->config->app_name ? hs->config->app_name : SERVER_APP_NAME,
+      SERVER_TLS_RUNNER_NAME, NULL);
+  purc_enable_log (true, false);
+
+  while (!__atomic_load_n (&hs->quitting, __ATOMIC_ACQUIRE)) {
+    int i, n;
+
+    n = epoll_wait (hs->epollfd, events, WS_HANDSHAKER_EVENTS, 1000);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      purc_log_error ("SSL: failed to call epoll_wait: %s\n", strerror (errno));
+      break;
     }
-    if (!SSL_set_fd (client->ssl, client->fd)) {
-      purc_log_info ("SSL: unable to set file descriptor\n");
-      return;
+
+    for (i = 0; i < n; i++) {
+      if (events[i].data.ptr == NULL)
+        handshaker_take (hs);
+      else
+        handshaker_step (hs, events[i].data.ptr, false);
+    }
+
+    handshaker_expire (hs);
+
+    /* wake up the thread handling the sockets once for a batch */
+    io_queue_notify (&hs->results);
+  }
+
+  purc_log_info ("The TLS handshaker exits\n");
+  purc_cleanup ();
+  return NULL;
+}
+
+/* Release a client never given back by the handshaker */
+static void
+handshaker_drop (WSServer * server, WSClient * client)
+{
+  if (client->ssl)
+    SSL_free (client->ssl);
+  ws_close (client);
+  send_queue_destroy (&client->sendq);
+
+  server->nr_clients--;
+}
+
+/* Start the thread doing the TLS handshakes.
+ *
+ * On error, -1 is returned and the handshakes are done inline.
+ * On success, 0 is returned. */
+static int
+ws_start_handshaker (WSServer * server)
+{
+  WSHandshaker *hs;
+  struct epoll_event ev;
+
+  if ((hs = calloc (1, sizeof (WSHandshaker))) == NULL)
+    return -1;
+
+  hs->config = server->config;
+  hs->epollfd = -1;
+  hs->requests.efd = hs->results.efd = -1;
+  list_head_init (&hs->handshaking);
+
+  if (io_queue_init (&hs->requests) || io_queue_init (&hs->results))
+    goto error;
+
+  if ((hs->epollfd = epoll_create1 (EPOLL_CLOEXEC)) < 0)
+    goto error;
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl (hs->epollfd, EPOLL_CTL_ADD, hs->requests.efd, &ev))
+    goto error;
+
+  if (pthread_create (&hs->thread, NULL, handshaker_main, hs))
+    goto error;
+
+  server->handshaker = hs;
+  purc_log_info ("Doing the TLS handshakes in a dedicated thread\n");
+  return 0;
+
+error:
+  purc_log_error ("Failed to start the TLS handshaker: %s\n", strerror (errno));
+  if (hs->epollfd >= 0)
+    close (hs->epollfd);
+  io_queue_destroy (&hs->requests);
+  io_queue_destroy (&hs->results);
+  free (hs);
+  return -1;
+}
+
+/* Stop the thread doing the TLS handshakes and release the clients
+ * still in handshaking. */
+static void
+ws_stop_handshaker (WSServer * server)
+{
+  WSHandshaker *hs = server->handshaker;
+  WSClient *client, *tmp;
+  IOMessage msg;
+  uint64_t one = 1;
+
+  if (hs == NULL)
+    return;
+
+  __atomic_store_n (&hs->quitting, true, __ATOMIC_RELEASE);
+  if (write (hs->requests.efd, &one, sizeof (one)) < 0)
+    purc_log_warn ("Failed to wake up the TLS handshaker: %s\n",
+        strerror (errno));
+  pthread_join (hs->thread, NULL);
+
+  /* all the clients are owned by this thread now */
+  while (io_queue_pop (&hs->requests, &msg))
+    handshaker_drop (server, (WSClient *) msg.data);
+  list_for_each_entry_safe (client, tmp, &hs->handshaking, handshaking) {
+    list_del_init (&client->handshaking);
+    handshaker_drop (server, client);
+  }
+  while (io_queue_pop (&hs->results, &msg))
+    handshaker_drop (server, (WSClient *) msg.data);
+
+  io_queue_destroy (&hs->requests);
+  io_queue_destroy (&hs->results);
+  close (hs->epollfd);
+  free (hs);
+  server->handshaker = NULL;
+}
+
+/* Pass a client just accepted to the handshaker.
+ *
+ * On error, 1 is returned and the handshake should be done inline.
+ * On success, 0 is returned; the client is given back by
+ * ws_handle_handshakes() later. */
+static int
+submit_handshake (WSServer * server, WSClient * client)
+{
+  IOMessage *msg;
+
+  if ((msg = calloc (1, sizeof (IOMessage))) == NULL)
+    return 1;
+
+  /* create the SSL structure here to avoid touching the context there */
+  if (new_client_ssl (server, client)) {
+    free (msg);
+    return 1;
+  }
+
+  client->sslstatus |= WS_TLS_ACCEPTING;
+  msg->data = (char *) client;
+  io_queue_push (&server->handshaker->requests, msg);
+  return 0;
+}
+
+int
+ws_handshake_fd (WSServer * server)
+{
+  return server->handshaker ? server->handshaker->results.efd : -1;
+}
+
+int
+ws_handle_handshakes (WSServer * server, WSClient ** clients, int max)
+{
+  WSHandshaker *hs = server->handshaker;
+  IOMessage msg;
+  int n = 0;
+
+  if (hs == NULL)
+    return 0;
+
+  /* the caller calls again if `max` clients are taken */
+  io_queue_clear (&hs->results);
+  while (n < max && io_queue_pop (&hs->results, &msg)) {
+    WSClient *client = (WSClient *) msg.data;
+
+    if (client->status & WS_CLOSE) {
+      handle_ws_read_close (server, client);
+      continue;
     }
-  }
 
-  /* attempt to initiate the TLS/SSL handshake */
-  if (accept_ssl (client) == 0) {
-    purc_log_info ("SSL Accepted: %d %s\n", client->fd, client->remote_ip);
+    check_ktls (client);
+    purc_log_info ("SSL Accepted: %d %s%s\n", client->fd, client->remote_ip,
+        client->ktls_tx ? " (kTLS)" : "");
+    clients[n++] = client;
   }
+
+  return n;
 }
+#endif /* HAVE(TLS_HANDSHAKER) */
 
 /* Given the current status of the SSL buffer, perform that action.
  *
@@ -830,7 +1430,7 @@ set_nonblocking (int sock)
  *
  * The newly assigned socket is returned. */
 static WSClient *
-accept_client (int listener /*, GSLList ** colist */)
+accept_client (WSServer * server, int listener)
 {
   WSClient *client;
   struct sockaddr_storage raddr;
@@ -839,25 +1439,27 @@ accept_client (int listener /*, GSLList ** colist */)
   socklen_t alen;
 
   alen = sizeof (raddr);
+#if HAVE(ACCEPT4)
+  /* errno is kept for the caller if failed */
+  if ((newfd = accept4 (listener, (struct sockaddr *) &raddr, &alen,
+                  SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1)
+    return NULL;
+#else
   if ((newfd = accept (listener, (struct sockaddr *) &raddr, &alen)) == -1)
-    purc_log_error ("Unable to set accept: %s.", strerror (errno));
+    return NULL;
 
   fcntl (newfd, F_SETFD, FD_CLOEXEC);
+  set_nonblocking (newfd);
+#endif
+  src = ws_get_raddr ((struct sockaddr *) &raddr);
 
-  if (newfd == -1) {
-    purc_log_info ("Unable to accept: %s.", strerror (errno));
+  if ((client = new_wsclient (server, newfd)) == NULL) {
+    close (newfd);
+    errno = ENOMEM;
     return NULL;
   }
-  src = ws_get_raddr ((struct sockaddr *) &raddr);
-
-  /* malloc a new client */
-  client = new_wsclient ();
-  client->fd = newfd;
   inet_ntop (raddr.ss_family, src, client->remote_ip, INET6_ADDRSTRLEN);
 
-  /* make the socket non-blocking */
-  set_nonblocking (client->fd);
-
   return client;
 }
 
@@ -930,6 +1532,14 @@ ws_set_header_key_value (WSHeaders * headers, char *key, char *value)
     headers->ws_key = strdup (value);
   else if (strcasecmp ("Sec-WebSocket-Version", key) == 0)
     headers->ws_sock_ver = strdup (value);
+  else if (strcasecmp ("Sec-WebSocket-Extensions", key) == 0) {
+    /* the header may be repeated */
+    if (headers->ws_extensions)
+      ws_append_str (&headers->ws_extensions, ", ");
+    else
+      headers->ws_extensions = strdup ("");
+    ws_append_str (&headers->ws_extensions, value);
+  }
   else if (strcasecmp ("User-Agent", key) == 0)
     headers->agent = strdup (value);
   else if (strcasecmp ("Referer", key) == 0)
@@ -1051,27 +1661,6 @@ parse_headers (WSHeaders * headers)
   return 0;
 }
 
-/* Set into a queue the data that couldn't be sent. */
-static void
-ws_queue_sockbuf (WSClient * client, const char *buffer, int len, int bytes)
-{
-  WSQueue *queue = calloc (1, sizeof (WSQueue));
-
-  if (bytes < 1)
-    bytes = 0;
-
-  queue->queued = calloc (len - bytes, sizeof (char));
-  memcpy (queue->queued, buffer + bytes, len - bytes);
-  queue->qlen = len - bytes;
-  client->sockqueue = queue;
-
-  update_upper_entity_stats (client->entity,
-          client->sockqueue ? client->sockqueue->qlen : 0,
-          client->message ? client->message->payloadsz : 0);
-
-  client->status |= WS_SENDING;
-}
-
 /* Read data from the given client's socket and set a connection
  * status given the output of recv().
  *
@@ -1103,6 +1692,9 @@ read_socket (WSServer * server, WSClient * client, char *buffer, int size)
   (void)server;
 
 #if HAVE(LIBSSL)
+  /* still read by OpenSSL if kTLS is on for receiving, since it handles
+   * the control records (alerts, key updates) by recvmsg() while the
+   * kernel decrypts the data */
   if (server->config->use_ssl)
     return read_ssl_socket (client, buffer, size);
   else
@@ -1112,45 +1704,81 @@ read_socket (WSServer * server, WSClient * client, char *buffer, int size)
 #endif
 }
 
-static int
-send_plain_buffer (WSClient * client, const char *buffer, int len)
-{
-  return send (client->fd, buffer, len, 0);
-}
-
-static int
-send_buffer (WSServer * server, WSClient * client, const char *buffer, int len)
-{
-  (void)server;
 #if HAVE(LIBSSL)
-  if (server->config->use_ssl)
-    return send_ssl_buffer (client, buffer, len);
-  else
-    return send_plain_buffer (client, buffer, len);
-#else
-  return send_plain_buffer (client, buffer, len);
-#endif
+/* the max size of the plain text in a TLS record */
+#define WS_TLS_RECORD_SIZE 16384
+
+/* Gather the buffers into TLS records and write them to the TLS/SSL
+ * connection, instead of writing a record for each buffer.
+ *
+ * On error, -1 is returned and the connection status is set.
+ * On success, the number of bytes sent is returned, which may be 0. */
+static ssize_t
+send_ssl_iovs (WSClient * client, const struct iovec *iov, int iovcnt)
+{
+  char buf[WS_TLS_RECORD_SIZE];
+  ssize_t total = 0;
+  int i = 0;
+
+  while (i < iovcnt) {
+    const char *data;
+    size_t len = 0;
+    int bytes;
+
+    if (iov[i].iov_len >= sizeof (buf)) {
+      data = iov[i].iov_base;
+      len = iov[i].iov_len;
+      i++;
+    } else {
+      while (i < iovcnt && len + iov[i].iov_len <= sizeof (buf)) {
+        memcpy (buf + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+        i++;
+      }
+      data = buf;
+    }
+
+    if (len == 0)
+      continue;
+
+    bytes = send_ssl_buffer (client, data, len);
+    if (bytes <= 0)
+      return (client->status & WS_ERR) ? -1 : total;
+
+    total += bytes;
+    if ((size_t) bytes < len)
+      break;
+  }
+
+  return total;
 }
+#endif
 
-/* Attmpt to send the given buffer to the given socket.
+/* Write the buffers to the client's socket with a single syscall.
  *
  * On error, -1 is returned and the connection status is set.
- * On success, the number of bytes sent is returned. */
-static int
-ws_respond_data (WSServer * server, WSClient * client, const char *buffer, int len)
+ * On success, the number of bytes sent is returned, which may be 0. */
+static ssize_t
+send_iovs (WSServer * server, WSClient * client, const struct iovec *iov,
+           int iovcnt)
 {
-  int bytes = 0;
+  ssize_t bytes;
 
-  bytes = send_buffer (server, client, buffer, len);
-  if (bytes == -1 && errno == EPIPE)
-    return ws_set_status (client, WS_ERR | WS_CLOSE, bytes);
+  (void) server;
+#if HAVE(LIBSSL)
+  /* the kernel builds the records if kTLS is on for sending */
+  if (server->config->use_ssl && !client->ktls_tx)
+    return send_ssl_iovs (client, iov, iovcnt);
+#endif
 
-  /* did not send all of it... buffer it for a later attempt */
-  if (bytes < len || (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
-    ws_queue_sockbuf (client, buffer, len, bytes);
+  do {
+    bytes = writev (client->fd, iov, iovcnt);
+  } while (bytes == -1 && errno == EINTR);
 
-    if (client->status & WS_SENDING && server->on_pending)
-        server->on_pending (server, (SockClient *)client);
+  if (bytes == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    return ws_set_status (client, WS_ERR | WS_CLOSE, -1);
   }
 
   return bytes;
@@ -1160,96 +1788,163 @@ ws_respond_data (WSServer * server, WSClient * client, const char *buffer, int l
  *
  * On error, -1 is returned and the connection status is set.
  * On success, the number of bytes sent is returned. */
-static int
-ws_respond_cache (WSServer* server, WSClient * client)
+static ssize_t
+ws_write_pending (WSServer * server, WSClient * client)
 {
-  WSQueue *queue = client->sockqueue;
-  int bytes = 0;
+  struct iovec iov[SEND_QUEUE_MAX_IOVS];
+  ssize_t total = 0;
 
-  bytes = send_buffer (server, client, queue->queued, queue->qlen);
-  if (bytes == -1 && errno == EPIPE)
-    return ws_set_status (client, WS_ERR | WS_CLOSE, bytes);
+  while (!send_queue_is_empty (&client->sendq)) {
+    int iovcnt = send_queue_get_iovs (&client->sendq, iov, SEND_QUEUE_MAX_IOVS);
+    ssize_t bytes = send_iovs (server, client, iov, iovcnt);
 
-  if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
-    return bytes;
+    if (bytes < 0)
+      return -1;
+
+    send_queue_consume (&client->sendq, bytes);
+    total += bytes;
+    if ((size_t) bytes < iovs_size (iov, iovcnt)) {
+      send_queue_set_blocked (&client->sendq);
+      break;
+    }
+  }
 
-  if (chop_nchars (queue->queued, bytes, queue->qlen) == 0)
+  if (send_queue_is_empty (&client->sendq))
     ws_clear_queue (client);
   else
-    queue->qlen -= bytes;
+    update_upper_entity_stats (client->entity,
+            client->sendq.sz_pending,
+            client->message ? client->message->payloadsz : 0);
 
-  return bytes;
+  return total;
 }
 
-/* Attempt to realloc the current sent queue.
+/* Mark the client to flush its gather queue when the server is uncorked. */
+static void
+ws_gather (WSServer * server, WSClient * client)
+{
+  if (list_empty (&client->gathering))
+    list_add_tail (&client->gathering, &server->gathering);
+}
+
+/* An entry point to attempt to send the client's data.
  *
- * On error, 1 is returned and the connection status is set.
+ * The buffers are sent at once if the server is not corked and nothing
+ * is pending, otherwise they are queued.  When queued, the data within
+ * [ref, ref + sz_ref) are referred instead of copied, and `to_free` is
+ * freed after the data sent.
+ *
+ * On error, -1 is returned and the connection status is set.
  * On success, 0 is returned. */
 static int
-ws_realloc_send_buf (WSClient * client, const char *buf, int len)
+ws_writev (WSServer * server, WSClient * client, const struct iovec *iov,
+           int iovcnt, const char *ref, size_t sz_ref, void *to_free)
 {
-  WSQueue *queue = client->sockqueue;
-  char *tmp = NULL;
-  int newlen = 0;
+  ssize_t bytes = 0;
 
-  newlen = queue->qlen + len;
-  tmp = realloc (queue->queued, newlen);
-  if (tmp == NULL && newlen > 0) {
+  if (client->status & WS_ERR)
+    goto failed;
+
+  if (!server->corked && send_queue_is_empty (&client->sendq)) {
+    bytes = send_iovs (server, client, iov, iovcnt);
+    if (bytes < 0)
+      goto failed;
+
+    if ((size_t) bytes == iovs_size (iov, iovcnt)) {
+      if (to_free)
+        free (to_free);
+      return 0;
+    }
+
+    send_queue_set_blocked (&client->sendq);
+  }
+
+  /* did not send all of it... queue it for a later attempt */
+  if (!send_queue_append (&client->sendq, iov, iovcnt, bytes,
+                          ref, sz_ref, to_free)) {
     ws_clear_queue (client);
-    return ws_set_status (client, WS_ERR | WS_CLOSE, 1);
+    return ws_set_status (client, WS_ERR | WS_CLOSE, -1);
   }
-  queue->queued = tmp;
-  memcpy (queue->queued + queue->qlen, buf, len);
-  queue->qlen += len;
 
   update_upper_entity_stats (client->entity,
-          client->sockqueue ? client->sockqueue->qlen : 0,
+          client->sendq.sz_pending,
           client->message ? client->message->payloadsz : 0);
+  client->status |= WS_SENDING;
 
-  /* client probably  too slow, so stop queueing until everything is
-   * sent */
-  if (queue->qlen >= SOCK_THROTTLE_THLD)
+  /* client probably too slow */
+  if (client->sendq.sz_pending >= SOCK_THROTTLE_THLD)
     client->status |= WS_THROTTLING;
 
+  if (server->corked)
+    ws_gather (server, client);
+  else if (server->on_pending)
+    server->on_pending (server, (SockClient *) client);
+
   return 0;
+
+failed:
+  if (to_free)
+    free (to_free);
+  return -1;
 }
 
-/* An entry point to attempt to send the client's data.
+/* Attempt to send the given buffer to the given socket.
  *
- * On error, 1 is returned and the connection status is set.
- * On success, the number of bytes sent is returned. */
+ * On error, -1 is returned and the connection status is set.
+ * On success, 0 is returned. */
 static int
 ws_respond (WSServer * server, WSClient * client, const char *buffer, int len)
 {
-  int bytes = 0;
+  struct iovec iov;
 
-  /* attempt to send the whole buffer */
-  if (client->sockqueue == NULL)
-    bytes = ws_respond_data (server, client, buffer, len);
-  /* buffer not empty, just append new data if we're not throttling the
-   * client */
-  else if (client->sockqueue != NULL && buffer != NULL &&
-           !(client->status & WS_THROTTLING)) {
-    if (ws_realloc_send_buf (client, buffer, len) == 1)
-      return bytes;
-  }
-  /* send from cache buffer */
-  else {
-    bytes = ws_respond_cache (server, client);
-  }
+  iov.iov_base = (void *) buffer;
+  iov.iov_len = len;
+  return ws_writev (server, client, &iov, 1, NULL, 0, NULL);
+}
 
-  return bytes;
+/* Hold the data sent to the clients in their gather queues until
+ * ws_uncork() is called. */
+void
+ws_cork (WSServer * server)
+{
+  server->corked = true;
+}
+
+/* Flush the gather queues of the clients which got data when the server
+ * was corked. */
+void
+ws_uncork (WSServer * server)
+{
+  struct list_head *p, *n;
+
+  server->corked = false;
+
+  list_for_each_safe (p, n, &server->gathering) {
+    WSClient *client = list_entry (p, WSClient, gathering);
+
+    list_del_init (p);
+    ws_write_pending (server, client);
+    if (!send_queue_is_empty (&client->sendq) && server->on_pending)
+      server->on_pending (server, (SockClient *) client);
+  }
 }
 
-/* Encode a websocket frame (header/message) and attempt to send it
- * through the client's socket.
+/* Encode a websocket frame header and attempt to send it along with
+ * the payload through the client's socket without copying the payload.
+ * The FIN bit is cleared if `fin` is zero, and the RSV1 bit is set if
+ * `compressed` is not zero.
+ *
+ * If `owned` is not NULL, it is the buffer of the payload given up by
+ * the caller, and the payload will be referred instead of copied if it
+ * is queued.
  *
  * On success, 0 is returned. */
 static int
-ws_send_frame (WSServer * server, WSClient * client, WSOpcode opcode, const char *p, int sz)
+ws_send_fragment (WSServer * server, WSClient * client, WSOpcode opcode,
+                  int fin, int compressed, const char *p, int sz, void *owned)
 {
   unsigned char buf[32] = { 0 };
-  char *frm = NULL;
+  struct iovec iov[2];
   uint64_t payloadlen = 0, u64;
   int hsize = 2;
 
@@ -1263,7 +1958,8 @@ ws_send_frame (WSServer * server, WSClient * client, WSOpcode opcode, const char
     hsize += 8;
   }
 
-  buf[0] = 0x80 | ((uint8_t) opcode);
+  buf[0] = (fin ? 0x80 : 0x00) | (compressed ? 0x40 : 0x00) |
+    ((uint8_t) opcode);
   switch (payloadlen) {
   case WS_PAYLOAD_EXT16:
     buf[1] = WS_PAYLOAD_EXT16;
@@ -1278,17 +1974,61 @@ ws_send_frame (WSServer * server, WSClient * client, WSOpcode opcode, const char
   default:
     buf[1] = (sz & 0xff);
   }
-  frm = calloc (hsize + sz, sizeof (unsigned char));
-  memcpy (frm, buf, hsize);
-  if (p != NULL && sz > 0)
-    memcpy (frm + hsize, p, sz);
 
-  ws_respond (server, client, frm, hsize + sz);
-  free (frm);
+  iov[0].iov_base = buf;
+  iov[0].iov_len = hsize;
+  iov[1].iov_base = (void *) p;
+  iov[1].iov_len = (p != NULL && sz > 0) ? sz : 0;
+
+  ws_writev (server, client, iov, 2, owned ? p : NULL, sz, owned);
 
   return 0;
 }
 
+/* Send a whole message in a single frame.
+ *
+ * On success, 0 is returned. */
+static inline int
+ws_send_frame (WSServer * server, WSClient * client, WSOpcode opcode,
+               const char *p, int sz, void *owned)
+{
+  return ws_send_fragment (server, client, opcode, 1, 0, p, sz, owned);
+}
+
+/* Send a frame of a text or binary message.  The message is compressed
+ * if permessage-deflate is negotiated and it is not too small, which is
+ * decided by the first frame of the message.
+ *
+ * On success, 0 is returned. */
+static int
+ws_send_data_frame (WSServer * server, WSClient * client, WSOpcode opcode,
+                    int fin, const char *p, int sz, void *owned)
+{
+#if HAVE(ZLIB)
+  WSDeflate *pmd = client->deflate;
+  char *out = NULL;
+  int outsz = 0, failed;
+
+  if (pmd && opcode != WS_OPCODE_CONTINUATION)
+    pmd->tx_compressing = (sz >= server->config->deflate_threshold);
+
+  if (pmd && pmd->tx_compressing) {
+    failed = ws_deflate_frame (pmd, fin, p, sz, &out, &outsz);
+    if (owned)
+      free (owned);
+    /* the compressing context is broken */
+    if (failed)
+      return ws_set_status (client, WS_ERR | WS_CLOSE, -1);
+
+    return ws_send_fragment (server, client, opcode, fin,
+                             opcode != WS_OPCODE_CONTINUATION,
+                             out, outsz, out);
+  }
+#endif
+
+  return ws_send_fragment (server, client, opcode, fin, 0, p, sz, owned);
+}
+
 /* Send an error message to the given client.
  *
  * On success, the number of sent bytes is returned. */
@@ -1305,7 +2045,7 @@ ws_error (WSServer * server, WSClient * client, unsigned short code, const char
   if (err)
     len += snprintf (buf + 2, sizeof buf - 4, "%s", err);
 
-  return ws_send_frame (server, client, WS_OPCODE_CLOSE, buf, len);
+  return ws_send_frame (server, client, WS_OPCODE_CLOSE, buf, len, NULL);
 }
 
 /* Log hit to the access log.
@@ -1428,7 +2168,15 @@ ws_send_handshake_headers (WSServer * server, WSClient * client, WSHeaders * hea
 
   ws_append_str (&str, "Sec-WebSocket-Accept: ");
   ws_append_str (&str, headers->ws_accept);
-  ws_append_str (&str, CRLF CRLF);
+  ws_append_str (&str, CRLF);
+
+  if (headers->ws_ext_resp) {
+    ws_append_str (&str, "Sec-WebSocket-Extensions: ");
+    ws_append_str (&str, headers->ws_ext_resp);
+    ws_append_str (&str, CRLF);
+  }
+
+  ws_append_str (&str, CRLF);
 
   bytes = ws_respond (server, client, str, strlen (str));
   free (str);
@@ -1483,6 +2231,9 @@ ws_get_handshake (WSServer * server, WSClient * client)
   }
 
   ws_set_handshake_headers (client->headers);
+#if HAVE(ZLIB)
+  ws_negotiate_deflate (server, client);
+#endif
 
   /* handshake response */
   ws_send_handshake_headers (server, client, client->headers);
@@ -1504,7 +2255,7 @@ ws_get_handshake (WSServer * server, WSClient * client)
 int
 ws_ping_client (WSServer * server, WSClient * client)
 {
-    return ws_send_frame (server, client, WS_OPCODE_PING, NULL, 0);
+    return ws_send_frame (server, client, WS_OPCODE_PING, NULL, 0, NULL);
 }
 
 /* Close client
@@ -1513,7 +2264,7 @@ ws_ping_client (WSServer * server, WSClient * client)
 int
 ws_close_client (WSServer * server, WSClient * client)
 {
-    return ws_send_frame (server, client, WS_OPCODE_CLOSE, NULL, 0);
+    return ws_send_frame (server, client, WS_OPCODE_CLOSE, NULL, 0, NULL);
 }
 
 /* Send a data message to the given client.
@@ -1526,7 +2277,7 @@ ws_send_packet (WSServer *server, WSClient *client, WSOpcode opcode, const char
   char *buf = NULL;
 
   if (opcode != WS_OPCODE_BIN) {
-    buf = sanitize_utf8 (p, sz);
+    buf = ws_utf8_sanitize (p, sz);
   } else {
     buf = malloc (sz);
     memcpy (buf, p, sz);
@@ -1543,13 +2294,13 @@ ws_send_packet (WSServer *server, WSClient *client, WSOpcode opcode, const char
     switch (opcode) {
         case WS_OPCODE_TEXT:
         case WS_OPCODE_BIN:
-            return ws_send_frame (server, client, opcode, p, sz);
+            return ws_send_data_frame (server, client, opcode, 1, p, sz, NULL);
 
         case WS_OPCODE_PING:
-            return ws_send_frame (server, client, WS_OPCODE_PING, NULL, 0);
+            return ws_send_frame (server, client, WS_OPCODE_PING, NULL, 0, NULL);
 
         case WS_OPCODE_CLOSE:
-            return ws_send_frame (server, client, WS_OPCODE_CLOSE, NULL, 0);
+            return ws_send_frame (server, client, WS_OPCODE_CLOSE, NULL, 0, NULL);
 
         default:
             purc_log_warn ("Unknown WebSocket opcode: %d\n", opcode);
@@ -1566,7 +2317,6 @@ int
 ws_send_packet_safe (WSServer *server, WSClient *client,
         WSOpcode opcode, const char *p, int sz)
 {
-    int retv;
     char *buf = NULL;
 
     if (sz <= 0)
@@ -1574,32 +2324,158 @@ ws_send_packet_safe (WSServer *server, WSClient *client,
 
     switch (opcode) {
         case WS_OPCODE_TEXT:
-            if ((buf = sanitize_utf8 (p, sz)) == NULL)
+            /* most texts are valid; only copy the invalid ones */
+            if (ws_utf8_validate (p, sz))
+                return ws_send_data_frame (server, client, WS_OPCODE_TEXT,
+                        1, p, sz, NULL);
+            if ((buf = ws_utf8_sanitize (p, sz)) == NULL)
                 return -1;
             break;
 
         case WS_OPCODE_BIN:
-            return ws_send_frame (server, client, WS_OPCODE_BIN, p, sz);
+            return ws_send_data_frame (server, client, WS_OPCODE_BIN,
+                    1, p, sz, NULL);
 
         case WS_OPCODE_PING:
-            return ws_send_frame (server, client, WS_OPCODE_PING, NULL, 0);
+            return ws_send_frame (server, client, WS_OPCODE_PING, NULL, 0, NULL);
 
         case WS_OPCODE_CLOSE:
-            return ws_send_frame (server, client, WS_OPCODE_CLOSE, NULL, 0);
+            return ws_send_frame (server, client, WS_OPCODE_CLOSE, NULL, 0, NULL);
 
         default:
             purc_log_warn ("Unknown WebSocket opcode: %d\n", opcode);
             return -1;
     }
 
-    retv = ws_send_frame (server, client, opcode, buf, sz);
-    if (buf) {
-        free (buf);
-    }
+    /* the sanitized buffer is given up to the gather queue */
+    return ws_send_data_frame (server, client, opcode, 1, buf, sz, buf);
+}
+
+/* Send a frame of a fragmented message to the given client and take the
+ * ownership of the data, which must be allocated by malloc().
+ *
+ * On success, 0 is returned. */
+int
+ws_send_owned_frame (WSServer *server, WSClient *client,
+        WSOpcode opcode, int fin, char *p, int sz)
+{
+    return ws_send_data_frame (server, client, opcode, fin, p, sz, p);
+}
+
+/* Send a data message to the given client and take the ownership of
+ * the data, which must be allocated by malloc().
+ *
+ * On success, 0 is returned. */
+int
+ws_send_owned_packet (WSServer *server, WSClient *client,
+        WSOpcode opcode, char *p, int sz)
+{
+    int retv;
+
+    if (sz > 0 && (opcode == WS_OPCODE_TEXT || opcode == WS_OPCODE_BIN))
+        return ws_send_data_frame (server, client, opcode, 1, p, sz, p);
 
+    retv = ws_send_packet (server, client, opcode, p, sz);
+    free (p);
     return retv;
 }
 
+/* Whether there are data which can be read without waiting for the
+ * socket, i.e., the decrypted data buffered by the TLS/SSL connection. */
+static inline int
+ws_input_pending (WSServer * server, WSClient * client)
+{
+  (void) server;
+#if HAVE(LIBSSL)
+  if (server->config->use_ssl && client->ssl)
+    return SSL_pending (client->ssl) > 0;
+#endif
+  (void) client;
+  return 0;
+}
+
+/* Read up to `size` bytes from the client, and mark the input drained if
+ * the socket (or the TLS/SSL connection) has no more data.
+ *
+ * On error, or if no data available, the return value of read_socket()
+ * is returned and the connection status is set.
+ * On success, the number of bytes read is returned. */
+static int
+ws_read_once (WSServer * server, WSClient * client, char *buffer, int size)
+{
+  int bytes = read_socket (server, client, buffer, size);
+
+  if (bytes < size && !ws_input_pending (server, client))
+    client->drained = 1;
+
+  return bytes;
+}
+
+/* Take up to `need` bytes of the input of the client.
+ *
+ * The bytes buffered in the input buffer are taken first.  When the buffer
+ * is empty, it is refilled by one read of the whole buffer, unless the
+ * rest is large enough to read directly into `dst`.  No more reads are
+ * issued once the input is drained in this round.
+ *
+ * On error, or if no data available, a value less than 1 is returned and
+ * the connection status is set if the connection is closed.
+ * On success, the number of bytes taken is returned. */
+static int
+ws_read_input (WSServer * server, WSClient * client, char *dst, int need)
+{
+  int total = 0, bytes;
+
+  while (total < need) {
+    int avail = client->nr_inbuf - client->pos_inbuf;
+
+    if (avail > 0) {
+      bytes = avail < need - total ? avail : need - total;
+      memcpy (dst + total, client->inbuf + client->pos_inbuf, bytes);
+      client->pos_inbuf += bytes;
+      total += bytes;
+      continue;
+    }
+
+    if (client->drained)
+      break;
+
+    if (need - total >= WS_INBUF_SIZE) {
+      bytes = ws_read_once (server, client, dst + total, need - total);
+      if (bytes < 1)
+        goto done;
+      total += bytes;
+      continue;
+    }
+
+    if (client->inbuf == NULL &&
+        (client->inbuf = malloc (WS_INBUF_SIZE)) == NULL)
+      return ws_set_status (client, WS_ERR | WS_CLOSE, -1);
+
+    client->nr_inbuf = client->pos_inbuf = 0;
+    bytes = ws_read_once (server, client, client->inbuf, WS_INBUF_SIZE);
+    if (bytes < 1)
+      goto done;
+    client->nr_inbuf = bytes;
+  }
+
+  return total;
+
+done:
+  client->drained = 1;
+  /* the data taken are useless if the connection is closed */
+  if (client->status & WS_CLOSE)
+    return bytes;
+  return total > 0 ? total : bytes;
+}
+
+/* Whether the client has buffered or unread input in this round. */
+static inline int
+ws_has_input (WSClient * client)
+{
+  return client->pos_inbuf < client->nr_inbuf || !client->drained;
+}
+
 /* Read a websocket frame's header.
  *
  * On success, the number of bytesr read is returned. */
@@ -1609,8 +2485,7 @@ ws_read_header (WSServer * server, WSClient * client, WSFrame * frm, int pos, in
   char *buf = frm->buf;
   int bytes = 0;
 
-  /* read the first 2 bytes for basic frame info */
-  if ((bytes = read_socket (server, client, buf + pos, need)) < 1) {
+  if ((bytes = ws_read_input (server, client, buf + pos, need)) < 1) {
     if (client->status & WS_CLOSE)
       ws_error (server, client, WS_CLOSE_UNEXPECTED, "Unable to read header");
     return bytes;
@@ -1630,8 +2505,7 @@ ws_read_payload (WSServer * server, WSClient * client, WSMessage * msg, int pos,
   char *buf = msg->payload;
   int bytes = 0;
 
-  /* read the first 2 bytes for basic frame info */
-  if ((bytes = read_socket (server, client, buf + pos, need)) < 1) {
+  if ((bytes = ws_read_input (server, client, buf + pos, need)) < 1) {
     if (client->status & WS_CLOSE)
       ws_error (server, client, WS_CLOSE_UNEXPECTED, "Unable to read payload");
     return bytes;
@@ -1654,12 +2528,22 @@ ws_set_front_header_fields (WSClient * client)
   (*frm)->fin = WS_FRM_FIN (*(buf));
   (*frm)->masking = WS_FRM_MASK (*(buf + 1));
   (*frm)->opcode = WS_FRM_OPCODE (*(buf));
-  (*frm)->res = WS_FRM_R1 (*(buf)) || WS_FRM_R2 (*(buf)) || WS_FRM_R3 (*(buf));
+  (*frm)->res = WS_FRM_R2 (*(buf)) || WS_FRM_R3 (*(buf));
+  (*frm)->compressed = WS_FRM_R1 (*(buf));
 
   /* should be masked and can't be using RESVd  bits */
   if (!(*frm)->masking || (*frm)->res)
     return ws_set_status (client, WS_ERR | WS_CLOSE, 1);
 
+  /* RSV1 is only allowed on the first frame of a compressed message */
+  if ((*frm)->compressed) {
+#if HAVE(ZLIB)
+    if (client->deflate == NULL || ((*frm)->opcode != WS_OPCODE_TEXT &&
+                                    (*frm)->opcode != WS_OPCODE_BIN))
+#endif
+      return ws_set_status (client, WS_ERR | WS_CLOSE, 1);
+  }
+
   return 0;
 }
 
@@ -1667,12 +2551,8 @@ ws_set_front_header_fields (WSClient * client)
 static void
 ws_unmask_payload (char *buf, int len, int offset, unsigned char mask[])
 {
-  int i, j = 0;
-
-  /* unmask data */
-  for (i = offset; i < len; ++i, ++j) {
-    buf[i] ^= mask[j % 4];
-  }
+  if (len > offset)
+    ws_unmask (buf + offset, len - offset, mask, 0);
 }
 
 /* Close a websocket connection. */
@@ -1680,7 +2560,7 @@ static int
 ws_handle_close (WSServer * server, WSClient * client)
 {
   client->status = WS_ERR | WS_CLOSE;
-  return ws_send_frame (server, client, WS_OPCODE_CLOSE, NULL, 0);
+  return ws_send_frame (server, client, WS_OPCODE_CLOSE, NULL, 0, NULL);
 }
 
 /* Handle a websocket error.
@@ -1733,7 +2613,7 @@ ws_handle_ping (WSServer * server, WSClient * client)
 
   /* No payload from ping */
   if (len == 0) {
-    ws_send_frame (server, client, WS_OPCODE_PONG, NULL, 0);
+    ws_send_frame (server, client, WS_OPCODE_PONG, NULL, 0, NULL);
     return;
   }
 
@@ -1756,14 +2636,14 @@ ws_handle_ping (WSServer * server, WSClient * client)
     client->status = WS_ERR | WS_CLOSE;
 
     update_upper_entity_stats (client->entity,
-          client->sockqueue ? client->sockqueue->qlen : 0, 0);
+          client->sendq.sz_pending, 0);
     return;
   }
 
   (*msg)->payload = tmp;
   (*msg)->payloadsz -= len;
 
-  ws_send_frame (server, client, WS_OPCODE_PONG, buf, len);
+  ws_send_frame (server, client, WS_OPCODE_PONG, buf, len, NULL);
 
   (*msg)->buflen = 0;   /* done with the current frame's payload */
   /* Control frame injected in the middle of a fragmented message. */
@@ -1780,19 +2660,40 @@ ws_handle_ping (WSServer * server, WSClient * client)
 int
 ws_validate_string (const char *str, int len)
 {
-  uint32_t state = UTF8_VALID;
-
-  if (verify_utf8 (&state, str, len) == UTF8_INVAL) {
+  if (!ws_utf8_validate (str, len)) {
     purc_log_info ("Invalid UTF8 data!\n");
     return 1;
   }
-  if (state != UTF8_VALID) {
-    purc_log_info ("Invalid UTF8 data!\n");
+
+  return 0;
+}
+
+#if HAVE(ZLIB)
+/* Decompress the payload of the current message in place.
+ *
+ * On error, 1 is returned and the connection status is set.
+ * On success, 0 is returned. */
+static int
+ws_inflate_payload (WSServer * server, WSClient * client)
+{
+  WSMessage **msg = &client->message;
+  char *buf = NULL;
+  int sz = 0, code;
+
+  code = ws_inflate_message (client->deflate, (*msg)->payload,
+                             (*msg)->payloadsz, &buf, &sz);
+  if (code != 0) {
+    ws_handle_err (server, client, code, WS_ERR | WS_CLOSE, NULL);
     return 1;
   }
 
+  free ((*msg)->payload);
+  (*msg)->payload = buf;
+  (*msg)->payloadsz = sz;
+  update_upper_entity_stats (client->entity, client->sendq.sz_pending, sz);
   return 0;
 }
+#endif
 
 /* It handles a text or binary message frame from the client. */
 static void
@@ -1819,6 +2720,11 @@ ws_handle_text_bin (WSServer * server, WSClient * client)
   if (!(*frm)->fin)
     return;
 
+#if HAVE(ZLIB)
+  if ((*msg)->compressed && ws_inflate_payload (server, client) != 0)
+    return;
+#endif
+
   /* validate text data encoded as UTF-8 */
   if ((*msg)->opcode == WS_OPCODE_TEXT) {
     if (ws_validate_string ((*msg)->payload, (*msg)->payloadsz) != 0) {
@@ -1855,6 +2761,7 @@ ws_manage_payload_opcode (WSServer * server, WSClient * client)
   case WS_OPCODE_BIN:
     purc_log_info ("TEXT\n");
     client->message->opcode = (*frm)->opcode;
+    client->message->compressed = (*frm)->compressed;
     clock_gettime (CLOCK_MONOTONIC, &client->ts);
     ws_handle_text_bin (server, client);
     break;
@@ -2028,12 +2935,12 @@ ws_realloc_frm_payload (WSClient * client, WSFrame * frm, WSMessage * msg)
 
   msg->payload = tmp;
   update_upper_entity_stats (client->entity,
-          client->sockqueue ? client->sockqueue->qlen : 0, newlen);
+          client->sendq.sz_pending, newlen);
   return 0;
 
 failed:
     update_upper_entity_stats (client->entity,
-          client->sockqueue ? client->sockqueue->qlen : 0, 0);
+          client->sendq.sz_pending, 0);
     return 1;
 }
 
@@ -2062,7 +2969,7 @@ ws_get_frm_payload (WSServer * server, WSClient * client)
     (*msg)->payload = calloc (sz, sizeof (char));
 
     update_upper_entity_stats (client->entity,
-              client->sockqueue ? client->sockqueue->qlen : 0, sz);
+              client->sendq.sz_pending, sz);
   }
   /* handle a new frame */
   else if ((*msg)->buflen == 0 && (*frm)->payloadlen) {
@@ -2126,9 +3033,15 @@ read_client_data (WSServer * server, WSClient * client)
           purc_log_info ("Accepted after handshake: %d %s\n", client->fd, client->remote_ip);
       }
   }
-  /* Message */
-  else
-    bytes = ws_get_message (server, client);
+  /* Messages: parse all of the frames buffered or readable in this round,
+   * until the upper entity paused the input */
+  else {
+    client->drained = 0;
+    do {
+      bytes = ws_get_message (server, client);
+    } while (!(client->status & (WS_ERR | WS_CLOSE)) && ws_has_input (client) &&
+        !(client->entity && client->entity->paused));
+  }
 
   return bytes;
 }
@@ -2142,6 +3055,11 @@ ws_cleanup_client (WSServer * server, WSClient * client)
     shutdown_ssl (client);
 #endif
 
+  /* try to send the data held by corking, e.g., the close frame */
+  list_del_init (&client->gathering);
+  if (!send_queue_is_empty (&client->sendq))
+    ws_write_pending (server, client);
+
   shutdown (client->fd, SHUT_RDWR);
   /* upon close, call on_close() callback */
   if (server->on_close)
@@ -2154,10 +3072,17 @@ ws_cleanup_client (WSServer * server, WSClient * client)
 
   /* errored out while parsing a frame or a message */
   if (client->status & WS_ERR) {
-    ws_clear_queue (client);
     ws_free_frame (client);
     ws_free_message (client);
   }
+  ws_clear_queue (client);
+  send_queue_destroy (&client->sendq);
+#if HAVE(ZLIB)
+  ws_free_deflate (client);
+#endif
+  if (client->inbuf)
+    free (client->inbuf);
+  client->inbuf = NULL;
 
   server->closing = 0;
   ws_close (client);
@@ -2176,6 +3101,10 @@ ws_cleanup_client (WSServer * server, WSClient * client)
 static void
 handle_ws_read_close (WSServer * server, WSClient * client)
 {
+  /* try to send the data held by corking first */
+  if (client->status & WS_SENDING)
+    ws_write_pending (server, client);
+
   if (client->status & WS_SENDING) {
     server->closing = 1;
     return;
@@ -2183,33 +3112,74 @@ handle_ws_read_close (WSServer * server, WSClient * client)
   ws_cleanup_client (server, client);
 }
 
-/* Handle a new socket connection. */
-WSClient*
-ws_handle_accept (WSServer * server, int listener)
+/* Handle the pending socket connections. */
+int
+ws_handle_accepts (WSServer * server, int listener, WSClient ** clients,
+    int max)
 {
   WSClient *client;
+  int n = 0;
+
+  while (n < max) {
+    client = accept_client (server, listener);
+    if (client == NULL) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        purc_log_error ("Unable to accept: %s.\n", strerror (errno));
+      break;
+    }
 
-  client = accept_client (listener/*, &server->colist*/);
-  if (client == NULL)
-    return NULL;
+    server->nr_clients++;
+    if (server->nr_clients > server->config->max_clients) {
+      purc_log_warn ("Too busy: %d %s.\n", client->fd, client->remote_ip);
 
-  server->nr_clients++;
-  if (server->nr_clients > MAX_CLIENTS_EACH) {
-    purc_log_warn ("Too busy: %d %s.\n", client->fd, client->remote_ip);
+      http_error (server, client, WS_TOO_BUSY_STR);
+      handle_ws_read_close (server, client);
+      continue;
+    }
 
-    http_error (server, client, WS_TOO_BUSY_STR);
-    handle_ws_read_close (server, client);
-    return NULL;
+#if HAVE(LIBSSL)
+    if (server->config->use_ssl) {
+#if HAVE(TLS_HANDSHAKER)
+      /* the client is given back after the handshake */
+      if (server->handshaker && submit_handshake (server, client) == 0)
+        continue;
+#endif
+      /* set flag to do TLS handshake */
+      client->sslstatus |= WS_TLS_ACCEPTING;
+    }
+#endif
+
+    clients[n++] = client;
   }
 
-#if HAVE(LIBSSL)
-  /* set flag to do TLS handshake */
-  if (server->config->use_ssl)
-    client->sslstatus |= WS_TLS_ACCEPTING;
+#if HAVE(TLS_HANDSHAKER)
+  /* wake up the handshaker once for a batch */
+  if (server->handshaker)
+    io_queue_notify (&server->handshaker->requests);
 #endif
 
-  return client;
+  return n;
+}
+
+#if !HAVE(TLS_HANDSHAKER)
+int
+ws_handshake_fd (WSServer * server)
+{
+  (void) server;
+  return -1;
+}
+
+int
+ws_handle_handshakes (WSServer * server, WSClient ** clients, int max)
+{
+  (void) server;
+  (void) clients;
+  (void) max;
+  return 0;
 }
+#endif
 
 /* Handle a tcp read:
   0: ok;
@@ -2258,9 +3228,9 @@ ws_handle_writes (WSServer * server, WSClient * client)
     return 1;
 #endif
 
-  ws_respond (server, client, NULL, 0); /* buffered data */
+  ws_write_pending (server, client); /* buffered data */
   /* done sending data */
-  if (client->sockqueue == NULL)
+  if (send_queue_is_empty (&client->sendq))
     client->status &= ~WS_SENDING;
 
   /* An error ocurred while sending data or while reading data but still
@@ -2331,6 +3301,8 @@ ws_listen (WSServer* server)
   }
 
   fcntl (listener, F_SETFD, FD_CLOEXEC);
+  /* the pending connections are accepted until EAGAIN */
+  set_nonblocking (listener);
 
   /* Options */
   if (setsockopt (listener, SOL_SOCKET, SO_REUSEADDR, &ov, sizeof (ov)) == -1) {
@@ -2366,7 +3338,11 @@ ws_init (purcmc_server_config *config)
 {
   WSServer *server = calloc (1, sizeof (WSServer));
 
+  list_head_init (&server->gathering);
+  client_table_init (&server->clients, sizeof (WSClient));
   server->config = config;
+  ws_unmask_init ();
+  ws_utf8_init ();
 
   return server;
 }
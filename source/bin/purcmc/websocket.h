@@ -39,6 +39,10 @@
 #include <netinet/in.h>
 #include <sys/select.h>
 
+#include "utils/list.h"
+#include "sendqueue.h"
+#include "clienttable.h"
+
 #if HAVE(LIBSSL)
 #include <openssl/crypto.h>
 #include <openssl/err.h>
@@ -113,6 +117,7 @@
 #define WS_PAYLOAD_EXT64      127
 #define WS_PAYLOAD_FULL       125
 #define WS_FRM_HEAD_SZ         16       /* frame header size */
+#define WS_INBUF_SIZE       16384       /* size of the input buffer */
 
 #define WS_FRM_FIN(x)         (((x) >> 7) & 0x01)
 #define WS_FRM_MASK(x)        (((x) >> 7) & 0x01)
@@ -129,6 +134,16 @@
 #define WS_CLOSE_TOO_LARGE    1009
 #define WS_CLOSE_UNEXPECTED   1011
 
+/* do not compress the messages smaller than this by default */
+#define WS_DEFLATE_THRESHOLD  256
+
+/* the TLS sessions cached for resumption and their lifetime in seconds */
+#define WS_TLS_SESSION_CACHE_SIZE   1024
+#define WS_TLS_SESSION_TIMEOUT      3600
+#define WS_TLS_SESSION_ID_CONTEXT   "purcmc"
+/* give up the TLS handshakes not finished in this time (seconds) */
+#define WS_TLS_HANDSHAKE_TIMEOUT    10
+
 typedef enum WSSTATUS
 {
   WS_OK = 0,
@@ -154,12 +169,6 @@ typedef enum WSOPCODE
   WS_OPCODE_PONG = 0x0A,
 } WSOpcode;
 
-typedef struct WSQueue_
-{
-  char *queued;                 /* queue data */
-  int qlen;                     /* queue length */
-} WSQueue;
-
 /* WS HTTP Headers */
 typedef struct WSHeaders_
 {
@@ -179,9 +188,11 @@ typedef struct WSHeaders_
   char *ws_protocol;
   char *ws_key;
   char *ws_sock_ver;
+  char *ws_extensions;
 
   char *ws_accept;
   char *ws_resp;
+  char *ws_ext_resp;
 } WSHeaders;
 
 /* A WebSocket Message */
@@ -192,6 +203,7 @@ typedef struct WSFrame_
   unsigned char fin;            /* frame fin flag */
   unsigned char mask[4];        /* mask key */
   uint8_t res;                  /* extensions */
+  uint8_t compressed;           /* RSV1 of permessage-deflate */
   int payload_offset;           /* end of header/start of payload */
   int payloadlen;               /* payload length (for each frame) */
 
@@ -208,6 +220,7 @@ typedef struct WSMessage_
 {
   WSOpcode opcode;              /* frame opcode */
   int fragmented;               /* reading a fragmented frame */
+  int compressed;               /* compressed by permessage-deflate */
   int mask_offset;              /* for fragmented frames */
 
   char *payload;                /* payload message */
@@ -226,18 +239,31 @@ typedef struct WSClient_
 
   char remote_ip[INET6_ADDRSTRLEN];     /* client IP */
 
-  WSQueue *sockqueue;           /* sending buffer */
+  SendQueue sendq;              /* sending gather queue */
+  struct list_head gathering;   /* node in the clients to flush after uncorked */
   WSHeaders *headers;           /* HTTP headers */
   WSFrame *frame;               /* frame headers */
   WSMessage *message;           /* message */
   WSStatus status;              /* connection status */
 
+  char *inbuf;                  /* input buffer filled by one read */
+  int nr_inbuf;                 /* number of bytes in the input buffer */
+  int pos_inbuf;                /* position of the first unparsed byte */
+  int drained;                  /* nothing more to read in this round */
+
   struct timeval start_proc;
   struct timeval end_proc;
 
 #if HAVE(LIBSSL)
   SSL *ssl;
   WSStatus sslstatus;           /* ssl connection status */
+  bool ktls_tx;                 /* the kernel encrypts the records sent */
+  bool ktls_rx;                 /* the kernel decrypts the records received */
+  struct list_head handshaking; /* node in the clients of the handshaker */
+  time_t handshake_expire;      /* the time to give up the handshake */
+#endif
+#if HAVE(ZLIB)
+  struct WSDeflate_ *deflate;   /* permessage-deflate context if negotiated */
 #endif
 } WSClient;
 
@@ -250,6 +276,13 @@ typedef struct WSServer_
   int closing;
   int nr_clients;
 
+  /* hold the data sent in the gather queues? */
+  bool corked;
+  /* the clients to flush after uncorked */
+  struct list_head gathering;
+  /* the clients, allocated in the slots of their fds */
+  ClientTable clients;
+
   /* Callbacks */
   int (*on_accepted) (void *server, struct SockClient_* client);
   int (*on_packet) (void *server, struct SockClient_ * client,
@@ -260,6 +293,8 @@ typedef struct WSServer_
 
 #if HAVE(LIBSSL)
   SSL_CTX *ctx;
+  /* the thread doing the TLS handshakes; NULL if they are done inline */
+  struct WSHandshaker_ *handshaker;
 #endif
 
   purcmc_server_config* config;
@@ -274,6 +309,12 @@ int ws_send_packet (WSServer * server, WSClient * client,
         WSOpcode op, const char *data, int sz);
 int ws_send_packet_safe (WSServer * server, WSClient * client,
         WSOpcode op, const char *data, int sz);
+int ws_send_owned_packet (WSServer * server, WSClient * client,
+        WSOpcode op, char *data, int sz);
+int ws_send_owned_frame (WSServer * server, WSClient * client,
+        WSOpcode op, int fin, char *data, int sz);
+void ws_cork (WSServer * server);
+void ws_uncork (WSServer * server);
 int ws_validate_string (const char *str, int len);
 
 WSServer *ws_init (purcmc_server_config * config);
@@ -281,7 +322,16 @@ int ws_initialize_ssl_ctx (WSServer * server);
 int ws_listen (WSServer *server);
 void ws_stop (WSServer *server);
 
-WSClient* ws_handle_accept (WSServer * server, int listener);
+/* Accept the pending connections until the backlog is drained or `max`
+   clients are accepted; returns the number of the clients accepted */
+int ws_handle_accepts (WSServer * server, int listener, WSClient ** clients,
+    int max);
+/* Get the eventfd signaled when the TLS handshakes are finished;
+   -1 if the handshakes are done in the thread handling the sockets */
+int ws_handshake_fd (WSServer * server);
+/* Take the clients whose TLS handshakes are finished; the clients failed
+   are closed, and the number of the clients ready for use is returned */
+int ws_handle_handshakes (WSServer * server, WSClient ** clients, int max);
 int ws_handle_reads (WSServer * server, WSClient * client);
 int ws_handle_writes (WSServer * server, WSClient * client);
 int ws_remove_dangling_client (WSServer * server, WSClient *client);
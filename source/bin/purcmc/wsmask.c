@@ -0,0 +1,192 @@
+/*
+** wsmask.c -- the kernels to unmask the payload of WebSocket frames.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <config.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "wsmask.h"
+
+/* SSE2 is always available on x86 builds; see GlobalCompilerFlags.cmake */
+#if CPU(X86_SSE2) || CPU(X86_64)
+#define USE_UNMASK_SSE2     1
+#include <emmintrin.h>
+#endif
+
+/* AVX2 is detected at runtime, so the build does not need -mavx2 */
+#if (CPU(X86) || CPU(X86_64)) && COMPILER(GCC_COMPATIBLE)
+#define USE_UNMASK_AVX2     1
+#include <immintrin.h>
+#endif
+
+#if CPU(ARM64) || HAVE(ARM_NEON_INTRINSICS)
+#define USE_UNMASK_NEON     1
+#include <arm_neon.h>
+#endif
+
+static void unmask_scalar(char *buf, size_t len,
+        const unsigned char mask[4], size_t phase)
+{
+    for (size_t i = 0; i < len; i++)
+        buf[i] ^= mask[(phase + i) & 3];
+}
+
+/* Return the key rotated by `phase` as it is laid out in the memory */
+static inline uint32_t rotated_mask(const unsigned char mask[4], size_t phase)
+{
+    unsigned char bytes[4];
+    uint32_t m32;
+
+    for (int i = 0; i < 4; i++)
+        bytes[i] = mask[(phase + i) & 3];
+    memcpy(&m32, bytes, sizeof(m32));
+    return m32;
+}
+
+/* The strides of all kernels are multiples of 4, so the phase of the
+   remaining bytes is unchanged. */
+static void unmask_word(char *buf, size_t len,
+        const unsigned char mask[4], size_t phase)
+{
+    uint64_t m64 = rotated_mask(mask, phase);
+    size_t i = 0;
+
+    m64 |= m64 << 32;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, buf + i, sizeof(w));
+        w ^= m64;
+        memcpy(buf + i, &w, sizeof(w));
+    }
+
+    unmask_scalar(buf + i, len - i, mask, phase);
+}
+
+#if USE_UNMASK_SSE2
+static void unmask_sse2(char *buf, size_t len,
+        const unsigned char mask[4], size_t phase)
+{
+    __m128i m = _mm_set1_epi32((int)rotated_mask(mask, phase));
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(buf + i + 16));
+        _mm_storeu_si128((__m128i *)(buf + i), _mm_xor_si128(v0, m));
+        _mm_storeu_si128((__m128i *)(buf + i + 16), _mm_xor_si128(v1, m));
+    }
+
+    unmask_word(buf + i, len - i, mask, phase);
+}
+#endif
+
+#if USE_UNMASK_AVX2
+__attribute__((target("avx2")))
+static void unmask_avx2(char *buf, size_t len,
+        const unsigned char mask[4], size_t phase)
+{
+    __m256i m = _mm256_set1_epi32((int)rotated_mask(mask, phase));
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(buf + i + 32));
+        _mm256_storeu_si256((__m256i *)(buf + i), _mm256_xor_si256(v0, m));
+        _mm256_storeu_si256((__m256i *)(buf + i + 32),
+                _mm256_xor_si256(v1, m));
+    }
+
+    unmask_word(buf + i, len - i, mask, phase);
+}
+#endif
+
+#if USE_UNMASK_NEON
+static void unmask_neon(char *buf, size_t len,
+        const unsigned char mask[4], size_t phase)
+{
+    uint8x16_t m = vreinterpretq_u8_u32(vdupq_n_u32(rotated_mask(mask, phase)));
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        uint8x16_t v0 = vld1q_u8((const uint8_t *)buf + i);
+        uint8x16_t v1 = vld1q_u8((const uint8_t *)buf + i + 16);
+        vst1q_u8((uint8_t *)buf + i, veorq_u8(v0, m));
+        vst1q_u8((uint8_t *)buf + i + 16, veorq_u8(v1, m));
+    }
+
+    unmask_word(buf + i, len - i, mask, phase);
+}
+#endif
+
+static WSUnmaskKernel kernels[5] = {
+    { "scalar", unmask_scalar },
+    { "word", unmask_word },
+};
+
+static int nr_kernels = 2;
+static const WSUnmaskKernel *selected = &kernels[1];
+
+void ws_unmask_init(void)
+{
+    if (nr_kernels > 2)
+        return;
+
+#if USE_UNMASK_SSE2
+    kernels[nr_kernels].name = "sse2";
+    kernels[nr_kernels].unmask = unmask_sse2;
+    nr_kernels++;
+#endif
+
+#if USE_UNMASK_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[nr_kernels].name = "avx2";
+        kernels[nr_kernels].unmask = unmask_avx2;
+        nr_kernels++;
+    }
+#endif
+
+#if USE_UNMASK_NEON
+    kernels[nr_kernels].name = "neon";
+    kernels[nr_kernels].unmask = unmask_neon;
+    nr_kernels++;
+#endif
+
+    selected = &kernels[nr_kernels - 1];
+}
+
+const WSUnmaskKernel *ws_unmask_kernels(int *nr)
+{
+    *nr = nr_kernels;
+    return kernels;
+}
+
+const WSUnmaskKernel *ws_unmask_kernel(void)
+{
+    return selected;
+}
+
+void ws_unmask(char *buf, size_t len, const unsigned char mask[4],
+        size_t phase)
+{
+    selected->unmask(buf, len, mask, phase);
+}
+
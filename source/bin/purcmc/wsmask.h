@@ -0,0 +1,53 @@
+/*
+** wsmask.h -- the kernels to unmask the payload of WebSocket frames.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef XGUIPRO_PURCMC_WSMASK_H
+#define XGUIPRO_PURCMC_WSMASK_H
+
+#include <stddef.h>
+
+/*
+ * XOR `len` bytes at `buf` with the 4-byte masking key; `phase` is the
+ * index of the key byte for the first byte, i.e., the offset of `buf` in
+ * the frame payload modulo 4.
+ */
+typedef void (*ws_unmask_fn)(char *buf, size_t len,
+        const unsigned char mask[4], size_t phase);
+
+typedef struct WSUnmaskKernel_ {
+    const char     *name;
+    ws_unmask_fn    unmask;
+} WSUnmaskKernel;
+
+/* Select the fastest kernel supported by the CPU; call it once at startup */
+void ws_unmask_init(void);
+
+/* Return the kernels supported by the CPU, from the slowest to the fastest */
+const WSUnmaskKernel *ws_unmask_kernels(int *nr_kernels);
+
+/* Return the kernel selected by ws_unmask_init() */
+const WSUnmaskKernel *ws_unmask_kernel(void);
+
+/* Unmask the data by using the selected kernel */
+void ws_unmask(char *buf, size_t len, const unsigned char mask[4],
+        size_t phase);
+
+#endif /* !XGUIPRO_PURCMC_WSMASK_H */
+
@@ -0,0 +1,523 @@
+/*
+** wsutf8.c -- the UTF-8 validators for the text messages of WebSocket.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <config.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wsutf8.h"
+
+/* SSSE3 and AVX2 are detected at runtime */
+#if (CPU(X86) || CPU(X86_64)) && COMPILER(GCC_COMPATIBLE)
+#define USE_UTF8_SIMD_X86   1
+#include <immintrin.h>
+#endif
+
+/* vqtbl1q_u8() is only available on AArch64 */
+#if CPU(ARM64)
+#define USE_UTF8_NEON       1
+#include <arm_neon.h>
+#endif
+
+/* *INDENT-OFF* */
+
+/* UTF-8 Decoder */
+/* Copyright (c) 2008-2009 Bjoern Hoehrmann <bjoern@hoehrmann.de>
+ * See http://bjoern.hoehrmann.de/utf-8/decoder/dfa/ for details. */
+#define UTF8_VALID 0
+#define UTF8_INVAL 1
+static const uint8_t utf8d[] = {
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 00..1f */
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 20..3f */
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 40..5f */
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 60..7f */
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, /* 80..9f */
+  7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, /* a0..bf */
+  8,8,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2, /* c0..df */
+  0xa,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x4,0x3,0x3, /* e0..ef */
+  0xb,0x6,0x6,0x6,0x5,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8, /* f0..ff */
+  0x0,0x1,0x2,0x3,0x5,0x8,0x7,0x1,0x1,0x1,0x4,0x6,0x1,0x1,0x1,0x1, /* s0..s0 */
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,0,1,1,1,1,1,0,1,0,1,1,1,1,1,1, /* s1..s2 */
+  1,2,1,1,1,1,1,2,1,2,1,1,1,1,1,1,1,1,1,1,1,1,1,2,1,1,1,1,1,1,1,1, /* s3..s4 */
+  1,2,1,1,1,1,1,1,1,2,1,1,1,1,1,1,1,1,1,1,1,1,1,3,1,3,1,1,1,1,1,1, /* s5..s6 */
+  1,3,1,1,1,1,1,3,1,3,1,1,1,1,1,1,1,3,1,1,1,1,1,1,1,1,1,1,1,1,1,1, /* s7..s8 */
+};
+/* *INDENT-ON* */
+
+/* Determine if the given string is valid UTF-8.
+ *
+ * The state after the by has been processed is returned. */
+static uint32_t verify_utf8(uint32_t *state, const char *str, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        uint32_t type = utf8d[(uint8_t)str[i]];
+        *state = utf8d[256 + (*state) * 16 + type];
+
+        if (*state == UTF8_INVAL)
+            break;
+    }
+
+    return *state;
+}
+
+/* Decode a character maintaining state and a byte, and returns the
+ * state achieved after processing the byte.
+ *
+ * The state after the by has been processed is returned. */
+static uint32_t utf8_decode(uint32_t *state, uint32_t *p, uint32_t b)
+{
+    uint32_t type = utf8d[(uint8_t)b];
+
+    *p = (*state != UTF8_VALID) ? (b & 0x3fu) | (*p << 6) : (0xff >> type) & (b);
+    *state = utf8d[256 + *state * 16 + type];
+
+    return *state;
+}
+
+char *ws_utf8_sanitize(const char *str, size_t len)
+{
+    char *buf = NULL;
+    uint32_t state = UTF8_VALID, prev = UTF8_VALID, cp = 0;
+    size_t i = 0, j = 0, k = 0, l = 0;
+
+    buf = calloc(len + 1, sizeof(char));
+    if (buf == NULL)
+        return NULL;
+
+    for (; i < len; prev = state, ++i) {
+        switch (utf8_decode(&state, &cp, (unsigned char)str[i])) {
+        case UTF8_INVAL:
+            /* replace the whole sequence */
+            if (k) {
+                for (l = i - k; l < i; ++l)
+                    buf[j++] = '?';
+            } else {
+                buf[j++] = '?';
+            }
+            state = UTF8_VALID;
+            if (prev != UTF8_VALID)
+                i--;
+            k = 0;
+            break;
+        case UTF8_VALID:
+            /* fill i - k valid continuation bytes */
+            if (k)
+                for (l = i - k; l < i; ++l)
+                    buf[j++] = str[l];
+            buf[j++] = str[i];
+            k = 0;
+            break;
+        default:
+            /* UTF8_VALID + continuation bytes */
+            k++;
+            break;
+        }
+    }
+
+    return buf;
+}
+
+static bool validate_dfa(const char *str, size_t len)
+{
+    uint32_t state = UTF8_VALID;
+
+    return verify_utf8(&state, str, len) == UTF8_VALID;
+}
+
+/* The DFA with a fast path skipping ASCII words */
+static bool validate_scalar(const char *str, size_t len)
+{
+    uint32_t state = UTF8_VALID;
+    size_t i = 0;
+
+    while (i < len) {
+        if (state == UTF8_VALID) {
+            while (i + sizeof(uint64_t) <= len) {
+                uint64_t w;
+                memcpy(&w, str + i, sizeof(w));
+                if (w & UINT64_C(0x8080808080808080))
+                    break;
+                i += sizeof(uint64_t);
+            }
+
+            if (i >= len)
+                break;
+        }
+
+        state = utf8d[256 + state * 16 + utf8d[(uint8_t)str[i]]];
+        if (state == UTF8_INVAL)
+            return false;
+        i++;
+    }
+
+    return state == UTF8_VALID;
+}
+
+/*
+ * The SIMD validators use the lookup algorithm of simdjson/simdutf
+ * (John Keiser and Daniel Lemire, Validating UTF-8 In Less Than One
+ * Instruction Per Byte, 2021): the errors of every two adjacent bytes are
+ * classified by three 16-entry table lookups on the high nibble of the
+ * first byte, the low nibble of the first byte, and the high nibble of the
+ * second byte, and the classes are ANDed.  The missing or extra
+ * continuation bytes of 3- and 4-byte sequences are checked separately.
+ */
+#define TOO_SHORT       (1 << 0)
+#define TOO_LONG        (1 << 1)
+#define OVERLONG_3      (1 << 2)
+#define TOO_LARGE       (1 << 3)
+#define SURROGATE       (1 << 4)
+#define OVERLONG_2      (1 << 5)
+#define TOO_LARGE_1000  (1 << 6)
+#define OVERLONG_4      (1 << 6)
+#define TWO_CONTS       (1 << 7)
+#define CARRY           (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#if USE_UTF8_SIMD_X86 || USE_UTF8_NEON
+static const uint8_t byte_1_high[16] = {
+    /* 0_______ ________ <ASCII in byte 1> */
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    /* 10______ ________ <continuation in byte 1> */
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    /* 1100____ ________ <two byte lead in byte 1> */
+    TOO_SHORT | OVERLONG_2,
+    /* 1101____ ________ <two byte lead in byte 1> */
+    TOO_SHORT,
+    /* 1110____ ________ <three byte lead in byte 1> */
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    /* 1111____ ________ <four+ byte lead in byte 1> */
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+};
+
+static const uint8_t byte_1_low[16] = {
+    /* ____0000 ________ */
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    /* ____0001 ________ */
+    CARRY | OVERLONG_2,
+    /* ____001_ ________ */
+    CARRY,
+    CARRY,
+    /* ____0100 ________ */
+    CARRY | TOO_LARGE,
+    /* ____0101 ________ */
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    /* ____011_ ________ */
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    /* ____1___ ________ */
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    /* ____1101 ________ */
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+};
+
+static const uint8_t byte_2_high[16] = {
+    /* ________ 0_______ <ASCII in byte 2> */
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    /* ________ 1000____ */
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    /* ________ 1001____ */
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    /* ________ 101_____ */
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE  | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE  | TOO_LARGE,
+    /* ________ 11______ */
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+};
+
+/* The bytes greater than these in the last three positions of a block
+   are leading bytes which need continuation bytes in the next block. */
+#define INCOMPLETE_3    (0xf0 - 1)
+#define INCOMPLETE_2    (0xe0 - 1)
+#define INCOMPLETE_1    (0xc0 - 1)
+#endif
+
+#if USE_UTF8_SIMD_X86
+__attribute__((target("ssse3")))
+static inline __m128i ssse3_check_block(__m128i input, __m128i prev_input)
+{
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+    __m128i prev2 = _mm_alignr_epi8(input, prev_input, 14);
+    __m128i prev3 = _mm_alignr_epi8(input, prev_input, 13);
+    __m128i sc, must23;
+
+    sc = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)byte_1_high),
+            _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+    sc = _mm_and_si128(sc,
+            _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)byte_1_low),
+                _mm_and_si128(prev1, nibble)));
+    sc = _mm_and_si128(sc,
+            _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)byte_2_high),
+                _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+    /* only 111_____ in prev2 and 1111____ in prev3 will be >= 0x80 */
+    must23 = _mm_or_si128(
+            _mm_subs_epu8(prev2, _mm_set1_epi8(0xe0 - 0x80)),
+            _mm_subs_epu8(prev3, _mm_set1_epi8(0xf0 - 0x80)));
+    must23 = _mm_and_si128(must23, _mm_set1_epi8((char)0x80));
+    return _mm_xor_si128(must23, sc);
+}
+
+__attribute__((target("ssse3")))
+static bool validate_ssse3(const char *str, size_t len)
+{
+    const __m128i max_value = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, INCOMPLETE_3, INCOMPLETE_2, INCOMPLETE_1);
+    __m128i error = _mm_setzero_si128();
+    __m128i prev_input = _mm_setzero_si128();
+    __m128i prev_incomplete = _mm_setzero_si128();
+    char tail[16];
+    size_t i = 0;
+
+    while (i < len) {
+        __m128i input;
+
+        if (i + 16 <= len) {
+            input = _mm_loadu_si128((const __m128i *)(str + i));
+        }
+        else {
+            /* pad the tail with zeros which also catch the truncated
+               sequences */
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, str + i, len - i);
+            input = _mm_loadu_si128((const __m128i *)tail);
+        }
+
+        if (_mm_movemask_epi8(input) == 0) {
+            error = _mm_or_si128(error, prev_incomplete);
+            prev_incomplete = _mm_setzero_si128();
+        }
+        else {
+            error = _mm_or_si128(error, ssse3_check_block(input, prev_input));
+            prev_incomplete = _mm_subs_epu8(input, max_value);
+        }
+
+        prev_input = input;
+        i += 16;
+    }
+
+    error = _mm_or_si128(error, prev_incomplete);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128()))
+        == 0xffff;
+}
+
+/* Return the bytes of `prev_input` and `input` shifted right by N bytes */
+#define AVX2_PREV(input, prev_input, n)                                     \
+    _mm256_alignr_epi8(input,                                               \
+            _mm256_permute2x128_si256(prev_input, input, 0x21), 16 - (n))
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_check_block(__m256i input, __m256i prev_input)
+{
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i prev1 = AVX2_PREV(input, prev_input, 1);
+    __m256i prev2 = AVX2_PREV(input, prev_input, 2);
+    __m256i prev3 = AVX2_PREV(input, prev_input, 3);
+    __m256i sc, must23;
+
+    sc = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(
+                _mm_loadu_si128((const __m128i *)byte_1_high)),
+            _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+    sc = _mm256_and_si256(sc,
+            _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(
+                    _mm_loadu_si128((const __m128i *)byte_1_low)),
+                _mm256_and_si256(prev1, nibble)));
+    sc = _mm256_and_si256(sc,
+            _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(
+                    _mm_loadu_si128((const __m128i *)byte_2_high)),
+                _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+
+    must23 = _mm256_or_si256(
+            _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xe0 - 0x80)),
+            _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xf0 - 0x80)));
+    must23 = _mm256_and_si256(must23, _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must23, sc);
+}
+
+__attribute__((target("avx2")))
+static bool validate_avx2(const char *str, size_t len)
+{
+    const __m256i max_value = _mm256_setr_epi8(
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            INCOMPLETE_3, INCOMPLETE_2, INCOMPLETE_1);
+    __m256i error = _mm256_setzero_si256();
+    __m256i prev_input = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+    char tail[32];
+    size_t i = 0;
+
+    while (i < len) {
+        __m256i input;
+
+        if (i + 32 <= len) {
+            input = _mm256_loadu_si256((const __m256i *)(str + i));
+        }
+        else {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, str + i, len - i);
+            input = _mm256_loadu_si256((const __m256i *)tail);
+        }
+
+        if (_mm256_movemask_epi8(input) == 0) {
+            error = _mm256_or_si256(error, prev_incomplete);
+            prev_incomplete = _mm256_setzero_si256();
+        }
+        else {
+            error = _mm256_or_si256(error, avx2_check_block(input, prev_input));
+            prev_incomplete = _mm256_subs_epu8(input, max_value);
+        }
+
+        prev_input = input;
+        i += 32;
+    }
+
+    error = _mm256_or_si256(error, prev_incomplete);
+    return _mm256_testz_si256(error, error);
+}
+#endif /* USE_UTF8_SIMD_X86 */
+
+#if USE_UTF8_NEON
+static inline uint8x16_t neon_check_block(uint8x16_t input,
+        uint8x16_t prev_input)
+{
+    uint8x16_t prev1 = vextq_u8(prev_input, input, 15);
+    uint8x16_t prev2 = vextq_u8(prev_input, input, 14);
+    uint8x16_t prev3 = vextq_u8(prev_input, input, 13);
+    uint8x16_t sc, must23;
+
+    sc = vqtbl1q_u8(vld1q_u8(byte_1_high), vshrq_n_u8(prev1, 4));
+    sc = vandq_u8(sc, vqtbl1q_u8(vld1q_u8(byte_1_low),
+                vandq_u8(prev1, vdupq_n_u8(0x0f))));
+    sc = vandq_u8(sc, vqtbl1q_u8(vld1q_u8(byte_2_high),
+                vshrq_n_u8(input, 4)));
+
+    must23 = vorrq_u8(vqsubq_u8(prev2, vdupq_n_u8(0xe0 - 0x80)),
+            vqsubq_u8(prev3, vdupq_n_u8(0xf0 - 0x80)));
+    must23 = vandq_u8(must23, vdupq_n_u8(0x80));
+    return veorq_u8(must23, sc);
+}
+
+static bool validate_neon(const char *str, size_t len)
+{
+    static const uint8_t max_array[16] = {
+        255, 255, 255, 255, 255, 255, 255, 255,
+        255, 255, 255, 255, 255, INCOMPLETE_3, INCOMPLETE_2, INCOMPLETE_1,
+    };
+    const uint8x16_t max_value = vld1q_u8(max_array);
+    uint8x16_t error = vdupq_n_u8(0);
+    uint8x16_t prev_input = vdupq_n_u8(0);
+    uint8x16_t prev_incomplete = vdupq_n_u8(0);
+    uint8_t tail[16];
+    size_t i = 0;
+
+    while (i < len) {
+        uint8x16_t input;
+
+        if (i + 16 <= len) {
+            input = vld1q_u8((const uint8_t *)str + i);
+        }
+        else {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, str + i, len - i);
+            input = vld1q_u8(tail);
+        }
+
+        if (vmaxvq_u8(input) < 0x80) {
+            error = vorrq_u8(error, prev_incomplete);
+            prev_incomplete = vdupq_n_u8(0);
+        }
+        else {
+            error = vorrq_u8(error, neon_check_block(input, prev_input));
+            prev_incomplete = vqsubq_u8(input, max_value);
+        }
+
+        prev_input = input;
+        i += 16;
+    }
+
+    error = vorrq_u8(error, prev_incomplete);
+    return vmaxvq_u8(error) == 0;
+}
+#endif /* USE_UTF8_NEON */
+
+static WSUtf8Validator validators[5] = {
+    { "dfa", validate_dfa },
+    { "scalar", validate_scalar },
+};
+
+static int nr_validators = 2;
+static const WSUtf8Validator *selected = &validators[1];
+
+void ws_utf8_init(void)
+{
+    if (nr_validators > 2)
+        return;
+
+#if USE_UTF8_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        validators[nr_validators].name = "ssse3";
+        validators[nr_validators].validate = validate_ssse3;
+        nr_validators++;
+    }
+
+    if (__builtin_cpu_supports("avx2")) {
+        validators[nr_validators].name = "avx2";
+        validators[nr_validators].validate = validate_avx2;
+        nr_validators++;
+    }
+#endif
+
+#if USE_UTF8_NEON
+    validators[nr_validators].name = "neon";
+    validators[nr_validators].validate = validate_neon;
+    nr_validators++;
+#endif
+
+    selected = &validators[nr_validators - 1];
+}
+
+const WSUtf8Validator *ws_utf8_validators(int *nr)
+{
+    *nr = nr_validators;
+    return validators;
+}
+
+const WSUtf8Validator *ws_utf8_validator(void)
+{
+    return selected;
+}
+
+bool ws_utf8_validate(const char *str, size_t len)
+{
+    return selected->validate(str, len);
+}
+
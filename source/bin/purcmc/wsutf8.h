@@ -0,0 +1,55 @@
+/*
+** wsutf8.h -- the UTF-8 validators for the text messages of WebSocket.
+**
+** Copyright (C) 2022 FMSoft <http://www.fmsoft.cn>
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef XGUIPRO_PURCMC_WSUTF8_H
+#define XGUIPRO_PURCMC_WSUTF8_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Return true if the `len` bytes at `str` are a complete valid UTF-8 text */
+typedef bool (*ws_utf8_validate_fn)(const char *str, size_t len);
+
+typedef struct WSUtf8Validator_ {
+    const char             *name;
+    ws_utf8_validate_fn     validate;
+} WSUtf8Validator;
+
+/* Select the fastest validator supported by the CPU; call it at startup */
+void ws_utf8_init(void);
+
+/* Return the validators supported by the CPU; the first one is the DFA */
+const WSUtf8Validator *ws_utf8_validators(int *nr_validators);
+
+/* Return the validator selected by ws_utf8_init() */
+const WSUtf8Validator *ws_utf8_validator(void);
+
+/* Validate the text by using the selected validator */
+bool ws_utf8_validate(const char *str, size_t len);
+
+/*
+ * Replace malformed sequences with '?'.
+ *
+ * Returns a malloc'd buffer of `len + 1` bytes, or NULL on failure.
+ */
+char *ws_utf8_sanitize(const char *str, size_t len);
+
+#endif /* !XGUIPRO_PURCMC_WSUTF8_H */
+
@@ -0,0 +1,297 @@
+/*
+** test_builtin.c -- The test of the connections of the builtin endpoints.
+**
+** Copyright (C) 2022 FMSoft (http://www.fmsoft.cn)
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+#undef NDEBUG
+
+#include <config.h>
+
+#include "purcmc/builtin.h"
+
+#include <purc/purc.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#define NR_REQUESTS     1000
+#define MIN_FLOODED     100
+
+/* The server side runs on the main thread, the interpreter on another */
+
+static void wait_readable(int fd)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+
+    while (poll(&pfd, 1, -1) < 0)
+        assert(errno == EINTR);
+}
+
+static void clear_eventfd(int fd)
+{
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) < 0)
+        assert(errno == EAGAIN);
+}
+
+/* Every interpreter runs with its own instance */
+static void init_interpreter(const char *runner_name)
+{
+    int ret = purc_init_ex(PURC_MODULE_EJSON, "cn.fmsoft.hvml.xguipro",
+            runner_name, NULL);
+    assert(ret == PURC_ERROR_OK);
+}
+
+static pcrdr_msg *make_request(int id)
+{
+    char request_id[16];
+
+    snprintf(request_id, sizeof(request_id), "%d", id);
+    return pcrdr_make_request_message(PCRDR_MSG_TARGET_SESSION, 0,
+            PCRDR_OPERATION_LOAD, request_id, NULL,
+            PCRDR_MSG_ELEMENT_TYPE_VOID, NULL, NULL,
+            PCRDR_MSG_DATA_TYPE_PLAIN, "<hvml></hvml>", 13);
+}
+
+static int request_id_of(const pcrdr_msg *msg)
+{
+    return atoi(purc_variant_get_string_const(msg->requestId));
+}
+
+/* Sends the requests and checks the responses in order */
+static void *requester_main(void *arg)
+{
+    purcmc_builtin_conn *conn = arg;
+    int fd = purcmc_builtin_conn_get_fd(conn);
+    int nr_responses = 0;
+
+    init_interpreter("requester");
+
+    for (int i = 0; i < NR_REQUESTS; i++)
+        assert(purcmc_builtin_conn_send(conn, make_request(i)) == PCRDR_SC_OK);
+
+    while (nr_responses < NR_REQUESTS) {
+        pcrdr_msg *msg = purcmc_builtin_conn_recv(conn);
+
+        if (msg == NULL) {
+            assert(!purcmc_builtin_conn_is_closed(conn));
+            wait_readable(fd);
+            continue;
+        }
+
+        assert(msg->type == PCRDR_MSG_TYPE_RESPONSE);
+        assert(request_id_of(msg) == nr_responses);
+        assert(msg->retCode == PCRDR_SC_OK);
+        assert(msg->resultValue == (uint64_t)nr_responses);
+        pcrdr_release_message(msg);
+        nr_responses++;
+    }
+
+    purcmc_builtin_conn_close(conn);
+    purc_cleanup();
+    return NULL;
+}
+
+/* Requests and responses pass through the two queues in order */
+static void check_round_trip(void)
+{
+    int wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    BuiltinConn *conn;
+    pthread_t thread;
+    int nr_requests = 0;
+    bool closed = false;
+
+    assert(wake_fd >= 0);
+    assert((conn = builtin_conn_new(wake_fd)));
+    assert(pthread_create(&thread, NULL, requester_main, conn) == 0);
+
+    while (!closed) {
+        pcrdr_msg *msg, *again;
+
+        wait_readable(wake_fd);
+        clear_eventfd(wake_fd);
+        while (builtin_conn_fetch(conn, &msg)) {
+            if (msg == NULL) {
+                closed = true;
+                break;
+            }
+
+            /* the message put back is fetched again first */
+            builtin_conn_unfetch(conn, msg);
+            assert(builtin_conn_fetch(conn, &again) && again == msg);
+
+            assert(msg->type == PCRDR_MSG_TYPE_REQUEST);
+            assert(request_id_of(msg) == nr_requests);
+
+            pcrdr_msg *response = pcrdr_make_response_message(
+                    purc_variant_get_string_const(msg->requestId), NULL,
+                    PCRDR_SC_OK, nr_requests, PCRDR_MSG_DATA_TYPE_VOID,
+                    NULL, 0);
+            assert(response);
+            /* a clone is posted; the server still owns the response */
+            assert(builtin_conn_post(conn, response) == 0);
+            pcrdr_release_message(response);
+            pcrdr_release_message(msg);
+            nr_requests++;
+        }
+    }
+
+    assert(nr_requests == NR_REQUESTS);
+    pthread_join(thread, NULL);
+    builtin_conn_detach(conn);
+    close(wake_fd);
+}
+
+/* Sends the requests until the server closed the connection */
+static void *flooder_main(void *arg)
+{
+    purcmc_builtin_conn *conn = arg;
+    int fd = purcmc_builtin_conn_get_fd(conn);
+    int i = 0;
+
+    init_interpreter("flooder");
+
+    while (purcmc_builtin_conn_send(conn, make_request(i)) == PCRDR_SC_OK)
+        i++;
+    assert(purcmc_builtin_conn_is_closed(conn));
+
+    /* nothing was posted by the server but the close */
+    wait_readable(fd);
+    assert(purcmc_builtin_conn_recv(conn) == NULL);
+
+    purcmc_builtin_conn_close(conn);
+    purc_cleanup();
+    return NULL;
+}
+
+/* The interpreter never writes `wake_fd` after the server closed it */
+static void check_close_while_writing(void)
+{
+    int wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    BuiltinConn *conn;
+    pthread_t thread;
+    int nr_fetched = 0;
+    uint64_t count;
+
+    assert(wake_fd >= 0);
+    assert((conn = builtin_conn_new(wake_fd)));
+    assert(pthread_create(&thread, NULL, flooder_main, conn) == 0);
+
+    while (nr_fetched < MIN_FLOODED) {
+        pcrdr_msg *msg;
+
+        wait_readable(wake_fd);
+        clear_eventfd(wake_fd);
+        while (nr_fetched < MIN_FLOODED && builtin_conn_fetch(conn, &msg)) {
+            assert(msg && request_id_of(msg) == nr_fetched);
+            pcrdr_release_message(msg);
+            nr_fetched++;
+        }
+    }
+
+    /* the messages not fetched are released with the connection */
+    builtin_conn_detach(conn);
+    clear_eventfd(wake_fd);
+    pthread_join(thread, NULL);
+
+    assert(read(wake_fd, &count, sizeof(count)) < 0 && errno == EAGAIN);
+    close(wake_fd);
+}
+
+/* Receives a few messages and closes the connection */
+static void *closer_main(void *arg)
+{
+    purcmc_builtin_conn *conn = arg;
+    int fd = purcmc_builtin_conn_get_fd(conn);
+    int nr_received = 0;
+
+    init_interpreter("closer");
+
+    while (nr_received < MIN_FLOODED) {
+        pcrdr_msg *msg = purcmc_builtin_conn_recv(conn);
+
+        if (msg == NULL) {
+            wait_readable(fd);
+            continue;
+        }
+
+        pcrdr_release_message(msg);
+        nr_received++;
+    }
+
+    purcmc_builtin_conn_close(conn);
+    purc_cleanup();
+    return NULL;
+}
+
+/* The server keeps posting while the interpreter closes the connection */
+static void check_close_while_posting(void)
+{
+    int wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    BuiltinConn *conn;
+    pthread_t thread;
+    pcrdr_msg *event, *msg;
+    bool closed = false;
+
+    assert(wake_fd >= 0);
+    assert((conn = builtin_conn_new(wake_fd)));
+    assert(pthread_create(&thread, NULL, closer_main, conn) == 0);
+
+    event = pcrdr_make_event_message(PCRDR_MSG_TARGET_SESSION, 0,
+            "change", NULL, PCRDR_MSG_ELEMENT_TYPE_VOID, NULL, NULL,
+            PCRDR_MSG_DATA_TYPE_VOID, NULL, 0);
+    assert(event);
+
+    while (!closed) {
+        assert(builtin_conn_post(conn, event) == 0);
+        while (builtin_conn_fetch(conn, &msg)) {
+            assert(msg == NULL);
+            closed = true;
+        }
+    }
+
+    /* the events not received are released with the connection */
+    pcrdr_release_message(event);
+    pthread_join(thread, NULL);
+    builtin_conn_detach(conn);
+    close(wake_fd);
+}
+
+int main(void)
+{
+    int ret;
+
+    ret = purc_init_ex(PURC_MODULE_EJSON, "cn.fmsoft.hvml.xguipro",
+            "test_builtin", NULL);
+    assert(ret == PURC_ERROR_OK);
+
+    check_round_trip();
+    check_close_while_writing();
+    check_close_while_posting();
+
+    purc_cleanup();
+    printf("All builtin connection tests passed\n");
+    return 0;
+}
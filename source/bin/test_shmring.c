@@ -0,0 +1,204 @@
+/*
+** test_shmring.c -- The test of reading the packets from the shared ring.
+**
+** Copyright (C) 2022 FMSoft (http://www.fmsoft.cn)
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+#undef NDEBUG
+
+#include <config.h>
+
+#include "purcmc/shmring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* The view of the client: the memfd mapped again */
+typedef struct Client_ {
+    ShmRingHeader  *header;
+    char           *data;
+    size_t          sz_mapped;
+    uint64_t        head;
+} Client;
+
+static void client_map(Client *client, ShmRing *ring)
+{
+    client->sz_mapped = ring->header->data_offset + ring->size;
+    client->header = mmap(NULL, client->sz_mapped, PROT_READ | PROT_WRITE,
+            MAP_SHARED, ring->fd, 0);
+    assert(client->header != MAP_FAILED);
+    client->data = (char *)client->header + client->header->data_offset;
+    client->head = 0;
+}
+
+/* Copy the body to the ring, which may wrap around, and publish it */
+static void client_send(Client *client, const char *body, uint32_t size,
+        ShmRingDesc *desc)
+{
+    uint32_t mask = client->header->size - 1;
+
+    for (uint32_t i = 0; i < size; i++)
+        client->data[(client->head + i) & mask] = body[i];
+
+    desc->pos = client->head;
+    desc->size = size;
+    desc->op = 1;
+    client->head += size;
+    __atomic_store_n(&client->header->head, client->head, __ATOMIC_RELEASE);
+}
+
+static void client_rewrite(Client *client, const ShmRingDesc *desc, char c)
+{
+    uint32_t mask = client->header->size - 1;
+
+    for (uint32_t i = 0; i < desc->size; i++)
+        client->data[(desc->pos + i) & mask] = c;
+}
+
+/* A body rewritten after published does not change the copy read */
+static void check_rewritten(ShmRing *ring, Client *client)
+{
+    static const char body[] = "type:request\nrequestId:1\n";
+    ShmRingDesc desc;
+    char buf[sizeof(body) + 1];
+
+    client_send(client, body, sizeof(body) - 1, &desc);
+    assert(shm_ring_read(ring, &desc, buf) == 0);
+    client_rewrite(client, &desc, 'X');
+
+    assert(memcmp(buf, body, sizeof(body) - 1) == 0);
+    assert(buf[desc.size] == '\0');
+    shm_ring_release(ring, &desc);
+}
+
+/* The descriptors out of the space produced are refused */
+static void check_bad_descs(ShmRing *ring, Client *client)
+{
+    ShmRingDesc desc;
+    char buf[64];
+
+    client_send(client, "abcd", 4, &desc);
+
+    desc.size = 5;
+    assert(shm_ring_read(ring, &desc, buf) == -1);
+    desc.size = 0;
+    assert(shm_ring_read(ring, &desc, buf) == -1);
+    desc.pos = client->head + 1;
+    desc.size = 1;
+    assert(shm_ring_read(ring, &desc, buf) == -1);
+
+    desc.pos = client->head - 4;
+    desc.size = 4;
+    assert(shm_ring_read(ring, &desc, buf) == 0);
+    assert(memcmp(buf, "abcd", 5) == 0);
+    shm_ring_release(ring, &desc);
+
+    /* never go back */
+    desc.pos = 0;
+    assert(shm_ring_read(ring, &desc, buf) == -1);
+}
+
+/* A body wrapped around the end of the data area is read contiguously */
+static void check_wrapped(ShmRing *ring, Client *client)
+{
+    uint32_t size = ring->size;
+    ShmRingDesc desc;
+    char *body = malloc(size / 2);
+    char *buf = malloc(size / 2 + 1);
+
+    assert(body && buf);
+    for (uint32_t i = 0; i < size / 2; i++)
+        body[i] = 'a' + i % 26;
+
+    for (int i = 0; i < 5; i++) {
+        client_send(client, body, size / 2 - 7, &desc);
+        assert(shm_ring_read(ring, &desc, buf) == 0);
+        client_rewrite(client, &desc, 'X');
+        assert(memcmp(buf, body, desc.size) == 0);
+        shm_ring_release(ring, &desc);
+    }
+
+    free(body);
+    free(buf);
+}
+
+struct Rewriter {
+    Client         *client;
+    ShmRingDesc     desc;
+    bool            quitting;
+};
+
+static void *rewriter_main(void *arg)
+{
+    struct Rewriter *rw = arg;
+    char c = 0;
+
+    while (!__atomic_load_n(&rw->quitting, __ATOMIC_ACQUIRE))
+        client_rewrite(rw->client, &rw->desc, c++);
+    return NULL;
+}
+
+/* The copy stays the same after read, while the client keeps rewriting */
+static void check_racing(ShmRing *ring, Client *client)
+{
+    struct Rewriter rw = { client, { 0, 0, 0 }, false };
+    pthread_t thread;
+    char buf[257], snapshot[257];
+
+    client_send(client, "0123456789", 10, &rw.desc);
+    rw.desc.size = 256;
+    client->head = rw.desc.pos + 256;
+    __atomic_store_n(&client->header->head, client->head, __ATOMIC_RELEASE);
+
+    assert(pthread_create(&thread, NULL, rewriter_main, &rw) == 0);
+    for (int i = 0; i < 10000; i++) {
+        assert(shm_ring_read(ring, &rw.desc, buf) == 0);
+        memcpy(snapshot, buf, sizeof(buf));
+        for (int j = 0; j < 100; j++)
+            assert(memcmp(snapshot, buf, sizeof(buf)) == 0);
+    }
+    __atomic_store_n(&rw.quitting, true, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+
+    shm_ring_release(ring, &rw.desc);
+}
+
+int main(void)
+{
+    ShmRing *ring;
+    Client client;
+
+    if ((ring = shm_ring_create(SHM_RING_MIN_SIZE)) == NULL) {
+        printf("The shared ring is not supported; skipped\n");
+        return 0;
+    }
+
+    client_map(&client, ring);
+    check_rewritten(ring, &client);
+    check_bad_descs(ring, &client);
+    check_wrapped(ring, &client);
+    check_racing(ring, &client);
+
+    munmap(client.header, client.sz_mapped);
+    shm_ring_destroy(ring);
+    printf("All shared ring tests passed\n");
+    return 0;
+}
@@ -0,0 +1,230 @@
+/*
+** test_wsutf8.c -- The differential test of the UTF-8 validators.
+**
+** Copyright (C) 2022 FMSoft (http://www.fmsoft.cn)
+**
+** This file is part of xGUI Pro, an advanced HVML renderer.
+**
+** xGUI Pro is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** xGUI Pro is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see http://www.gnu.org/licenses/.
+*/
+
+#undef NDEBUG
+
+#include <config.h>
+
+#include "purcmc/wsutf8.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#define MAX_TEXT_LEN    256
+#define NR_RANDOM_TEXTS 1000000
+
+static const WSUtf8Validator *validators;
+static int nr_validators;
+static unsigned long nr_checked, nr_valid;
+
+/* Check all validators give the same result as the DFA one */
+static void check(const char *str, size_t len)
+{
+    bool expected = validators[0].validate(str, len);
+
+    for (int i = 1; i < nr_validators; i++) {
+        if (validators[i].validate(str, len) != expected) {
+            fprintf(stderr, "%s disagrees with %s (expected %s) on:",
+                    validators[i].name, validators[0].name,
+                    expected ? "valid" : "invalid");
+            for (size_t j = 0; j < len; j++)
+                fprintf(stderr, " %02x", (unsigned char)str[j]);
+            fprintf(stderr, "\n");
+            abort();
+        }
+    }
+
+    nr_checked++;
+    if (expected)
+        nr_valid++;
+}
+
+/* Put the bytes at all positions around the block boundaries in a text of
+   ASCII or valid multi-byte characters, with and without a tail. */
+static void check_at_boundaries(const unsigned char *seq, size_t sz_seq)
+{
+    static const char *fillers[] = { "a", "\xc3\xa9", "\xe4\xb8\xad" };
+    char buf[MAX_TEXT_LEN];
+
+    for (size_t f = 0; f < sizeof(fillers)/sizeof(fillers[0]); f++) {
+        size_t sz_filler = strlen(fillers[f]);
+
+        for (size_t pos = 0; pos + sz_seq <= 70; pos++) {
+            size_t len = 0;
+
+            while (len + sz_filler <= pos) {
+                memcpy(buf + len, fillers[f], sz_filler);
+                len += sz_filler;
+            }
+            while (len < pos)
+                buf[len++] = 'b';
+
+            memcpy(buf + len, seq, sz_seq);
+            len += sz_seq;
+            check(buf, len);
+
+            for (size_t n = 0; n < 40; n++)
+                buf[len++] = 'c';
+            check(buf, len);
+        }
+    }
+}
+
+static void check_sequences(void)
+{
+    unsigned char seq[4];
+
+    /* all one- and two-byte sequences */
+    for (int a = 0; a < 256; a++) {
+        seq[0] = a;
+        check((char *)seq, 1);
+        check_at_boundaries(seq, 1);
+
+        for (int b = 0; b < 256; b++) {
+            seq[1] = b;
+            check((char *)seq, 2);
+        }
+    }
+
+    /* all three-byte sequences with a non-ASCII leading byte, and the
+       interesting ones at the block boundaries */
+    for (int a = 0x80; a < 256; a++) {
+        for (int b = 0; b < 256; b++) {
+            for (int c = 0; c < 256; c++) {
+                seq[0] = a; seq[1] = b; seq[2] = c;
+                check((char *)seq, 3);
+            }
+        }
+    }
+
+    /* four-byte sequences with the edge values of each byte */
+    static const unsigned char edges[] = {
+        0x00, 0x7f, 0x80, 0x8f, 0x90, 0x9f, 0xa0, 0xbf, 0xc0, 0xc1, 0xc2,
+        0xdf, 0xe0, 0xed, 0xee, 0xef, 0xf0, 0xf1, 0xf4, 0xf5, 0xf8, 0xff,
+    };
+    const size_t nr_edges = sizeof(edges)/sizeof(edges[0]);
+    for (size_t a = 0; a < nr_edges; a++) {
+        for (size_t b = 0; b < nr_edges; b++) {
+            for (size_t c = 0; c < nr_edges; c++) {
+                for (size_t d = 0; d < nr_edges; d++) {
+                    seq[0] = edges[a]; seq[1] = edges[b];
+                    seq[2] = edges[c]; seq[3] = edges[d];
+                    check((char *)seq, 4);
+                    if (edges[a] >= 0xc0)
+                        check_at_boundaries(seq, 4);
+                }
+            }
+        }
+    }
+}
+
+/* Generate a valid text and corrupt some bytes sometimes */
+static size_t random_text(char *buf)
+{
+    size_t len = 0, max = rand() % MAX_TEXT_LEN;
+
+    while (len + 4 <= max) {
+        unsigned cp;
+        int kind = rand() % 8;
+
+        if (kind < 4)
+            cp = rand() % 0x80;
+        else if (kind < 5)
+            cp = 0x80 + rand() % (0x800 - 0x80);
+        else if (kind < 7)
+            cp = 0x800 + rand() % (0x10000 - 0x800);
+        else
+            cp = 0x10000 + rand() % (0x110000 - 0x10000);
+
+        if (cp >= 0xd800 && cp < 0xe000)
+            cp = 'x';
+
+        if (cp < 0x80) {
+            buf[len++] = cp;
+        }
+        else if (cp < 0x800) {
+            buf[len++] = 0xc0 | (cp >> 6);
+            buf[len++] = 0x80 | (cp & 0x3f);
+        }
+        else if (cp < 0x10000) {
+            buf[len++] = 0xe0 | (cp >> 12);
+            buf[len++] = 0x80 | ((cp >> 6) & 0x3f);
+            buf[len++] = 0x80 | (cp & 0x3f);
+        }
+        else {
+            buf[len++] = 0xf0 | (cp >> 18);
+            buf[len++] = 0x80 | ((cp >> 12) & 0x3f);
+            buf[len++] = 0x80 | ((cp >> 6) & 0x3f);
+            buf[len++] = 0x80 | (cp & 0x3f);
+        }
+    }
+
+    switch (rand() % 4) {
+    case 0:
+        /* flip a bit */
+        if (len)
+            buf[rand() % len] ^= 1 << (rand() % 8);
+        break;
+    case 1:
+        /* truncate */
+        if (len)
+            len -= rand() % 4 % len;
+        break;
+    case 2:
+        /* garbage */
+        if (len)
+            buf[rand() % len] = rand();
+        break;
+    default:
+        break;
+    }
+
+    return len;
+}
+
+int main(void)
+{
+    char buf[MAX_TEXT_LEN];
+    unsigned seed = (unsigned)time(NULL);
+
+    ws_utf8_init();
+    validators = ws_utf8_validators(&nr_validators);
+
+    printf("Validators:");
+    for (int i = 0; i < nr_validators; i++)
+        printf(" %s", validators[i].name);
+    printf("; selected: %s\n", ws_utf8_validator()->name);
+
+    check_sequences();
+    printf("Sequences: %lu checked, %lu valid\n", nr_checked, nr_valid);
+
+    printf("Random seed: %u\n", seed);
+    srand(seed);
+    nr_checked = nr_valid = 0;
+    for (int i = 0; i < NR_RANDOM_TEXTS; i++)
+        check(buf, random_text(buf));
+    printf("Random texts: %lu checked, %lu valid\n", nr_checked, nr_valid);
+
+    return 0;
+}
+
@@ -132,6 +132,8 @@ XGUIPRO_CHECK_HAVE_INCLUDE(HAVE_SYS_TIMEB_H sys/timeb.h)
 XGUIPRO_CHECK_HAVE_INCLUDE(HAVE_SYS_IOCTL_H sys/ioctl.h)
 XGUIPRO_CHECK_HAVE_INCLUDE(HAVE_SYS_SELECT_H sys/select.h)
 XGUIPRO_CHECK_HAVE_INCLUDE(HAVE_SYS_EPOLL_H sys/epoll.h)
+XGUIPRO_CHECK_HAVE_INCLUDE(HAVE_POLL_H poll.h)
+XGUIPRO_CHECK_HAVE_INCLUDE(HAVE_SYS_EVENTFD_H sys/eventfd.h)
 XGUIPRO_CHECK_HAVE_INCLUDE(HAVE_SYS_MOUNT_H sys/mount.h)
 XGUIPRO_CHECK_HAVE_INCLUDE(HAVE_SYS_STATFS_H sys/statfs.h)
 XGUIPRO_CHECK_HAVE_INCLUDE(HAVE_SYS_STATVFS_H sys/statvfs.h)
@@ -160,6 +162,7 @@ XGUIPRO_CHECK_HAVE_FUNCTION(HAVE_TIMEGM timegm)
 XGUIPRO_CHECK_HAVE_FUNCTION(HAVE_VASPRINTF vasprintf)
 XGUIPRO_CHECK_HAVE_FUNCTION(HAVE_VSYSLOG vsyslog)
 XGUIPRO_CHECK_HAVE_FUNCTION(HAVE_ALLOCA alloca)
+XGUIPRO_CHECK_HAVE_FUNCTION(HAVE_ACCEPT4 accept4)
 
 XGUIPRO_CHECK_HAVE_FUNCTION(HAVE_OPENPTY openpty)
 XGUIPRO_CHECK_HAVE_FUNCTION(HAVE_REALPATH realpath)
@@ -24,6 +24,11 @@ if (OpenSSL_FOUND)
     XGUIPRO_OPTION_DEFINE(HAVE_LIBSSL "Whether having OpenSSL." PUBLIC ON)
 endif (OpenSSL_FOUND)
 
+find_package(ZLIB)
+if (ZLIB_FOUND)
+    XGUIPRO_OPTION_DEFINE(HAVE_ZLIB "Whether having zlib." PUBLIC ON)
+endif (ZLIB_FOUND)
+
 # Public options specific to the HybridOS port. Do not add any options here unless
 # there is a strong reason we should support changing the value of the option,
 # and the option is not relevant to any other xGUIPro ports.